@@ -0,0 +1,144 @@
+/*
+    Region allocator for bulk loaded papers.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+#include <string.h>
+#include "arena.h"
+
+/* every allocation starts on a multiple of this */
+#define ARENA_ALIGN (2 * sizeof(gpointer))
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(gsize)(ARENA_ALIGN - 1))
+
+/* Blocks are chained through a header at their start */
+typedef struct arena_block {
+  struct arena_block *prev;
+} arena_block;
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(arena_block))
+
+struct gra_arena_t {
+  arena_block *blocks;
+  gchar *next;
+  gsize left;
+  gsize blockSize;
+  gsize size;
+  int refCount;
+};
+
+/* static method prototypes */
+static gchar *add_block(gra_arena_t *a, gsize size);
+
+
+gra_arena_t *
+gra_arena_new(gsize blockSize) {
+  gra_arena_t *a;
+
+  a = g_malloc0(sizeof(gra_arena_t));
+  a->blockSize = blockSize ? blockSize : GRA_ARENA_BLOCK_SIZE;
+  a->refCount = 1;
+
+  return a;
+}
+
+
+gra_arena_t *
+gra_arena_ref(gra_arena_t *a) {
+  g_atomic_int_inc(&a->refCount);
+  return a;
+}
+
+
+void
+gra_arena_unref(gra_arena_t *a) {
+  arena_block *b, *prev;
+
+  if(!a || !g_atomic_int_dec_and_test(&a->refCount)) return;
+
+  for(b = a->blocks; b; b = prev) {
+    prev = b->prev;
+    g_free(b);
+  }
+  g_free(a);
+}
+
+
+gpointer
+gra_arena_alloc(gra_arena_t *a, gsize size) {
+  gchar *result;
+
+  size = ARENA_ROUND(size ? size : 1);
+
+  /* Big allocations get a block of their own, so the rest of the
+     current block is not wasted. */
+  if(size > a->blockSize / 4)
+    return add_block(a, size);
+
+  if(size > a->left) {
+    a->next = add_block(a, a->blockSize - ARENA_HEADER);
+    a->left = a->blockSize - ARENA_HEADER;
+  }
+
+  result = a->next;
+  a->next += size;
+  a->left -= size;
+
+  return result;
+}
+
+
+gpointer
+gra_arena_alloc0(gra_arena_t *a, gsize size) {
+  return memset(gra_arena_alloc(a, size), 0, size);
+}
+
+
+gchar *
+gra_arena_strdup(gra_arena_t *a, const gchar *s) {
+  gsize len;
+
+  if(!s) return NULL;
+
+  len = strlen(s) + 1;
+  return memcpy(gra_arena_alloc(a, len), s, len);
+}
+
+
+gsize
+gra_arena_size(gra_arena_t *a) {
+  return a->size;
+}
+
+
+
+/*
+ * Static Methods
+ */
+
+/* Chain a new block of at least size usable bytes onto the arena.
+   Returns the start of its usable space. */
+static gchar *
+add_block(gra_arena_t *a, gsize size) {
+  arena_block *b;
+
+  b = g_malloc(ARENA_HEADER + size);
+  b->prev = a->blocks;
+  a->blocks = b;
+  a->size += ARENA_HEADER + size;
+
+  return (gchar *) b + ARENA_HEADER;
+}
@@ -0,0 +1,70 @@
+/*
+    Region allocator for bulk loaded papers.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <glib.h>
+#include "datatypes.h"
+
+/** Default size of the blocks an arena carves allocations from. */
+#define GRA_ARENA_BLOCK_SIZE (64 * 1024)
+
+
+/** Creates an arena.  Allocations are carved from large blocks and
+ *  are only given back when the whole arena is freed.
+ *  @param blockSize Size of each block, or 0 for GRA_ARENA_BLOCK_SIZE.
+ *  @return The arena, holding one reference.
+ */
+gra_arena_t *gra_arena_new(gsize blockSize);
+
+/** Adds a reference to an arena.
+ *  @param a the arena
+ *  @return a
+ */
+gra_arena_t *gra_arena_ref(gra_arena_t *a);
+
+/** Drops a reference to an arena.  The last one frees every block.
+ *  @param a the arena.  May be NULL.
+ */
+void gra_arena_unref(gra_arena_t *a);
+
+/** Allocates from an arena.  The memory is suitably aligned for any
+ *  type.
+ *  @param a the arena
+ *  @param size number of bytes
+ *  @return The memory, which is not cleared.
+ */
+gpointer gra_arena_alloc(gra_arena_t *a, gsize size);
+
+/** As gra_arena_alloc, with the memory cleared. */
+gpointer gra_arena_alloc0(gra_arena_t *a, gsize size);
+
+/** Copies a string into an arena.
+ *  @param a the arena
+ *  @param s the string.  May be NULL.
+ *  @return The copy, or NULL if s is NULL.
+ */
+gchar *gra_arena_strdup(gra_arena_t *a, const gchar *s);
+
+/** Reports how much memory an arena has taken from the system.
+ *  @param a the arena
+ *  @return Size of all blocks in bytes.
+ */
+gsize gra_arena_size(gra_arena_t *a);
+#endif
@@ -0,0 +1,881 @@
+/*
+    Benchmarks of the paper database over a synthetic library.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* gra_bench builds a synthetic library from a seed, so the same
+   options always give the same database, then times scenarios
+   against it.  Each scenario records the latency of every operation;
+   the report is one JSON object on standard output, with throughput
+   and latency percentiles per scenario.  Progress goes to standard
+   error.
+
+     gra_bench [--papers N] [--fields N] [--refs N] [--notes N]
+               [--seed N] [--samples N] [--file F] [--scenario S]...
+               [--trace] [--slow US]
+
+   With --trace, each scenario also lists the statements it spent
+   the most time in, and those of its queries which ran longer than
+   --slow microseconds, from gra_db_trace.  Tracing slows every
+   statement down a little.
+
+   Micro scenarios time single calls; macro scenarios time whole
+   tasks.  Throughput counts only the timed calls, not the setup
+   around them.  "Cold" opens start a new connection; the operating
+   system's file cache stays warm. */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "data.h"
+#include "bibtex.h"
+#include "export.h"
+#include "citegraph.h"
+#include "query.h"
+
+/* papers saved per batch while the library is built */
+#define BENCH_BATCH 1000
+
+/* statements listed per scenario with --trace */
+#define BENCH_TOP_STATEMENTS 10
+
+/* searches use words of the vocabulary, which titles are made of */
+static const gchar * const words[] = {
+  "adaptive", "algebra", "analysis", "approximate", "bounded", "cache",
+  "compiler", "concurrent", "consensus", "curve", "data", "distributed",
+  "dynamic", "efficient", "entropy", "fault", "formal", "graph",
+  "hashing", "heuristic", "incremental", "index", "inference", "kernel",
+  "language", "lattice", "learning", "linear", "locality", "logic",
+  "memory", "model", "network", "numerical", "optimal", "parallel",
+  "parser", "probabilistic", "protocol", "quantum", "query", "random",
+  "recursive", "robust", "scalable", "scheduling", "search", "semantic",
+  "sequential", "signal", "sparse", "stochastic", "storage", "stream",
+  "structure", "symbolic", "synthesis", "system", "theory", "tolerant",
+  "transaction", "tree", "verification", "wireless"
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+static const gchar * const surnames[] = {
+  "Adams", "Baker", "Chen", "Dijkstra", "Erdos", "Fischer", "Garcia",
+  "Hoare", "Ito", "Johnson", "Knuth", "Lamport", "Miller", "Nakamura",
+  "Okafor", "Patel", "Quinn", "Rivest", "Singh", "Tarjan", "Ullman",
+  "Valiant", "Wirth", "Xu", "Yao", "Zhang"
+};
+#define SURNAME_COUNT (sizeof(surnames) / sizeof(surnames[0]))
+
+/* options */
+static gint papers = 10000;
+static gint fieldsPerPaper = 8;
+static gint refsPerPaper = 4;
+static gint notesPerPaper = 1;
+static gint seed = 42;
+static gint samples = 10000;
+static gchar *filename = NULL;
+static gchar **only = NULL;
+static gboolean trace = FALSE;
+static gint slowMicros = 10000;
+
+static GOptionEntry options[] = {
+  { "papers", 'p', 0, G_OPTION_ARG_INT, &papers, "Papers in the library", "N" },
+  { "fields", 'f', 0, G_OPTION_ARG_INT, &fieldsPerPaper, "Extra fields per paper", "N" },
+  { "refs", 'r', 0, G_OPTION_ARG_INT, &refsPerPaper, "Papers cited by each paper", "N" },
+  { "notes", 'n', 0, G_OPTION_ARG_INT, &notesPerPaper, "Notes per paper", "N" },
+  { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "Seed of the generator", "N" },
+  { "samples", 0, 0, G_OPTION_ARG_INT, &samples, "Operations per micro scenario", "N" },
+  { "file", 0, 0, G_OPTION_ARG_FILENAME, &filename, "Database to create", "F" },
+  { "scenario", 0, 0, G_OPTION_ARG_STRING_ARRAY, &only, "Run only this scenario", "S" },
+  { "trace", 0, 0, G_OPTION_ARG_NONE, &trace, "Report the statements run", NULL },
+  { "slow", 0, 0, G_OPTION_ARG_INT, &slowMicros, "Log queries slower than this", "US" },
+  { NULL }
+};
+
+/* the outcome of one scenario */
+typedef struct {
+  const gchar *name;
+  const gchar *kind;
+  GArray *latency;        /* microseconds per operation */
+  gint64 elapsed;         /* microseconds for the whole scenario */
+  unsigned long papers;   /* papers handled by a macro scenario */
+  unsigned long long bytes;
+  gra_db_stats_t *stats;  /* with --trace */
+} bench_result;
+
+typedef struct {
+  gra_db_t *db;
+  GRand *rand;
+  GArray *citations;      /* every citation made so far */
+  gra_citegraph_t *graph;
+} bench_ctx;
+
+typedef void (*bench_func)(bench_ctx *ctx, bench_result *r);
+
+static void bench_bulk_insert(bench_ctx *ctx, bench_result *r);
+static void bench_cold_open(bench_ctx *ctx, bench_result *r);
+static void bench_random_load(bench_ctx *ctx, bench_result *r);
+static void bench_load_many(bench_ctx *ctx, bench_result *r);
+static void bench_update(bench_ctx *ctx, bench_result *r);
+static void bench_mark_read(bench_ctx *ctx, bench_result *r);
+static void bench_browse(bench_ctx *ctx, bench_result *r);
+static void bench_search(bench_ctx *ctx, bench_result *r);
+static void bench_author(bench_ctx *ctx, bench_result *r);
+static void bench_query(bench_ctx *ctx, bench_result *r);
+static void bench_graph_build(bench_ctx *ctx, bench_result *r);
+static void bench_graph_query(bench_ctx *ctx, bench_result *r);
+static void bench_export(bench_ctx *ctx, bench_result *r);
+static void bench_delete_many(bench_ctx *ctx, bench_result *r);
+static gra_paper_t *make_paper(bench_ctx *ctx, int id);
+static gchar *make_words(GRand *rand, int n);
+static void add_ref(gra_paper_t *p, int refPaperId);
+static gboolean cites(gra_paper_t *p, int refPaperId);
+static gboolean wanted(const gchar *name);
+static void report(FILE *out, bench_result *r, gboolean last);
+static void report_stats(FILE *out, gra_db_stats_t *stats);
+static void json_string(FILE *out, const gchar *s);
+static double percentile(GArray *sorted, double q);
+static gint compare_doubles(gconstpointer a, gconstpointer b);
+static void check(GError *err, const gchar *what);
+
+/* in the order they run; bulk_insert builds the library */
+static const struct {
+  const gchar *name;
+  const gchar *kind;
+  bench_func func;
+} scenarios[] = {
+  { "bulk_insert", "macro", bench_bulk_insert },
+  { "cold_open", "macro", bench_cold_open },
+  { "random_load", "micro", bench_random_load },
+  { "load_many", "micro", bench_load_many },
+  { "update", "micro", bench_update },
+  { "mark_read", "macro", bench_mark_read },
+  { "browse", "micro", bench_browse },
+  { "search", "micro", bench_search },
+  { "author", "micro", bench_author },
+  { "query", "micro", bench_query },
+  { "graph_build", "macro", bench_graph_build },
+  { "graph_query", "micro", bench_graph_query },
+  { "export", "macro", bench_export },
+  /* last, as it shrinks the library */
+  { "delete_many", "macro", bench_delete_many }
+};
+#define SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+
+int
+main(int argc, char **argv) {
+  GOptionContext *context;
+  GError *err = NULL;
+  bench_ctx ctx;
+  bench_result r[SCENARIO_COUNT];
+  int i, n = 0;
+
+  context = g_option_context_new("- benchmark the paper database");
+  g_option_context_add_main_entries(context, options, NULL);
+  if(!g_option_context_parse(context, &argc, &argv, &err)) {
+    g_printerr("%s\n", err->message);
+    return 2;
+  }
+  g_option_context_free(context);
+  if(!filename)
+    filename = g_build_filename(g_get_tmp_dir(), "gra_bench.db", NULL);
+
+  /* always a fresh library, so the IDs and contents are the same */
+  g_remove(filename);
+  ctx.db = gra_db_open(filename, &err);
+  check(err, "open");
+  ctx.rand = g_rand_new_with_seed(seed);
+  ctx.citations = g_array_new(FALSE, FALSE, sizeof(int));
+  ctx.graph = NULL;
+  if(trace)
+    gra_db_trace(ctx.db, TRUE, slowMicros);
+
+  for(i=0; i<SCENARIO_COUNT; i++) {
+    if(i && !wanted(scenarios[i].name))
+      continue;
+    g_printerr("%s...\n", scenarios[i].name);
+    r[n].name = scenarios[i].name;
+    r[n].kind = scenarios[i].kind;
+    r[n].latency = g_array_new(FALSE, FALSE, sizeof(double));
+    r[n].papers = 0;
+    r[n].bytes = 0;
+    gra_db_stats_free(gra_db_stats(ctx.db, TRUE));
+    r[n].elapsed = g_get_monotonic_time();
+    scenarios[i].func(&ctx, r + n);
+    r[n].elapsed = g_get_monotonic_time() - r[n].elapsed;
+    r[n].stats = gra_db_stats(ctx.db, FALSE);
+    n++;
+  }
+
+  /* the report */
+  printf("{\n  \"config\": {\"papers\": %d, \"fields\": %d, \"refs\": %d, \"notes\": %d,"
+         " \"seed\": %d, \"samples\": %d, \"sqlite\": \"%s\"},\n  \"scenarios\": [\n",
+         papers, fieldsPerPaper, refsPerPaper, notesPerPaper, seed, samples,
+         sqlite3_libversion());
+  for(i=0; i<n; i++) {
+    report(stdout, r + i, i == n - 1);
+    g_array_free(r[i].latency, TRUE);
+    gra_db_stats_free(r[i].stats);
+  }
+  printf("  ]\n}\n");
+
+  if(ctx.graph)
+    gra_citegraph_free(ctx.graph);
+  gra_db_close(ctx.db, &err);
+  check(err, "close");
+  g_rand_free(ctx.rand);
+  g_array_free(ctx.citations, TRUE);
+  g_free(filename);
+  g_strfreev(only);
+  return 0;
+}
+
+
+
+/*
+ * Scenarios
+ */
+
+/* Macro: build the library, one save per paper, in batches */
+static void
+bench_bulk_insert(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t *p;
+  gint64 start;
+  double us;
+  int i;
+
+  for(i=1; i<=papers; i++) {
+    if(i % BENCH_BATCH == 1)
+      gra_db_batch_begin(ctx->db, &err);
+
+    p = make_paper(ctx, i);
+    start = g_get_monotonic_time();
+    gra_db_paper_save(ctx->db, p, &err);
+    us = g_get_monotonic_time() - start;
+    g_array_append_val(r->latency, us);
+    gra_paper_free(p);
+
+    /* the commit's cost goes to the paper which ends the batch */
+    if(i % BENCH_BATCH == 0 || i == papers) {
+      start = g_get_monotonic_time();
+      gra_db_batch_commit(ctx->db, &err);
+      g_array_index(r->latency, double, r->latency->len - 1) +=
+        g_get_monotonic_time() - start;
+    }
+    check(err, "insert");
+  }
+}
+
+
+/* Macro: open a new connection and load one paper */
+static void
+bench_cold_open(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_db_t *db;
+  gra_paper_t *p;
+  gint64 start;
+  double us;
+  int i;
+
+  for(i=0; i<20; i++) {
+    start = g_get_monotonic_time();
+    db = gra_db_open(filename, &err);
+    check(err, "cold open");
+    p = gra_db_paper_load(db, g_rand_int_range(ctx->rand, 1, papers + 1), &err);
+    check(err, "cold open load");
+    gra_paper_free(p);
+    gra_db_close(db, &err);
+    check(err, "cold open close");
+    us = g_get_monotonic_time() - start;
+    g_array_append_val(r->latency, us);
+  }
+}
+
+
+/* Micro: load a random paper with its fields and references */
+static void
+bench_random_load(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t *p;
+  gint64 start;
+  double us;
+  int i;
+
+  gra_db_cache_clear(ctx->db);
+  for(i=0; i<samples; i++) {
+    start = g_get_monotonic_time();
+    p = gra_db_paper_load(ctx->db, g_rand_int_range(ctx->rand, 1, papers + 1), &err);
+    gra_db_paper_load_fields(ctx->db, p, &err);
+    gra_db_paper_load_refs(ctx->db, p, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "random load");
+    g_array_append_val(r->latency, us);
+    gra_paper_free(p);
+  }
+}
+
+
+/* Micro: load 100 random papers with their fields in one call */
+static void
+bench_load_many(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t **many;
+  int ids[100];
+  gint64 start;
+  double us;
+  int i, j;
+
+  for(i=0; i<samples / 100 + 1; i++) {
+    for(j=0; j<100; j++)
+      ids[j] = g_rand_int_range(ctx->rand, 1, papers + 1);
+    start = g_get_monotonic_time();
+    many = gra_db_paper_load_many(ctx->db, ids, 100, GRA_LOAD_FIELDS, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "load many");
+    g_array_append_val(r->latency, us);
+    gra_paper_free_many(many, 100);
+  }
+}
+
+
+/* Micro: change a field and add a citation to a random paper */
+static void
+bench_update(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t *p;
+  gchar *value;
+  gint64 start;
+  double us;
+  int i, cited;
+
+  for(i=0; i<samples; i++) {
+    p = gra_db_paper_load(ctx->db, g_rand_int_range(ctx->rand, 1, papers + 1), &err);
+    gra_db_paper_load_fields(ctx->db, p, &err);
+    gra_db_paper_load_refs(ctx->db, p, &err);
+    check(err, "update load");
+
+    /* a paper it does not cite yet */
+    do {
+      cited = g_rand_int_range(ctx->rand, 1, papers + 1);
+    } while(cites(p, cited) && g_list_length(p->refs) < papers);
+
+    value = make_words(ctx->rand, 3);
+    start = g_get_monotonic_time();
+    gra_paper_set_field(p, "note", value);
+    if(!cites(p, cited))
+      add_ref(p, cited);
+    gra_db_paper_save(ctx->db, p, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "update");
+    g_array_append_val(r->latency, us);
+    g_free(value);
+    gra_paper_free(p);
+  }
+}
+
+
+/* Macro: mark every paper read or unread, a batch per page.  The
+   bytes are those of the database pages written. */
+static void
+bench_mark_read(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t **page, *last = NULL;
+  sqlite3_stmt *stmt;
+  gint64 start;
+  double us;
+  int i, n, written, high, pageSize = 0;
+
+  sqlite3_prepare_v2(ctx->db->db, "PRAGMA page_size", -1, &stmt, NULL);
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+    pageSize = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+  sqlite3_db_status(ctx->db->db, SQLITE_DBSTATUS_CACHE_WRITE, &written, &high, TRUE);
+
+  do {
+    page = gra_db_paper_browse(ctx->db, GRA_SORT_ID, FALSE, last, 0, BENCH_BATCH, &n, &err);
+    check(err, "mark read page");
+
+    start = g_get_monotonic_time();
+    gra_db_batch_begin(ctx->db, &err);
+    for(i=0; i<n; i++) {
+      gra_paper_set_read(page[i], !page[i]->read);
+      gra_db_paper_save(ctx->db, page[i], &err);
+    }
+    gra_db_batch_commit(ctx->db, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "mark read");
+    if(n)
+      g_array_append_val(r->latency, us);
+    r->papers += n;
+
+    if(last)
+      gra_paper_free(last);
+    last = n ? gra_paper_ref(page[n - 1]) : NULL;
+    gra_paper_free_many(page, n);
+  } while(last);
+
+  sqlite3_db_status(ctx->db->db, SQLITE_DBSTATUS_CACHE_WRITE, &written, &high, TRUE);
+  r->bytes = (unsigned long long) written * pageSize;
+}
+
+
+/* Micro: page through the library by title, a page at a time */
+static void
+bench_browse(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_paper_t **page, *last = NULL;
+  gint64 start;
+  double us;
+  int i, n;
+
+  for(i=0; i<samples / 100 + 1; i++) {
+    start = g_get_monotonic_time();
+    page = gra_db_paper_browse(ctx->db, GRA_SORT_TITLE, FALSE, last, 0, 100, &n, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "browse");
+    g_array_append_val(r->latency, us);
+
+    /* start again from the top at the end */
+    if(last)
+      gra_paper_free(last);
+    last = n ? gra_paper_ref(page[n - 1]) : NULL;
+    gra_paper_free_many(page, n);
+  }
+  if(last)
+    gra_paper_free(last);
+}
+
+
+/* Micro: keyword searches for one or two words of the vocabulary */
+static void
+bench_search(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  GList *hits;
+  gchar *query;
+  gint64 start;
+  double us;
+  int i;
+
+  for(i=0; i<samples; i++) {
+    query = make_words(ctx->rand, g_rand_int_range(ctx->rand, 1, 3));
+    start = g_get_monotonic_time();
+    hits = gra_db_search_keyword(ctx->db, query, 20, 0, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "search");
+    g_array_append_val(r->latency, us);
+    g_list_free_full(hits, (GDestroyNotify) gra_paper_free);
+    g_free(query);
+  }
+}
+
+
+/* Micro: complete a surname from its first three letters, then find
+   the first page of the papers of the author completed */
+static void
+bench_author(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  GList *authors, *hits;
+  gchar *prefix;
+  gint64 start;
+  double us;
+  int i;
+
+  for(i=0; i<samples; i++) {
+    prefix = g_strndup(surnames[g_rand_int_range(ctx->rand, 0, SURNAME_COUNT)], 3);
+    start = g_get_monotonic_time();
+    authors = gra_db_author_complete(ctx->db, prefix, 10, &err);
+    hits = authors ? gra_db_search_author(ctx->db, ((gra_author_t *) authors->data)->name,
+                                          20, 0, &err) : NULL;
+    us = g_get_monotonic_time() - start;
+    check(err, "author");
+    g_array_append_val(r->latency, us);
+    g_list_free_full(hits, (GDestroyNotify) gra_paper_free);
+    g_list_free_full(authors, (GDestroyNotify) gra_author_free);
+    g_free(prefix);
+  }
+}
+
+
+/* Micro: unread papers of one type and author, in a span of years,
+   whose journal has a word, by title; the first two pages */
+static void
+bench_query(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_query_t *q;
+  gra_paper_t **page, *last;
+  gint64 start;
+  double us;
+  int i, n, year;
+
+  for(i=0; i<samples; i++) {
+    year = g_rand_int_range(ctx->rand, 1950, 2005);
+    start = g_get_monotonic_time();
+    q = gra_query_new();
+    gra_query_read(q, FALSE);
+    gra_query_type(q, gra_bibtex_types[g_rand_int_range(ctx->rand, 0, gra_bibtex_type_count)]);
+    gra_query_author(q, surnames[g_rand_int_range(ctx->rand, 0, SURNAME_COUNT)]);
+    gra_query_year(q, year, year + 10);
+    gra_query_field(q, "journal", words[g_rand_int_range(ctx->rand, 0, WORD_COUNT)]);
+    gra_query_order(q, GRA_SORT_TITLE, FALSE);
+    page = gra_query_run(ctx->db, q, NULL, 20, &n, &err);
+    last = n ? gra_paper_ref(page[n - 1]) : NULL;
+    gra_paper_free_many(page, n);
+    if(last) {
+      page = gra_query_run(ctx->db, q, last, 20, &n, &err);
+      gra_paper_free_many(page, n);
+      gra_paper_free(last);
+    }
+    gra_query_free(q);
+    us = g_get_monotonic_time() - start;
+    check(err, "query");
+    g_array_append_val(r->latency, us);
+  }
+}
+
+
+/* Macro: build the citation graph, then rank every paper */
+static void
+bench_graph_build(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  GArray *ranks;
+  gint64 start;
+  double us;
+
+  if(ctx->graph)
+    gra_citegraph_free(ctx->graph);
+
+  start = g_get_monotonic_time();
+  ctx->graph = gra_citegraph_new(ctx->db, 0, &err);
+  us = g_get_monotonic_time() - start;
+  check(err, "graph build");
+  g_array_append_val(r->latency, us);
+
+  start = g_get_monotonic_time();
+  ranks = gra_citegraph_pagerank(ctx->graph, 10);
+  us = g_get_monotonic_time() - start;
+  g_array_append_val(r->latency, us);
+  g_array_unref(ranks);
+}
+
+
+/* Micro: citations two steps out, co-citations and coupling of a
+   random paper, in turn */
+static void
+bench_graph_query(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  GArray *hits;
+  gint64 start;
+  double us;
+  int i, id;
+
+  if(!ctx->graph) {
+    ctx->graph = gra_citegraph_new(ctx->db, 0, &err);
+    check(err, "graph build");
+  }
+
+  for(i=0; i<samples; i++) {
+    id = g_rand_int_range(ctx->rand, 1, papers + 1);
+    start = g_get_monotonic_time();
+    if(i % 3 == 0)
+      hits = gra_citegraph_closure(ctx->graph, id, GRA_CITES, 2);
+    else if(i % 3 == 1)
+      hits = gra_citegraph_cocited(ctx->graph, id, 20);
+    else
+      hits = gra_citegraph_coupled(ctx->graph, id, 20);
+    us = g_get_monotonic_time() - start;
+    g_array_append_val(r->latency, us);
+    g_array_unref(hits);
+  }
+}
+
+
+/* Macro: export the whole library as BibTeX */
+static void
+bench_export(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  gra_export_stats_t stats;
+  gchar *out;
+  gint64 start;
+  double us;
+
+  out = g_strconcat(filename, ".bib", NULL);
+  start = g_get_monotonic_time();
+  gra_export(ctx->db, out, GRA_EXPORT_BIBTEX, 0, &stats, &err);
+  us = g_get_monotonic_time() - start;
+  check(err, "export");
+  g_array_append_val(r->latency, us);
+  r->papers = stats.papers;
+  r->bytes = stats.bytes;
+  g_remove(out);
+  g_free(out);
+}
+
+
+
+/* Macro: delete the newest tenth of the library, a batch of IDs at a
+   time, with everything hanging off each paper */
+static void
+bench_delete_many(bench_ctx *ctx, bench_result *r) {
+  GError *err = NULL;
+  int ids[BENCH_BATCH];
+  gint64 start;
+  double us;
+  int id, n;
+
+  for(id=papers - papers / 10 + 1; id<=papers; id += n) {
+    for(n=0; n<BENCH_BATCH && id + n <= papers; n++)
+      ids[n] = id + n;
+    start = g_get_monotonic_time();
+    r->papers += gra_db_paper_delete_many(ctx->db, ids, n, &err);
+    us = g_get_monotonic_time() - start;
+    check(err, "delete many");
+    g_array_append_val(r->latency, us);
+  }
+}
+
+
+/*
+ * Static Methods
+ */
+
+/* A paper with the configured number of fields, citations and notes.
+   Citations go to earlier papers; half copy a citation of another
+   paper, so a few papers are cited far more than the rest. */
+static gra_paper_t *
+make_paper(bench_ctx *ctx, int id) {
+  GRand *rand = ctx->rand;
+  GArray *citations = ctx->citations;
+  gra_paper_t *p;
+  gchar name[32], *text, *right;
+  int i, cited;
+
+  p = gra_paper_new();
+  p->fileName = g_strdup_printf("paper%d.pdf", id);
+  p->pageCount = g_rand_int_range(rand, 1, 40);
+  p->read = g_rand_boolean(rand);
+  p->type = g_strdup(gra_bibtex_types[g_rand_int_range(rand, 0, gra_bibtex_type_count)]);
+  p->author = g_strdup_printf("%s, %c.",
+                              surnames[g_rand_int_range(rand, 0, SURNAME_COUNT)],
+                              'A' + g_rand_int_range(rand, 0, 26));
+  p->title = make_words(rand, g_rand_int_range(rand, 3, 9));
+  p->year = g_rand_int_range(rand, 1950, 2014);
+
+  for(i=0; i<fieldsPerPaper; i++) {
+    if(i < gra_bibtex_field_count)
+      g_strlcpy(name, gra_bibtex_fields[i], sizeof(name));
+    else
+      g_snprintf(name, sizeof(name), "custom%d", i);
+    text = make_words(rand, g_rand_int_range(rand, 1, 6));
+    gra_paper_set_field(p, name, text);
+    g_free(text);
+  }
+
+  for(i=0; i<refsPerPaper && id > 1; i++) {
+    if(citations->len && g_rand_boolean(rand))
+      cited = g_array_index(citations, int, g_rand_int_range(rand, 0, citations->len));
+    else
+      cited = g_rand_int_range(rand, 1, id);
+
+    /* once per cited paper */
+    if(cites(p, cited))
+      continue;
+    add_ref(p, cited);
+    g_array_append_val(citations, cited);
+  }
+
+  for(i=0; i<notesPerPaper; i++) {
+    text = make_words(rand, g_rand_int_range(rand, 5, 20));
+    right = make_words(rand, 2);
+    gra_paper_set_note(p, g_rand_int_range(rand, 1, p->pageCount + 1), text, right);
+    g_free(text);
+    g_free(right);
+  }
+
+  return p;
+}
+
+
+/* Words of the vocabulary, separated by spaces */
+static gchar *
+make_words(GRand *rand, int n) {
+  GString *s;
+  int i;
+
+  s = g_string_new(NULL);
+  for(i=0; i<n; i++) {
+    if(i)
+      g_string_append_c(s, ' ');
+    g_string_append(s, words[g_rand_int_range(rand, 0, WORD_COUNT)]);
+  }
+
+  return g_string_free(s, FALSE);
+}
+
+
+/* Cite a paper, saved with the citing one */
+static void
+add_ref(gra_paper_t *p, int refPaperId) {
+  gra_reference_t *ref;
+
+  ref = g_new0(gra_reference_t, 1);
+  ref->paperId = p->id;
+  ref->refPaperId = refPaperId;
+  ref->changed = TRUE;
+  p->refs = g_list_prepend(p->refs, ref);
+}
+
+
+/* Does a paper cite another already */
+static gboolean
+cites(gra_paper_t *p, int refPaperId) {
+  GList *link;
+
+  for(link=p->refs; link; link=link->next) {
+    if(((gra_reference_t *) link->data)->refPaperId == refPaperId)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+/* Is a scenario picked on the command line, or are all picked */
+static gboolean
+wanted(const gchar *name) {
+  int i;
+
+  if(!only)
+    return TRUE;
+  for(i=0; only[i]; i++) {
+    if(!strcmp(only[i], name))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+
+/* One scenario of the JSON report */
+static void
+report(FILE *out, bench_result *r, gboolean last) {
+  double seconds, total = 0;
+  int i;
+
+  g_array_sort(r->latency, compare_doubles);
+  for(i=0; i<r->latency->len; i++)
+    total += g_array_index(r->latency, double, i);
+  seconds = r->elapsed / 1e6;
+
+  fprintf(out, "    {\"name\": \"%s\", \"kind\": \"%s\", \"ops\": %u,"
+          " \"seconds\": %.6f, \"ops_per_sec\": %.1f,",
+          r->name, r->kind, r->latency->len, seconds,
+          total > 0 ? r->latency->len / (total / 1e6) : 0.0);
+  if(r->papers)
+    fprintf(out, " \"papers\": %lu, \"papers_per_sec\": %.1f,",
+            r->papers, total > 0 ? r->papers / (total / 1e6) : 0.0);
+  if(r->bytes)
+    fprintf(out, " \"bytes\": %llu, \"bytes_per_sec\": %.1f,",
+            r->bytes, total > 0 ? r->bytes / (total / 1e6) : 0.0);
+  fprintf(out, " \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p99\": %.1f,"
+          " \"p999\": %.1f, \"max\": %.1f}",
+          r->latency->len ? total / r->latency->len : 0.0,
+          percentile(r->latency, 0.5), percentile(r->latency, 0.99),
+          percentile(r->latency, 0.999), percentile(r->latency, 1.0));
+  if(r->stats)
+    report_stats(out, r->stats);
+  fprintf(out, "}%s\n", last ? "" : ",");
+}
+
+
+/* The statements a scenario spent the most time in, and its slow log */
+static void
+report_stats(FILE *out, gra_db_stats_t *stats) {
+  gra_stmt_stats_t *s;
+  gra_slow_query_t *q;
+  int i;
+
+  fprintf(out, ",\n      \"sql\": {\"calls\": %lu, \"rows\": %" G_GUINT64_FORMAT
+          ", \"total_us\": %" G_GUINT64_FORMAT ", \"statements\": [",
+          stats->calls, stats->rows, stats->totalMicros);
+  for(i=0; i<stats->statements->len && i<BENCH_TOP_STATEMENTS; i++) {
+    s = g_ptr_array_index(stats->statements, i);
+    fprintf(out, "%s\n        {\"calls\": %lu, \"rows\": %" G_GUINT64_FORMAT
+            ", \"total_us\": %" G_GUINT64_FORMAT ", \"max_us\": %" G_GUINT64_FORMAT
+            ", \"sql\": ",
+            i ? "," : "", s->calls, s->rows, s->totalMicros, s->maxMicros);
+    json_string(out, s->sql);
+    fprintf(out, "}");
+  }
+  fprintf(out, "],\n      \"slow\": [");
+  for(i=0; i<stats->slow->len; i++) {
+    q = g_ptr_array_index(stats->slow, i);
+    fprintf(out, "%s\n        {\"us\": %" G_GUINT64_FORMAT ", \"sql\": ",
+            i ? "," : "", q->micros);
+    json_string(out, q->sql);
+    fprintf(out, "}");
+  }
+  fprintf(out, "]}");
+}
+
+
+/* A quoted JSON string */
+static void
+json_string(FILE *out, const gchar *s) {
+  fputc('"', out);
+  for(; *s; s++) {
+    if(*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if((guchar) *s < 0x20)
+      fprintf(out, "\\u%04x", (guchar) *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+
+/* The sample at or above a fraction of the sorted samples */
+static double
+percentile(GArray *sorted, double q) {
+  int i;
+
+  if(!sorted->len)
+    return 0;
+  i = (int) ceil(q * sorted->len) - 1;
+  if(i < 0)
+    i = 0;
+  return g_array_index(sorted, double, i);
+}
+
+
+static gint
+compare_doubles(gconstpointer a, gconstpointer b) {
+  double x = *(const double *) a, y = *(const double *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Give up on the first error */
+static void
+check(GError *err, const gchar *what) {
+  if(err) {
+    g_printerr("%s: %s\n", what, err->message);
+    exit(1);
+  }
+}
@@ -0,0 +1,509 @@
+/*
+    BibTeX import for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "bibtex.h"
+#include "data.h"
+
+#define BIB_BUFFER_SIZE (64 * 1024)
+#define BIB_MAX_VALUE (1024 * 1024)
+
+/**
+ * These are the standard bibtex fields.  Minus the ones which are
+ * always defined.
+ */
+const gchar * const gra_bibtex_fields[] = {
+  "address", "editor", "eprint", "institution", "journal", "key",
+    "month", "note", "organization", "pages", "publisher", "school",
+    "series", "url", "volume"
+};
+const int gra_bibtex_field_count =
+  sizeof(gra_bibtex_fields) / sizeof(gra_bibtex_fields[0]);
+
+
+/**
+ * These are the standard document types used in bibtex.
+ */
+const gchar * const gra_bibtex_types[] = {
+  "Article", "Book", "Booklet", "Conference", "Inbook", "Incollection",
+    "Inproceedings", "Manual", "Mastersthesis", "misc", "Phdthesis",
+    "Techreport", "Unpublished"
+};
+const int gra_bibtex_type_count =
+  sizeof(gra_bibtex_types) / sizeof(gra_bibtex_types[0]);
+
+
+/* the predefined bibtex month strings */
+static const gchar *months[][2] = {
+  {"jan", "January"}, {"feb", "February"}, {"mar", "March"},
+  {"apr", "April"}, {"may", "May"}, {"jun", "June"},
+  {"jul", "July"}, {"aug", "August"}, {"sep", "September"},
+  {"oct", "October"}, {"nov", "November"}, {"dec", "December"}
+};
+
+
+/* buffered reader which keeps track of line numbers */
+typedef struct bib_reader {
+  FILE *in;
+  gchar buf[BIB_BUFFER_SIZE];
+  gsize pos;
+  gsize len;
+  int line;
+} bib_reader;
+
+
+/* parser state, reused from one entry to the next */
+typedef struct bib_parser {
+  bib_reader r;
+  GString *key;
+  GString *name;
+  GString *field;
+  GString *value;
+  GHashTable *macros;
+  gra_paper_t *paper;
+  const gchar *message;
+  int errorLine;
+} bib_parser;
+
+
+static int bib_getc(bib_reader *r);
+static void bib_ungetc(bib_reader *r, int c);
+static int skip_space(bib_reader *r);
+static gboolean is_name_char(int c);
+static void read_name(bib_parser *ps, GString *s);
+static void append_char(GString *s, int c);
+static gboolean read_delimited(bib_parser *ps, int close);
+static gboolean read_value(bib_parser *ps);
+static gboolean parse_fields(bib_parser *ps, int close);
+static gboolean parse_entry(bib_parser *ps);
+static gboolean skip_block(bib_parser *ps, int close);
+static gboolean fail(bib_parser *ps, const gchar *message);
+static void store_field(bib_parser *ps);
+static const gchar *canonical_type(const gchar *type);
+
+
+void
+gra_bibtex_import(gra_db_t *db, const gchar *filename,
+                  gra_bibtex_error_func onError, gpointer data,
+                  gra_bibtex_stats_t *stats, GError **error) {
+  FILE *in;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  in = fopen(filename, "r");
+  if(!in) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s",
+                filename, g_strerror(errno));
+    return;
+  }
+
+  gra_bibtex_import_stream(db, in, onError, data, stats, error);
+  fclose(in);
+}
+
+
+void
+gra_bibtex_import_stream(gra_db_t *db, FILE *in,
+                         gra_bibtex_error_func onError, gpointer data,
+                         gra_bibtex_stats_t *stats, GError **error) {
+  bib_parser *ps;
+  gra_bibtex_stats_t result = {0};
+  gint64 start;
+  unsigned long inBatch = 0;
+  GError *err = NULL;
+  int c;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  start = g_get_monotonic_time();
+
+  /* the parser carries the read buffer, so keep it off the stack */
+  ps = g_malloc0(sizeof(bib_parser));
+  ps->r.in = in;
+  ps->r.line = 1;
+  ps->key = g_string_new(NULL);
+  ps->name = g_string_new(NULL);
+  ps->field = g_string_new(NULL);
+  ps->value = g_string_new(NULL);
+  ps->macros = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+  gra_db_batch_begin(db, &err);
+
+  while(!err) {
+    /* anything outside of an entry is a comment */
+    while((c = bib_getc(&ps->r)) != EOF && c != '@');
+    if(c == EOF) break;
+
+    if(!parse_entry(ps)) {
+      result.errors++;
+      if(onError)
+        onError(ps->errorLine, ps->message, data);
+    }
+
+    /* @string, @comment and @preamble do not produce a paper */
+    if(!ps->paper) continue;
+
+    gra_db_paper_save(db, ps->paper, &err);
+    gra_paper_free(ps->paper);
+    ps->paper = NULL;
+    if(err) break;
+    result.entries++;
+
+    /* start a new transaction every so often */
+    if(++inBatch == GRA_BIBTEX_BATCH_SIZE) {
+      gra_db_batch_commit(db, &err);
+      gra_db_batch_begin(db, &err);
+      inBatch = 0;
+    }
+  }
+
+  /* a read error looks like the end of the file */
+  if(!err && ferror(in)) {
+    g_set_error(&err, GRA_DATA_ERROR, 4, "Read error near line %d: %s",
+                ps->r.line, g_strerror(errno));
+  }
+
+  if(err) {
+    if(db->batchDepth)
+      gra_db_batch_rollback(db, NULL);
+    g_propagate_error(error, err);
+  } else {
+    gra_db_batch_commit(db, error);
+  }
+
+  /* report */
+  result.lines = ps->r.line;
+  result.seconds = (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC;
+  if(result.seconds > 0)
+    result.entriesPerSecond = result.entries / result.seconds;
+  if(stats)
+    *stats = result;
+
+  gra_paper_free(ps->paper);
+  g_string_free(ps->key, TRUE);
+  g_string_free(ps->name, TRUE);
+  g_string_free(ps->field, TRUE);
+  g_string_free(ps->value, TRUE);
+  g_hash_table_destroy(ps->macros);
+  g_free(ps);
+}
+
+
+
+/*
+ * Static Methods
+ */
+
+/* read one character, refilling the buffer as needed */
+static int
+bib_getc(bib_reader *r) {
+  int c;
+
+  if(r->pos == r->len) {
+    r->len = fread(r->buf, 1, sizeof(r->buf), r->in);
+    r->pos = 0;
+    if(r->len == 0) return EOF;
+  }
+
+  c = (unsigned char) r->buf[r->pos++];
+  if(c == '\n') r->line++;
+  return c;
+}
+
+
+/* push back the character returned by the last bib_getc */
+static void
+bib_ungetc(bib_reader *r, int c) {
+  if(c == EOF) return;
+  r->pos--;
+  if(c == '\n') r->line--;
+}
+
+
+/* skip white space, returning the first other character */
+static int
+skip_space(bib_reader *r) {
+  int c;
+
+  while((c = bib_getc(r)) != EOF && g_ascii_isspace(c));
+  return c;
+}
+
+
+/* characters allowed in entry types, keys, field names and strings */
+static gboolean
+is_name_char(int c) {
+  return c != EOF && !g_ascii_isspace(c) && !strchr(",={}()#\"%", c);
+}
+
+
+static void
+read_name(bib_parser *ps, GString *s) {
+  int c;
+
+  g_string_truncate(s, 0);
+  while(is_name_char(c = bib_getc(&ps->r)))
+    g_string_append_c(s, c);
+  bib_ungetc(&ps->r, c);
+}
+
+
+/* append to a value, folding runs of white space into one blank */
+static void
+append_char(GString *s, int c) {
+  if(g_ascii_isspace(c)) {
+    if(s->len && s->str[s->len-1] != ' ')
+      g_string_append_c(s, ' ');
+  } else {
+    g_string_append_c(s, c);
+  }
+}
+
+
+/* Read a {braced} or "quoted" value part.  The opening delimiter has
+   been consumed; inner braces are kept. */
+static gboolean
+read_delimited(bib_parser *ps, int close) {
+  int depth = 0;
+  int c;
+
+  while((c = bib_getc(&ps->r)) != EOF) {
+    if(c == '{') {
+      depth++;
+    } else if(c == '}') {
+      if(!depth && close == '}') return TRUE;
+      if(!depth) return fail(ps, "Unbalanced braces in value.");
+      depth--;
+    } else if(c == close && !depth) {
+      return TRUE;
+    }
+
+    if(ps->value->len > BIB_MAX_VALUE)
+      return fail(ps, "Field value is too long.");
+    append_char(ps->value, c);
+  }
+
+  return fail(ps, "Unexpected end of file in value.");
+}
+
+
+/* read a value: parts joined with # */
+static gboolean
+read_value(bib_parser *ps) {
+  const gchar *macro;
+  int c;
+  int i;
+
+  g_string_truncate(ps->value, 0);
+  for(;;) {
+    c = skip_space(&ps->r);
+    if(c == '{' || c == '"') {
+      if(!read_delimited(ps, c == '{' ? '}' : '"'))
+        return FALSE;
+    } else if(is_name_char(c)) {
+      /* a number, or the name of a @string */
+      bib_ungetc(&ps->r, c);
+      read_name(ps, ps->name);
+      g_string_ascii_down(ps->name);
+      macro = g_hash_table_lookup(ps->macros, ps->name->str);
+      for(i=0; !macro && i<G_N_ELEMENTS(months); i++) {
+        if(!strcmp(ps->name->str, months[i][0]))
+          macro = months[i][1];
+      }
+      g_string_append(ps->value, macro ? macro : ps->name->str);
+    } else {
+      return fail(ps, "Expected a field value.");
+    }
+
+    /* concatenation? */
+    c = skip_space(&ps->r);
+    if(c != '#') {
+      bib_ungetc(&ps->r, c);
+      break;
+    }
+  }
+
+  /* drop the blank a trailing newline may have left */
+  if(ps->value->len && ps->value->str[ps->value->len-1] == ' ')
+    g_string_truncate(ps->value, ps->value->len-1);
+  if(ps->value->len && ps->value->str[0] == ' ')
+    g_string_erase(ps->value, 0, 1);
+
+  return TRUE;
+}
+
+
+/* read name = value pairs up to the closing delimiter */
+static gboolean
+parse_fields(bib_parser *ps, int close) {
+  int c;
+
+  for(;;) {
+    c = skip_space(&ps->r);
+    if(c == close) return TRUE;
+    if(c == EOF) return fail(ps, "Unexpected end of file in entry.");
+
+    /* field name */
+    bib_ungetc(&ps->r, c);
+    read_name(ps, ps->field);
+    if(!ps->field->len) return fail(ps, "Expected a field name.");
+    g_string_ascii_down(ps->field);
+
+    if(skip_space(&ps->r) != '=')
+      return fail(ps, "Expected '=' after field name.");
+
+    if(!read_value(ps)) return FALSE;
+    store_field(ps);
+
+    /* separator or the end of the entry */
+    c = skip_space(&ps->r);
+    if(c == close) return TRUE;
+    if(c != ',') return fail(ps, "Expected ',' between fields.");
+  }
+}
+
+
+/* parse one entry.  The @ has been consumed. */
+static gboolean
+parse_entry(bib_parser *ps) {
+  gchar *type;
+  int open, close;
+  int c;
+
+  ps->paper = NULL;
+  ps->errorLine = ps->r.line;
+
+  /* entry type */
+  read_name(ps, ps->name);
+  g_string_ascii_down(ps->name);
+  open = skip_space(&ps->r);
+  if(open != '{' && open != '(') {
+    /* a stray @, or an @comment on a line of its own */
+    bib_ungetc(&ps->r, open);
+    if(!strcmp(ps->name->str, "comment")) return TRUE;
+    return fail(ps, "Expected '{' after entry type.");
+  }
+  close = open == '{' ? '}' : ')';
+
+  /* entries with no key or fields */
+  if(!strcmp(ps->name->str, "comment") || !strcmp(ps->name->str, "preamble"))
+    return skip_block(ps, close);
+
+  /* @string{name = value} */
+  if(!strcmp(ps->name->str, "string")) {
+    c = skip_space(&ps->r);
+    bib_ungetc(&ps->r, c);
+    read_name(ps, ps->key);
+    g_string_ascii_down(ps->key);
+    if(!ps->key->len) return fail(ps, "Expected a string name.");
+    if(skip_space(&ps->r) != '=') return fail(ps, "Expected '=' after string name.");
+    if(!read_value(ps)) return FALSE;
+    if(skip_space(&ps->r) != close) return fail(ps, "Expected end of @string.");
+    g_hash_table_replace(ps->macros, g_strdup(ps->key->str),
+                         g_strdup(ps->value->str));
+    return TRUE;
+  }
+
+  /* a real entry */
+  type = g_strdup(ps->name->str);
+  ps->paper = gra_paper_new();
+  ps->paper->fileName = g_strdup("");
+  ps->paper->type = g_strdup(canonical_type(type));
+  g_free(type);
+
+  /* citation key */
+  c = skip_space(&ps->r);
+  bib_ungetc(&ps->r, c);
+  read_name(ps, ps->key);
+  if(ps->key->len)
+    gra_paper_set_field(ps->paper, "citekey", ps->key->str);
+
+  c = skip_space(&ps->r);
+  if(c == close) return TRUE;
+  if(c != ',') return fail(ps, "Expected ',' after citation key.");
+
+  return parse_fields(ps, close);
+}
+
+
+/* skip a balanced block up to close */
+static gboolean
+skip_block(bib_parser *ps, int close) {
+  int depth = 0;
+  int c;
+
+  while((c = bib_getc(&ps->r)) != EOF) {
+    if(c == '{') depth++;
+    else if(c == '}' && depth) depth--;
+    else if(c == close && !depth) return TRUE;
+  }
+
+  return fail(ps, "Unexpected end of file in entry.");
+}
+
+
+/* record a parse error and drop the entry in progress */
+static gboolean
+fail(bib_parser *ps, const gchar *message) {
+  ps->message = message;
+  ps->errorLine = ps->r.line;
+  gra_paper_free(ps->paper);
+  ps->paper = NULL;
+  return FALSE;
+}
+
+
+/* put a parsed field into its Paper column or Field row */
+static void
+store_field(bib_parser *ps) {
+  gra_paper_t *p = ps->paper;
+  const gchar *name = ps->field->str;
+
+  if(!strcmp(name, "title")) {
+    g_free(p->title);
+    p->title = g_strdup(ps->value->str);
+  } else if(!strcmp(name, "author")) {
+    g_free(p->author);
+    p->author = g_strdup(ps->value->str);
+  } else if(!strcmp(name, "year")) {
+    p->year = strtoul(ps->value->str, NULL, 10);
+  } else {
+    gra_paper_set_field(p, name, ps->value->str);
+  }
+}
+
+
+/* map an entry type onto one of the standard types */
+static const gchar *
+canonical_type(const gchar *type) {
+  int i;
+
+  for(i=0; i<gra_bibtex_type_count; i++) {
+    if(!g_ascii_strcasecmp(type, gra_bibtex_types[i]))
+      return gra_bibtex_types[i];
+  }
+
+  return type;
+}
@@ -0,0 +1,93 @@
+/*
+    BibTeX import for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BIBTEX_H
+#define BIBTEX_H
+
+#include <stdio.h>
+#include <glib.h>
+#include "datatypes.h"
+
+/** Number of entries written per transaction during an import. */
+#define GRA_BIBTEX_BATCH_SIZE 50000
+
+/** The standard bibtex fields, minus the ones stored as Paper columns
+ *  (title, author and year).
+ */
+extern const gchar * const gra_bibtex_fields[];
+extern const int gra_bibtex_field_count;
+
+/** The standard bibtex document types, as stored in Paper.Type. */
+extern const gchar * const gra_bibtex_types[];
+extern const int gra_bibtex_type_count;
+
+
+/** @struct gra_bibtex_stats_t
+ *  @brief Summary of a finished import.
+ *  @var gra_bibtex_stats_t::entries Number of papers written.
+ *  @var gra_bibtex_stats_t::errors Number of entries skipped because
+ *  they could not be parsed.
+ *  @var gra_bibtex_stats_t::lines Number of lines read.
+ *  @var gra_bibtex_stats_t::seconds Wall clock time of the import.
+ *  @var gra_bibtex_stats_t::entriesPerSecond Import throughput.
+ */
+typedef struct gra_bibtex_stats_t {
+  unsigned long entries;
+  unsigned long errors;
+  unsigned long lines;
+  double seconds;
+  double entriesPerSecond;
+} gra_bibtex_stats_t;
+
+
+/** Called for every entry which cannot be parsed.  The entry is
+ *  skipped and the import carries on with the next one.
+ *  @param line The line on which the error was found.
+ *  @param message A description of the problem.
+ *  @param data The user data given to the import function.
+ */
+typedef void (*gra_bibtex_error_func)(int line, const gchar *message, gpointer data);
+
+
+/** Imports every entry of a BibTeX file into the database.  The file
+ *  is read in fixed size chunks, so memory use does not depend on the
+ *  size of the file, and papers are written in batches of
+ *  GRA_BIBTEX_BATCH_SIZE entries.
+ *
+ *  Entry types are mapped onto gra_bibtex_types, title, author and
+ *  year become Paper columns, and every other field becomes a Field
+ *  row.  The citation key is stored in a field named "citekey".
+ *  @param db the database connection
+ *  @param filename The .bib file to read.
+ *  @param onError Parse error callback.  May be NULL.
+ *  @param data User data for onError.
+ *  @param stats Filled in with the import summary.  May be NULL.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  Only I/O and database errors are reported here; the batch being
+ *  written when one happens is rolled back.
+ */
+void gra_bibtex_import(gra_db_t *db, const gchar *filename,
+                       gra_bibtex_error_func onError, gpointer data,
+                       gra_bibtex_stats_t *stats, GError **error);
+
+
+/** As gra_bibtex_import, reading from an open stream. */
+void gra_bibtex_import_stream(gra_db_t *db, FILE *in,
+                              gra_bibtex_error_func onError, gpointer data,
+                              gra_bibtex_stats_t *stats, GError **error);
+#endif
@@ -0,0 +1,1081 @@
+/*
+    In-memory index of the citations between papers.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <string.h>
+#include <math.h>
+#include <sqlite3.h>
+#include "data.h"
+#include "citegraph.h"
+
+#define DB_ERROR(error)  g_set_error(error, GRA_DATA_ERROR, 1, "SQLite Error: %s", sqlite3_errmsg(db->db))
+
+/* every citation, by citing paper, in the order of the primary key */
+static const gchar *scanSql =
+  "SELECT \"PaperID\", \"RefPaperID\" FROM \"Reference\""
+  " ORDER BY \"PaperID\", \"RefPaperID\"";
+
+/* the changes to the citations of one paper in one direction, each
+   array sorted.  Added papers are never in the arrays, removed ones
+   always are. */
+typedef struct node_delta {
+  GArray *added;
+  GArray *removed;
+} node_delta;
+
+/* one part of a query, over papers first to last - 1 */
+typedef void (*part_func)(gra_citegraph_t *g, gpointer data, int part,
+                          int first, int last);
+
+/* the parts of a query still running on the pool */
+typedef struct part_run {
+  GMutex lock;
+  GCond cond;
+  int left;
+} part_run;
+
+typedef struct part_job {
+  gra_citegraph_t *g;
+  part_func func;
+  gpointer data;
+  int part;
+  int first;
+  int last;
+  part_run *run;
+} part_job;
+
+/* a score for every paper, for top_nodes */
+typedef double (*node_score)(gra_citegraph_t *g, int paperId, gpointer data);
+
+typedef struct top_ctx {
+  node_score score;
+  gpointer data;
+  int limit;
+  GArray **tops;
+} top_ctx;
+
+/* one step of gra_citegraph_closure */
+typedef struct expand_ctx {
+  gra_cite_direction dir;
+  const gint32 *frontier;
+  guint *seen;
+  int parts;
+  GArray **next;
+} expand_ctx;
+
+/* the papers two steps away, counted by the paths to them */
+typedef struct shared_ctx {
+  int paperId;
+  gra_cite_direction dir;
+  const gint32 *via;
+  GHashTable **counts;
+} shared_ctx;
+
+/* one PageRank iteration.  Papers outside the graph have an out
+   degree of -1. */
+typedef struct rank_ctx {
+  double *rank;
+  double *next;
+  double *share;
+  gint32 *outDegree;
+  double *sums;
+  int *present;
+  double base;
+} rank_ctx;
+
+struct gra_citegraph_t {
+  gra_db_t *db;
+  GThreadPool *pool;
+  int threads;
+  GRWLock lock;
+  /* the arrays, by direction: where each paper's citations start,
+     then the citations */
+  int baseNodes;
+  guint32 *start[2];
+  gint32 *ids[2];
+  unsigned long edges;
+  /* changes since, by direction and paper ID */
+  int nodes;
+  GHashTable *delta[2];
+  guint8 *dirty;
+  unsigned long pending;
+  unsigned long citations;
+  unsigned long compactions;
+  double buildSeconds;
+  guint version;
+  /* ranks of the graph as of rankVersion */
+  GMutex rankLock;
+  double *ranks;
+  guint rankVersion;
+};
+
+/* static method prototypes */
+static void graph_load(gra_citegraph_t *g, GError **error);
+static void build_reverse(gra_citegraph_t *g);
+static void compact(gra_citegraph_t *g);
+static void grow(gra_citegraph_t *g, int nodes);
+static int edge_change(gra_citegraph_t *g, int paperId, int otherId,
+                       gra_cite_direction dir, gboolean added);
+static const gint32 *neighbors(gra_citegraph_t *g, int paperId,
+                               gra_cite_direction dir, GArray *buf, int *n);
+static int degree(gra_citegraph_t *g, int paperId, gra_cite_direction dir);
+static gboolean sorted_find(const gint32 *a, guint n, gint32 x, guint *at);
+static void node_delta_free(gpointer data);
+static int parts_for(gra_citegraph_t *g, gsize work);
+static void run_parts(gra_citegraph_t *g, int n, int parts, part_func func,
+                      gpointer data);
+static void part_main(gpointer data, gpointer user_data);
+static void top_add(GArray *top, int limit, int paperId, double score);
+static GArray *top_nodes(gra_citegraph_t *g, int limit, node_score score,
+                         gpointer data);
+static void top_part(gra_citegraph_t *g, gpointer data, int part,
+                     int first, int last);
+static gint hit_compare(gconstpointer a, gconstpointer b);
+static gint id_compare(gconstpointer a, gconstpointer b);
+static void expand_part(gra_citegraph_t *g, gpointer data, int part,
+                        int first, int last);
+static GArray *shared(gra_citegraph_t *g, int paperId,
+                      gra_cite_direction first, int limit);
+static void shared_part(gra_citegraph_t *g, gpointer data, int part,
+                        int first, int last);
+static double cited_score(gra_citegraph_t *g, int paperId, gpointer data);
+static double rank_score(gra_citegraph_t *g, int paperId, gpointer data);
+static void rank_compute(gra_citegraph_t *g);
+static void rank_degree_part(gra_citegraph_t *g, gpointer data, int part,
+                             int first, int last);
+static void rank_share_part(gra_citegraph_t *g, gpointer data, int part,
+                            int first, int last);
+static void rank_next_part(gra_citegraph_t *g, gpointer data, int part,
+                           int first, int last);
+
+
+gra_citegraph_t *
+gra_citegraph_new(gra_db_t *db, int threads, GError **error) {
+  gra_citegraph_t *g;
+  GError *err = NULL;
+  gint64 began;
+  int i;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  if(threads <= 0)
+    threads = g_get_num_processors();
+
+  g = g_malloc0(sizeof(gra_citegraph_t));
+  g->db = db;
+  g->threads = threads;
+  g->version = 1;
+  g_rw_lock_init(&g->lock);
+  g_mutex_init(&g->rankLock);
+  for(i=0; i<2; i++)
+    g->delta[i] = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                        NULL, node_delta_free);
+
+  /* nothing may change the table between the scan and the attach */
+  gra_db_lock(db);
+  if(db->batchDepth) {
+    g_set_error(&err, GRA_DATA_ERROR, 3, "A batch is open.");
+  } else if(db->citations) {
+    g_set_error(&err, GRA_DATA_ERROR, 3,
+                "The connection already has a citation graph.");
+  } else {
+    began = g_get_monotonic_time();
+    graph_load(g, &err);
+    g->buildSeconds = (g_get_monotonic_time() - began) / (double) G_USEC_PER_SEC;
+  }
+  if(!err) {
+    db->citations = g;
+    db->citeLog = g_array_new(FALSE, FALSE, sizeof(gra_citation_change_t));
+    db->citeMarks = g_array_new(FALSE, FALSE, sizeof(guint));
+  }
+  gra_db_unlock(db);
+
+  if(err) {
+    g_propagate_error(error, err);
+    g->db = NULL;
+    gra_citegraph_free(g);
+    return NULL;
+  }
+
+  /* the calling thread runs one part of each query itself */
+  if(threads > 1)
+    g->pool = g_thread_pool_new(part_main, NULL, threads - 1, FALSE, NULL);
+
+  return g;
+}
+
+
+void
+gra_citegraph_free(gra_citegraph_t *g) {
+  gra_db_t *db = g->db;
+  int i;
+
+  if(db) {
+    gra_db_lock(db);
+    db->citations = NULL;
+    g_array_free(db->citeLog, TRUE);
+    g_array_free(db->citeMarks, TRUE);
+    db->citeLog = NULL;
+    db->citeMarks = NULL;
+    gra_db_unlock(db);
+  }
+
+  if(g->pool)
+    g_thread_pool_free(g->pool, FALSE, TRUE);
+
+  for(i=0; i<2; i++) {
+    g_free(g->start[i]);
+    g_free(g->ids[i]);
+    g_hash_table_destroy(g->delta[i]);
+  }
+  g_free(g->dirty);
+  g_free(g->ranks);
+  g_rw_lock_clear(&g->lock);
+  g_mutex_clear(&g->rankLock);
+  g_free(g);
+}
+
+
+int
+gra_citegraph_count(gra_citegraph_t *g, int paperId, gra_cite_direction dir) {
+  int n;
+
+  g_rw_lock_reader_lock(&g->lock);
+  n = degree(g, paperId, dir);
+  g_rw_lock_reader_unlock(&g->lock);
+
+  return n;
+}
+
+
+/* Walk out from a paper a step at a time.  Each step expands every
+   paper found by the one before, in parallel once there are many. */
+GArray *
+gra_citegraph_closure(gra_citegraph_t *g, int paperId,
+                      gra_cite_direction dir, int depth) {
+  GArray *hits = g_array_new(FALSE, FALSE, sizeof(gra_citation_hit_t));
+  GArray *frontier;
+  gra_citation_hit_t h;
+  expand_ctx x;
+  guint i;
+  int level, part;
+
+  g_rw_lock_reader_lock(&g->lock);
+  if(paperId < 0 || paperId >= g->nodes) {
+    g_rw_lock_reader_unlock(&g->lock);
+    return hits;
+  }
+
+  x.dir = dir;
+  x.seen = g_new0(guint, g->nodes / 32 + 1);
+  x.seen[paperId / 32] |= 1u << (paperId % 32);
+  x.next = g_new(GArray *, g->threads);
+  frontier = g_array_new(FALSE, FALSE, sizeof(gint32));
+  g_array_append_val(frontier, paperId);
+
+  for(level=1; frontier->len && (depth < 0 || level <= depth); level++) {
+    x.parts = parts_for(g, frontier->len);
+    x.frontier = (const gint32 *) frontier->data;
+    for(part=0; part<x.parts; part++)
+      x.next[part] = g_array_new(FALSE, FALSE, sizeof(gint32));
+    run_parts(g, frontier->len, x.parts, expand_part, &x);
+
+    /* the papers first reached by this step are the next frontier */
+    g_array_set_size(frontier, 0);
+    for(part=0; part<x.parts; part++) {
+      g_array_append_vals(frontier, x.next[part]->data, x.next[part]->len);
+      g_array_free(x.next[part], TRUE);
+    }
+    g_array_sort(frontier, id_compare);
+
+    h.score = level;
+    for(i=0; i<frontier->len; i++) {
+      h.paperId = g_array_index(frontier, gint32, i);
+      g_array_append_val(hits, h);
+    }
+  }
+  g_rw_lock_reader_unlock(&g->lock);
+
+  g_array_free(frontier, TRUE);
+  g_free(x.next);
+  g_free(x.seen);
+  return hits;
+}
+
+
+GArray *
+gra_citegraph_cocited(gra_citegraph_t *g, int paperId, int limit) {
+  /* through the papers citing it, to the others they cite */
+  return shared(g, paperId, GRA_CITED_BY, limit);
+}
+
+
+GArray *
+gra_citegraph_coupled(gra_citegraph_t *g, int paperId, int limit) {
+  /* through the papers it cites, to the others citing them */
+  return shared(g, paperId, GRA_CITES, limit);
+}
+
+
+GArray *
+gra_citegraph_most_cited(gra_citegraph_t *g, int limit) {
+  GArray *hits;
+
+  g_rw_lock_reader_lock(&g->lock);
+  hits = top_nodes(g, limit, cited_score, NULL);
+  g_rw_lock_reader_unlock(&g->lock);
+
+  return hits;
+}
+
+
+GArray *
+gra_citegraph_pagerank(gra_citegraph_t *g, int limit) {
+  GArray *hits;
+
+  g_rw_lock_reader_lock(&g->lock);
+  g_mutex_lock(&g->rankLock);
+  if(!g->ranks || g->rankVersion != g->version)
+    rank_compute(g);
+  hits = top_nodes(g, limit, rank_score, g->ranks);
+  g_mutex_unlock(&g->rankLock);
+  g_rw_lock_reader_unlock(&g->lock);
+
+  return hits;
+}
+
+
+void
+gra_citegraph_get_stats(gra_citegraph_t *g, gra_citegraph_stats_t *stats) {
+  int v;
+
+  g_rw_lock_reader_lock(&g->lock);
+  stats->papers = 0;
+  for(v=0; v<g->nodes; v++) {
+    if(degree(g, v, GRA_CITES) || degree(g, v, GRA_CITED_BY))
+      stats->papers++;
+  }
+  stats->citations = g->citations;
+  stats->pending = g->pending / 2;
+  stats->compactions = g->compactions;
+  stats->bytes = 2 * (g->baseNodes + 1) * sizeof(guint32)
+               + 2 * g->edges * sizeof(gint32) + g->nodes;
+  stats->buildSeconds = g->buildSeconds;
+  g_rw_lock_reader_unlock(&g->lock);
+}
+
+
+void
+gra_citegraph_apply(gra_citegraph_t *g, const gra_citation_change_t *changes, guint n) {
+  const gra_citation_change_t *c;
+  guint i;
+
+  if(!n) return;
+
+  g_rw_lock_writer_lock(&g->lock);
+  for(i=0; i<n; i++) {
+    c = changes + i;
+    if(c->paperId < 0 || c->refPaperId < 0)
+      continue;
+    grow(g, MAX(c->paperId, c->refPaperId) + 1);
+    g->citations += edge_change(g, c->paperId, c->refPaperId, GRA_CITES, c->added);
+    edge_change(g, c->refPaperId, c->paperId, GRA_CITED_BY, c->added);
+  }
+
+  /* fold the changes in once looking them up costs more than a build */
+  if(g->pending / 2 > MAX(GRA_CITEGRAPH_COMPACT_MIN, g->citations / 16))
+    compact(g);
+
+  g->version++;
+  g_rw_lock_writer_unlock(&g->lock);
+}
+
+
+/* Read the Reference table into the arrays.  The primary key gives
+   the citations of each paper in order, so the cites arrays fill as
+   the rows come; the cited by arrays are made from them. */
+static void
+graph_load(gra_citegraph_t *g, GError **error) {
+  gra_db_t *db = g->db;
+  sqlite3_stmt *stmt = NULL;
+  GArray *start, *ids;
+  guint32 end;
+  int rc, from, to, maxId = -1;
+
+  if(sqlite3_prepare_v2(db->db, scanSql, -1, &stmt, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    return;
+  }
+
+  start = g_array_new(FALSE, FALSE, sizeof(guint32));
+  ids = g_array_sized_new(FALSE, FALSE, sizeof(gint32), 4096);
+  while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    from = sqlite3_column_int(stmt, 0);
+    to = sqlite3_column_int(stmt, 1);
+    if(from < 0 || to < 0)
+      continue;
+
+    /* papers citing nothing start where the next one does */
+    end = ids->len;
+    while(start->len <= from)
+      g_array_append_val(start, end);
+    g_array_append_val(ids, to);
+    maxId = MAX(maxId, to);
+  }
+  if(rc != SQLITE_DONE)
+    DB_ERROR(error);
+  sqlite3_finalize(stmt);
+
+  if(error && *error) {
+    g_array_free(start, TRUE);
+    g_array_free(ids, TRUE);
+    return;
+  }
+
+  /* every paper cited gets a slot, and one more ends the last */
+  g->nodes = MAX((int) start->len, maxId + 1);
+  end = ids->len;
+  while(start->len <= g->nodes)
+    g_array_append_val(start, end);
+
+  g->baseNodes = g->nodes;
+  g->edges = g->citations = ids->len;
+  g->start[GRA_CITES] = (guint32 *) g_array_free(start, FALSE);
+  g->ids[GRA_CITES] = (gint32 *) g_array_free(ids, FALSE);
+  g->dirty = g_new0(guint8, g->nodes + 1);
+  build_reverse(g);
+}
+
+
+/* Make the cited by arrays from the cites arrays, with a counting
+   sort.  Citing papers are visited in order, so each list comes out
+   sorted. */
+static void
+build_reverse(gra_citegraph_t *g) {
+  const guint32 *out = g->start[GRA_CITES];
+  const gint32 *cited = g->ids[GRA_CITES];
+  guint32 *start, *fill;
+  gint32 *ids;
+  guint32 e;
+  int v, n = g->baseNodes;
+
+  start = g_new0(guint32, n + 1);
+  ids = g_new(gint32, g->edges + 1);
+  for(e=0; e<g->edges; e++)
+    start[cited[e] + 1]++;
+  for(v=0; v<n; v++)
+    start[v + 1] += start[v];
+
+  fill = g_new(guint32, n + 1);
+  memcpy(fill, start, (n + 1) * sizeof(guint32));
+  for(v=0; v<n; v++) {
+    for(e=out[v]; e<out[v + 1]; e++)
+      ids[fill[cited[e]]++] = v;
+  }
+  g_free(fill);
+
+  g_free(g->start[GRA_CITED_BY]);
+  g_free(g->ids[GRA_CITED_BY]);
+  g->start[GRA_CITED_BY] = start;
+  g->ids[GRA_CITED_BY] = ids;
+}
+
+
+/* Fold the changes into new arrays.  The write lock is held. */
+static void
+compact(gra_citegraph_t *g) {
+  GArray *buf = g_array_new(FALSE, FALSE, sizeof(gint32));
+  const gint32 *cites;
+  guint32 *start;
+  gint32 *ids;
+  guint32 end = 0;
+  int v, n;
+
+  start = g_new(guint32, g->nodes + 1);
+  ids = g_new(gint32, g->citations + 1);
+  for(v=0; v<g->nodes; v++) {
+    start[v] = end;
+    cites = neighbors(g, v, GRA_CITES, buf, &n);
+    if(n)
+      memcpy(ids + end, cites, n * sizeof(gint32));
+    end += n;
+  }
+  start[g->nodes] = end;
+  g_array_free(buf, TRUE);
+
+  g_free(g->start[GRA_CITES]);
+  g_free(g->ids[GRA_CITES]);
+  g->start[GRA_CITES] = start;
+  g->ids[GRA_CITES] = ids;
+  g->baseNodes = g->nodes;
+  g->edges = end;
+  build_reverse(g);
+
+  g_hash_table_remove_all(g->delta[GRA_CITES]);
+  g_hash_table_remove_all(g->delta[GRA_CITED_BY]);
+  memset(g->dirty, 0, g->nodes);
+  g->pending = 0;
+  g->compactions++;
+}
+
+
+/* Make room for papers up to nodes - 1 */
+static void
+grow(gra_citegraph_t *g, int nodes) {
+  if(nodes <= g->nodes)
+    return;
+
+  g->dirty = g_realloc(g->dirty, nodes + 1);
+  memset(g->dirty + g->nodes, 0, nodes + 1 - g->nodes);
+  g->nodes = nodes;
+}
+
+
+/* Add or remove one direction of a citation, returning how the
+   number of citations changed */
+static int
+edge_change(gra_citegraph_t *g, int paperId, int otherId,
+            gra_cite_direction dir, gboolean added) {
+  node_delta *d;
+  GArray *list;
+  gboolean inBase = FALSE, found;
+  guint at;
+  int change = 0;
+
+  if(paperId < g->baseNodes) {
+    inBase = sorted_find(g->ids[dir] + g->start[dir][paperId],
+                         g->start[dir][paperId + 1] - g->start[dir][paperId],
+                         otherId, &at);
+  }
+
+  d = g_hash_table_lookup(g->delta[dir], GINT_TO_POINTER(paperId));
+  if(!d) {
+    d = g_new(node_delta, 1);
+    d->added = g_array_new(FALSE, FALSE, sizeof(gint32));
+    d->removed = g_array_new(FALSE, FALSE, sizeof(gint32));
+    g_hash_table_insert(g->delta[dir], GINT_TO_POINTER(paperId), d);
+  }
+
+  /* adding back a removed citation takes back the removal, and
+     removing an added one takes back the add */
+  list = inBase ? d->removed : d->added;
+  found = sorted_find((const gint32 *) list->data, list->len, otherId, &at);
+  if(added != inBase && !found) {
+    g_array_insert_val(list, at, otherId);
+    g->pending++;
+    change = added ? 1 : -1;
+  } else if(added == inBase && found) {
+    g_array_remove_index(list, at);
+    g->pending--;
+    change = added ? 1 : -1;
+  }
+
+  if(d->added->len || d->removed->len) {
+    g->dirty[paperId] |= 1 << dir;
+  } else {
+    g->dirty[paperId] &= ~(1 << dir);
+    g_hash_table_remove(g->delta[dir], GINT_TO_POINTER(paperId));
+  }
+
+  return change;
+}
+
+
+/* The papers next to one, sorted.  Points into the arrays unless the
+   paper has changes, which are merged into buf. */
+static const gint32 *
+neighbors(gra_citegraph_t *g, int paperId, gra_cite_direction dir,
+          GArray *buf, int *n) {
+  const gint32 *base = NULL, *added, *removed;
+  node_delta *d;
+  int count = 0, i = 0, a = 0, r = 0;
+
+  if(paperId >= 0 && paperId < g->baseNodes) {
+    base = g->ids[dir] + g->start[dir][paperId];
+    count = g->start[dir][paperId + 1] - g->start[dir][paperId];
+  }
+  if(paperId < 0 || paperId >= g->nodes || !(g->dirty[paperId] & (1 << dir))) {
+    *n = count;
+    return base;
+  }
+
+  /* the arrays, less the removed, merged with the added */
+  d = g_hash_table_lookup(g->delta[dir], GINT_TO_POINTER(paperId));
+  added = (const gint32 *) d->added->data;
+  removed = (const gint32 *) d->removed->data;
+  g_array_set_size(buf, 0);
+  while(i < count || a < d->added->len) {
+    if(a < d->added->len && (i == count || added[a] < base[i])) {
+      g_array_append_val(buf, added[a]);
+      a++;
+      continue;
+    }
+    while(r < d->removed->len && removed[r] < base[i])
+      r++;
+    if(r == d->removed->len || removed[r] != base[i])
+      g_array_append_val(buf, base[i]);
+    i++;
+  }
+
+  *n = buf->len;
+  return (const gint32 *) buf->data;
+}
+
+
+static int
+degree(gra_citegraph_t *g, int paperId, gra_cite_direction dir) {
+  node_delta *d;
+  int n = 0;
+
+  if(paperId >= 0 && paperId < g->baseNodes)
+    n = g->start[dir][paperId + 1] - g->start[dir][paperId];
+  if(paperId >= 0 && paperId < g->nodes && (g->dirty[paperId] & (1 << dir))) {
+    d = g_hash_table_lookup(g->delta[dir], GINT_TO_POINTER(paperId));
+    n += d->added->len - d->removed->len;
+  }
+
+  return n;
+}
+
+
+/* Binary search, giving where x is or would go */
+static gboolean
+sorted_find(const gint32 *a, guint n, gint32 x, guint *at) {
+  guint lo = 0, hi = n, mid;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(a[mid] < x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *at = lo;
+  return lo < n && a[lo] == x;
+}
+
+
+static void
+node_delta_free(gpointer data) {
+  node_delta *d = (node_delta *) data;
+
+  g_array_free(d->added, TRUE);
+  g_array_free(d->removed, TRUE);
+  g_free(d);
+}
+
+
+/* Parts to split work over; small jobs are not worth the threads */
+static int
+parts_for(gra_citegraph_t *g, gsize work) {
+  if(!g->pool || work < GRA_CITEGRAPH_PARALLEL_MIN)
+    return 1;
+  return MIN(g->threads, work / (GRA_CITEGRAPH_PARALLEL_MIN / 4));
+}
+
+
+/* Run func over 0 to n - 1 in parts, the first on this thread and
+   the rest on the pool, and wait for them all */
+static void
+run_parts(gra_citegraph_t *g, int n, int parts, part_func func,
+          gpointer data) {
+  part_job *jobs;
+  part_run run;
+  int i;
+
+  if(parts <= 1) {
+    func(g, data, 0, 0, n);
+    return;
+  }
+
+  g_mutex_init(&run.lock);
+  g_cond_init(&run.cond);
+  run.left = parts - 1;
+
+  jobs = g_new(part_job, parts);
+  for(i=0; i<parts; i++) {
+    jobs[i].g = g;
+    jobs[i].func = func;
+    jobs[i].data = data;
+    jobs[i].part = i;
+    jobs[i].first = (gint64) n * i / parts;
+    jobs[i].last = (gint64) n * (i + 1) / parts;
+    jobs[i].run = &run;
+    if(i)
+      g_thread_pool_push(g->pool, jobs + i, NULL);
+  }
+  func(g, data, 0, jobs[0].first, jobs[0].last);
+
+  g_mutex_lock(&run.lock);
+  while(run.left)
+    g_cond_wait(&run.cond, &run.lock);
+  g_mutex_unlock(&run.lock);
+
+  g_mutex_clear(&run.lock);
+  g_cond_clear(&run.cond);
+  g_free(jobs);
+}
+
+
+/* A part of a query, on a pool thread */
+static void
+part_main(gpointer data, gpointer user_data) {
+  part_job *j = (part_job *) data;
+
+  j->func(j->g, j->data, j->part, j->first, j->last);
+
+  g_mutex_lock(&j->run->lock);
+  if(!--j->run->left)
+    g_cond_signal(&j->run->cond);
+  g_mutex_unlock(&j->run->lock);
+}
+
+
+/* Keep the best limit hits, best first.  Without a limit every hit is
+   kept, unsorted. */
+static void
+top_add(GArray *top, int limit, int paperId, double score) {
+  gra_citation_hit_t h;
+  guint lo = 0, hi = top->len, mid;
+
+  h.paperId = paperId;
+  h.score = score;
+  if(limit <= 0) {
+    g_array_append_val(top, h);
+    return;
+  }
+  if(top->len == limit &&
+     hit_compare(&h, &g_array_index(top, gra_citation_hit_t, limit - 1)) >= 0)
+    return;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(hit_compare(&h, &g_array_index(top, gra_citation_hit_t, mid)) < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  g_array_insert_val(top, lo, h);
+  if(top->len > limit)
+    g_array_set_size(top, limit);
+}
+
+
+/* The best scoring papers, each part of the graph keeping its own
+   best until they are merged */
+static GArray *
+top_nodes(gra_citegraph_t *g, int limit, node_score score, gpointer data) {
+  GArray *hits;
+  gra_citation_hit_t *h;
+  top_ctx x;
+  guint i;
+  int part, parts = parts_for(g, g->nodes);
+
+  x.score = score;
+  x.data = data;
+  x.limit = limit;
+  x.tops = g_new(GArray *, parts);
+  for(part=0; part<parts; part++)
+    x.tops[part] = g_array_new(FALSE, FALSE, sizeof(gra_citation_hit_t));
+  run_parts(g, g->nodes, parts, top_part, &x);
+
+  hits = x.tops[0];
+  for(part=1; part<parts; part++) {
+    for(i=0; i<x.tops[part]->len; i++) {
+      h = &g_array_index(x.tops[part], gra_citation_hit_t, i);
+      top_add(hits, limit, h->paperId, h->score);
+    }
+    g_array_free(x.tops[part], TRUE);
+  }
+  g_free(x.tops);
+
+  if(limit <= 0)
+    g_array_sort(hits, hit_compare);
+  return hits;
+}
+
+
+static void
+top_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  top_ctx *x = (top_ctx *) data;
+  double s;
+  int v;
+
+  for(v=first; v<last; v++) {
+    s = x->score(g, v, x->data);
+    if(s > 0)
+      top_add(x->tops[part], x->limit, v, s);
+  }
+}
+
+
+/* Highest score first, then lowest ID */
+static gint
+hit_compare(gconstpointer a, gconstpointer b) {
+  const gra_citation_hit_t *x = a, *y = b;
+
+  if(x->score != y->score)
+    return x->score > y->score ? -1 : 1;
+  return x->paperId < y->paperId ? -1 : x->paperId > y->paperId;
+}
+
+
+static gint
+id_compare(gconstpointer a, gconstpointer b) {
+  gint32 x = *(const gint32 *) a, y = *(const gint32 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+
+/* Collect the unseen papers next to a part of the frontier.  With
+   more than one part, papers are claimed atomically, so each lands
+   in exactly one part's list. */
+static void
+expand_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  expand_ctx *x = (expand_ctx *) data;
+  GArray *buf = g_array_new(FALSE, FALSE, sizeof(gint32));
+  GArray *next = x->next[part];
+  const gint32 *near;
+  guint bit, *word;
+  int i, j, n;
+
+  for(i=first; i<last; i++) {
+    near = neighbors(g, x->frontier[i], x->dir, buf, &n);
+    for(j=0; j<n; j++) {
+      word = x->seen + near[j] / 32;
+      bit = 1u << (near[j] % 32);
+      if(x->parts > 1) {
+        if(g_atomic_int_or(word, bit) & bit)
+          continue;
+      } else {
+        if(*word & bit)
+          continue;
+        *word |= bit;
+      }
+      g_array_append_val(next, near[j]);
+    }
+  }
+
+  g_array_free(buf, TRUE);
+}
+
+
+/* Count the papers two steps from one: first one way, then back the
+   other, by the number of ways to reach each */
+static GArray *
+shared(gra_citegraph_t *g, int paperId, gra_cite_direction first, int limit) {
+  GArray *hits, *buf = g_array_new(FALSE, FALSE, sizeof(gint32));
+  GHashTableIter iter;
+  gpointer key, value;
+  shared_ctx x;
+  gsize work = 0;
+  int i, n, part, parts;
+
+  hits = g_array_new(FALSE, FALSE, sizeof(gra_citation_hit_t));
+
+  g_rw_lock_reader_lock(&g->lock);
+  x.paperId = paperId;
+  x.dir = first == GRA_CITES ? GRA_CITED_BY : GRA_CITES;
+  x.via = neighbors(g, paperId, first, buf, &n);
+  for(i=0; i<n; i++)
+    work += degree(g, x.via[i], x.dir);
+
+  parts = parts_for(g, work);
+  x.counts = g_new(GHashTable *, parts);
+  for(part=0; part<parts; part++)
+    x.counts[part] = g_hash_table_new(g_direct_hash, g_direct_equal);
+  run_parts(g, n, parts, shared_part, &x);
+  g_rw_lock_reader_unlock(&g->lock);
+
+  /* add the parts' counts together */
+  for(part=1; part<parts; part++) {
+    g_hash_table_iter_init(&iter, x.counts[part]);
+    while(g_hash_table_iter_next(&iter, &key, &value)) {
+      g_hash_table_insert(x.counts[0], key, GINT_TO_POINTER(
+        GPOINTER_TO_INT(g_hash_table_lookup(x.counts[0], key)) +
+        GPOINTER_TO_INT(value)));
+    }
+    g_hash_table_destroy(x.counts[part]);
+  }
+
+  g_hash_table_iter_init(&iter, x.counts[0]);
+  while(g_hash_table_iter_next(&iter, &key, &value))
+    top_add(hits, limit, GPOINTER_TO_INT(key), GPOINTER_TO_INT(value));
+  if(limit <= 0)
+    g_array_sort(hits, hit_compare);
+
+  g_hash_table_destroy(x.counts[0]);
+  g_free(x.counts);
+  g_array_free(buf, TRUE);
+  return hits;
+}
+
+
+static void
+shared_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  shared_ctx *x = (shared_ctx *) data;
+  GHashTable *counts = x->counts[part];
+  GArray *buf = g_array_new(FALSE, FALSE, sizeof(gint32));
+  const gint32 *near;
+  gpointer key;
+  int i, j, n;
+
+  for(i=first; i<last; i++) {
+    near = neighbors(g, x->via[i], x->dir, buf, &n);
+    for(j=0; j<n; j++) {
+      if(near[j] == x->paperId)
+        continue;
+      key = GINT_TO_POINTER(near[j]);
+      g_hash_table_insert(counts, key, GINT_TO_POINTER(
+        GPOINTER_TO_INT(g_hash_table_lookup(counts, key)) + 1));
+    }
+  }
+
+  g_array_free(buf, TRUE);
+}
+
+
+static double
+cited_score(gra_citegraph_t *g, int paperId, gpointer data) {
+  return degree(g, paperId, GRA_CITED_BY);
+}
+
+
+static double
+rank_score(gra_citegraph_t *g, int paperId, gpointer data) {
+  return ((double *) data)[paperId];
+}
+
+
+/* PageRank by power iteration.  Each paper pulls its rank from the
+   papers citing it, so the parts never write to the same place.  The
+   rank of papers citing nothing is spread over every paper.  The read
+   lock and rankLock are held. */
+static void
+rank_compute(gra_citegraph_t *g) {
+  rank_ctx x;
+  double *swap, total;
+  int i, it, v, papers = 0, n = g->nodes;
+  int parts = parts_for(g, n);
+
+  x.rank = g_new(double, n + 1);
+  x.next = g_new(double, n + 1);
+  x.share = g_new(double, n + 1);
+  x.outDegree = g_new(gint32, n + 1);
+  x.sums = g_new(double, parts);
+  x.present = g_new0(int, parts);
+
+  run_parts(g, n, parts, rank_degree_part, &x);
+  for(i=0; i<parts; i++)
+    papers += x.present[i];
+  for(v=0; v<n; v++)
+    x.rank[v] = x.outDegree[v] < 0 || !papers ? 0 : 1.0 / papers;
+
+  for(it=0; papers && it<GRA_CITEGRAPH_ITERATIONS; it++) {
+    memset(x.sums, 0, parts * sizeof(double));
+    run_parts(g, n, parts, rank_share_part, &x);
+    for(total=0, i=0; i<parts; i++)
+      total += x.sums[i];
+    x.base = (1 - GRA_CITEGRAPH_DAMPING) / papers
+           + GRA_CITEGRAPH_DAMPING * total / papers;
+
+    memset(x.sums, 0, parts * sizeof(double));
+    run_parts(g, n, parts, rank_next_part, &x);
+    for(total=0, i=0; i<parts; i++)
+      total += x.sums[i];
+
+    swap = x.rank;
+    x.rank = x.next;
+    x.next = swap;
+    if(total < GRA_CITEGRAPH_TOLERANCE)
+      break;
+  }
+
+  g_free(g->ranks);
+  g->ranks = x.rank;
+  g->rankVersion = g->version;
+
+  g_free(x.next);
+  g_free(x.share);
+  g_free(x.outDegree);
+  g_free(x.sums);
+  g_free(x.present);
+}
+
+
+static void
+rank_degree_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  rank_ctx *x = (rank_ctx *) data;
+  int v;
+
+  for(v=first; v<last; v++) {
+    x->outDegree[v] = degree(g, v, GRA_CITES);
+    if(!x->outDegree[v] && !degree(g, v, GRA_CITED_BY))
+      x->outDegree[v] = -1;
+    else
+      x->present[part]++;
+  }
+}
+
+
+/* What each paper passes to each paper it cites, and the total rank
+   of those citing nothing */
+static void
+rank_share_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  rank_ctx *x = (rank_ctx *) data;
+  int v;
+
+  for(v=first; v<last; v++) {
+    if(x->outDegree[v] > 0) {
+      x->share[v] = x->rank[v] / x->outDegree[v];
+    } else {
+      x->share[v] = 0;
+      if(!x->outDegree[v])
+        x->sums[part] += x->rank[v];
+    }
+  }
+}
+
+
+/* The next rank of each paper, and how far the ranks moved */
+static void
+rank_next_part(gra_citegraph_t *g, gpointer data, int part, int first, int last) {
+  rank_ctx *x = (rank_ctx *) data;
+  GArray *buf = g_array_new(FALSE, FALSE, sizeof(gint32));
+  const gint32 *citing;
+  double sum;
+  int v, i, n;
+
+  for(v=first; v<last; v++) {
+    if(x->outDegree[v] < 0) {
+      x->next[v] = 0;
+      continue;
+    }
+    citing = neighbors(g, v, GRA_CITED_BY, buf, &n);
+    for(sum=0, i=0; i<n; i++)
+      sum += x->share[citing[i]];
+    x->next[v] = x->base + GRA_CITEGRAPH_DAMPING * sum;
+    x->sums[part] += fabs(x->next[v] - x->rank[v]);
+  }
+
+  g_array_free(buf, TRUE);
+}
@@ -0,0 +1,204 @@
+/*
+    In-memory index of the citations between papers.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The citation graph holds the whole Reference table in memory as two
+   compressed adjacency arrays: the papers each paper cites, and the
+   papers citing it, both sorted by ID.  It is built with one scan of
+   the table, and kept current by gra_db_reference_save and
+   gra_db_reference_delete, whose changes reach the graph when the
+   batch they were made in commits.  Changes are kept beside the
+   arrays until there are enough of them to be worth folding in.
+
+   Paper IDs index the arrays directly.  The graph takes 8 bytes per
+   citation and 8 per paper ID, up to the highest one cited.
+
+   Queries take a read lock, so any thread may run them, several at
+   once.  Those which visit many papers are split between the graph's
+   own threads. */
+
+#ifndef CITEGRAPH_H
+#define CITEGRAPH_H
+
+#include <glib.h>
+#include "datatypes.h"
+
+/** Changes kept beside the arrays before they are folded in, at
+ *  least.  More are kept for larger graphs, up to one per 16
+ *  citations. */
+#define GRA_CITEGRAPH_COMPACT_MIN 4096
+
+/** Papers a query must visit at once before it is split between
+ *  threads. */
+#define GRA_CITEGRAPH_PARALLEL_MIN 4096
+
+/** Damping factor of gra_citegraph_pagerank. */
+#define GRA_CITEGRAPH_DAMPING 0.85
+
+/** Most iterations of gra_citegraph_pagerank. */
+#define GRA_CITEGRAPH_ITERATIONS 100
+
+/** gra_citegraph_pagerank stops once the ranks move less than this
+ *  in total over an iteration. */
+#define GRA_CITEGRAPH_TOLERANCE 1e-9
+
+/** Which way to follow citations. */
+typedef enum {
+  GRA_CITES,     /**< from a paper to the papers it cites */
+  GRA_CITED_BY   /**< from a paper to the papers citing it */
+} gra_cite_direction;
+
+/** @struct gra_citation_hit_t
+ *  @brief A paper found by a citation graph query.
+ *  @var gra_citation_hit_t::paperId ID of the paper.
+ *  @var gra_citation_hit_t::score What the query found: the number of
+ *  steps to the paper, the number of citations in common, the number
+ *  of citations, or the rank.
+ */
+typedef struct gra_citation_hit_t {
+  int paperId;
+  double score;
+} gra_citation_hit_t;
+
+/** @struct gra_citation_change_t
+ *  @brief A citation added or removed, as reported by data.c.
+ *  @var gra_citation_change_t::paperId ID of the citing paper.
+ *  @var gra_citation_change_t::refPaperId ID of the cited paper.
+ *  @var gra_citation_change_t::added TRUE if the citation was added,
+ *  FALSE if it was removed.
+ */
+typedef struct gra_citation_change_t {
+  int paperId;
+  int refPaperId;
+  gboolean added;
+} gra_citation_change_t;
+
+/** @struct gra_citegraph_stats_t
+ *  @brief The size of a citation graph.
+ *  @var gra_citegraph_stats_t::papers Papers citing or cited at least
+ *  once.
+ *  @var gra_citegraph_stats_t::citations Citations in the graph.
+ *  @var gra_citegraph_stats_t::pending Citations added or removed
+ *  since the arrays were last built.
+ *  @var gra_citegraph_stats_t::compactions Times the changes were
+ *  folded into the arrays.
+ *  @var gra_citegraph_stats_t::bytes Memory held by the arrays.
+ *  @var gra_citegraph_stats_t::buildSeconds Time the first build took.
+ */
+typedef struct gra_citegraph_stats_t {
+  int papers;
+  unsigned long citations;
+  unsigned long pending;
+  unsigned long compactions;
+  gsize bytes;
+  double buildSeconds;
+} gra_citegraph_stats_t;
+
+
+/** Builds the citation graph of a database and attaches it to the
+ *  connection, so saved and deleted references update it.  Other
+ *  threads wait on gra_db_lock while the table is read.  A connection
+ *  has at most one graph.  Free it before closing the connection.
+ *  @param db the database connection, outside of any batch
+ *  @param threads threads for queries, or 0 for one per processor
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The graph, or NULL on error.
+ */
+gra_citegraph_t *gra_citegraph_new(gra_db_t *db, int threads, GError **error);
+
+/** Detaches a citation graph from its connection and frees it.
+ *  @param g the graph
+ */
+void gra_citegraph_free(gra_citegraph_t *g);
+
+/** Counts the citations of a paper.
+ *  @param g the graph
+ *  @param paperId ID of the paper
+ *  @param dir GRA_CITES for the papers it cites, GRA_CITED_BY for the
+ *  papers citing it
+ *  @return The number of papers.
+ */
+int gra_citegraph_count(gra_citegraph_t *g, int paperId, gra_cite_direction dir);
+
+/** Finds the papers a paper leads to by following citations, up to a
+ *  number of steps.
+ *  @param g the graph
+ *  @param paperId ID of the paper to start from, which is not
+ *  returned
+ *  @param dir which way to follow the citations
+ *  @param depth most steps to take, or -1 for no limit
+ *  @return A GArray of gra_citation_hit_t scored by the fewest steps
+ *  to each paper, nearest first, then by ID.  Free with g_array_unref.
+ */
+GArray *gra_citegraph_closure(gra_citegraph_t *g, int paperId,
+                              gra_cite_direction dir, int depth);
+
+/** Finds the papers cited together with a paper (co-citation).
+ *  @param g the graph
+ *  @param paperId ID of the paper
+ *  @param limit most papers to return, or -1 for no limit
+ *  @return A GArray of gra_citation_hit_t scored by the number of
+ *  papers citing both, highest first, then by ID.  Free with
+ *  g_array_unref.
+ */
+GArray *gra_citegraph_cocited(gra_citegraph_t *g, int paperId, int limit);
+
+/** Finds the papers citing the same papers as a paper (bibliographic
+ *  coupling).
+ *  @param g the graph
+ *  @param paperId ID of the paper
+ *  @param limit most papers to return, or -1 for no limit
+ *  @return A GArray of gra_citation_hit_t scored by the number of
+ *  papers both cite, highest first, then by ID.  Free with
+ *  g_array_unref.
+ */
+GArray *gra_citegraph_coupled(gra_citegraph_t *g, int paperId, int limit);
+
+/** Finds the most cited papers.
+ *  @param g the graph
+ *  @param limit most papers to return, or -1 for no limit
+ *  @return A GArray of gra_citation_hit_t scored by the number of
+ *  papers citing them, highest first, then by ID.  Free with
+ *  g_array_unref.
+ */
+GArray *gra_citegraph_most_cited(gra_citegraph_t *g, int limit);
+
+/** Ranks the papers by PageRank over their citations.  The ranks are
+ *  kept until the graph changes, so asking again is cheap.  Papers
+ *  with no citations either way are not ranked.
+ *  @param g the graph
+ *  @param limit most papers to return, or -1 for no limit
+ *  @return A GArray of gra_citation_hit_t scored by rank, highest
+ *  first, then by ID.  The ranks sum to 1.  Free with g_array_unref.
+ */
+GArray *gra_citegraph_pagerank(gra_citegraph_t *g, int limit);
+
+/** Reports the size of a citation graph.
+ *  @param g the graph
+ *  @param stats filled in
+ */
+void gra_citegraph_get_stats(gra_citegraph_t *g, gra_citegraph_stats_t *stats);
+
+/** Applies committed changes to the Reference table.  Called by
+ *  data.c.
+ *  @param g the graph
+ *  @param changes the changes, in the order they were made
+ *  @param n number of changes
+ */
+void gra_citegraph_apply(gra_citegraph_t *g, const gra_citation_change_t *changes, guint n);
+#endif
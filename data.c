@@ -18,17 +18,392 @@
  */
 
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <sqlite3.h>
+#include <stdio.h>
+#include <errno.h>
 #include <time.h>
+#include <string.h>
 #include "data.h"
+#include "dataprivate.h"
+#include "query.h"
+#include "arena.h"
+#include "worker.h"
+#include "citegraph.h"
 #define DB_ERROR(error)  g_set_error(error, GRA_DATA_ERROR, 1, "SQLite Error: %s", sqlite3_errmsg(db->db))
 
+/* virtual machine steps between upgrade progress reports */
+#define UPGRADE_PROGRESS_OPS 100000
+
 static void create_schema(gra_db_t *db, GError **error);
 static gboolean has_schema(gra_db_t *db, GError **error);
-static gboolean has_schema_version(gra_db_t *db, GError **error);
-static void schema_upgrade(gra_db_t *db, GError **error);
-static gint fieldcmp(gconstpointer, gconstpointer);
-static gboolean fieldSaveVisit(gpointer, gpointer, gpointer);
+static void read_meta_info(gra_db_t *db, GError **error);
+static void set_schema_version(gra_db_t *db, double version, GError **error);
+static int upgrade_tick(void *data);
+static void upgrade_paper_indexes(gra_db_t *db, GError **error);
+static void upgrade_text_index(gra_db_t *db, GError **error);
+static void upgrade_contents_table(gra_db_t *db, GError **error);
+static void upgrade_document_store(gra_db_t *db, GError **error);
+static void upgrade_document_text(gra_db_t *db, GError **error);
+static void upgrade_note_pages(gra_db_t *db, GError **error);
+static void upgrade_browse_indexes(gra_db_t *db, GError **error);
+static void upgrade_authors(gra_db_t *db, GError **error);
+static gboolean has_table(gra_db_t *db, const gchar *name, GError **error);
+static void create_search_index(gra_db_t *db, GError **error);
+static void run_script(gra_db_t *db, const gchar **script, int n, GError **error);
+static gpointer paper_alloc(gra_arena_t *arena, gsize size);
+static gchar *paper_strdup(gra_arena_t *arena, const gchar *s);
+static void paper_set_text(gra_paper_t *p, gchar **member, const gchar *value,
+                           gra_paper_column column);
+static gchar *match_expr(const gchar *column, const gchar *text);
+static GList *search(gra_db_t *db, gra_db_stmt_id id, const gchar *column, const gchar *text,
+                     int limit, int offset, GError **error);
+static gboolean fieldFreeVisit(gra_field_t *f, gpointer data);
+static gboolean fieldSaveVisit(gra_field_t *f, gpointer data);
+static int field_find(gra_paper_t *p, const gchar *name, gboolean *found);
+static gra_field_t *field_insert(gra_paper_t *p, int at, const gchar *name);
+static sqlite3_stmt *db_stmt(gra_db_t *db, gra_db_stmt_id id, GError **error);
+static void db_step_once(gra_db_t *db, gra_db_stmt_id id, GError **error);
+static sqlite3_stmt *update_stmt(gra_db_t *db, sqlite3_stmt **cache, const gchar *table,
+                                 const gchar *key, const gchar **columns, int n,
+                                 guint mask, GError **error);
+static void bind_text(sqlite3_stmt *stmt, int i, const gchar *text);
+static void field_write(gra_db_t *db, gra_field_t *f, GString *text, GError **error);
+static void text_append(gra_db_t *db, int paperId, const gchar *text, GError **error);
+static void text_flush(gra_db_t *db, GError **error);
+static void create_load_set(gra_db_t *db, GError **error);
+static gchar *hash_contents(gra_db_t *db, FILE *in, sqlite3_blob *blob, gsize size,
+                            GError **error);
+static int document_find(gra_db_t *db, const gchar *hash, GError **error);
+static int document_store(gra_db_t *db, const gchar *hash, gsize size, FILE *in,
+                          sqlite3_blob *blob, GError **error);
+static void document_link(gra_db_t *db, int paperId, int docId, GError **error);
+static void document_unref(gra_db_t *db, int docId, int refs, GError **error);
+static void document_sweep(gra_db_t *db);
+static gchar *document_path(gra_db_t *db, const gchar *hash);
+static gboolean document_open(gra_db_t *db, gra_contents_t *c, int docId,
+                              gboolean external, const gchar *hash, GError **error);
+static void copy_contents(gra_db_t *db, FILE *in, sqlite3_blob *src, FILE *out,
+                          sqlite3_blob *dst, GChecksum *sum, gsize size, GError **error);
+static void contents_unstage(gra_db_t *db, int paperId, GError **error);
+static void add_field_row(gra_paper_t *p, sqlite3_stmt *stmt);
+static void add_ref_row(gra_paper_t *p, sqlite3_stmt *stmt);
+static gra_note_t *note_add(gra_paper_t *p, int page);
+static void note_free(gpointer data);
+static void notes_free(gra_paper_t *p);
+static gboolean notes_loaded(gra_paper_t *p, int block);
+static void notes_mark_loaded(gra_paper_t *p, int first, int last);
+static void cache_insert(gra_db_t *db, gra_paper_t *p);
+static void cache_remove(gra_db_t *db, int id);
+static void cache_resize(gra_db_t *db, gra_paper_t *p);
+static void cache_evict(gra_db_t *db);
+static void cache_entry_free(gpointer data);
+static gsize paper_size(gra_paper_t *p);
+static gboolean fieldSizeVisit(gra_field_t *f, gpointer data);
+static void trace_attach(gra_db_t *db, gra_db_trace_t *trace);
+static void trace_unref(gra_db_trace_t *trace);
+static void trace_reset(gra_db_trace_t *trace);
+static int trace_hook(unsigned type, void *data, void *p, void *x);
+static gra_stmt_stats_t *trace_entry(gra_db_trace_t *trace, sqlite3_stmt *stmt);
+static gboolean cite_lookup(gra_db_t *db, int rowid, gra_citation_change_t *c,
+                            GError **error);
+static void cite_note(gra_db_t *db, int paperId, int refPaperId, gboolean added);
+static int delete_set(gra_db_t *db, const int *ids, int n, GError **error);
+static gchar **author_split(const gchar *authors);
+static gchar *author_fold(const gchar *text);
+static gchar *author_key(const gchar *name);
+static void author_link(gra_db_t *db, int paperId, const gchar *authors,
+                        gboolean replace, GError **error);
+static void bind_prefix(sqlite3_stmt *stmt, const gchar *prefix);
+static void paper_forget(gra_paper_t *p);
+static gint64 db_bytes(gra_db_t *db, GError **error);
+static void stmt_stats_free(gpointer data);
+static void stmt_free(gpointer data);
+static void slow_query_free(gpointer data);
+static gint stmt_stats_compare(gconstpointer a, gconstpointer b);
+
+/* state carried through the field save traversal */
+typedef struct field_save_ctx {
+  gra_db_t *db;
+  gra_paper_t *p;
+  GString *text;
+  GError **error;
+} field_save_ctx;
+
+/* how a paper and the rows saved with it stood before a save, so a
+   rolled back save leaves them as it found them */
+typedef struct paper_save_undo {
+  int id;
+  gboolean indb;
+  gra_field_t *fields;
+  gra_reference_t *refs;
+  gra_note_t **notes;
+  gra_note_t *noteState;
+  guint noteCount;
+} paper_save_undo;
+
+static void save_undo_mark(gra_paper_t *p, paper_save_undo *u);
+static void save_undo_restore(gra_paper_t *p, paper_save_undo *u);
+static void save_undo_free(paper_save_undo *u);
+
+/* One schema migration.  Each step moves the schema to its version
+   in a transaction of its own, so an interrupted upgrade picks up
+   where it stopped. */
+typedef struct schema_step {
+  double version;
+  const gchar *description;
+  void (*apply)(gra_db_t *db, GError **error);
+} schema_step;
+
+/* every step after the 1.0 base schema, in order */
+static const schema_step schema_steps[] = {
+  { 1.1, "Indexing fields, notes and references", upgrade_paper_indexes },
+  { 2.0, "Building the full-text index", upgrade_text_index },
+  { 2.1, "Moving paper contents to their own table", upgrade_contents_table },
+  { 2.2, "Storing each distinct document once", upgrade_document_store },
+  { 2.3, "Preparing the document text index", upgrade_document_text },
+  { 2.4, "Indexing notes by page", upgrade_note_pages },
+  { 2.5, "Indexing papers for browsing", upgrade_browse_indexes },
+  { 2.6, "Listing the authors of each paper", upgrade_authors }
+};
+
+/* A cached paper.  The link sits in the LRU queue. */
+typedef struct cache_entry {
+  gra_paper_t *paper;
+  gsize bytes;
+  GList link;
+} cache_entry;
+
+/* Statement timings, shared by a writer and its pool readers.  The
+   hooks of every connection sharing it take the lock as a statement
+   finishes. */
+struct gra_db_trace_t {
+  GMutex lock;
+  gint refCount;
+  gint64 slowMicros;
+  GHashTable *stmts;      /* SQL text -> gra_stmt_stats_t */
+  gra_slow_query_t slow[GRA_DB_SLOW_LOG_SIZE];
+  int slowNext;
+  int slowCount;
+  gint64 since;
+};
+
+/* A statement which has started and not yet finished.  Only the
+   thread using its connection touches it. */
+typedef struct trace_run {
+  gint64 start;
+  guint64 rows;
+} trace_run;
+
+/* where gra_db_upgrade reports to while a step runs */
+typedef struct upgrade_ctx {
+  gra_db_progress_func progress;
+  gpointer data;
+  const gchar *description;
+  int step;
+  int steps;
+  gboolean cancelled;
+} upgrade_ctx;
+
+/* Browsing pages through the papers in order of a sort key.  The
+   first page is found by its offset; each page after it starts right
+   after the last paper of the one before, found by seeking the sort
+   index.  The ID breaks ties, so the order is total.  Seeking past a
+   paper is split in two: the rest of its own key, ordered by ID, then
+   the keys after it.  Each half seeks the index on its own, where one
+   query over both would scan every paper sharing the key.  Only IDs
+   come from the index; the papers are read for the rows returned.
+   Each half carries its number and the key, so the compound and the
+   join over it can be put back in that order. */
+#define BROWSE_COLUMNS(t) \
+  t "\"ID\", " t "\"FileName\", " t "\"PageCount\", " t "\"Read\", " \
+  t "\"Type\", " t "\"Author\", " t "\"Title\", " t "\"Year\""
+#define BROWSE_ORDER(key, dir) \
+  " ORDER BY " key " " dir ", \"ID\" " dir
+#define BROWSE_FIRST(key, dir) \
+  "SELECT " BROWSE_COLUMNS("") " FROM \"Paper\"" \
+  BROWSE_ORDER(key, dir) " LIMIT ?4 OFFSET ?3"
+#define BROWSE_HALVES(t, dir) \
+  " ORDER BY " t "\"h\", " t "\"k\" " dir ", " t "\"ID\" " dir
+#define BROWSE_AFTER(key, cmp, dir) \
+  "SELECT " BROWSE_COLUMNS("P.") " FROM (" \
+  "SELECT * FROM (SELECT 0 AS \"h\", " key " AS \"k\", \"ID\" FROM \"Paper\"" \
+  " WHERE " key " = ?1 AND \"ID\" " cmp " ?2" \
+  " ORDER BY \"ID\" " dir " LIMIT ?3 + ?4)" \
+  " UNION ALL SELECT * FROM (SELECT 1 AS \"h\", " key " AS \"k\", \"ID\" FROM \"Paper\"" \
+  " WHERE " key " " cmp " ?1" BROWSE_ORDER(key, dir) " LIMIT ?3 + ?4)" \
+  BROWSE_HALVES("", dir) " LIMIT ?4 OFFSET ?3)" \
+  " AS K CROSS JOIN \"Paper\" AS P ON P.\"ID\" = K.\"ID\"" BROWSE_HALVES("K.", dir)
+#define BROWSE_SQL(column, key) \
+  [GRA_STMT_BROWSE + column * 4] = BROWSE_FIRST(key, "ASC"), \
+  [GRA_STMT_BROWSE + column * 4 + 1] = BROWSE_AFTER(key, ">", "ASC"), \
+  [GRA_STMT_BROWSE + column * 4 + 2] = BROWSE_FIRST(key, "DESC"), \
+  [GRA_STMT_BROWSE + column * 4 + 3] = BROWSE_AFTER(key, "<", "DESC")
+
+/* SQL for each slot of the statement cache */
+static const gchar *stmt_sql[GRA_STMT_COUNT] = {
+  [GRA_STMT_PAPER_LOAD] =
+    "SELECT ID, FileName, PageCount, Read, Type, Author, Title, Year FROM \"Paper\" WHERE ID=?",
+  [GRA_STMT_PAPER_INSERT] =
+    "INSERT INTO \"Paper\" (\"FileName\", \"PageCount\", \"Read\", \"Type\", \"Author\", \"Title\", \"Year\") VALUES(?, ?, ?, ?, ?, ?, ?)",
+  [GRA_STMT_PAPER_FIELDS] =
+    "SELECT \"ID\", \"Name\", \"Value\" FROM \"Field\" WHERE \"PaperID\"=?",
+  [GRA_STMT_PAPER_REFS] =
+    "SELECT \"rowid\", \"RefPaperID\" FROM \"Reference\" WHERE \"PaperID\"=?",
+  [GRA_STMT_FIELD_INSERT] =
+    "INSERT INTO \"Field\" (\"PaperID\", \"Name\", \"Value\") VALUES(?, ?, ?)",
+  [GRA_STMT_FIELD_DELETE] =
+    "DELETE FROM \"Field\" WHERE \"ID\"=?",
+  [GRA_STMT_REF_INSERT] =
+    "INSERT INTO \"Reference\" (\"PaperID\", \"RefPaperID\") VALUES(?, ?)",
+  [GRA_STMT_REF_DELETE] =
+    "DELETE FROM \"Reference\" WHERE \"rowid\"=?",
+  [GRA_STMT_REF_GET] =
+    "SELECT \"PaperID\", \"RefPaperID\" FROM \"Reference\" WHERE \"rowid\"=?",
+  [GRA_STMT_BEGIN] = "BEGIN IMMEDIATE",
+  [GRA_STMT_BEGIN_READ] = "BEGIN",
+  [GRA_STMT_COMMIT] = "COMMIT",
+  [GRA_STMT_ROLLBACK] = "ROLLBACK",
+  [GRA_STMT_SAVEPOINT] = "SAVEPOINT gra_batch",
+  [GRA_STMT_RELEASE] = "RELEASE gra_batch",
+  [GRA_STMT_ROLLBACK_TO] = "ROLLBACK TO gra_batch",
+  [GRA_STMT_SEARCH] =
+    "SELECT p.\"ID\", p.\"FileName\", p.\"PageCount\", p.\"Read\", p.\"Type\", p.\"Author\", p.\"Title\", p.\"Year\""
+    " FROM \"PaperText\" JOIN \"Paper\" p ON p.\"ID\"=\"PaperText\".\"rowid\""
+    " WHERE \"PaperText\" MATCH ? ORDER BY \"rank\" LIMIT ? OFFSET ?",
+  [GRA_STMT_SEARCH_BODY] =
+    "SELECT p.\"ID\", p.\"FileName\", p.\"PageCount\", p.\"Read\", p.\"Type\", p.\"Author\", p.\"Title\", p.\"Year\""
+    " FROM (SELECT \"rowid\" >> 16 AS \"Doc\", min(\"rank\") AS \"Rank\" FROM \"DocumentText\""
+    "  WHERE \"DocumentText\" MATCH ? GROUP BY \"Doc\") t"
+    " JOIN \"Paper\" p ON p.\"DocumentID\"=t.\"Doc\""
+    " ORDER BY t.\"Rank\", p.\"ID\" LIMIT ? OFFSET ?",
+  [GRA_STMT_TEXT_FLUSH] =
+    "INSERT INTO \"PaperText\" (\"rowid\", \"Title\", \"Author\", \"Fields\")"
+    " SELECT p.\"ID\", p.\"Title\", p.\"Author\", COALESCE(f.\"Text\", '')"
+    " FROM \"Paper\" p LEFT JOIN"
+    " (SELECT \"PaperID\", group_concat(\"Value\", ' ') AS \"Text\" FROM \"Field\""
+    "  WHERE \"ID\">=?3 AND \"PaperID\" BETWEEN ?1 AND ?2 GROUP BY \"PaperID\") f"
+    " ON f.\"PaperID\"=p.\"ID\""
+    " WHERE p.\"ID\" BETWEEN ?1 AND ?2",
+  [GRA_STMT_TEXT_APPEND] =
+    "UPDATE \"PaperText\" SET \"Fields\"=\"Fields\" || ' ' || ? WHERE \"rowid\"=?",
+  [GRA_STMT_LOAD_BEGIN] =
+    "SAVEPOINT gra_load",
+  [GRA_STMT_LOAD_END] =
+    "RELEASE gra_load",
+  [GRA_STMT_LOADSET_CLEAR] =
+    "DELETE FROM temp.\"LoadSet\"",
+  [GRA_STMT_LOADSET_ADD] =
+    "INSERT INTO temp.\"LoadSet\" (\"Ord\", \"ID\") VALUES(?, ?)",
+  [GRA_STMT_LOAD_PAPERS] =
+    "SELECT p.\"ID\", p.\"FileName\", p.\"PageCount\", p.\"Read\", p.\"Type\", p.\"Author\","
+    " p.\"Title\", p.\"Year\", s.\"Ord\""
+    " FROM temp.\"LoadSet\" s JOIN \"Paper\" p ON p.\"ID\"=s.\"ID\"",
+  [GRA_STMT_LOAD_FIELDS] =
+    "SELECT f.\"ID\", f.\"Name\", f.\"Value\", s.\"Ord\""
+    " FROM temp.\"LoadSet\" s JOIN \"Field\" f ON f.\"PaperID\"=s.\"ID\"",
+  [GRA_STMT_LOAD_REFS] =
+    "SELECT r.\"rowid\", r.\"RefPaperID\", s.\"Ord\""
+    " FROM temp.\"LoadSet\" s JOIN \"Reference\" r ON r.\"PaperID\"=s.\"ID\"",
+  [GRA_STMT_DELSET_CLEAR] =
+    "DELETE FROM temp.\"DeleteSet\"",
+  [GRA_STMT_DELSET_ADD] =
+    "INSERT OR IGNORE INTO temp.\"DeleteSet\" (\"ID\") VALUES(?)",
+  [GRA_STMT_DELSET_DOCS] =
+    "SELECT \"DocumentID\", count(*) FROM \"Paper\""
+    " WHERE \"ID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\") AND \"DocumentID\" IS NOT NULL"
+    " GROUP BY \"DocumentID\"",
+  [GRA_STMT_DELSET_CITES] =
+    "SELECT \"PaperID\", \"RefPaperID\" FROM \"Reference\""
+    " WHERE \"PaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")"
+    " OR \"RefPaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_DELSET_PAPERS] =
+    "DELETE FROM \"Paper\" WHERE \"ID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_DELSET_FIELDS] =
+    "DELETE FROM \"Field\" WHERE \"PaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_DELSET_REFS] =
+    "DELETE FROM \"Reference\" WHERE \"PaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")"
+    " OR \"RefPaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_DELSET_NOTES] =
+    "DELETE FROM \"Note\" WHERE \"PaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_DELSET_AUTHORS] =
+    "DELETE FROM \"Authorship\" WHERE \"PaperID\" IN (SELECT \"ID\" FROM temp.\"DeleteSet\")",
+  [GRA_STMT_CONTENTS_DOC] =
+    "SELECT d.\"ID\", d.\"Size\", d.\"External\", d.\"Hash\" FROM \"Paper\" p"
+    " LEFT JOIN \"Document\" d ON d.\"ID\"=p.\"DocumentID\" WHERE p.\"ID\"=?",
+  [GRA_STMT_STAGE_SIZE] =
+    "SELECT length(\"Contents\") FROM \"DocumentStage\" WHERE \"PaperID\"=?",
+  [GRA_STMT_STAGE_CREATE] =
+    "INSERT OR REPLACE INTO \"DocumentStage\" (\"PaperID\", \"Contents\") VALUES(?, zeroblob(?))",
+  [GRA_STMT_STAGE_DELETE] =
+    "DELETE FROM \"DocumentStage\" WHERE \"PaperID\"=?",
+  [GRA_STMT_DOC_FIND] =
+    "SELECT \"ID\" FROM \"Document\" WHERE \"Hash\"=?",
+  [GRA_STMT_DOC_INSERT] =
+    "INSERT INTO \"Document\" (\"Hash\", \"Size\", \"RefCount\", \"External\") VALUES(?, ?, 0, ?)",
+  [GRA_STMT_DOC_CONTENTS] =
+    "INSERT INTO \"DocumentContents\" (\"DocumentID\", \"Contents\") VALUES(?, zeroblob(?))",
+  [GRA_STMT_DOC_REF] =
+    "UPDATE \"Document\" SET \"RefCount\"=\"RefCount\"+? WHERE \"ID\"=?",
+  [GRA_STMT_DOC_INFO] =
+    "SELECT \"RefCount\", \"External\", \"Hash\", \"Size\" FROM \"Document\" WHERE \"ID\"=?",
+  [GRA_STMT_DOC_DELETE] =
+    "DELETE FROM \"Document\" WHERE \"ID\"=?",
+  [GRA_STMT_PAPER_SET_DOC] =
+    "UPDATE \"Paper\" SET \"DocumentID\"=? WHERE \"ID\"=?",
+  [GRA_STMT_NOTE_LOAD] =
+    "SELECT \"ID\", \"Page\", \"LeftNote\", \"RightNote\" FROM \"Note\""
+    " WHERE \"PaperID\"=? AND \"Page\" BETWEEN ? AND ?",
+  [GRA_STMT_NOTE_INSERT] =
+    "INSERT INTO \"Note\" (\"PaperID\", \"Page\", \"LeftNote\", \"RightNote\") VALUES(?, ?, ?, ?)",
+  [GRA_STMT_NOTE_UPDATE] =
+    "UPDATE \"Note\" SET \"PaperID\"=?, \"Page\"=?, \"LeftNote\"=?, \"RightNote\"=? WHERE \"ID\"=?",
+  [GRA_STMT_NOTE_DELETE] =
+    "DELETE FROM \"Note\" WHERE \"ID\"=?",
+  [GRA_STMT_PAPER_COUNT] =
+    "SELECT count(*) FROM \"Paper\"",
+  [GRA_STMT_AUTHOR_FIND] =
+    "SELECT \"ID\" FROM \"Author\" WHERE \"Key\"=?",
+  [GRA_STMT_AUTHOR_INSERT] =
+    "INSERT INTO \"Author\" (\"Name\", \"Key\") VALUES(?, ?)",
+  [GRA_STMT_AUTHOR_LINK] =
+    "INSERT INTO \"Authorship\" (\"PaperID\", \"Position\", \"AuthorID\") VALUES(?, ?, ?)",
+  [GRA_STMT_AUTHOR_UNLINK] =
+    "DELETE FROM \"Authorship\" WHERE \"PaperID\"=?",
+  [GRA_STMT_AUTHOR_PRUNE] =
+    "DELETE FROM \"Author\" WHERE \"PaperCount\"=0",
+  /* the page is picked from the author index alone; only its papers
+     are read */
+  [GRA_STMT_AUTHOR_SEARCH] =
+    "SELECT " BROWSE_COLUMNS("p.") " FROM ("
+    "SELECT pa.\"PaperID\" AS \"ID\", min(pa.\"Position\") AS \"Position\""
+    " FROM \"Author\" a JOIN \"Authorship\" pa ON pa.\"AuthorID\"=a.\"ID\""
+    " WHERE a.\"Key\">=?1 AND a.\"Key\"<?2 GROUP BY pa.\"PaperID\""
+    " ORDER BY 2, 1 LIMIT ?3 OFFSET ?4) AS K"
+    " CROSS JOIN \"Paper\" AS p ON p.\"ID\"=K.\"ID\" ORDER BY K.\"Position\", K.\"ID\"",
+  [GRA_STMT_AUTHOR_COMPLETE] =
+    "SELECT \"ID\", \"Name\", \"PaperCount\" FROM \"Author\""
+    " WHERE \"Key\">=?1 AND \"Key\"<?2 ORDER BY \"Key\" LIMIT ?3",
+  [GRA_STMT_AUTHOR_STATS] =
+    "SELECT count(*), min(NULLIF(p.\"Year\", 0)), max(p.\"Year\"),"
+    " (SELECT count(*) FROM \"Authorship\" pa JOIN \"Reference\" r"
+    "  ON r.\"RefPaperID\"=pa.\"PaperID\" WHERE pa.\"AuthorID\"=?1),"
+    " (SELECT count(DISTINCT o.\"AuthorID\") FROM \"Authorship\" pa JOIN \"Authorship\" o"
+    "  ON o.\"PaperID\"=pa.\"PaperID\" WHERE pa.\"AuthorID\"=?1 AND o.\"AuthorID\"<>?1)"
+    " FROM \"Authorship\" pa JOIN \"Paper\" p ON p.\"ID\"=pa.\"PaperID\" WHERE pa.\"AuthorID\"=?1",
+  BROWSE_SQL(GRA_SORT_ID, "\"ID\""),
+  BROWSE_SQL(GRA_SORT_TITLE, "\"Title\" COLLATE NOCASE"),
+  BROWSE_SQL(GRA_SORT_AUTHOR, "\"Author\" COLLATE NOCASE"),
+  BROWSE_SQL(GRA_SORT_YEAR, "IFNULL(\"Year\", 0)")
+};
+
+/* Columns which may be updated, in the order of their bits and of
+   their parameters.  The row's key follows them. */
+static const gchar *paperColumns[] = {
+  "FileName", "PageCount", "Read", "Type", "Author", "Title", "Year"
+};
+static const gchar *fieldColumns[] = { "PaperID", "Name", "Value" };
+static const gchar *refColumns[] = { "PaperID", "RefPaperID" };
 
 GQuark
 gra_data_error_quark(void) {
@@ -40,51 +415,176 @@ gra_data_error_quark(void) {
  */
 gra_db_t *
 gra_db_open(const gchar *filename, GError **error) {
+  return gra_db_open_full(filename, GRA_DB_OPEN_DEFAULT, error);
+}
+
+
+/* Open the database with the requested journaling options */
+gra_db_t *
+gra_db_open_full(const gchar *filename, unsigned int flags, GError **error) {
   gra_db_t *db;
   int code;
+  gboolean created = FALSE;
+  GError *err = NULL;
 
   /* fail on prior errors */
   if(error && *error) return NULL;
 
   /* allocate the database and open it */
-  db = (gra_db_t*) g_malloc(sizeof(gra_db_t));
+  db = (gra_db_t*) g_malloc0(sizeof(gra_db_t));
   db->changed = FALSE;
+  db->readOnly = (flags & GRA_DB_OPEN_READ_ONLY) != 0;
+  g_rec_mutex_init(&db->writeLock);
+  g_mutex_init(&db->readerLock);
+  g_cond_init(&db->readerFree);
 
   /* attempt to open the database */
-  code = sqlite3_open(filename, &(db->db));
+  code = sqlite3_open_v2(filename, &(db->db),
+                         db->readOnly ? SQLITE_OPEN_READONLY
+                                      : SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                         NULL);
   if(code != SQLITE_OK) {
     g_set_error(error, GRA_DATA_ERROR, 1,
                 "SQLite Error: %s", sqlite3_errmsg(db->db));
     sqlite3_close(db->db);
+    g_rec_mutex_clear(&db->writeLock);
+    g_mutex_clear(&db->readerLock);
+    g_cond_clear(&db->readerFree);
     g_free(db);
     return NULL;
   }
 
-  /* create the schema if needed */
-  if(!has_schema(db, error)) {
-    create_schema(db, error);
+  /* switch journaling before anything else touches the file */
+  if(flags & GRA_DB_OPEN_WAL) {
+    code = sqlite3_exec(db->db,
+                        "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL",
+                        NULL, NULL, NULL);
+    if(code != SQLITE_OK) {
+      DB_ERROR(&err);
+    }
+  }
+
+  /* create the base schema if needed */
+  if(!has_schema(db, &err) && !err) {
+    if(db->readOnly) {
+      g_set_error(&err, GRA_DATA_ERROR, 5, "Database has no schema.");
+    } else {
+      create_schema(db, &err);
+      created = TRUE;
+    }
+  }
+  read_meta_info(db, &err);
+
+  /* files from a newer program are left alone */
+  if(!err && db->version > GRA_DB_VERSION) {
+    g_set_error(&err, GRA_DATA_ERROR, 5,
+                "Database version %.1f is newer than this program (%.1f).",
+                db->version, GRA_DB_VERSION);
+  }
+
+  /* read-only files cannot be upgraded */
+  if(!err && db->readOnly && db->version < GRA_DB_VERSION) {
+    g_set_error(&err, GRA_DATA_ERROR, 5,
+                "Database version %.1f needs an upgrade.", db->version);
+  }
+
+  /* handle schema upgrade, if needed.  New files always are. */
+  if(!err && db->version < GRA_DB_VERSION &&
+     (created || !(flags & GRA_DB_OPEN_NO_UPGRADE))) {
+    gra_db_upgrade(db, NULL, NULL, &err);
   }
 
-  /* handle schema upgrade, if needed */
-  if(!has_schema_version(db, error)) {
-    schema_upgrade(db, error);
+  create_load_set(db, &err);
+
+  if(err) {
+    gra_db_close(db, NULL);
+    g_propagate_error(error, err);
+    return NULL;
   }
 
   return db;
 }
 
 
+/* Bring the schema up to date, one step at a time */
+void
+gra_db_upgrade(gra_db_t *db, gra_db_progress_func progress, gpointer data,
+               GError **error) {
+  upgrade_ctx ctx = {0};
+  GError *err = NULL;
+  int n = sizeof(schema_steps) / sizeof(schema_steps[0]);
+  int i;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  ctx.progress = progress;
+  ctx.data = data;
+  for(i=0; i<n; i++) {
+    if(schema_steps[i].version > db->version)
+      ctx.steps++;
+  }
+
+  for(i=0; i<n && !err; i++) {
+    if(schema_steps[i].version <= db->version)
+      continue;
+
+    ctx.description = schema_steps[i].description;
+    ctx.step++;
+
+    /* report at the start of the step, then every so often */
+    if(progress) {
+      if(upgrade_tick(&ctx)) break;
+      sqlite3_progress_handler(db->db, UPGRADE_PROGRESS_OPS, upgrade_tick, &ctx);
+    }
+
+    gra_db_batch_begin(db, &err);
+    if(err) break;
+    schema_steps[i].apply(db, &err);
+    set_schema_version(db, schema_steps[i].version, &err);
+    gra_db_batch_commit(db, &err);
+    if(err) {
+      gra_db_batch_rollback(db, NULL);
+      break;
+    }
+
+    db->version = schema_steps[i].version;
+  }
+
+  sqlite3_progress_handler(db->db, 0, NULL, NULL);
+
+  /* an interrupted statement is just a symptom */
+  if(ctx.cancelled) {
+    g_clear_error(&err);
+    g_set_error(&err, GRA_DATA_ERROR, 6,
+                "Upgrade cancelled at version %.1f.", db->version);
+  }
+  if(err)
+    g_propagate_error(error, err);
+}
+
+
 /* Close the database and destroy the connection. */
 void
 gra_db_close(gra_db_t *db, GError **error) {
   int rc;
+  int i;
   sqlite3_stmt *stmt=NULL;
 
   /* fail on prior errors */
   if(error && *error) return;
+
+  /* the worker must let go of the connection first */
+  if(db->worker)
+    gra_db_worker_stop(db);
+
+  /* then the readers */
+  gra_db_pool_set_readers(db, 0, NULL);
+  if(db->readers)
+    g_queue_free(db->readers);
   
   /* update the meta info if it has changed */
-  if(db->changed) {
+  if(db->changed && !db->readOnly) {
     rc = sqlite3_prepare_v2(db->db, "UPDATE MetaInfo SET LastUpdate=?", -1, &stmt, 0);
     if(rc != SQLITE_OK) {
       g_set_error(error, GRA_DATA_ERROR, 1,
@@ -103,27 +603,449 @@ gra_db_close(gra_db_t *db, GError **error) {
   cleanup:
   if(stmt)
     sqlite3_finalize(stmt);
+
+  /* release the paper cache */
+  gra_db_cache_set_budget(db, 0);
+
+  /* release the statement cache */
+  for(i=0; i<GRA_STMT_COUNT; i++) {
+    if(db->stmts[i])
+      sqlite3_finalize(db->stmts[i]);
+  }
+  for(i=0; i<=GRA_PAPER_ALL; i++) {
+    if(db->paperUpdates[i])
+      sqlite3_finalize(db->paperUpdates[i]);
+  }
+  for(i=0; i<=GRA_FIELD_ALL; i++) {
+    if(db->fieldUpdates[i])
+      sqlite3_finalize(db->fieldUpdates[i]);
+  }
+  for(i=0; i<=GRA_REFERENCE_ALL; i++) {
+    if(db->refUpdates[i])
+      sqlite3_finalize(db->refUpdates[i]);
+  }
+  if(db->queries)
+    g_hash_table_destroy(db->queries);
+
   sqlite3_close(db->db);
+  trace_attach(db, NULL);
+  if(db->docSweep)
+    g_ptr_array_free(db->docSweep, TRUE);
+  g_rec_mutex_clear(&db->writeLock);
+  g_mutex_clear(&db->readerLock);
+  g_cond_clear(&db->readerFree);
   g_free(db);
 }
 
 
+/* Report statement cache usage */
+void
+gra_db_stmt_stats(gra_db_t *db, unsigned long *hits, unsigned long *prepares) {
+  if(hits) *hits = db->stmtHits;
+  if(prepares) *prepares = db->stmtPrepares;
+}
+
+
+/* Resize the paper cache, creating or destroying it as needed */
+void
+gra_db_cache_set_budget(gra_db_t *db, gsize bytes) {
+  db->cacheBudget = bytes;
+
+  if(!bytes) {
+    if(db->cache) {
+      gra_db_cache_clear(db);
+      g_hash_table_destroy(db->cache);
+      db->cache = NULL;
+    }
+    return;
+  }
+
+  if(!db->cache) {
+    db->cache = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                      NULL, cache_entry_free);
+    g_queue_init(&db->cacheLru);
+  }
+  cache_evict(db);
+}
+
+
+/* Drop every cached paper */
+void
+gra_db_cache_clear(gra_db_t *db) {
+  if(!db->cache) return;
+
+  g_hash_table_remove_all(db->cache);
+  g_queue_init(&db->cacheLru);
+  db->cacheBytes = 0;
+}
+
+
+/* Report paper cache usage */
+void
+gra_db_cache_stats(gra_db_t *db, gra_cache_stats_t *stats) {
+  stats->hits = db->cacheHits;
+  stats->misses = db->cacheMisses;
+  stats->evictions = db->cacheEvictions;
+  stats->papers = db->cache ? g_hash_table_size(db->cache) : 0;
+  stats->bytes = db->cacheBytes;
+  stats->budget = db->cacheBudget;
+}
+
+
+/* Start or stop timing statements */
+void
+gra_db_trace(gra_db_t *db, gboolean enable, gint64 slowMicros) {
+  gra_db_trace_t *trace;
+
+  if(!enable) {
+    trace_attach(db, NULL);
+    return;
+  }
+
+  if(!db->trace) {
+    trace = g_new0(gra_db_trace_t, 1);
+    g_mutex_init(&trace->lock);
+    trace->refCount = 1;
+    trace->stmts = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                         NULL, stmt_stats_free);
+    trace->since = g_get_real_time();
+    trace_attach(db, trace);
+    trace_unref(trace);
+  }
+
+  g_mutex_lock(&db->trace->lock);
+  db->trace->slowMicros = slowMicros;
+  g_mutex_unlock(&db->trace->lock);
+}
+
+
+/* Copy the timings out, most expensive statement first */
+gra_db_stats_t *
+gra_db_stats(gra_db_t *db, gboolean reset) {
+  gra_db_trace_t *trace = db->trace;
+  gra_db_stats_t *stats;
+  gra_stmt_stats_t *s, *copy;
+  gra_slow_query_t *q;
+  GHashTableIter iter;
+  int i, at;
+
+  if(!trace) return NULL;
+
+  stats = g_new0(gra_db_stats_t, 1);
+  stats->statements = g_ptr_array_new_with_free_func(stmt_stats_free);
+  stats->slow = g_ptr_array_new_with_free_func(slow_query_free);
+
+  g_mutex_lock(&trace->lock);
+  g_hash_table_iter_init(&iter, trace->stmts);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *) &s)) {
+    copy = g_new(gra_stmt_stats_t, 1);
+    *copy = *s;
+    copy->sql = g_strdup(s->sql);
+    g_ptr_array_add(stats->statements, copy);
+    stats->calls += s->calls;
+    stats->rows += s->rows;
+    stats->totalMicros += s->totalMicros;
+  }
+
+  /* the ring, from its oldest entry */
+  for(i=0; i<trace->slowCount; i++) {
+    at = (trace->slowNext - trace->slowCount + i + GRA_DB_SLOW_LOG_SIZE)
+         % GRA_DB_SLOW_LOG_SIZE;
+    q = g_new(gra_slow_query_t, 1);
+    *q = trace->slow[at];
+    q->sql = g_strdup(q->sql);
+    g_ptr_array_add(stats->slow, q);
+  }
+  stats->since = trace->since;
+
+  if(reset)
+    trace_reset(trace);
+  g_mutex_unlock(&trace->lock);
+
+  g_ptr_array_sort(stats->statements, stmt_stats_compare);
+  return stats;
+}
+
+
+/* Free a timings snapshot */
+void
+gra_db_stats_free(gra_db_stats_t *stats) {
+  if(!stats) return;
+
+  g_ptr_array_free(stats->statements, TRUE);
+  g_ptr_array_free(stats->slow, TRUE);
+  g_free(stats);
+}
+
+
+/* Start a transaction, or a savepoint if one is already open */
+void
+gra_db_batch_begin(gra_db_t *db, GError **error) {
+  GError *err = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  /* held until the batch ends */
+  gra_db_lock(db);
+
+  if(db->batchDepth)
+    db_step_once(db, GRA_STMT_SAVEPOINT, &err);
+  else
+    db_step_once(db, db->readOnly ? GRA_STMT_BEGIN_READ : GRA_STMT_BEGIN, &err);
+  if(err) {
+    gra_db_unlock(db);
+    g_propagate_error(error, err);
+    return;
+  }
+
+  /* a savepoint rolled back takes its citation changes with it */
+  if(db->batchDepth && db->citeMarks)
+    g_array_append_val(db->citeMarks, db->citeLog->len);
+
+  db->batchDepth++;
+}
+
+
+/* Commit the innermost batch */
+void
+gra_db_batch_commit(gra_db_t *db, GError **error) {
+  /* abort on previous error */
+  if(error && *error) return;
+
+  if(!db->batchDepth) {
+    g_set_error(error, GRA_DATA_ERROR, 3, "No batch is open.");
+    return;
+  }
+
+  /* index the papers added during the batch */
+  if(db->batchDepth == 1)
+    text_flush(db, error);
+
+  db_step_once(db, db->batchDepth > 1 ? GRA_STMT_RELEASE : GRA_STMT_COMMIT, error);
+  if(error && *error) return;
+
+  /* only now may dropped documents leave the disk */
+  if(db->batchDepth == 1 && db->docSweep)
+    document_sweep(db);
+
+  /* nor may the citation graph see the batch's citations */
+  if(db->citeMarks && db->batchDepth > 1 && db->citeMarks->len) {
+    g_array_set_size(db->citeMarks, db->citeMarks->len - 1);
+  } else if(db->citeMarks && db->batchDepth == 1) {
+    gra_citegraph_apply(db->citations, (gra_citation_change_t *) db->citeLog->data,
+                        db->citeLog->len);
+    g_array_set_size(db->citeLog, 0);
+  }
+
+  db->batchDepth--;
+  db->changed = TRUE;
+  gra_db_unlock(db);
+}
+
+
+/* Roll back the innermost batch.  This is a cleanup path, so it runs
+   even when an error has already been reported. */
+void
+gra_db_batch_rollback(gra_db_t *db, GError **error) {
+  GError *err = NULL;
+
+  if(!db->batchDepth) {
+    g_set_error(&err, GRA_DATA_ERROR, 3, "No batch is open.");
+  } else if(db->batchDepth > 1) {
+    /* undo the savepoint's work, then pop it */
+    db_step_once(db, GRA_STMT_ROLLBACK_TO, &err);
+    db_step_once(db, GRA_STMT_RELEASE, &err);
+    if(db->citeMarks && db->citeMarks->len) {
+      g_array_set_size(db->citeLog, g_array_index(db->citeMarks, guint,
+                                                  db->citeMarks->len - 1));
+      g_array_set_size(db->citeMarks, db->citeMarks->len - 1);
+    }
+    db->batchDepth--;
+    gra_db_unlock(db);
+  } else {
+    /* a failed ROLLBACK still ends the transaction */
+    db_step_once(db, GRA_STMT_ROLLBACK, &err);
+    db->batchDepth = 0;
+    db->textFirstPaper = 0;
+    db->textFirstField = 0;
+    if(db->docSweep)
+      g_ptr_array_set_size(db->docSweep, 0);
+    if(db->citeMarks) {
+      g_array_set_size(db->citeLog, 0);
+      g_array_set_size(db->citeMarks, 0);
+    }
+    gra_db_unlock(db);
+  }
+
+  /* only report if the caller has no error of their own */
+  if(err) {
+    if(error && !*error)
+      g_propagate_error(error, err);
+    else
+      g_error_free(err);
+  }
+}
+
+
+/* Serialize threads sharing the connection */
+void
+gra_db_lock(gra_db_t *db) {
+  g_rec_mutex_lock(&db->writeLock);
+}
+
+
+void
+gra_db_unlock(gra_db_t *db) {
+  g_rec_mutex_unlock(&db->writeLock);
+}
+
+
+/* Size the pool of read-only connections */
+void
+gra_db_pool_set_readers(gra_db_t *db, int readers, GError **error) {
+  gra_db_t *reader;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  /* readers only run beside the writer with write-ahead logging */
+  if(readers > 0 && !db->readers) {
+    if(!*sqlite3_db_filename(db->db, "main")) {
+      g_set_error(error, GRA_DATA_ERROR, 1, "Readers need a database file.");
+      return;
+    }
+
+    gra_db_lock(db);
+    if(sqlite3_exec(db->db, "PRAGMA journal_mode=WAL; PRAGMA synchronous=NORMAL",
+                    NULL, NULL, NULL) != SQLITE_OK) {
+      DB_ERROR(error);
+      gra_db_unlock(db);
+      return;
+    }
+    gra_db_unlock(db);
+
+    db->readers = g_queue_new();
+  }
+
+  if(!db->readers) return;
+  g_mutex_lock(&db->readerLock);
+  db->readerMax = readers > 0 ? readers : 0;
+
+  /* close idle readers over the limit */
+  while(db->readerCount > db->readerMax &&
+        (reader = g_queue_pop_head(db->readers))) {
+    gra_db_close(reader, NULL);
+    db->readerCount--;
+  }
+
+  /* waiters may open a reader now, or find the pool gone */
+  g_cond_broadcast(&db->readerFree);
+  g_mutex_unlock(&db->readerLock);
+}
+
+
+/* Hand out an idle reader, opening one if the pool has room */
+gra_db_t *
+gra_db_reader_acquire(gra_db_t *db, GError **error) {
+  gra_db_t *reader = NULL;
+  gboolean open = FALSE;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  if(!db->readers) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No reader pool.");
+    return NULL;
+  }
+
+  /* claim an idle reader, or a slot for a new one, waiting until
+     there is either.  The pool may shrink, or go, meanwhile. */
+  g_mutex_lock(&db->readerLock);
+  while(db->readerMax) {
+    reader = g_queue_pop_head(db->readers);
+    if(reader) break;
+    if(db->readerCount < db->readerMax) {
+      db->readerCount++;
+      open = TRUE;
+      break;
+    }
+    g_cond_wait(&db->readerFree, &db->readerLock);
+  }
+  g_mutex_unlock(&db->readerLock);
+
+  if(!reader && !open) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No reader pool.");
+    return NULL;
+  }
+  if(reader) {
+    trace_attach(reader, db->trace);
+    return reader;
+  }
+
+  reader = gra_db_open_full(sqlite3_db_filename(db->db, "main"),
+                            GRA_DB_OPEN_READ_ONLY, error);
+  if(reader && db->mmapSize)
+    gra_db_set_mmap_size(reader, db->mmapSize, NULL);
+  if(reader)
+    trace_attach(reader, db->trace);
+  if(!reader) {
+    /* the slot is free again, for a waiter to try */
+    g_mutex_lock(&db->readerLock);
+    db->readerCount--;
+    g_cond_signal(&db->readerFree);
+    g_mutex_unlock(&db->readerLock);
+  }
+
+  return reader;
+}
+
+
+/* Give a reader back to the pool */
+void
+gra_db_reader_release(gra_db_t *db, gra_db_t *reader) {
+  if(!reader) return;
+
+  /* the pool shrank while it was out */
+  g_mutex_lock(&db->readerLock);
+  if(db->readerCount > db->readerMax) {
+    db->readerCount--;
+    g_mutex_unlock(&db->readerLock);
+    gra_db_close(reader, NULL);
+    return;
+  }
+
+  g_queue_push_tail(db->readers, reader);
+  g_cond_signal(&db->readerFree);
+  g_mutex_unlock(&db->readerLock);
+}
+
+
 gra_paper_t *
 gra_db_paper_load(gra_db_t *db, int id, GError **error) {
-  gra_paper_t *result;
+  gra_paper_t *result=NULL;
   sqlite3_stmt *stmt=NULL;
   int rc;
+  cache_entry *entry;
   
   /* abort on previous error */
   if(error && *error) return NULL;
 
-  rc = sqlite3_prepare_v2(db->db, "SELECT ID, FileName, PageCount, Read, Type, Author, Title, Year FROM \"Paper\" WHERE ID=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
-    goto cleanup;
+  /* hand out the paper we already have */
+  if(db->cache) {
+    entry = g_hash_table_lookup(db->cache, GINT_TO_POINTER(id));
+    if(entry) {
+      db->cacheHits++;
+      g_queue_unlink(&db->cacheLru, &entry->link);
+      g_queue_push_head_link(&db->cacheLru, &entry->link);
+      return gra_paper_ref(entry->paper);
+    }
+    db->cacheMisses++;
   }
 
+  stmt = db_stmt(db, GRA_STMT_PAPER_LOAD, error);
+  if(!stmt) goto cleanup;
+
   /* finish off the query and run*/
   sqlite3_bind_int(stmt, 1, id);
   rc = sqlite3_step(stmt);
@@ -134,26 +1056,13 @@ gra_db_paper_load(gra_db_t *db, int id, GError **error) {
   }
 
   /* build the result */
-  result = g_malloc(sizeof(gra_paper_t));
-  if(!result) {
-    goto cleanup;
-  }
-  result->id = sqlite3_column_int(stmt, 0);
-  result->fileName = g_strdup((gchar*)sqlite3_column_text(stmt, 1));
-  result->pageCount = sqlite3_column_int(stmt, 2);
-  result->read = sqlite3_column_int(stmt, 3);
-  result->type = g_strdup((gchar*)sqlite3_column_text(stmt, 4));
-  result->author = g_strdup((gchar*)sqlite3_column_text(stmt, 5));
-  result->title = g_strdup((gchar*)sqlite3_column_text(stmt, 6));
-  result->year = sqlite3_column_int(stmt, 7);
-  result->fields = NULL;
-  result->refs = NULL;
-  result->indb = TRUE;
-  result->changed = FALSE;
+  result = gra_db_paper_from_row(stmt, NULL);
+  if(db->cache)
+    cache_insert(db, result);
 
   /* all done! */
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return result;
 }
 
@@ -163,41 +1072,61 @@ gra_db_paper_save(gra_db_t *db, gra_paper_t *p, GError **error) {
   sqlite3_stmt *stmt=NULL;
   int rc;
   GList *cur;
+  gra_reference_t *ref;
+  field_save_ctx ctx = {0};
+  paper_save_undo undo;
+  GError *err = NULL;
+  gboolean wasInDb = p->indb;
+  guint columns = 0;
   
   /* abort on previous error */
   if(error && *error) return;
 
-  /* do not save unchanged papers */
-  if(!p->changed)
+  /* do not save unchanged papers, only their changed notes */
+  if(!p->changed) {
+    gra_db_paper_save_notes(db, p, error);
+    return;
+  }
+
+  /* the paper, its fields, references and notes go in together */
+  gra_db_batch_begin(db, &err);
+  if(err) {
+    g_propagate_error(error, err);
     return;
+  }
+  save_undo_mark(p, &undo);
 
   if(p->indb) {
-    /* prepare update */
-    rc = sqlite3_prepare_v2(db->db, "UPDATE \"Paper\" SET \"Read\"=?, \"Type\"=?, \"Author\"=?, \"Title\"=?, \"Year\"=? WHERE \"ID\"=?", -1, &stmt, 0);
-    if(rc == SQLITE_OK)
-      rc = sqlite3_bind_int(stmt, 6, p->id);
+    /* Update the changed columns.  With none marked, a paper whose
+       fields changed has nothing of its own to write; otherwise it
+       was changed by hand, and every column is written. */
+    columns = p->dirty ? p->dirty : p->childrenChanged ? 0 : GRA_PAPER_ALL;
+    if(!columns) goto children;
+    stmt = update_stmt(db, db->paperUpdates, "Paper", "ID", paperColumns,
+                       G_N_ELEMENTS(paperColumns), columns, &err);
+    if(stmt)
+      sqlite3_bind_int(stmt, 8, p->id);
   } else {
     /* prepare insert */
-    rc = sqlite3_prepare_v2(db->db, "INSERT INTO \"Paper\" (\"Read\", \"Type\", \"Author\", \"Title\", \"Year\") VALUES(?, ?, ?, ?, ?)", -1, &stmt, 0);
+    stmt = db_stmt(db, GRA_STMT_PAPER_INSERT, &err);
   }
 
   /* handle statement errors */
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
-  }
+  if(!stmt) goto cleanup;
 
   /* bind the values */
-  sqlite3_bind_int(stmt, 1, p->read);
-  sqlite3_bind_text(stmt, 2, p->type, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text(stmt, 3, p->author, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text(stmt, 4, p->title, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_int(stmt, 5, p->year);
+  bind_text(stmt, 1, p->fileName);
+  sqlite3_bind_int(stmt, 2, p->pageCount);
+  sqlite3_bind_int(stmt, 3, p->read);
+  bind_text(stmt, 4, p->type);
+  bind_text(stmt, 5, p->author);
+  bind_text(stmt, 6, p->title);
+  sqlite3_bind_int(stmt, 7, p->year);
 
   /* run the query */
   rc = sqlite3_step(stmt);
   if(rc != SQLITE_DONE) {
-    DB_ERROR(error);
+    DB_ERROR(&err);
     goto cleanup;
   }
 
@@ -205,110 +1134,205 @@ gra_db_paper_save(gra_db_t *db, gra_paper_t *p, GError **error) {
   if(!p->indb) {
     p->id = sqlite3_last_insert_rowid(db->db);
     p->indb = TRUE;
-  }
 
-  /* the database is now current */
-  p->changed = FALSE;
+    /* IDs only grow, so a range covers every paper to be indexed */
+    if(!db->textFirstPaper)
+      db->textFirstPaper = p->id;
+    db->textLastPaper = p->id;
+  }
 
-  /* handle the fields, if any */
-  if(p->fields) {
-    g_tree_foreach(p->fields, fieldSaveVisit, NULL);
+  sqlite3_reset(stmt);
+  stmt = NULL;
+
+  /* the author list is kept split up in Authorship */
+  if(!wasInDb || (columns & GRA_PAPER_AUTHOR))
+    author_link(db, p->id, p->author, wasInDb, &err);
+  if(err) goto cleanup;
+
+  children:
+  /* handle the fields, if any, collecting the text of new ones */
+  ctx.text = g_string_new(NULL);
+  ctx.db = db;
+  ctx.p = p;
+  ctx.error = &err;
+  gra_paper_foreach_field(p, fieldSaveVisit, &ctx);
+
+  /* New papers are indexed when the batch commits.  New fields of
+     an old paper are indexed now, in one write. */
+  if(!err && wasInDb && ctx.text->len) {
+    text_append(db, p->id, ctx.text->str, &err);
   }
 
   /* handle the references, if any */
-  if(p->refs) {
-    for(cur=p->refs; cur; cur = g_list_next(cur)) {
-      gra_db_reference_save(db, (gra_reference_t*)(cur->data), error);
+  for(cur=p->refs; cur && !err; cur = g_list_next(cur)) {
+    ref = (gra_reference_t*)(cur->data);
+    if(ref->paperId != p->id) {
+      ref->paperId = p->id;
+      ref->dirty |= GRA_REFERENCE_PAPER_ID;
+      ref->changed = TRUE;
     }
+    gra_db_reference_save(db, ref, &err);
   }
-  
+
+  /* the notes of a new paper can only be written now */
+  gra_db_paper_save_notes(db, p, &err);
+
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
-  return;
+  if(stmt) sqlite3_reset(stmt);
+  if(ctx.text) g_string_free(ctx.text, TRUE);
+  if(!err)
+    gra_db_batch_commit(db, &err);
+  if(err) {
+    /* nothing was written, so the paper and its rows are as they were */
+    gra_db_batch_rollback(db, NULL);
+    save_undo_restore(p, &undo);
+    save_undo_free(&undo);
+    g_propagate_error(error, err);
+    return;
+  }
+  save_undo_free(&undo);
+
+  /* the database is now current */
+  p->changed = FALSE;
+  p->childrenChanged = FALSE;
+  p->dirty = 0;
+
+  /* a different copy of this paper in the cache is now stale */
+  if(db->cache) {
+    cache_entry *entry = g_hash_table_lookup(db->cache, GINT_TO_POINTER(p->id));
+    if(entry && entry->paper != p)
+      cache_remove(db, p->id);
+    else if(entry)
+      cache_resize(db, p);
+  }
 }
 
 
 void
 gra_db_paper_delete(gra_db_t *db, gra_paper_t *p, GError **error) {
-  int rc;
-  sqlite3_stmt *stmt = NULL;
+  GError *err = NULL;
 
   /* abort on previous error */
   if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "DELETE FROM \"Paper\" WHERE \"ID\"=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
+  delete_set(db, &p->id, 1, &err);
+  if(err) {
+    g_propagate_error(error, err);
+    return;
   }
 
-  /* bind and run the delete */
-  sqlite3_bind_int(stmt, 1, p->id);
-  rc = sqlite3_step(stmt);
+  /* this is no longer in the db, mark it as such */
+  paper_forget(p);
+}
 
-  if(rc != SQLITE_DONE) {
-    DB_ERROR(error);
-    goto cleanup;
-  }
 
-  /* this is no longer in the db, mark it as such */
-  p->indb = FALSE;
-  p->changed = TRUE;
+/* Delete papers with their dependent rows, a statement per table */
+int
+gra_db_paper_delete_many(gra_db_t *db, const int *ids, int n, GError **error) {
+  /* abort on previous error */
+  if(error && *error) return 0;
 
-  cleanup:
-  if(stmt) sqlite3_finalize(stmt);
-  return;
+  if(n <= 0) return 0;
+  return delete_set(db, ids, n, error);
 }
 
 
+/* Drop orphaned rows, then rebuild the file without its free pages */
 void
-gra_db_paper_load_fields(gra_db_t *db, gra_paper_t *p, GError **error) {
-  int rc;
+gra_db_compact(gra_db_t *db, gra_db_compact_stats_t *stats, GError **error) {
+  const gchar *orphans[] = {
+    "DELETE FROM \"Field\" WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")",
+    "DELETE FROM \"Reference\" WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")"
+    " OR \"RefPaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")",
+    "DELETE FROM \"Note\" WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")",
+    "DELETE FROM \"Authorship\" WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")",
+    "DELETE FROM \"Author\" WHERE \"PaperCount\"=0",
+    "DELETE FROM \"DocumentStage\" WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")"
+  };
+  const gchar *vacuum[] = { "VACUUM" };
   sqlite3_stmt *stmt = NULL;
-  gra_field_t *field = NULL;
+  GError *err = NULL;
+  int i, rc;
 
   /* abort on previous error */
   if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "SELECT \"ID\", \"Name\", \"Value\" FROM \"Field\" WHERE \"PaperID\"=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
+  memset(stats, 0, sizeof(*stats));
+
+  /* VACUUM cannot run inside a transaction */
+  gra_db_lock(db);
+  if(db->batchDepth) {
+    g_set_error(&err, GRA_DATA_ERROR, 3, "A batch is open.");
+    goto done;
+  }
+  stats->bytesBefore = db_bytes(db, &err);
+
+  gra_db_batch_begin(db, &err);
+  if(err) goto done;
+
+  /* the citation graph loses the orphaned citations too */
+  if(db->citations) {
+    rc = sqlite3_prepare_v2(db->db,
+                            "SELECT \"PaperID\", \"RefPaperID\" FROM \"Reference\""
+                            " WHERE \"PaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")"
+                            " OR \"RefPaperID\" NOT IN (SELECT \"ID\" FROM \"Paper\")",
+                            -1, &stmt, NULL);
+    while(rc == SQLITE_OK && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      cite_note(db, sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), FALSE);
+    if(rc != SQLITE_DONE)
+      DB_ERROR(&err);
+    sqlite3_finalize(stmt);
   }
-  sqlite3_bind_int(stmt, 1, p->id);
 
-  /* set up GTree */
-  if(!p->fields)
-    p->fields = g_tree_new(fieldcmp);
-  if(!p->fields) {
-    g_set_error(error, GRA_DATA_ERROR, 2, "Could not allocate binary tree for fields.");
-    goto cleanup;
+  for(i=0; i<G_N_ELEMENTS(orphans) && !err; i++) {
+    run_script(db, orphans + i, 1, &err);
+    stats->orphans += sqlite3_changes(db->db);
   }
-    
 
-  /* loop through results */
-  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
-    /* create field structure */
-    field = g_malloc(sizeof(gra_field_t));
-    if(!field) {
-      g_set_error(error, GRA_DATA_ERROR, 2, "Could not allocate field.");
-      goto cleanup;
-    }
+  if(err) {
+    gra_db_batch_rollback(db, NULL);
+    goto done;
+  }
+  gra_db_batch_commit(db, &err);
+
+  /* row IDs of the Reference table may change, so no paper in the
+     cache can be trusted afterwards */
+  run_script(db, vacuum, 1, &err);
+  gra_db_cache_clear(db);
+
+  /* with write-ahead logging, the file shrinks at a checkpoint */
+  if(!err)
+    sqlite3_wal_checkpoint_v2(db->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+  stats->bytesAfter = db_bytes(db, &err);
+
+  done:
+  gra_db_unlock(db);
+  if(err)
+    g_propagate_error(error, err);
+}
+
+
+void
+gra_db_paper_load_fields(gra_db_t *db, gra_paper_t *p, GError **error) {
+  int rc;
+  sqlite3_stmt *stmt = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return;
 
-    /* populate the field */
-    field->id = sqlite3_column_int(stmt, 0);
-    field->paperId = p->id;
-    field->name = g_strdup((gchar*) sqlite3_column_text(stmt, 1));
-    field->value = g_strdup((gchar*) sqlite3_column_text(stmt, 2));
-    field->indb = TRUE;
-    field->changed = FALSE;
+  stmt = db_stmt(db, GRA_STMT_PAPER_FIELDS, error);
+  if(!stmt) goto cleanup;
+  sqlite3_bind_int(stmt, 1, p->id);
 
-    /* add the field to the tree */
-    g_tree_insert(p->fields, field->name, field);
+  /* loop through results */
+  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    add_field_row(p, stmt);
   }
+  if(db->cache)
+    cache_resize(db, p);
 
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return;
 }
 
@@ -317,100 +1341,495 @@ void
 gra_db_paper_load_refs(gra_db_t *db, gra_paper_t *p, GError **error) {
   int rc;
   sqlite3_stmt *stmt = NULL;
-  gra_reference_t *ref = NULL;
 
   /* abort on previous error */
   if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "SELECT \"ID\", \"RefPaperID\" FROM \"Reference\" WHERE \"PaperID\"=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
-  }
+  stmt = db_stmt(db, GRA_STMT_PAPER_REFS, error);
+  if(!stmt) goto cleanup;
   sqlite3_bind_int(stmt, 1, p->id);
 
 
   /* loop through results */
   while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
-    /* create field structure */
-    ref = g_malloc(sizeof(gra_reference_t));
-    if(!ref) {
-      g_set_error(error, GRA_DATA_ERROR, 2, "Could not allocate field.");
-      goto cleanup;
-    }
-
-    /* populate the field */
-    ref->id = sqlite3_column_int(stmt, 0);
-    ref->paperId = p->id;
-    ref->refPaperId = sqlite3_column_int(stmt, 1);
-    ref->indb = TRUE;
-    ref->changed = FALSE;
-
-    /* add the reference to the list */
-    p->refs = g_list_prepend(p->refs, ref);
+    add_ref_row(p, stmt);
   }
+  if(db->cache)
+    cache_resize(db, p);
 
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return;
 }
 
 
-/* field functions */
+/* Load the notes of the blocks of pages not loaded yet */
 void
-gra_db_field_save(gra_db_t *db, gra_field_t *f, GError **error) {
+gra_db_paper_load_notes(gra_db_t *db, gra_paper_t *p, int firstPage,
+                        int lastPage, GError **error) {
+  int rc, first, last, block, page;
   sqlite3_stmt *stmt = NULL;
-  int rc;
+  gra_note_t *n;
 
   /* abort on previous error */
   if(error && *error) return;
 
-  /* do not save unchanged fields */
-  if(!f->changed)
-    return;
+  g_return_if_fail(firstPage >= 0 && firstPage <= lastPage);
 
-  if(f->indb) {
-    /* prepare update */
-    rc = sqlite3_prepare_v2(db->db, "UPDATE \"Field\" SET \"PaperID\"=?, \"Name\"=?, \"Value\"=? WHERE \"ID\"=?", -1, &stmt, 0);
-    if(rc != SQLITE_OK) {
+  /* nothing to load for a new paper */
+  if(!p->indb) return;
+
+  first = firstPage / GRA_NOTE_BLOCK_PAGES;
+  last = lastPage / GRA_NOTE_BLOCK_PAGES;
+
+  for(block = first; block <= last; block++) {
+    if(notes_loaded(p, block)) continue;
+
+    /* one query for each run of blocks still to load */
+    for(first = block; block < last && !notes_loaded(p, block + 1); block++)
+      ;
+
+    stmt = db_stmt(db, GRA_STMT_NOTE_LOAD, error);
+    if(!stmt) return;
+    sqlite3_bind_int(stmt, 1, p->id);
+    sqlite3_bind_int(stmt, 2, first * GRA_NOTE_BLOCK_PAGES);
+    sqlite3_bind_int(stmt, 3, block * GRA_NOTE_BLOCK_PAGES + GRA_NOTE_BLOCK_PAGES - 1);
+
+    while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+      page = sqlite3_column_int(stmt, 1);
+      if(p->notes && g_hash_table_lookup(p->notes, GINT_TO_POINTER(page)))
+        continue;
+      n = note_add(p, page);
+      n->id = sqlite3_column_int(stmt, 0);
+      n->leftNote = g_strdup((gchar*)sqlite3_column_text(stmt, 2));
+      n->rightNote = g_strdup((gchar*)sqlite3_column_text(stmt, 3));
+      n->indb = TRUE;
+    }
+    sqlite3_reset(stmt);
+
+    if(rc != SQLITE_DONE) {
       DB_ERROR(error);
-      goto cleanup;
+      return;
     }
-    rc = sqlite3_bind_int(stmt, 4, f->id);
-  } else {
-    /* prepare insert */
-    rc = sqlite3_prepare_v2(db->db, "INSERT INTO \"Field\" (\"PaperID\", \"Name\", \"Value\") VALUES(?, ?, ?)", -1, &stmt, 0);
+    notes_mark_loaded(p, first, block);
   }
 
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
+  if(db->cache)
+    cache_resize(db, p);
+}
+
+
+/* Load a set of papers with one query per table */
+gra_paper_t **
+gra_db_paper_load_many(gra_db_t *db, const int *ids, int n,
+                       unsigned int flags, GError **error) {
+  gra_paper_t **result;
+  gra_paper_t *p;
+  gra_arena_t *arena = NULL;
+  sqlite3_stmt *stmt = NULL;
+  GError *err = NULL;
+  int i, rc;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  result = g_new0(gra_paper_t *, n);
+  if(n <= 0) return result;
+
+  /* every paper holds the arena; ours is dropped when done */
+  if(flags & GRA_LOAD_ARENA)
+    arena = gra_arena_new(0);
+
+  /* Nothing but the temp table is written, so this takes no write
+     lock, and the reads below share one snapshot. */
+  db_step_once(db, GRA_STMT_LOAD_BEGIN, &err);
+  if(err) {
+    gra_arena_unref(arena);
+    goto fail;
   }
+  db_step_once(db, GRA_STMT_LOADSET_CLEAR, &err);
+
+  /* the ID set, numbered in caller order */
+  for(i=0; i<n && !err; i++) {
+    stmt = db_stmt(db, GRA_STMT_LOADSET_ADD, &err);
+    if(!stmt) break;
+    sqlite3_bind_int(stmt, 1, i);
+    sqlite3_bind_int(stmt, 2, ids[i]);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
+  if(err) goto done;
 
-  /* bind the colums and run */
-  sqlite3_bind_int(stmt, 1, f->paperId);
-  sqlite3_bind_text(stmt, 2, f->name, -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text(stmt, 3, f->value, -1, SQLITE_TRANSIENT);
-  rc = sqlite3_step(stmt);
+  /* the papers */
+  stmt = db_stmt(db, GRA_STMT_LOAD_PAPERS, &err);
+  if(!stmt) goto done;
+  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    result[sqlite3_column_int(stmt, 8)] = gra_db_paper_from_row(stmt, arena);
+  }
+  if(rc != SQLITE_DONE) DB_ERROR(&err);
+  sqlite3_reset(stmt);
+
+  /* their fields */
+  if(!err && (flags & GRA_LOAD_FIELDS)) {
+    stmt = db_stmt(db, GRA_STMT_LOAD_FIELDS, &err);
+    if(!stmt) goto done;
+    while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+      p = result[sqlite3_column_int(stmt, 3)];
+      if(p) add_field_row(p, stmt);
+    }
+    if(rc != SQLITE_DONE) DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
 
-  if(rc != SQLITE_DONE) {
+  /* and their references */
+  if(!err && (flags & GRA_LOAD_REFS)) {
+    stmt = db_stmt(db, GRA_STMT_LOAD_REFS, &err);
+    if(!stmt) goto done;
+    while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+      p = result[sqlite3_column_int(stmt, 2)];
+      if(p) add_ref_row(p, stmt);
+    }
+    if(rc != SQLITE_DONE) DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
+
+  done:
+  /* the savepoint only covers the temp table, so just release it */
+  db_step_once(db, GRA_STMT_LOAD_END, err ? NULL : &err);
+  gra_arena_unref(arena);
+  if(!err) return result;
+
+  fail:
+  gra_paper_free_many(result, n);
+  g_propagate_error(error, err);
+  return NULL;
+}
+
+
+int
+gra_db_paper_count(gra_db_t *db, GError **error) {
+  sqlite3_stmt *stmt;
+  int result = -1;
+
+  /* abort on previous error */
+  if(error && *error) return -1;
+
+  stmt = db_stmt(db, GRA_STMT_PAPER_COUNT, error);
+  if(!stmt) return -1;
+
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+    result = sqlite3_column_int(stmt, 0);
+  else
     DB_ERROR(error);
-    goto cleanup;
+
+  sqlite3_reset(stmt);
+  return result;
+}
+
+
+/* Load a page of papers, seeking past the last one of the page before */
+gra_paper_t **
+gra_db_paper_browse(gra_db_t *db, gra_db_sort_column column,
+                    gboolean descending, const gra_paper_t *after,
+                    int skip, int limit, int *n, GError **error) {
+  gra_paper_t **result;
+  gra_arena_t *arena;
+  sqlite3_stmt *stmt;
+  int rc = SQLITE_DONE;
+
+  *n = 0;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  stmt = db_stmt(db, GRA_STMT_BROWSE + column * 4 + (descending ? 2 : 0) + (after ? 1 : 0),
+                 error);
+  if(!stmt) return NULL;
+
+  /* the key of the paper to start after */
+  if(after) {
+    switch(column) {
+    case GRA_SORT_TITLE:
+      bind_text(stmt, 1, after->title);
+      break;
+    case GRA_SORT_AUTHOR:
+      bind_text(stmt, 1, after->author);
+      break;
+    case GRA_SORT_YEAR:
+      sqlite3_bind_int(stmt, 1, after->year);
+      break;
+    default:
+      sqlite3_bind_int(stmt, 1, after->id);
+    }
+    sqlite3_bind_int(stmt, 2, after->id);
   }
+  sqlite3_bind_int(stmt, 3, skip < 0 ? 0 : skip);
+  sqlite3_bind_int(stmt, 4, limit);
+
+  /* the page shares one arena, which goes with its last paper */
+  result = g_new0(gra_paper_t *, limit > 0 ? limit : 1);
+  arena = gra_arena_new(0);
+  while(*n < limit && (rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    result[(*n)++] = gra_db_paper_from_row(stmt, arena);
+  }
+  gra_arena_unref(arena);
 
-  /* handle new rows properly */
-  if(!f->indb) {
-    f->id = sqlite3_last_insert_rowid(db->db);
-    f->indb = TRUE;
+  if(*n < limit && rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    gra_paper_free_many(result, *n);
+    result = NULL;
+    *n = 0;
   }
 
-  /* the database is now current */
-  f->changed = FALSE;
-  
+  sqlite3_reset(stmt);
+  return result;
+}
 
-  cleanup:
-  if(stmt) sqlite3_finalize(stmt);
-  return;
+
+/* Allocate an empty paper which has not been saved yet */
+gra_paper_t *
+gra_paper_new(void) {
+  return gra_paper_new_in(NULL);
+}
+
+
+/* Allocate an empty paper, carved from an arena if one is given */
+gra_paper_t *
+gra_paper_new_in(gra_arena_t *arena) {
+  gra_paper_t *p;
+
+  p = paper_alloc(arena, sizeof(gra_paper_t));
+  p->indb = FALSE;
+  p->changed = TRUE;
+  p->refCount = 1;
+  p->arena = arena ? gra_arena_ref(arena) : NULL;
+
+  return p;
+}
+
+
+/* Column setters, which mark what they change for gra_db_paper_save */
+void
+gra_paper_set_file_name(gra_paper_t *p, const gchar *fileName) {
+  paper_set_text(p, &p->fileName, fileName, GRA_PAPER_FILE_NAME);
+}
+
+
+void
+gra_paper_set_page_count(gra_paper_t *p, int pageCount) {
+  if(p->pageCount == pageCount)
+    return;
+  p->pageCount = pageCount;
+  p->dirty |= GRA_PAPER_PAGE_COUNT;
+  p->changed = TRUE;
+}
+
+
+void
+gra_paper_set_read(gra_paper_t *p, gboolean read) {
+  read = read ? TRUE : FALSE;
+  if(p->read == read)
+    return;
+  p->read = read;
+  p->dirty |= GRA_PAPER_READ;
+  p->changed = TRUE;
+}
+
+
+void
+gra_paper_set_type(gra_paper_t *p, const gchar *type) {
+  paper_set_text(p, &p->type, type, GRA_PAPER_TYPE);
+}
+
+
+void
+gra_paper_set_author(gra_paper_t *p, const gchar *author) {
+  paper_set_text(p, &p->author, author, GRA_PAPER_AUTHOR);
+}
+
+
+void
+gra_paper_set_title(gra_paper_t *p, const gchar *title) {
+  paper_set_text(p, &p->title, title, GRA_PAPER_TITLE);
+}
+
+
+void
+gra_paper_set_year(gra_paper_t *p, unsigned int year) {
+  if(p->year == year)
+    return;
+  p->year = year;
+  p->dirty |= GRA_PAPER_YEAR;
+  p->changed = TRUE;
+}
+
+
+/* Set a field, adding it to the paper if it is not there yet */
+gra_field_t *
+gra_paper_set_field(gra_paper_t *p, const gchar *name, const gchar *value) {
+  gra_field_t *f;
+  gboolean found;
+  int at;
+
+  /* update an existing field */
+  at = field_find(p, name, &found);
+  if(found) {
+    f = p->fields + at;
+    if(g_strcmp0(f->value, value)) {
+      if(!p->arena)
+        g_free(f->value);
+      f->value = paper_strdup(p->arena, value);
+      f->dirty |= GRA_FIELD_VALUE;
+      f->changed = TRUE;
+      p->changed = TRUE;
+      p->childrenChanged = TRUE;
+    }
+    return f;
+  }
+
+  /* add a new one */
+  f = field_insert(p, at, name);
+  f->paperId = p->id;
+  f->value = paper_strdup(p->arena, value);
+  f->changed = TRUE;
+  p->changed = TRUE;
+  p->childrenChanged = TRUE;
+
+  return f;
+}
+
+
+/* Find a field by name */
+gra_field_t *
+gra_paper_get_field(gra_paper_t *p, const gchar *name) {
+  gboolean found;
+  int at;
+
+  at = field_find(p, name, &found);
+  return found ? p->fields + at : NULL;
+}
+
+
+/* Visit the fields in name order */
+void
+gra_paper_foreach_field(gra_paper_t *p, gra_field_func func, gpointer data) {
+  int i;
+
+  for(i=0; i < p->fieldCount; i++) {
+    if(func(p->fields + i, data))
+      break;
+  }
+}
+
+
+/* Find the note of a page */
+gra_note_t *
+gra_paper_get_note(gra_paper_t *p, int page) {
+  if(!p->notes) return NULL;
+  return g_hash_table_lookup(p->notes, GINT_TO_POINTER(page));
+}
+
+
+/* Set the notes of a page, marking the note only if they differ */
+gra_note_t *
+gra_paper_set_note(gra_paper_t *p, int page, const gchar *leftNote,
+                   const gchar *rightNote) {
+  gra_note_t *n;
+  gboolean changed = FALSE;
+
+  g_return_val_if_fail(page >= 0, NULL);
+
+  /* a new paper has no notes to load */
+  if(!p->indb)
+    notes_mark_loaded(p, page / GRA_NOTE_BLOCK_PAGES, page / GRA_NOTE_BLOCK_PAGES);
+  g_return_val_if_fail(notes_loaded(p, page / GRA_NOTE_BLOCK_PAGES), NULL);
+
+  n = gra_paper_get_note(p, page);
+  if(!n) {
+    n = note_add(p, page);
+    n->leftNote = g_strdup("");
+    n->rightNote = g_strdup("");
+  }
+
+  if(leftNote && strcmp(n->leftNote, leftNote)) {
+    g_free(n->leftNote);
+    n->leftNote = g_strdup(leftNote);
+    changed = TRUE;
+  }
+  if(rightNote && strcmp(n->rightNote, rightNote)) {
+    g_free(n->rightNote);
+    n->rightNote = g_strdup(rightNote);
+    changed = TRUE;
+  }
+
+  /* queue it for the next save */
+  if(changed && !n->changed) {
+    n->changed = TRUE;
+    if(!p->notesDirty)
+      p->notesDirty = g_ptr_array_new();
+    g_ptr_array_add(p->notesDirty, n);
+  }
+
+  return n;
+}
+
+
+/* Release a paper along with its fields and references */
+void
+gra_paper_free(gra_paper_t *p) {
+  if(!p) return;
+
+  /* someone else still holds it */
+  if(!g_atomic_int_dec_and_test(&p->refCount)) return;
+
+  /* notes never live in the arena */
+  notes_free(p);
+
+  /* everything else lives in the arena */
+  if(p->arena) {
+    gra_arena_unref(p->arena);
+    return;
+  }
+
+  gra_paper_foreach_field(p, fieldFreeVisit, NULL);
+  g_free(p->fields);
+  g_list_free_full(p->refs, g_free);
+
+  g_free(p->fileName);
+  g_free(p->type);
+  g_free(p->author);
+  g_free(p->title);
+  g_free(p);
+}
+
+
+/* Add a holder to a paper */
+gra_paper_t *
+gra_paper_ref(gra_paper_t *p) {
+  g_atomic_int_inc(&p->refCount);
+  return p;
+}
+
+
+/* Release an array of papers from gra_db_paper_load_many */
+void
+gra_paper_free_many(gra_paper_t **papers, int n) {
+  int i;
+
+  if(!papers) return;
+
+  for(i=0; i<n; i++) {
+    gra_paper_free(papers[i]);
+  }
+  g_free(papers);
+}
+
+
+/* field functions */
+void
+gra_db_field_save(gra_db_t *db, gra_field_t *f, GError **error) {
+  field_write(db, f, NULL, error);
 }
 
 
@@ -422,11 +1841,8 @@ gra_db_field_delete(gra_db_t *db, gra_field_t *f, GError **error) {
   /* abort on previous error */
   if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "DELETE FROM \"Field\" WHERE \"ID\"=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
-  }
+  stmt = db_stmt(db, GRA_STMT_FIELD_DELETE, error);
+  if(!stmt) goto cleanup;
 
   /* bind and run the delete */
   sqlite3_bind_int(stmt, 1, f->id);
@@ -442,7 +1858,7 @@ gra_db_field_delete(gra_db_t *db, gra_field_t *f, GError **error) {
   f->changed = TRUE;
 
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return;
 }
 
@@ -451,6 +1867,7 @@ gra_db_field_delete(gra_db_t *db, gra_field_t *f, GError **error) {
 void
 gra_db_reference_save(gra_db_t *db, gra_reference_t *r, GError **error) {
   sqlite3_stmt *stmt = NULL;
+  gra_citation_change_t old = { -1, -1, FALSE };
   int rc;
 
   /* abort on previous error */
@@ -461,21 +1878,20 @@ gra_db_reference_save(gra_db_t *db, gra_reference_t *r, GError **error) {
     return;
 
   if(r->indb) {
-    /* prepare update */
-    rc = sqlite3_prepare_v2(db->db, "UPDATE \"Reference\" SET \"PaperID\"=?, \"RefPaperID\"=? WHERE \"ID\"=?", -1, &stmt, 0);
-    if(rc != SQLITE_OK) {
-      DB_ERROR(error);
+    /* the citation graph loses the citation being replaced */
+    if(db->citations && !cite_lookup(db, r->id, &old, error))
       goto cleanup;
-    }
-    rc = sqlite3_bind_int(stmt, 3, r->id);
+
+    /* update the changed columns, or all of them if none are marked */
+    stmt = update_stmt(db, db->refUpdates, "Reference", "rowid", refColumns,
+                       G_N_ELEMENTS(refColumns),
+                       r->dirty ? r->dirty : GRA_REFERENCE_ALL, error);
+    if(!stmt) goto cleanup;
+    sqlite3_bind_int(stmt, 3, r->id);
   } else {
     /* prepare insert */
-    rc = sqlite3_prepare_v2(db->db, "INSERT INTO \"Reference\" (\"PaperID\", \"RefPaperID\") VALUES(?, ?)", -1, &stmt, 0);
-  }
-
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
+    stmt = db_stmt(db, GRA_STMT_REF_INSERT, error);
+    if(!stmt) goto cleanup;
   }
 
   /* bind the colums and run */
@@ -494,12 +1910,17 @@ gra_db_reference_save(gra_db_t *db, gra_reference_t *r, GError **error) {
     r->indb = TRUE;
   }
 
+  if(old.paperId >= 0)
+    cite_note(db, old.paperId, old.refPaperId, FALSE);
+  cite_note(db, r->paperId, r->refPaperId, TRUE);
+
   /* the database is now current */
   r->changed = FALSE;
-  
+  r->dirty = 0;
+
 
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return;
 }
 
@@ -508,15 +1929,17 @@ void
 gra_db_reference_delete(gra_db_t *db, gra_reference_t *r, GError ** error) {
   int rc;
   sqlite3_stmt *stmt = NULL;
+  gra_citation_change_t old = { -1, -1, FALSE };
 
   /* abort on previous error */
   if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "DELETE FROM \"Reference\" WHERE \"ID\"=?", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    DB_ERROR(error);
-    goto cleanup;
-  }
+  /* the citation graph needs what is being deleted */
+  if(db->citations && !cite_lookup(db, r->id, &old, error))
+    return;
+
+  stmt = db_stmt(db, GRA_STMT_REF_DELETE, error);
+  if(!stmt) goto cleanup;
 
   /* bind and run the delete */
   sqlite3_bind_int(stmt, 1, r->id);
@@ -527,213 +1950,2938 @@ gra_db_reference_delete(gra_db_t *db, gra_reference_t *r, GError ** error) {
     goto cleanup;
   }
 
+  if(old.paperId >= 0)
+    cite_note(db, old.paperId, old.refPaperId, FALSE);
+
   /* this is no longer in the db, mark it as such */
   r->indb = FALSE;
   r->changed = TRUE;
 
   cleanup:
-  if(stmt) sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
   return;
 }
 
 
-/*-------------------------------
- * static methods
- *-------------------------------*/
+/* note functions */
 
-/* creates the database schema */
-static void
-create_schema(gra_db_t *db, GError **error) {
-  const gchar *script[] = {
-    "CREATE TABLE \"MetaInfo\" ("
-      " \"Version\" REAL NOT NULL,"
-      " \"Created\" INTEGER NOT NULL,"
-      " \"LastUpdate\" INTEGER"
-      " )",
-    "CREATE TABLE \"Paper\" ("
-      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
-      " \"FileName\" TEXT NOT NULL,"
-      " \"Contents\" BLOB,"
-      " \"PageCount\" INTEGER,"
-      " \"Read\" INTEGER NOT NULL,"
-      " \"Type\" TEXT NOT NULL,"
-      " \"Author\" TEXT NOT NULL,"
-      " \"Title\" TEXT NOT NULL,"
-      " \"Year\" INTEGER"
-      " )",
-    "CREATE TABLE \"Field\" ("
-      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
-      " \"PaperID\" INTEGER NOT NULL,"
-      " \"Name\" TEXT NOT NULL,"
-      " \"Value\" TEXT NOT NULL,"
-      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\")"
-      " )",
-    "CREATE TABLE \"Reference\" ("
-      " \"PaperID\" INTEGER NOT NULL,"
-      " \"RefPaperID\" INTEGER NOT NULL,"
-      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\"),"
-      " FOREIGN KEY (\"RefPaperID\") REFERENCES \"Paper\"(\"ID\"),"
-      " PRIMARY KEY (\"PaperID\", \"RefPaperID\")"
-      " )",
-    "CREATE TABLE \"Note\" ("
-      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
-      " \"PaperID\" INTEGER NOT NULL,"
-      " \"Page\" INTEGER NOT NULL,"
-      " \"LeftNote\" TEXT NOT NULL,"
-      " \"RightNote\" TEXT NOT NULL,"
-      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\")"
-      ")"       
-  };
-  int i;
-  int n = sizeof(script) / sizeof(script[0]);
-  sqlite3_stmt *stmt=NULL;
-  int rc;
+/* Write the changed notes of a paper, and only those, in one batch */
+void
+gra_db_paper_save_notes(gra_db_t *db, gra_paper_t *p, GError **error) {
+  gra_note_t *n, *saved;
+  GError *err = NULL;
+  guint i;
 
-  /* fail on prior errors */
+  /* abort on previous error */
   if(error && *error) return;
 
-  /* run all items in the script */
-  for(i=0; i<n; i++) {
-    rc = sqlite3_prepare_v2(db->db, script[i], -1, &stmt, 0);
-    if(rc != SQLITE_OK) {
-      g_set_error(error, GRA_DATA_ERROR, 1,
-                  "SQLite Error: %s", sqlite3_errmsg(db->db));
-      return;
+  /* nothing changed, or the paper itself is yet to be saved */
+  if(!p->indb || !p->notesDirty || !p->notesDirty->len)
+    return;
+
+  gra_db_batch_begin(db, &err);
+  if(err) {
+    g_propagate_error(error, err);
+    return;
+  }
+
+  /* remember how the notes stood, for a rollback */
+  saved = g_new(gra_note_t, p->notesDirty->len);
+
+  for(i=0; i < p->notesDirty->len && !err; i++) {
+    n = g_ptr_array_index(p->notesDirty, i);
+    saved[i] = *n;
+    n->paperId = p->id;
+
+    /* an emptied note goes away */
+    if(!*n->leftNote && !*n->rightNote) {
+      if(n->indb)
+        gra_db_note_delete(db, n, &err);
+      n->changed = FALSE;
+    } else {
+      gra_db_note_save(db, n, &err);
     }
+  }
 
-    /* run and destroy */
-    rc = sqlite3_step(stmt);
-    if(rc != SQLITE_DONE) {
-      g_set_error(error, GRA_DATA_ERROR, 1,
-                  "SQLite Error: %s", sqlite3_errmsg(db->db));
+  if(!err)
+    gra_db_batch_commit(db, &err);
 
-      goto cleanup;
+  if(err) {
+    gra_db_batch_rollback(db, NULL);
+    while(i--) {
+      n = g_ptr_array_index(p->notesDirty, i);
+      n->id = saved[i].id;
+      n->indb = saved[i].indb;
+      n->changed = TRUE;
     }
-    sqlite3_finalize(stmt);
+    g_free(saved);
+    g_propagate_error(error, err);
+    return;
   }
 
-  /* update the MetaInfo table */
-  rc = sqlite3_prepare_v2(db->db,
-                          "INSERT INTO MetaInfo (\"Version\", \"Created\")"
-                          " VALUES(?, ?)",
-                          -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
+  g_free(saved);
+  g_ptr_array_set_size(p->notesDirty, 0);
+}
 
-    goto cleanup;
+
+void
+gra_db_note_save(gra_db_t *db, gra_note_t *n, GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  /* do not save unchanged notes */
+  if(!n->changed)
+    return;
+
+  if(n->indb) {
+    /* prepare update */
+    stmt = db_stmt(db, GRA_STMT_NOTE_UPDATE, error);
+    if(!stmt) goto cleanup;
+    sqlite3_bind_int(stmt, 5, n->id);
+  } else {
+    /* prepare insert */
+    stmt = db_stmt(db, GRA_STMT_NOTE_INSERT, error);
+    if(!stmt) goto cleanup;
   }
-  sqlite3_bind_double(stmt, 1, GRA_DB_VERSION);
-  sqlite3_bind_int(stmt, 2, time(0));
-  
+
+  /* bind the columns and run */
+  sqlite3_bind_int(stmt, 1, n->paperId);
+  sqlite3_bind_int(stmt, 2, n->page);
+  bind_text(stmt, 3, n->leftNote ? n->leftNote : "");
+  bind_text(stmt, 4, n->rightNote ? n->rightNote : "");
   rc = sqlite3_step(stmt);
-  if(rc != SQLITE_DONE) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
 
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
     goto cleanup;
   }
 
-  /* it's been changed! */
-  db->changed = TRUE;
-  
-  cleanup:  
-  if(stmt) sqlite3_finalize(stmt);
+  /* handle new rows properly */
+  if(!n->indb) {
+    n->id = sqlite3_last_insert_rowid(db->db);
+    n->indb = TRUE;
+  }
+
+  /* the database is now current */
+  n->changed = FALSE;
+
+  cleanup:
+  if(stmt) sqlite3_reset(stmt);
+  return;
 }
 
 
-/* Check to see if the schema is present */
-static gboolean
-has_schema(gra_db_t *db, GError **error) {
+void
+gra_db_note_delete(gra_db_t *db, gra_note_t *n, GError **error) {
   int rc;
-  sqlite3_stmt *stmt=NULL;
-  const unsigned char *name;
-  gboolean result = FALSE;
+  sqlite3_stmt *stmt = NULL;
 
-  /* fail on prior errors */
-  if(error && *error) return FALSE;
+  /* abort on previous error */
+  if(error && *error) return;
 
-  rc = sqlite3_prepare_v2(db->db, "SELECT \"NAME\" FROM \"SQLITE_MASTER\"", -1, &stmt, 0);
-  if(rc !=SQLITE_OK) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
+  stmt = db_stmt(db, GRA_STMT_NOTE_DELETE, error);
+  if(!stmt) goto cleanup;
 
+  /* bind and run the delete */
+  sqlite3_bind_int(stmt, 1, n->id);
+  rc = sqlite3_step(stmt);
+
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
     goto cleanup;
   }
 
-  while(sqlite3_step(stmt) == SQLITE_ROW) {
-    name = sqlite3_column_text(stmt, 0);
-    if(g_strcmp0((gchar*)name, "MetaInfo")) {
-      result = TRUE;
-      break;
-    }
-  }
-  
+  /* this is no longer in the db, mark it as such */
+  n->indb = FALSE;
+  n->changed = TRUE;
+
   cleanup:
-  sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
+  return;
+}
 
-  return result;
+
+/* contents functions */
+void
+gra_db_set_mmap_size(gra_db_t *db, gint64 bytes, GError **error) {
+  gchar *sql;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  sql = g_strdup_printf("PRAGMA mmap_size=%" G_GINT64_FORMAT, bytes);
+  if(sqlite3_exec(db->db, sql, NULL, NULL, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+  } else {
+    db->mmapSize = bytes;
+  }
+  g_free(sql);
 }
 
 
-/* Check to see if we are at current schema version */
-static gboolean
-has_schema_version(gra_db_t *db, GError **error) {
-  int rc;
-  sqlite3_stmt *stmt=NULL;
-  gboolean result = FALSE;
+void
+gra_db_set_external_threshold(gra_db_t *db, gsize bytes) {
+  db->externalThreshold = bytes;
+}
 
-  /* fail on prior errors */
-  if(error && *error) return FALSE;
 
-  rc = sqlite3_prepare_v2(db->db, "SELECT \"Version\" FROM \"MetaInfo\"", -1, &stmt, 0);
-  if(rc != SQLITE_OK) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
+gra_contents_t *
+gra_db_paper_contents_open(gra_db_t *db, int paperId, gboolean writable,
+                           GError **error) {
+  gra_contents_t *c = NULL;
+  sqlite3_stmt *stmt = NULL;
+  int rc, docId;
 
-    return FALSE;
-  }
+  /* abort on previous error */
+  if(error && *error) return NULL;
 
-  rc = sqlite3_step(stmt);
-  if(rc != SQLITE_ROW) {
-    g_set_error(error, GRA_DATA_ERROR, 1,
-                "SQLite Error: %s", sqlite3_errmsg(db->db));
+  /* writers keep the lock until they close */
+  if(writable)
+    gra_db_lock(db);
 
+  /* writers get the staged contents, readers the document */
+  stmt = db_stmt(db, writable ? GRA_STMT_STAGE_SIZE : GRA_STMT_CONTENTS_DOC, error);
+  if(!stmt) goto cleanup;
+
+  sqlite3_bind_int(stmt, 1, paperId);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_DONE) {
+    if(writable)
+      g_set_error(error, GRA_DATA_ERROR, 4, "No contents staged for paper %d.", paperId);
+    else
+      g_set_error(error, GRA_DATA_ERROR, 1, "No paper with ID %d.", paperId);
+    goto cleanup;
+  } else if(rc != SQLITE_ROW) {
+    DB_ERROR(error);
     goto cleanup;
   }
 
-  if(sqlite3_column_double(stmt, 0) == GRA_DB_VERSION) {
-    result = TRUE;
+  c = g_malloc0(sizeof(gra_contents_t));
+  c->db = db;
+  c->paperId = paperId;
+  c->writable = writable;
+
+  if(writable) {
+    c->size = sqlite3_column_int64(stmt, 0);
+    if(sqlite3_blob_open(db->db, "main", "DocumentStage", "Contents", paperId,
+                         TRUE, &c->blob) != SQLITE_OK) {
+      DB_ERROR(error);
+      g_free(c);
+      c = NULL;
+    }
+  } else {
+    /* a paper without contents has nothing to open */
+    docId = sqlite3_column_int(stmt, 0);
+    c->size = sqlite3_column_int64(stmt, 1);
+    if(docId && !document_open(db, c, docId, sqlite3_column_int(stmt, 2),
+                               (gchar*) sqlite3_column_text(stmt, 3), error)) {
+      g_free(c);
+      c = NULL;
+    }
   }
 
   cleanup:
-  sqlite3_finalize(stmt);
+  if(stmt) sqlite3_reset(stmt);
+  if(!c && writable)
+    gra_db_unlock(db);
+  return c;
+}
 
-  return result;
+
+gra_contents_t *
+gra_db_document_open(gra_db_t *db, int documentId, GError **error) {
+  gra_contents_t *c = NULL;
+  sqlite3_stmt *stmt;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  stmt = db_stmt(db, GRA_STMT_DOC_INFO, error);
+  if(!stmt) return NULL;
+
+  sqlite3_bind_int(stmt, 1, documentId);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_DONE) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No document with ID %d.", documentId);
+  } else if(rc != SQLITE_ROW) {
+    DB_ERROR(error);
+  } else {
+    c = g_malloc0(sizeof(gra_contents_t));
+    c->db = db;
+    c->size = sqlite3_column_int64(stmt, 3);
+    if(!document_open(db, c, documentId, sqlite3_column_int(stmt, 1),
+                      (gchar*) sqlite3_column_text(stmt, 2), error)) {
+      g_free(c);
+      c = NULL;
+    }
+  }
+  sqlite3_reset(stmt);
+
+  return c;
 }
 
 
-/* bring schema up to date with current schema */
-static void
-schema_upgrade(gra_db_t *db, GError **error) {
-  /* TODO: When upgrade is available, write this function! */
-  
-  /* fail on prior errors */
+gsize
+gra_db_paper_contents_size(gra_contents_t *c) {
+  return c->size;
+}
+
+
+gssize
+gra_db_paper_contents_read(gra_contents_t *c, gpointer buf, gsize len,
+                           gsize offset, GError **error) {
+  gra_db_t *db = c->db;
+
+  /* abort on previous error */
+  if(error && *error) return -1;
+
+  /* stop at the end */
+  if(offset >= c->size)
+    return 0;
+  if(len > c->size - offset)
+    len = c->size - offset;
+
+  if(c->map) {
+    memcpy(buf, g_mapped_file_get_contents(c->map) + offset, len);
+  } else if(sqlite3_blob_read(c->blob, buf, len, offset) != SQLITE_OK) {
+    DB_ERROR(error);
+    return -1;
+  }
+
+  return len;
+}
+
+
+gconstpointer
+gra_db_paper_contents_map(gra_contents_t *c) {
+  return c->map ? g_mapped_file_get_contents(c->map) : NULL;
+}
+
+
+void
+gra_db_paper_contents_write(gra_contents_t *c, gconstpointer buf, gsize len,
+                            gsize offset, GError **error) {
+  gra_db_t *db = c->db;
+
+  /* abort on previous error */
   if(error && *error) return;
 
+  if(!c->writable) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Contents not opened for writing.");
+    return;
+  }
+  if(offset > c->size || len > c->size - offset) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Write past the end of the contents.");
+    return;
+  }
+  if(!len)
+    return;
+
+  if(sqlite3_blob_write(c->blob, buf, len, offset) != SQLITE_OK) {
+    DB_ERROR(error);
+    return;
+  }
 }
 
 
-static gint
-fieldcmp(gconstpointer a, gconstpointer b) {
-  return g_strcmp0((gchar*) a, (gchar*) b);
+void
+gra_db_paper_contents_commit(gra_contents_t *c, GError **error) {
+  gra_db_t *db = c->db;
+  sqlite3_blob *stage = NULL;
+  gchar *hash = NULL;
+  int docId;
+  GError *err = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  if(!c->writable) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Contents not opened for writing.");
+    return;
+  }
+
+  /* An open writable blob counts as a write in progress, which
+     would keep the batch from opening a savepoint; read the staged
+     bytes through a read-only one instead. */
+  sqlite3_blob_close(c->blob);
+  c->blob = NULL;
+
+  gra_db_batch_begin(db, &err);
+  if(err) {
+    g_propagate_error(error, err);
+    return;
+  }
+
+  if(c->size && sqlite3_blob_open(db->db, "main", "DocumentStage", "Contents",
+                                  c->paperId, FALSE, &stage) != SQLITE_OK) {
+    DB_ERROR(&err);
+  }
+
+  /* store the staged bytes once, under their hash */
+  hash = hash_contents(db, NULL, stage, c->size, &err);
+  docId = document_find(db, hash, &err);
+  if(!docId && !err)
+    docId = document_store(db, hash, c->size, NULL, stage, &err);
+  sqlite3_blob_close(stage);
+  document_link(db, c->paperId, docId, &err);
+
+  /* the stage goes, leaving the handle nothing to write */
+  c->size = 0;
+  contents_unstage(db, c->paperId, &err);
+
+  gra_db_batch_commit(db, &err);
+  if(err) {
+    gra_db_batch_rollback(db, NULL);
+    g_propagate_error(error, err);
+  }
+  g_free(hash);
 }
 
 
-static gboolean
-fieldSaveVisit(gpointer key, gpointer value, gpointer data) {
-  /* TODO: Need error reporting mecahnism for this phase.  Danger! */
-  gra_db_field_save((gra_db_t*) data, (gra_field_t *) value, NULL);
+void
+gra_db_paper_contents_close(gra_contents_t *c) {
+  if(!c) return;
+
+  sqlite3_blob_close(c->blob);
+  if(c->map)
+    g_mapped_file_unref(c->map);
+  if(c->writable)
+    gra_db_unlock(c->db);
+  g_free(c);
+}
+
+
+void
+gra_db_paper_contents_create(gra_db_t *db, int paperId, gsize size,
+                             GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  GError *err = NULL;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  if(size > G_MAXINT) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Contents of %" G_GSIZE_FORMAT
+                " bytes are too large.", size);
+    return;
+  }
+
+  /* the paper must exist */
+  stmt = db_stmt(db, GRA_STMT_CONTENTS_DOC, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, paperId);
+  rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if(rc == SQLITE_DONE) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No paper with ID %d.", paperId);
+    return;
+  } else if(rc != SQLITE_ROW) {
+    DB_ERROR(error);
+    return;
+  }
+
+  /* empty contents are no contents */
+  if(!size) {
+    gra_db_batch_begin(db, &err);
+    if(err) {
+      g_propagate_error(error, err);
+      return;
+    }
+    contents_unstage(db, paperId, &err);
+    document_link(db, paperId, 0, &err);
+    gra_db_batch_commit(db, &err);
+    if(err) {
+      gra_db_batch_rollback(db, NULL);
+      g_propagate_error(error, err);
+    }
+    return;
+  }
+
+  stmt = db_stmt(db, GRA_STMT_STAGE_CREATE, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, paperId);
+  sqlite3_bind_int64(stmt, 2, size);
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+}
+
+
+void
+gra_db_paper_contents_import(gra_db_t *db, int paperId, const gchar *filename,
+                             GError **error) {
+  FILE *in;
+  gchar *hash = NULL;
+  int docId;
+  long size;
+  GError *err = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  in = fopen(filename, "rb");
+  if(!in || fseek(in, 0, SEEK_END) || (size = ftell(in)) < 0 ||
+     fseek(in, 0, SEEK_SET)) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s", filename, g_strerror(errno));
+    if(in) fclose(in);
+    return;
+  }
+
+  /* a file we already have costs one read to hash it */
+  hash = hash_contents(db, in, NULL, size, &err);
+  if(!err && fseek(in, 0, SEEK_SET))
+    g_set_error(&err, GRA_DATA_ERROR, 4, "%s: %s", filename, g_strerror(errno));
+  if(err) {
+    g_prefix_error(&err, "%s: ", filename);
+    goto cleanup;
+  }
+
+  gra_db_batch_begin(db, &err);
+  if(err) goto cleanup;
+
+  docId = document_find(db, hash, &err);
+  if(!docId && !err)
+    docId = document_store(db, hash, size, in, NULL, &err);
+  document_link(db, paperId, docId, &err);
+
+  gra_db_batch_commit(db, &err);
+  if(err)
+    gra_db_batch_rollback(db, NULL);
+
+  cleanup:
+  if(err)
+    g_propagate_error(error, err);
+  g_free(hash);
+  fclose(in);
+}
+
+
+/* search functions */
+GList *
+gra_db_search_keyword(gra_db_t *db, const gchar *keyword,
+                      int limit, int offset, GError **error) {
+  return search(db, GRA_STMT_SEARCH, NULL, keyword, limit, offset, error);
+}
+
+
+GList *
+gra_db_search_title(gra_db_t *db, const gchar *title,
+                    int limit, int offset, GError **error) {
+  return search(db, GRA_STMT_SEARCH, "Title", title, limit, offset, error);
+}
+
+
+/* Authors are looked up by the start of their key, which is the
+   surname and a comma, then any given names typed */
+GList *
+gra_db_search_author(gra_db_t *db, const gchar *author,
+                     int limit, int offset, GError **error) {
+  sqlite3_stmt *stmt;
+  GList *result = NULL;
+  gchar *key;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  /* nothing to look for */
+  key = author_key(author);
+  if(!key) return NULL;
+
+  stmt = db_stmt(db, GRA_STMT_AUTHOR_SEARCH, error);
+  if(!stmt) goto cleanup;
+
+  bind_prefix(stmt, key);
+  sqlite3_bind_int(stmt, 3, limit < 0 ? -1 : limit);
+  sqlite3_bind_int(stmt, 4, offset < 0 ? 0 : offset);
+
+  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    result = g_list_prepend(result, gra_db_paper_from_row(stmt, NULL));
+  }
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    g_list_free_full(result, (GDestroyNotify) gra_paper_free);
+    result = NULL;
+  }
+  result = g_list_reverse(result);
+  sqlite3_reset(stmt);
+
+  cleanup:
+  g_free(key);
+  return result;
+}
+
+
+GList *
+gra_db_search_body(gra_db_t *db, const gchar *text,
+                   int limit, int offset, GError **error) {
+  return search(db, GRA_STMT_SEARCH_BODY, NULL, text, limit, offset, error);
+}
+
+
+GList *
+gra_db_author_complete(gra_db_t *db, const gchar *text, int limit,
+                       GError **error) {
+  sqlite3_stmt *stmt;
+  GList *result = NULL;
+  gra_author_t *a;
+  gchar *prefix;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  /* typed text is folded as names are, but not reordered */
+  prefix = author_fold(text);
+  if(!prefix || !*prefix) goto cleanup;
+
+  stmt = db_stmt(db, GRA_STMT_AUTHOR_COMPLETE, error);
+  if(!stmt) goto cleanup;
+
+  bind_prefix(stmt, prefix);
+  sqlite3_bind_int(stmt, 3, limit < 0 ? -1 : limit);
+
+  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    a = g_new(gra_author_t, 1);
+    a->id = sqlite3_column_int(stmt, 0);
+    a->name = g_strdup((gchar*) sqlite3_column_text(stmt, 1));
+    a->paperCount = sqlite3_column_int(stmt, 2);
+    result = g_list_prepend(result, a);
+  }
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    g_list_free_full(result, (GDestroyNotify) gra_author_free);
+    result = NULL;
+  }
+  result = g_list_reverse(result);
+  sqlite3_reset(stmt);
+
+  cleanup:
+  g_free(prefix);
+  return result;
+}
+
+
+void
+gra_db_author_stats(gra_db_t *db, int authorId, gra_author_stats_t *stats,
+                    GError **error) {
+  sqlite3_stmt *stmt;
+
+  memset(stats, 0, sizeof(*stats));
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, GRA_STMT_AUTHOR_STATS, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, authorId);
+  if(sqlite3_step(stmt) == SQLITE_ROW) {
+    stats->papers = sqlite3_column_int(stmt, 0);
+    stats->firstYear = sqlite3_column_int(stmt, 1);
+    stats->lastYear = sqlite3_column_int(stmt, 2);
+    stats->citations = sqlite3_column_int(stmt, 3);
+    stats->coauthors = sqlite3_column_int(stmt, 4);
+  } else {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+}
+
+
+void
+gra_author_free(gra_author_t *a) {
+  if(!a) return;
+
+  g_free(a->name);
+  g_free(a);
+}
+
+
+/*-------------------------------
+ * static methods
+ *-------------------------------*/
+
+/* creates the database schema */
+static void
+create_schema(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TABLE \"MetaInfo\" ("
+      " \"Version\" REAL NOT NULL,"
+      " \"Created\" INTEGER NOT NULL,"
+      " \"LastUpdate\" INTEGER"
+      " )",
+    "CREATE TABLE \"Paper\" ("
+      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
+      " \"FileName\" TEXT NOT NULL,"
+      " \"Contents\" BLOB,"
+      " \"PageCount\" INTEGER,"
+      " \"Read\" INTEGER NOT NULL,"
+      " \"Type\" TEXT NOT NULL,"
+      " \"Author\" TEXT NOT NULL,"
+      " \"Title\" TEXT NOT NULL,"
+      " \"Year\" INTEGER"
+      " )",
+    "CREATE TABLE \"Field\" ("
+      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
+      " \"PaperID\" INTEGER NOT NULL,"
+      " \"Name\" TEXT NOT NULL,"
+      " \"Value\" TEXT NOT NULL,"
+      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\")"
+      " )",
+    "CREATE TABLE \"Reference\" ("
+      " \"PaperID\" INTEGER NOT NULL,"
+      " \"RefPaperID\" INTEGER NOT NULL,"
+      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\"),"
+      " FOREIGN KEY (\"RefPaperID\") REFERENCES \"Paper\"(\"ID\"),"
+      " PRIMARY KEY (\"PaperID\", \"RefPaperID\")"
+      " )",
+    "CREATE TABLE \"Note\" ("
+      " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
+      " \"PaperID\" INTEGER NOT NULL,"
+      " \"Page\" INTEGER NOT NULL,"
+      " \"LeftNote\" TEXT NOT NULL,"
+      " \"RightNote\" TEXT NOT NULL,"
+      " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\")"
+      ")"       
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+  sqlite3_stmt *stmt=NULL;
+  int rc;
+
+  /* fail on prior errors */
+  if(error && *error) return;
+
+  /* run all items in the script */
+  run_script(db, script, n, error);
+  if(error && *error) return;
+
+  /* update the MetaInfo table */
+  rc = sqlite3_prepare_v2(db->db,
+                          "INSERT INTO MetaInfo (\"Version\", \"Created\")"
+                          " VALUES(?, ?)",
+                          -1, &stmt, 0);
+  if(rc != SQLITE_OK) {
+    g_set_error(error, GRA_DATA_ERROR, 1,
+                "SQLite Error: %s", sqlite3_errmsg(db->db));
+
+    goto cleanup;
+  }
+  /* this is the 1.0 schema; gra_db_upgrade takes it from here */
+  sqlite3_bind_double(stmt, 1, 1.0);
+  sqlite3_bind_int(stmt, 2, time(0));
+  
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE) {
+    g_set_error(error, GRA_DATA_ERROR, 1,
+                "SQLite Error: %s", sqlite3_errmsg(db->db));
+
+    goto cleanup;
+  }
+
+  /* it's been changed! */
+  db->changed = TRUE;
+  
+  cleanup:  
+  if(stmt) sqlite3_finalize(stmt);
+}
+
+
+/* Check to see if the schema is present */
+static gboolean
+has_schema(gra_db_t *db, GError **error) {
+  return has_table(db, "MetaInfo", error);
+}
+
+
+/* Read the version and timestamps from MetaInfo */
+static void
+read_meta_info(gra_db_t *db, GError **error) {
+  int rc;
+  sqlite3_stmt *stmt=NULL;
+
+  /* fail on prior errors */
+  if(error && *error) return;
+
+  rc = sqlite3_prepare_v2(db->db, "SELECT \"Version\", \"Created\", \"LastUpdate\" FROM \"MetaInfo\"", -1, &stmt, 0);
+  if(rc != SQLITE_OK) {
+    DB_ERROR(error);
+    return;
+  }
+
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_ROW) {
+    if(rc == SQLITE_DONE)
+      g_set_error(error, GRA_DATA_ERROR, 5, "MetaInfo is empty.");
+    else
+      DB_ERROR(error);
+    goto cleanup;
+  }
+
+  db->version = sqlite3_column_double(stmt, 0);
+  db->created = sqlite3_column_int(stmt, 1);
+  db->lastUpdate = sqlite3_column_int(stmt, 2);
+
+  cleanup:
+  sqlite3_finalize(stmt);
+}
+
+
+/* Record the schema version reached by an upgrade step */
+static void
+set_schema_version(gra_db_t *db, double version, GError **error) {
+  sqlite3_stmt *stmt=NULL;
+
+  /* fail on prior errors */
+  if(error && *error) return;
+
+  if(sqlite3_prepare_v2(db->db, "UPDATE \"MetaInfo\" SET \"Version\"=?", -1, &stmt, 0) != SQLITE_OK) {
+    DB_ERROR(error);
+    return;
+  }
+  sqlite3_bind_double(stmt, 1, version);
+  if(sqlite3_step(stmt) != SQLITE_DONE)
+    DB_ERROR(error);
+  sqlite3_finalize(stmt);
+}
+
+
+/* Progress handler for gra_db_upgrade.  Returning non-zero interrupts
+   the running statement. */
+static int
+upgrade_tick(void *data) {
+  upgrade_ctx *ctx = data;
+
+  if(!ctx->progress(ctx->description, ctx->step, ctx->steps, ctx->data))
+    ctx->cancelled = TRUE;
+
+  return ctx->cancelled;
+}
+
+
+/* 1.1: PaperID lookups on Field and Note, and "cited by" lookups on
+   Reference, no longer scan the whole table */
+static void
+upgrade_paper_indexes(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE INDEX IF NOT EXISTS \"FieldPaper\" ON \"Field\"(\"PaperID\")",
+    "CREATE INDEX IF NOT EXISTS \"NotePaper\" ON \"Note\"(\"PaperID\")",
+    "CREATE INDEX IF NOT EXISTS \"ReferenceRefPaper\" ON \"Reference\"(\"RefPaperID\")"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* 2.0: the full-text index.  Files which already have one may still
+   carry the insert triggers it started out with; inserts are now
+   indexed by the save functions. */
+static void
+upgrade_text_index(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "DROP TRIGGER IF EXISTS \"PaperTextInsert\"",
+    "DROP TRIGGER IF EXISTS \"FieldTextInsert\""
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  if(has_table(db, "PaperText", error))
+    run_script(db, script, n, error);
+  else
+    create_search_index(db, error);
+}
+
+
+/* 2.1: contents get a table of their own.  Paper rows stay small, so
+   saving a paper no longer rewrites its PDF, and with the blob in the
+   last column a zeroblob() is written out without being allocated. */
+static void
+upgrade_contents_table(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TABLE \"PaperContents\" ("
+    " \"PaperID\" INTEGER PRIMARY KEY,"
+    " \"Contents\" BLOB NOT NULL,"
+    " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\"))",
+    "INSERT INTO \"PaperContents\" SELECT \"ID\", \"Contents\" FROM \"Paper\""
+    " WHERE length(\"Contents\") > 0",
+    "UPDATE \"Paper\" SET \"Contents\"=NULL WHERE \"Contents\" IS NOT NULL",
+    "CREATE TRIGGER \"PaperContentsDelete\" AFTER DELETE ON \"Paper\""
+    " BEGIN DELETE FROM \"PaperContents\" WHERE \"PaperID\"=old.\"ID\"; END"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* 2.2: contents become documents, stored once per distinct hash and
+   shared by the papers which have them.  The bytes sit in a table of
+   their own, so counting references never rewrites them.  Writers
+   stage their bytes in DocumentStage until they commit. */
+static void
+upgrade_document_store(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TABLE \"Document\" ("
+    " \"ID\" INTEGER PRIMARY KEY,"
+    " \"Hash\" TEXT NOT NULL UNIQUE,"
+    " \"Size\" INTEGER NOT NULL,"
+    " \"RefCount\" INTEGER NOT NULL,"
+    " \"External\" INTEGER NOT NULL DEFAULT 0)",
+    "CREATE TABLE \"DocumentContents\" ("
+    " \"DocumentID\" INTEGER PRIMARY KEY,"
+    " \"Contents\" BLOB NOT NULL,"
+    " FOREIGN KEY (\"DocumentID\") REFERENCES \"Document\"(\"ID\"))",
+    "CREATE TRIGGER \"DocumentContentsDelete\" AFTER DELETE ON \"Document\""
+    " BEGIN DELETE FROM \"DocumentContents\" WHERE \"DocumentID\"=old.\"ID\"; END",
+    "ALTER TABLE \"Paper\" ADD COLUMN \"DocumentID\" INTEGER REFERENCES \"Document\"(\"ID\")",
+    "CREATE TABLE \"DocumentStage\" ("
+    " \"PaperID\" INTEGER PRIMARY KEY,"
+    " \"Contents\" BLOB NOT NULL,"
+    " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\"))",
+    "CREATE TRIGGER \"DocumentStageDelete\" AFTER DELETE ON \"Paper\""
+    " BEGIN DELETE FROM \"DocumentStage\" WHERE \"PaperID\"=old.\"ID\"; END"
+  };
+  const gchar *drop[] = {
+    "DROP TRIGGER \"PaperContentsDelete\"",
+    "DROP TABLE \"PaperContents\""
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+  sqlite3_stmt *rows = NULL, *add = NULL, *copy = NULL;
+  sqlite3_blob *blob = NULL;
+  gchar *hash = NULL;
+  gsize size;
+  int rc, paperId, docId;
+
+  run_script(db, script, n, error);
+  if(error && *error) return;
+
+  /* hash what is there, keeping one copy of each */
+  if(sqlite3_prepare_v2(db->db, "SELECT \"PaperID\", length(\"Contents\")"
+                        " FROM \"PaperContents\"", -1, &rows, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, "INSERT INTO \"Document\" (\"Hash\", \"Size\", \"RefCount\")"
+                        " VALUES(?, ?, 0)", -1, &add, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, "INSERT INTO \"DocumentContents\" (\"DocumentID\", \"Contents\")"
+                        " SELECT ?, \"Contents\" FROM \"PaperContents\" WHERE \"PaperID\"=?",
+                        -1, &copy, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    goto cleanup;
+  }
+
+  while(!(error && *error) && (rc = sqlite3_step(rows)) == SQLITE_ROW) {
+    paperId = sqlite3_column_int(rows, 0);
+    if(sqlite3_blob_open(db->db, "main", "PaperContents", "Contents", paperId,
+                         FALSE, &blob) != SQLITE_OK) {
+      DB_ERROR(error);
+      break;
+    }
+    size = sqlite3_column_int64(rows, 1);
+    hash = hash_contents(db, NULL, blob, size, error);
+    sqlite3_blob_close(blob);
+
+    docId = document_find(db, hash, error);
+    if(!docId && !(error && *error)) {
+      /* the blob moves across whole, without passing through here */
+      sqlite3_bind_text(add, 1, hash, -1, SQLITE_STATIC);
+      sqlite3_bind_int64(add, 2, size);
+      if(sqlite3_step(add) != SQLITE_DONE)
+        DB_ERROR(error);
+      sqlite3_reset(add);
+      docId = sqlite3_last_insert_rowid(db->db);
+
+      sqlite3_bind_int(copy, 1, docId);
+      sqlite3_bind_int(copy, 2, paperId);
+      if(!(error && *error) && sqlite3_step(copy) != SQLITE_DONE)
+        DB_ERROR(error);
+      sqlite3_reset(copy);
+    }
+    document_link(db, paperId, docId, error);
+
+    g_free(hash);
+    hash = NULL;
+  }
+  if(!(error && *error) && rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+
+  cleanup:
+  sqlite3_finalize(rows);
+  sqlite3_finalize(add);
+  sqlite3_finalize(copy);
+  run_script(db, drop, sizeof(drop) / sizeof(drop[0]), error);
+}
+
+
+/* 2.3: an index over the text of each page of each document, filled
+   in the background by the indexer.  A page's rowid is its document
+   ID shifted left 16 bits plus the page number, so the pages of a
+   document are one rowid range.  DocumentIndex records which
+   extractor version did each document and how many pages it has
+   written.  The prefix index keeps search as you type quick, since
+   the last word of a query is matched as a prefix. */
+static void
+upgrade_document_text(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE VIRTUAL TABLE \"DocumentText\" USING fts5("
+    " \"Body\", tokenize='unicode61 remove_diacritics 2', prefix='2 3')",
+    "CREATE TABLE \"DocumentIndex\" ("
+    " \"DocumentID\" INTEGER PRIMARY KEY,"
+    " \"Version\" INTEGER NOT NULL,"
+    " \"Pages\" INTEGER NOT NULL,"
+    " \"Done\" INTEGER NOT NULL,"
+    " \"Error\" TEXT,"
+    " FOREIGN KEY (\"DocumentID\") REFERENCES \"Document\"(\"ID\"))",
+    "CREATE TRIGGER \"DocumentTextDelete\" AFTER DELETE ON \"Document\" BEGIN"
+    " DELETE FROM \"DocumentText\" WHERE \"rowid\" BETWEEN old.\"ID\" * 65536 AND old.\"ID\" * 65536 + 65535;"
+    " DELETE FROM \"DocumentIndex\" WHERE \"DocumentID\"=old.\"ID\";"
+    " END",
+    "CREATE INDEX \"PaperDocument\" ON \"Paper\"(\"DocumentID\")"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* 2.4: notes are loaded a page range at a time, so they are indexed
+   by page within their paper.  Nothing ever wrote notes before, but
+   should a page have more than one, their text is merged into the
+   oldest so the index can be unique. */
+static void
+upgrade_note_pages(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TEMP TABLE \"NoteMerge\" AS"
+    " SELECT min(\"ID\") AS \"ID\","
+    "  (SELECT group_concat(\"LeftNote\", char(10)) FROM"
+    "   (SELECT \"LeftNote\" FROM \"Note\" n WHERE n.\"PaperID\"=m.\"PaperID\" AND n.\"Page\"=m.\"Page\""
+    "    AND n.\"LeftNote\"<>'' ORDER BY n.\"ID\")) AS \"LeftNote\","
+    "  (SELECT group_concat(\"RightNote\", char(10)) FROM"
+    "   (SELECT \"RightNote\" FROM \"Note\" n WHERE n.\"PaperID\"=m.\"PaperID\" AND n.\"Page\"=m.\"Page\""
+    "    AND n.\"RightNote\"<>'' ORDER BY n.\"ID\")) AS \"RightNote\""
+    " FROM \"Note\" m GROUP BY \"PaperID\", \"Page\" HAVING count(*) > 1",
+    "UPDATE \"Note\" SET"
+    " \"LeftNote\"=(SELECT COALESCE(\"LeftNote\", '') FROM temp.\"NoteMerge\" t WHERE t.\"ID\"=\"Note\".\"ID\"),"
+    " \"RightNote\"=(SELECT COALESCE(\"RightNote\", '') FROM temp.\"NoteMerge\" t WHERE t.\"ID\"=\"Note\".\"ID\")"
+    " WHERE \"ID\" IN (SELECT \"ID\" FROM temp.\"NoteMerge\")",
+    "DELETE FROM \"Note\" WHERE \"ID\" NOT IN (SELECT min(\"ID\") FROM \"Note\" GROUP BY \"PaperID\", \"Page\")",
+    "DROP TABLE temp.\"NoteMerge\"",
+    "CREATE UNIQUE INDEX \"NotePage\" ON \"Note\"(\"PaperID\", \"Page\")",
+    "DROP INDEX IF EXISTS \"NotePaper\""
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* 2.5: the library is browsed in title, author or year order, a
+   page at a time.  The index expressions match the sort keys of the
+   browse statements exactly, or SQLite would not use them. */
+static void
+upgrade_browse_indexes(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE INDEX \"PaperTitle\" ON \"Paper\"(\"Title\" COLLATE NOCASE)",
+    "CREATE INDEX \"PaperAuthor\" ON \"Paper\"(\"Author\" COLLATE NOCASE)",
+    "CREATE INDEX \"PaperYear\" ON \"Paper\"(IFNULL(\"Year\", 0))"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* 2.6: the author lists are split into one row per author, found by
+   a normalized key, and linked to their papers in order.  The key
+   index serves both exact lookups and completion by prefix.  Triggers
+   keep each author's paper count, and authors left with none are
+   dropped by the statements which unlink them. */
+static void
+upgrade_authors(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TABLE \"Author\" ("
+    " \"ID\" INTEGER PRIMARY KEY AUTOINCREMENT,"
+    " \"Name\" TEXT NOT NULL,"
+    " \"Key\" TEXT NOT NULL,"
+    " \"PaperCount\" INTEGER NOT NULL DEFAULT 0)",
+    "CREATE UNIQUE INDEX \"AuthorKey\" ON \"Author\"(\"Key\")",
+    "CREATE INDEX \"AuthorUnused\" ON \"Author\"(\"ID\") WHERE \"PaperCount\"=0",
+    "CREATE TABLE \"Authorship\" ("
+    " \"PaperID\" INTEGER NOT NULL,"
+    " \"Position\" INTEGER NOT NULL,"
+    " \"AuthorID\" INTEGER NOT NULL,"
+    " FOREIGN KEY (\"PaperID\") REFERENCES \"Paper\"(\"ID\"),"
+    " FOREIGN KEY (\"AuthorID\") REFERENCES \"Author\"(\"ID\"),"
+    " PRIMARY KEY (\"PaperID\", \"Position\"))",
+    "CREATE INDEX \"AuthorPaper\" ON \"Authorship\"(\"AuthorID\", \"Position\", \"PaperID\")",
+    "CREATE TRIGGER \"AuthorshipInsert\" AFTER INSERT ON \"Authorship\" BEGIN"
+    " UPDATE \"Author\" SET \"PaperCount\"=\"PaperCount\"+1 WHERE \"ID\"=new.\"AuthorID\";"
+    " END",
+    "CREATE TRIGGER \"AuthorshipDelete\" AFTER DELETE ON \"Authorship\" BEGIN"
+    " UPDATE \"Author\" SET \"PaperCount\"=\"PaperCount\"-1 WHERE \"ID\"=old.\"AuthorID\";"
+    " END"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+  sqlite3_stmt *rows = NULL;
+  int rc;
+
+  run_script(db, script, n, error);
+  if(error && *error) return;
+
+  if(sqlite3_prepare_v2(db->db, "SELECT \"ID\", \"Author\" FROM \"Paper\"",
+                        -1, &rows, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    return;
+  }
+  while(!(error && *error) && (rc = sqlite3_step(rows)) == SQLITE_ROW) {
+    author_link(db, sqlite3_column_int(rows, 0),
+                (const gchar *) sqlite3_column_text(rows, 1), FALSE, error);
+  }
+  if(!(error && *error) && rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_finalize(rows);
+}
+
+
+/* Check to see if a table exists */
+static gboolean
+has_table(gra_db_t *db, const gchar *name, GError **error) {
+  int rc;
+  sqlite3_stmt *stmt=NULL;
+  gboolean result = FALSE;
+
+  /* fail on prior errors */
+  if(error && *error) return FALSE;
+
+  rc = sqlite3_prepare_v2(db->db, "SELECT 1 FROM \"sqlite_master\" WHERE \"type\"='table' AND \"name\"=?", -1, &stmt, 0);
+  if(rc != SQLITE_OK) {
+    DB_ERROR(error);
+    goto cleanup;
+  }
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    result = TRUE;
+  } else if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+
+  cleanup:
+  sqlite3_finalize(stmt);
+
+  return result;
+}
+
+
+/* Creates the full-text index over titles, authors and field values,
+   along with the triggers which keep it in sync, then fills it from
+   the existing rows.  Inserts are indexed by the save functions
+   instead of by trigger, which lets a paper and all of its fields go
+   into the index with one write. */
+static void
+create_search_index(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE VIRTUAL TABLE \"PaperText\" USING fts5("
+      " \"Title\", \"Author\", \"Fields\","
+      " tokenize='unicode61 remove_diacritics 2'"
+      " )",
+    /* title hits outrank author hits, which outrank field hits */
+    "INSERT INTO \"PaperText\"(\"PaperText\", \"rank\")"
+      " VALUES('rank', 'bm25(10.0, 5.0, 1.0)')",
+    "CREATE TRIGGER \"PaperTextUpdate\" AFTER UPDATE OF \"Title\", \"Author\" ON \"Paper\" BEGIN"
+      " UPDATE \"PaperText\" SET \"Title\"=new.\"Title\", \"Author\"=new.\"Author\""
+      " WHERE \"rowid\"=new.\"ID\";"
+      " END",
+    "CREATE TRIGGER \"PaperTextDelete\" AFTER DELETE ON \"Paper\" BEGIN"
+      " DELETE FROM \"PaperText\" WHERE \"rowid\"=old.\"ID\";"
+      " END",
+    "CREATE TRIGGER \"FieldTextChange\" AFTER UPDATE OF \"PaperID\", \"Value\" ON \"Field\" BEGIN"
+      " UPDATE \"PaperText\" SET \"Fields\"=COALESCE((SELECT group_concat(\"Value\", ' ')"
+      " FROM \"Field\" WHERE \"PaperID\"=\"PaperText\".\"rowid\"), '')"
+      " WHERE \"rowid\" IN (old.\"PaperID\", new.\"PaperID\");"
+      " END",
+    "CREATE TRIGGER \"FieldTextDelete\" AFTER DELETE ON \"Field\" BEGIN"
+      " UPDATE \"PaperText\" SET \"Fields\"=COALESCE((SELECT group_concat(\"Value\", ' ')"
+      " FROM \"Field\" WHERE \"PaperID\"=old.\"PaperID\"), '')"
+      " WHERE \"rowid\"=old.\"PaperID\";"
+      " END",
+    /* index whatever is already there */
+    "INSERT INTO \"PaperText\"(\"rowid\", \"Title\", \"Author\", \"Fields\")"
+      " SELECT p.\"ID\", p.\"Title\", p.\"Author\", COALESCE(f.\"Text\", '')"
+      " FROM \"Paper\" p LEFT JOIN"
+      " (SELECT \"PaperID\", group_concat(\"Value\", ' ') AS \"Text\""
+      "  FROM \"Field\" GROUP BY \"PaperID\") f"
+      " ON f.\"PaperID\"=p.\"ID\""
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* Run a list of statements which return no rows */
+static void
+run_script(gra_db_t *db, const gchar **script, int n, GError **error) {
+  int i;
+  int rc;
+  sqlite3_stmt *stmt=NULL;
+
+  /* fail on prior errors */
+  if(error && *error) return;
+
+  for(i=0; i<n; i++) {
+    rc = sqlite3_prepare_v2(db->db, script[i], -1, &stmt, 0);
+    if(rc != SQLITE_OK) {
+      DB_ERROR(error);
+      return;
+    }
+
+    /* run and destroy */
+    rc = sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    if(rc != SQLITE_DONE) {
+      DB_ERROR(error);
+      return;
+    }
+  }
+}
+
+
+/* Binary search for a field.  Returns its index, or where it would
+   go if found is set to FALSE. */
+static int
+field_find(gra_paper_t *p, const gchar *name, gboolean *found) {
+  int lo = 0, hi = p->fieldCount, mid, cmp;
+
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    cmp = p->fields[mid].name == name ? 0 : strcmp(p->fields[mid].name, name);
+    if(!cmp) {
+      *found = TRUE;
+      return mid;
+    }
+    if(cmp < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  *found = FALSE;
+  return lo;
+}
+
+
+/* Open a cleared slot for a new field at index at, growing the array
+   as needed.  The name is interned. */
+static gra_field_t *
+field_insert(gra_paper_t *p, int at, const gchar *name) {
+  gra_field_t *fields;
+  int space;
+
+  if(p->fieldCount == p->fieldSpace) {
+    space = p->fieldSpace ? p->fieldSpace * 2 : 8;
+    if(p->arena) {
+      /* the old array stays in the arena until it goes */
+      fields = gra_arena_alloc(p->arena, space * sizeof(gra_field_t));
+      if(p->fieldCount)
+        memcpy(fields, p->fields, p->fieldCount * sizeof(gra_field_t));
+    } else {
+      fields = g_renew(gra_field_t, p->fields, space);
+    }
+    p->fields = fields;
+    p->fieldSpace = space;
+  }
+
+  memmove(p->fields + at + 1, p->fields + at,
+          (p->fieldCount - at) * sizeof(gra_field_t));
+  p->fieldCount++;
+
+  memset(p->fields + at, 0, sizeof(gra_field_t));
+  p->fields[at].name = g_intern_string(name);
+
+  return p->fields + at;
+}
+
+
+static gboolean
+fieldSaveVisit(gra_field_t *f, gpointer data) {
+  field_save_ctx *ctx = (field_save_ctx *) data;
+
+  /* fields follow their paper, which may have just been inserted */
+  if(f->paperId != ctx->p->id) {
+    f->paperId = ctx->p->id;
+    f->dirty |= GRA_FIELD_PAPER_ID;
+    f->changed = TRUE;
+  }
+  field_write(ctx->db, f, ctx->text, ctx->error);
+
+  /* stop the traversal on the first error */
+  return ctx->error && *ctx->error;
+}
+
+
+/* Fetch a statement from the cache, preparing it on first use.  The
+   statement comes back with its bindings cleared; callers reset it
+   when they are done with it. */
+static sqlite3_stmt *
+db_stmt(gra_db_t *db, gra_db_stmt_id id, GError **error) {
+  int rc;
+
+  /* reuse the cached statement */
+  if(db->stmts[id]) {
+    db->stmtHits++;
+    sqlite3_clear_bindings(db->stmts[id]);
+    return db->stmts[id];
+  }
+
+  /* first use, prepare it for the life of the connection */
+  rc = sqlite3_prepare_v3(db->db, stmt_sql[id], -1,
+                          SQLITE_PREPARE_PERSISTENT, &(db->stmts[id]), 0);
+  if(rc != SQLITE_OK) {
+    DB_ERROR(error);
+    db->stmts[id] = NULL;
+    return NULL;
+  }
+  db->stmtPrepares++;
+
+  return db->stmts[id];
+}
+
+
+/* Fetch the statement for a piece of SQL from the cache keyed by
+   SQL, preparing it on first use */
+sqlite3_stmt *
+gra_db_stmt_prepare(gra_db_t *db, const gchar *sql, GError **error) {
+  sqlite3_stmt *stmt;
+
+  if(!db->queries)
+    db->queries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                        stmt_free);
+
+  stmt = g_hash_table_lookup(db->queries, sql);
+  if(stmt) {
+    db->stmtHits++;
+    return stmt;
+  }
+
+  /* make room, the simple way; statements in use come straight back */
+  if(g_hash_table_size(db->queries) >= GRA_QUERY_CACHE_SIZE)
+    g_hash_table_remove_all(db->queries);
+
+  if(sqlite3_prepare_v3(db->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, 0) != SQLITE_OK) {
+    DB_ERROR(error);
+    return NULL;
+  }
+  db->stmtPrepares++;
+  g_hash_table_insert(db->queries, g_strdup(sql), stmt);
+
+  return stmt;
+}
+
+
+/* Finalize a statement dropped from the cache */
+static void
+stmt_free(gpointer data) {
+  sqlite3_finalize((sqlite3_stmt *) data);
+}
+
+
+/* Fetch the UPDATE of a table which sets only the columns in mask,
+   building and preparing it on first use.  Each column keeps its
+   parameter number, and the key follows the last column, so callers
+   bind every value as they would for a full update. */
+static sqlite3_stmt *
+update_stmt(gra_db_t *db, sqlite3_stmt **cache, const gchar *table,
+            const gchar *key, const gchar **columns, int n, guint mask,
+            GError **error) {
+  GString *sql;
+  int rc;
+  int i;
+
+  /* reuse the cached statement */
+  if(cache[mask]) {
+    db->stmtHits++;
+    sqlite3_clear_bindings(cache[mask]);
+    return cache[mask];
+  }
+
+  sql = g_string_new(NULL);
+  g_string_printf(sql, "UPDATE \"%s\" SET ", table);
+  for(i=0; i<n; i++) {
+    if(!(mask & (1u << i)))
+      continue;
+    if(sql->str[sql->len - 1] != ' ')
+      g_string_append(sql, ", ");
+    g_string_append_printf(sql, "\"%s\"=?%d", columns[i], i + 1);
+  }
+  g_string_append_printf(sql, " WHERE \"%s\"=?%d", key, n + 1);
+
+  rc = sqlite3_prepare_v3(db->db, sql->str, -1,
+                          SQLITE_PREPARE_PERSISTENT, cache + mask, 0);
+  g_string_free(sql, TRUE);
+  if(rc != SQLITE_OK) {
+    DB_ERROR(error);
+    cache[mask] = NULL;
+    return NULL;
+  }
+  db->stmtPrepares++;
+
+  return cache[mask];
+}
+
+
+/* Run a cached statement which returns no rows */
+static void
+db_step_once(gra_db_t *db, gra_db_stmt_id id, GError **error) {
+  sqlite3_stmt *stmt;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, id, error);
+  if(!stmt) return;
+
+  rc = sqlite3_step(stmt);
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+}
+
+
+/* Bind a string, storing NULL strings as empty text.  The schema
+   declares the text columns NOT NULL.  The string is not copied, so
+   it must outlive the statement's next step. */
+static void
+bind_text(sqlite3_stmt *stmt, int i, const gchar *text) {
+  sqlite3_bind_text(stmt, i, text ? text : "", -1, SQLITE_STATIC);
+}
+
+
+/* Build a paper from a row of the form
+   ID, FileName, PageCount, Read, Type, Author, Title, Year */
+gra_paper_t *
+gra_db_paper_from_row(sqlite3_stmt *stmt, gra_arena_t *arena) {
+  gra_paper_t *result;
+
+  result = paper_alloc(arena, sizeof(gra_paper_t));
+  result->id = sqlite3_column_int(stmt, 0);
+  result->fileName = paper_strdup(arena, (gchar*)sqlite3_column_text(stmt, 1));
+  result->pageCount = sqlite3_column_int(stmt, 2);
+  result->read = sqlite3_column_int(stmt, 3);
+  result->type = paper_strdup(arena, (gchar*)sqlite3_column_text(stmt, 4));
+  result->author = paper_strdup(arena, (gchar*)sqlite3_column_text(stmt, 5));
+  result->title = paper_strdup(arena, (gchar*)sqlite3_column_text(stmt, 6));
+  result->year = sqlite3_column_int(stmt, 7);
+  result->fields = NULL;
+  result->fieldCount = 0;
+  result->fieldSpace = 0;
+  result->refs = NULL;
+  result->indb = TRUE;
+  result->changed = FALSE;
+  result->dirty = 0;
+  result->refCount = 1;
+  result->arena = arena ? gra_arena_ref(arena) : NULL;
+
+  return result;
+}
+
+
+/* Allocate cleared memory for a paper, from its arena if it has one */
+static gpointer
+paper_alloc(gra_arena_t *arena, gsize size) {
+  return arena ? gra_arena_alloc0(arena, size) : g_malloc0(size);
+}
+
+
+/* Copy a string for a paper, into its arena if it has one */
+static gchar *
+paper_strdup(gra_arena_t *arena, const gchar *s) {
+  return arena ? gra_arena_strdup(arena, s) : g_strdup(s);
+}
+
+
+/* Replace a string member of a paper, marking its column if it
+   differs.  Arena strings go when the arena does. */
+static void
+paper_set_text(gra_paper_t *p, gchar **member, const gchar *value,
+               gra_paper_column column) {
+  if(!g_strcmp0(*member, value))
+    return;
+  if(!p->arena)
+    g_free(*member);
+  *member = paper_strdup(p->arena, value);
+  p->dirty |= column;
+  p->changed = TRUE;
+}
+
+
+/* Add a field from a row of the form ID, Name, Value */
+static void
+add_field_row(gra_paper_t *p, sqlite3_stmt *stmt) {
+  gra_field_t *field;
+  const gchar *name = (gchar*) sqlite3_column_text(stmt, 1);
+  gboolean found;
+  int at;
+
+  /* a repeated name replaces the earlier row */
+  at = field_find(p, name, &found);
+  if(found) {
+    field = p->fields + at;
+    if(!p->arena)
+      g_free(field->value);
+  } else {
+    field = field_insert(p, at, name);
+  }
+
+  field->id = sqlite3_column_int(stmt, 0);
+  field->paperId = p->id;
+  field->value = paper_strdup(p->arena, (gchar*) sqlite3_column_text(stmt, 2));
+  field->indb = TRUE;
+  field->changed = FALSE;
+  field->dirty = 0;
+}
+
+
+/* Add a reference from a row of the form rowid, RefPaperID */
+static void
+add_ref_row(gra_paper_t *p, sqlite3_stmt *stmt) {
+  gra_reference_t *ref;
+  GList *link;
+
+  ref = paper_alloc(p->arena, sizeof(gra_reference_t));
+  ref->id = sqlite3_column_int(stmt, 0);
+  ref->paperId = p->id;
+  ref->refPaperId = sqlite3_column_int(stmt, 1);
+  ref->indb = TRUE;
+  ref->changed = FALSE;
+  ref->dirty = 0;
+
+  /* add the reference to the list */
+  if(!p->arena) {
+    p->refs = g_list_prepend(p->refs, ref);
+    return;
+  }
+
+  /* the same, with the list node in the arena too */
+  link = gra_arena_alloc(p->arena, sizeof(GList));
+  link->data = ref;
+  link->prev = NULL;
+  link->next = p->refs;
+  if(p->refs)
+    p->refs->prev = link;
+  p->refs = link;
+}
+
+
+/* Add an empty note to a paper's notes */
+static gra_note_t *
+note_add(gra_paper_t *p, int page) {
+  gra_note_t *n;
+
+  if(!p->notes)
+    p->notes = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, note_free);
+
+  n = g_new0(gra_note_t, 1);
+  n->paperId = p->id;
+  n->page = page;
+  g_hash_table_insert(p->notes, GINT_TO_POINTER(page), n);
+
+  return n;
+}
+
+
+static void
+note_free(gpointer data) {
+  gra_note_t *n = data;
+
+  g_free(n->leftNote);
+  g_free(n->rightNote);
+  g_free(n);
+}
+
+
+/* Release the notes of a paper */
+static void
+notes_free(gra_paper_t *p) {
+  if(p->notesDirty)
+    g_ptr_array_free(p->notesDirty, TRUE);
+  if(p->noteBlocks)
+    g_array_free(p->noteBlocks, TRUE);
+  if(p->notes)
+    g_hash_table_destroy(p->notes);
+}
+
+
+/* Have the notes of a block of pages been loaded? */
+static gboolean
+notes_loaded(gra_paper_t *p, int block) {
+  if(!p->noteBlocks || block >= (int) p->noteBlocks->len)
+    return FALSE;
+  return g_array_index(p->noteBlocks, guint8, block);
+}
+
+
+/* Record that the notes of a run of blocks are loaded */
+static void
+notes_mark_loaded(gra_paper_t *p, int first, int last) {
+  if(!p->noteBlocks)
+    p->noteBlocks = g_array_new(FALSE, TRUE, sizeof(guint8));
+  if(last >= (int) p->noteBlocks->len)
+    g_array_set_size(p->noteBlocks, last + 1);
+
+  for(; first <= last; first++)
+    g_array_index(p->noteBlocks, guint8, first) = 1;
+}
+
+
+/* Turn user text into an FTS5 query.  Each word becomes a quoted
+   string so that punctuation is never parsed as query syntax, and the
+   last word matches as a prefix so partially typed words find hits.
+   Returns NULL if there are no words. */
+static gchar *
+match_expr(const gchar *column, const gchar *text) {
+  GString *expr;
+  gchar **words;
+  const gchar *c;
+  int i, n=0;
+
+  if(!text) return NULL;
+
+  expr = g_string_new(NULL);
+  if(column)
+    g_string_append_printf(expr, "{%s} : (", column);
+
+  words = g_strsplit_set(text, " \t\r\n", -1);
+  for(i=0; words[i]; i++) {
+    if(!*words[i]) continue;
+
+    /* quote the word, doubling any embedded quotes */
+    if(n++) g_string_append_c(expr, ' ');
+    g_string_append_c(expr, '"');
+    for(c=words[i]; *c; c++) {
+      if(*c == '"') g_string_append_c(expr, '"');
+      g_string_append_c(expr, *c);
+    }
+    g_string_append_c(expr, '"');
+  }
+  g_strfreev(words);
+
+  if(!n) {
+    g_string_free(expr, TRUE);
+    return NULL;
+  }
+  g_string_append_c(expr, '*');
+  if(column)
+    g_string_append_c(expr, ')');
+
+  return g_string_free(expr, FALSE);
+}
+
+
+/* Run a ranked full-text search, optionally limited to one column of
+   the index. */
+static GList *
+search(gra_db_t *db, gra_db_stmt_id id, const gchar *column, const gchar *text,
+       int limit, int offset, GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  GList *result = NULL;
+  gchar *expr;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  /* nothing to look for */
+  expr = match_expr(column, text);
+  if(!expr) return NULL;
+
+  stmt = db_stmt(db, id, error);
+  if(!stmt) goto cleanup;
+
+  sqlite3_bind_text(stmt, 1, expr, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, limit < 0 ? -1 : limit);
+  sqlite3_bind_int(stmt, 3, offset < 0 ? 0 : offset);
+
+  /* collect the hits, best first */
+  while((rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    result = g_list_prepend(result, gra_db_paper_from_row(stmt, NULL));
+  }
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    g_list_free_full(result, (GDestroyNotify) gra_paper_free);
+    result = NULL;
+  }
+  result = g_list_reverse(result);
+
+  cleanup:
+  if(stmt) sqlite3_reset(stmt);
+  g_free(expr);
+  return result;
+}
+
+
+static gboolean
+fieldFreeVisit(gra_field_t *f, gpointer data) {
+  /* names are interned, so only the value is ours */
+  g_free(f->value);
+
+  return FALSE;
+}
+
+
+/* Write a field.  The values of inserted fields are collected in
+   text, if given, so the caller can index them in one go; otherwise
+   they are indexed right away. */
+static void
+field_write(gra_db_t *db, gra_field_t *f, GString *text, GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  /* do not save unchanged fields */
+  if(!f->changed)
+    return;
+
+  if(f->indb) {
+    /* update the changed columns, or all of them if none are marked */
+    stmt = update_stmt(db, db->fieldUpdates, "Field", "ID", fieldColumns,
+                       G_N_ELEMENTS(fieldColumns),
+                       f->dirty ? f->dirty : GRA_FIELD_ALL, error);
+    if(!stmt) goto cleanup;
+    sqlite3_bind_int(stmt, 4, f->id);
+  } else {
+    /* prepare insert */
+    stmt = db_stmt(db, GRA_STMT_FIELD_INSERT, error);
+    if(!stmt) goto cleanup;
+  }
+
+  /* bind the colums and run */
+  sqlite3_bind_int(stmt, 1, f->paperId);
+  bind_text(stmt, 2, f->name);
+  bind_text(stmt, 3, f->value);
+  rc = sqlite3_step(stmt);
+
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    goto cleanup;
+  }
+
+  /* handle new rows properly */
+  if(!f->indb) {
+    f->id = sqlite3_last_insert_rowid(db->db);
+    f->indb = TRUE;
+
+    /* updates are indexed by trigger, inserts are up to us */
+    sqlite3_reset(stmt);
+    stmt = NULL;
+    if(db->textFirstPaper && f->paperId >= db->textFirstPaper) {
+      /* the paper itself is still waiting for text_flush */
+      if(!db->textFirstField)
+        db->textFirstField = f->id;
+    } else if(text) {
+      if(text->len) g_string_append_c(text, ' ');
+      g_string_append(text, f->value);
+    } else {
+      text_append(db, f->paperId, f->value, error);
+    }
+  }
+
+  /* the database is now current */
+  f->changed = FALSE;
+  f->dirty = 0;
+
+  cleanup:
+  if(stmt) sqlite3_reset(stmt);
+  return;
+}
+
+
+/* Add text to the Fields column of a paper's index entry */
+static void
+text_append(gra_db_t *db, int paperId, const gchar *text, GError **error) {
+  sqlite3_stmt *stmt;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, GRA_STMT_TEXT_APPEND, error);
+  if(!stmt) return;
+
+  sqlite3_bind_text(stmt, 1, text, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 2, paperId);
+  if(sqlite3_step(stmt) != SQLITE_DONE)
+    DB_ERROR(error);
+  sqlite3_reset(stmt);
+}
+
+
+/* Index the papers inserted since the last flush.  Doing this once
+   per batch with a single INSERT ... SELECT is several times faster
+   than indexing each paper as it is saved. */
+static void
+text_flush(gra_db_t *db, GError **error) {
+  sqlite3_stmt *stmt;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  /* nothing new */
+  if(!db->textFirstPaper) return;
+
+  stmt = db_stmt(db, GRA_STMT_TEXT_FLUSH, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, db->textFirstPaper);
+  sqlite3_bind_int(stmt, 2, db->textLastPaper);
+  sqlite3_bind_int(stmt, 3, db->textFirstField ? db->textFirstField : G_MAXINT);
+  if(sqlite3_step(stmt) != SQLITE_DONE) {
+    DB_ERROR(error);
+  } else {
+    db->textFirstPaper = 0;
+    db->textFirstField = 0;
+  }
+  sqlite3_reset(stmt);
+}
+
+
+/* Create the scratch tables which hold the ID sets of
+   gra_db_paper_load_many and gra_db_paper_delete_many.  Loads take
+   no lock, so deletes keep a table of their own.  Temp tables belong
+   to the connection, so this is done on every open. */
+static void
+create_load_set(gra_db_t *db, GError **error) {
+  const gchar *script[] = {
+    "CREATE TEMP TABLE \"LoadSet\" ("
+      " \"Ord\" INTEGER PRIMARY KEY, \"ID\" INTEGER NOT NULL )",
+    "CREATE INDEX temp.\"LoadSetID\" ON \"LoadSet\"(\"ID\")",
+    "CREATE TEMP TABLE \"DeleteSet\" ( \"ID\" INTEGER PRIMARY KEY )"
+  };
+  int n = sizeof(script) / sizeof(script[0]);
+
+  run_script(db, script, n, error);
+}
+
+
+/* Add a freshly loaded paper to the cache, which holds a reference */
+static void
+cache_insert(gra_db_t *db, gra_paper_t *p) {
+  cache_entry *entry;
+
+  entry = g_malloc0(sizeof(cache_entry));
+  entry->paper = gra_paper_ref(p);
+  entry->bytes = paper_size(p);
+  entry->link.data = entry;
+
+  g_hash_table_insert(db->cache, GINT_TO_POINTER(p->id), entry);
+  g_queue_push_head_link(&db->cacheLru, &entry->link);
+  db->cacheBytes += entry->bytes;
+
+  cache_evict(db);
+}
+
+
+/* Drop a paper from the cache, if it is there */
+static void
+cache_remove(gra_db_t *db, int id) {
+  cache_entry *entry;
+
+  entry = g_hash_table_lookup(db->cache, GINT_TO_POINTER(id));
+  if(!entry) return;
+
+  g_queue_unlink(&db->cacheLru, &entry->link);
+  db->cacheBytes -= entry->bytes;
+  g_hash_table_remove(db->cache, GINT_TO_POINTER(id));
+}
+
+
+/* Recount a cached paper after its fields or references changed */
+static void
+cache_resize(gra_db_t *db, gra_paper_t *p) {
+  cache_entry *entry;
+
+  entry = g_hash_table_lookup(db->cache, GINT_TO_POINTER(p->id));
+  if(!entry || entry->paper != p) return;
+
+  db->cacheBytes -= entry->bytes;
+  entry->bytes = paper_size(p);
+  db->cacheBytes += entry->bytes;
+
+  cache_evict(db);
+}
+
+
+/* Evict least recently used papers until the cache fits its budget.
+   Papers held outside the cache are skipped: evicting them would
+   free nothing, and would break identity for their holders. */
+static void
+cache_evict(gra_db_t *db) {
+  GList *cur, *prev;
+  cache_entry *entry;
+
+  for(cur = db->cacheLru.tail; cur && db->cacheBytes > db->cacheBudget; cur = prev) {
+    prev = cur->prev;
+    entry = cur->data;
+    if(g_atomic_int_get(&entry->paper->refCount) > 1)
+      continue;
+
+    db->cacheEvictions++;
+    cache_remove(db, entry->paper->id);
+  }
+}
+
+
+/* hash table destructor for cache entries */
+static void
+cache_entry_free(gpointer data) {
+  cache_entry *entry = data;
+
+  gra_paper_free(entry->paper);
+  g_free(entry);
+}
+
+
+/* Estimate the memory held by a paper and everything hanging off it */
+static gsize
+paper_size(gra_paper_t *p) {
+  gsize size = sizeof(gra_paper_t);
+
+  size += p->fileName ? strlen(p->fileName) + 1 : 0;
+  size += p->type ? strlen(p->type) + 1 : 0;
+  size += p->author ? strlen(p->author) + 1 : 0;
+  size += p->title ? strlen(p->title) + 1 : 0;
+  size += (p->fieldSpace - p->fieldCount) * sizeof(gra_field_t);
+  gra_paper_foreach_field(p, fieldSizeVisit, &size);
+  size += g_list_length(p->refs) * (sizeof(gra_reference_t) + sizeof(GList));
+
+  if(p->notes) {
+    GHashTableIter it;
+    gpointer value;
+    gra_note_t *n;
+
+    g_hash_table_iter_init(&it, p->notes);
+    while(g_hash_table_iter_next(&it, NULL, &value)) {
+      n = value;
+      size += sizeof(gra_note_t) + strlen(n->leftNote) + strlen(n->rightNote) + 2;
+    }
+  }
+
+  return size;
+}
+
+
+static gboolean
+fieldSizeVisit(gra_field_t *f, gpointer data) {
+  gsize *size = data;
+
+  /* the slot and its value; names are shared */
+  *size += sizeof(gra_field_t);
+  *size += f->value ? strlen(f->value) + 1 : 0;
 
   return FALSE;
 }
+
+
+/* Copy size bytes from a file or blob to a file or blob, adding them
+   to a checksum on the way.  Any of the ends may be missing. */
+static void
+copy_contents(gra_db_t *db, FILE *in, sqlite3_blob *src, FILE *out,
+              sqlite3_blob *dst, GChecksum *sum, gsize size, GError **error) {
+  guchar *buf;
+  gsize n, offset = 0;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  buf = g_malloc(GRA_CONTENTS_CHUNK_SIZE);
+  while(offset < size) {
+    n = MIN(GRA_CONTENTS_CHUNK_SIZE, size - offset);
+
+    if(in && fread(buf, 1, n, in) != n) {
+      g_set_error(error, GRA_DATA_ERROR, 4, "%s",
+                  ferror(in) ? g_strerror(errno) : "File changed while reading.");
+      break;
+    }
+    if(src && sqlite3_blob_read(src, buf, n, offset) != SQLITE_OK) {
+      DB_ERROR(error);
+      break;
+    }
+
+    if(sum)
+      g_checksum_update(sum, buf, n);
+
+    if(out && fwrite(buf, 1, n, out) != n) {
+      g_set_error(error, GRA_DATA_ERROR, 4, "Write error: %s", g_strerror(errno));
+      break;
+    }
+    if(dst && sqlite3_blob_write(dst, buf, n, offset) != SQLITE_OK) {
+      DB_ERROR(error);
+      break;
+    }
+
+    offset += n;
+  }
+  g_free(buf);
+}
+
+
+/* SHA-256 of size bytes of a file or blob, in hex */
+static gchar *
+hash_contents(gra_db_t *db, FILE *in, sqlite3_blob *blob, gsize size,
+              GError **error) {
+  GChecksum *sum;
+  gchar *hash = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  sum = g_checksum_new(G_CHECKSUM_SHA256);
+  copy_contents(db, in, blob, NULL, NULL, sum, size, error);
+  if(!(error && *error))
+    hash = g_strdup(g_checksum_get_string(sum));
+  g_checksum_free(sum);
+
+  return hash;
+}
+
+
+/* ID of the document with the given hash, or 0 */
+static int
+document_find(gra_db_t *db, const gchar *hash, GError **error) {
+  sqlite3_stmt *stmt;
+  int rc, id = 0;
+
+  /* abort on previous error */
+  if(error && *error) return 0;
+
+  stmt = db_stmt(db, GRA_STMT_DOC_FIND, error);
+  if(!stmt) return 0;
+
+  sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    id = sqlite3_column_int(stmt, 0);
+  } else if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+
+  return id;
+}
+
+
+/* Store a new document, copied from a file or a blob, with no
+   references yet.  Large ones go to an external file, which is
+   written next to its final name and renamed into place, so a
+   document file is always whole.  A file left behind by a rolled
+   back batch holds the right bytes, and is simply written again. */
+static int
+document_store(gra_db_t *db, const gchar *hash, gsize size, FILE *in,
+               sqlite3_blob *blob, GError **error) {
+  sqlite3_stmt *stmt;
+  sqlite3_blob *dst = NULL;
+  FILE *out = NULL;
+  gchar *path = NULL, *dir = NULL, *tmp = NULL;
+  gboolean external;
+  int id = 0;
+
+  /* abort on previous error */
+  if(error && *error) return 0;
+
+  external = db->externalThreshold && size >= db->externalThreshold;
+  if(!external && size > G_MAXINT) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Contents of %" G_GSIZE_FORMAT
+                " bytes are too large.", size);
+    return 0;
+  }
+  if(external && !(path = document_path(db, hash))) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "External documents need a database file.");
+    return 0;
+  }
+
+  stmt = db_stmt(db, GRA_STMT_DOC_INSERT, error);
+  if(!stmt) goto cleanup;
+
+  sqlite3_bind_text(stmt, 1, hash, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, size);
+  sqlite3_bind_int(stmt, 3, external);
+  if(sqlite3_step(stmt) != SQLITE_DONE) {
+    DB_ERROR(error);
+    sqlite3_reset(stmt);
+    goto cleanup;
+  }
+  sqlite3_reset(stmt);
+  id = sqlite3_last_insert_rowid(db->db);
+
+  if(!external) {
+    stmt = db_stmt(db, GRA_STMT_DOC_CONTENTS, error);
+    if(!stmt) goto cleanup;
+    sqlite3_bind_int(stmt, 1, id);
+    sqlite3_bind_int64(stmt, 2, size);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(error);
+    sqlite3_reset(stmt);
+
+    if(error && *error) goto cleanup;
+    if(sqlite3_blob_open(db->db, "main", "DocumentContents", "Contents", id,
+                         TRUE, &dst) != SQLITE_OK) {
+      DB_ERROR(error);
+      goto cleanup;
+    }
+    copy_contents(db, in, blob, NULL, dst, NULL, size, error);
+    goto cleanup;
+  }
+
+  dir = g_path_get_dirname(path);
+  tmp = g_strconcat(path, ".tmp", NULL);
+  if(g_mkdir_with_parents(dir, 0755) || !(out = fopen(tmp, "wb"))) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s", dir, g_strerror(errno));
+    goto cleanup;
+  }
+  copy_contents(db, in, blob, out, NULL, NULL, size, error);
+  if(fclose(out) && !(error && *error))
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s", tmp, g_strerror(errno));
+  if(!(error && *error) && g_rename(tmp, path))
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s", path, g_strerror(errno));
+  if(error && *error)
+    g_unlink(tmp);
+
+  cleanup:
+  sqlite3_blob_close(dst);
+  g_free(path);
+  g_free(dir);
+  g_free(tmp);
+  return error && *error ? 0 : id;
+}
+
+
+/* Point a paper at a document, or at none for 0, moving its
+   reference from the old one. */
+static void
+document_link(gra_db_t *db, int paperId, int docId, GError **error) {
+  sqlite3_stmt *stmt;
+  int rc, old;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, GRA_STMT_CONTENTS_DOC, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, paperId);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    old = sqlite3_column_int(stmt, 0);
+  } else if(rc == SQLITE_DONE) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No paper with ID %d.", paperId);
+  } else {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+  if(rc != SQLITE_ROW)
+    return;
+
+  /* already there */
+  if(old == docId)
+    return;
+
+  if(docId) {
+    stmt = db_stmt(db, GRA_STMT_DOC_REF, error);
+    if(!stmt) return;
+    sqlite3_bind_int(stmt, 1, 1);
+    sqlite3_bind_int(stmt, 2, docId);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(error);
+    sqlite3_reset(stmt);
+  }
+
+  stmt = db_stmt(db, GRA_STMT_PAPER_SET_DOC, error);
+  if(!stmt) return;
+  if(docId)
+    sqlite3_bind_int(stmt, 1, docId);
+  else
+    sqlite3_bind_null(stmt, 1);
+  sqlite3_bind_int(stmt, 2, paperId);
+  if(sqlite3_step(stmt) != SQLITE_DONE)
+    DB_ERROR(error);
+  sqlite3_reset(stmt);
+
+  if(old)
+    document_unref(db, old, 1, error);
+}
+
+
+/* Drop references to a document, deleting it with the last one.  An
+   external file stays until the batch commits, see document_sweep. */
+static void
+document_unref(gra_db_t *db, int docId, int refs, GError **error) {
+  sqlite3_stmt *stmt;
+  gchar *hash = NULL;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, GRA_STMT_DOC_REF, error);
+  if(!stmt) return;
+  sqlite3_bind_int(stmt, 1, -refs);
+  sqlite3_bind_int(stmt, 2, docId);
+  rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    return;
+  }
+
+  stmt = db_stmt(db, GRA_STMT_DOC_INFO, error);
+  if(!stmt) return;
+  sqlite3_bind_int(stmt, 1, docId);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0) {
+    rc = SQLITE_DONE;
+  } else if(rc == SQLITE_ROW && sqlite3_column_int(stmt, 1)) {
+    hash = g_strdup((gchar*) sqlite3_column_text(stmt, 2));
+  }
+  sqlite3_reset(stmt);
+  if(rc == SQLITE_DONE)
+    return;
+  if(rc != SQLITE_ROW) {
+    DB_ERROR(error);
+    return;
+  }
+
+  /* that was the last one */
+  stmt = db_stmt(db, GRA_STMT_DOC_DELETE, error);
+  if(!stmt) goto cleanup;
+  sqlite3_bind_int(stmt, 1, docId);
+  rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    goto cleanup;
+  }
+
+  if(hash) {
+    if(!db->docSweep)
+      db->docSweep = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(db->docSweep, hash);
+    hash = NULL;
+  }
+
+  cleanup:
+  g_free(hash);
+}
+
+
+/* Remove the files of the external documents dropped by the batch
+   which just committed.  A document rolled back to by a savepoint, or
+   stored again since, still has its row and keeps its file. */
+static void
+document_sweep(gra_db_t *db) {
+  gchar *path, *dir;
+  int i;
+
+  for(i=0; i < db->docSweep->len; i++) {
+    if(document_find(db, g_ptr_array_index(db->docSweep, i), NULL))
+      continue;
+
+    path = document_path(db, g_ptr_array_index(db->docSweep, i));
+    g_unlink(path);
+
+    /* the shard goes too once it is empty */
+    dir = g_path_get_dirname(path);
+    g_rmdir(dir);
+    g_free(dir);
+    g_free(path);
+  }
+
+  g_ptr_array_set_size(db->docSweep, 0);
+}
+
+
+/* Open the bytes of a document for reading into a handle whose size
+   is already set: a mapping for external ones, a blob otherwise. */
+static gboolean
+document_open(gra_db_t *db, gra_contents_t *c, int docId,
+              gboolean external, const gchar *hash, GError **error) {
+  gchar *path;
+
+  if(external) {
+    path = document_path(db, hash);
+    c->map = g_mapped_file_new(path, FALSE, error);
+    g_free(path);
+    return c->map != NULL;
+  }
+
+  if(c->size && sqlite3_blob_open(db->db, "main", "DocumentContents", "Contents",
+                                  docId, FALSE, &c->blob) != SQLITE_OK) {
+    DB_ERROR(error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/* Where an external document lives: <database>-documents/ab/abcd...
+   NULL for databases without a file. */
+static gchar *
+document_path(gra_db_t *db, const gchar *hash) {
+  const char *file = sqlite3_db_filename(db->db, "main");
+
+  if(!file || !*file)
+    return NULL;
+
+  return g_strdup_printf("%s-documents" G_DIR_SEPARATOR_S "%.2s" G_DIR_SEPARATOR_S "%s",
+                         file, hash, hash);
+}
+
+
+/* Drop the staged contents of a paper */
+static void
+contents_unstage(gra_db_t *db, int paperId, GError **error) {
+  sqlite3_stmt *stmt;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  stmt = db_stmt(db, GRA_STMT_STAGE_DELETE, error);
+  if(!stmt) return;
+
+  sqlite3_bind_int(stmt, 1, paperId);
+  if(sqlite3_step(stmt) != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+}
+
+
+/* Point a connection's hooks at a set of timings, or at none */
+static void
+trace_attach(gra_db_t *db, gra_db_trace_t *trace) {
+  if(db->trace == trace) return;
+
+  if(trace) {
+    g_atomic_int_inc(&trace->refCount);
+    if(!db->traceRuns)
+      db->traceRuns = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL, g_free);
+    sqlite3_trace_v2(db->db,
+                     SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW,
+                     trace_hook, db);
+  } else {
+    sqlite3_trace_v2(db->db, 0, NULL, NULL);
+    if(db->traceRuns)
+      g_hash_table_destroy(db->traceRuns);
+    db->traceRuns = NULL;
+  }
+
+  if(db->trace)
+    trace_unref(db->trace);
+  db->trace = trace;
+}
+
+
+/* Drop a connection's hold on a set of timings */
+static void
+trace_unref(gra_db_trace_t *trace) {
+  if(!g_atomic_int_dec_and_test(&trace->refCount))
+    return;
+
+  trace_reset(trace);
+  g_hash_table_destroy(trace->stmts);
+  g_mutex_clear(&trace->lock);
+  g_free(trace);
+}
+
+
+/* Start the timings over.  The lock is held, if anyone else has it. */
+static void
+trace_reset(gra_db_trace_t *trace) {
+  int i;
+
+  g_hash_table_remove_all(trace->stmts);
+  for(i=0; i<GRA_DB_SLOW_LOG_SIZE; i++) {
+    g_free(trace->slow[i].sql);
+    trace->slow[i].sql = NULL;
+  }
+  trace->slowNext = 0;
+  trace->slowCount = 0;
+  trace->since = g_get_real_time();
+}
+
+
+/* Called by SQLite as a statement starts, for each row it returns,
+   and as it finishes.  SQLite's own timings are only good to the
+   millisecond on some systems, so runs are timed here.  Statements
+   SQLite runs inside another, such as those of the full-text index,
+   report no start; they are counted as part of the outer one. */
+static int
+trace_hook(unsigned type, void *data, void *p, void *x) {
+  gra_db_t *db = (gra_db_t *) data;
+  gra_db_trace_t *trace = db->trace;
+  sqlite3_stmt *stmt = (sqlite3_stmt *) p;
+  gra_stmt_stats_t *s;
+  gra_slow_query_t *q;
+  trace_run *run;
+  guint64 us;
+  char *sql;
+
+  run = g_hash_table_lookup(db->traceRuns, stmt);
+
+  switch(type) {
+  case SQLITE_TRACE_STMT:
+    /* triggers report their start too, as comments */
+    if(!strncmp((const char *) x, "--", 2))
+      break;
+    if(!run) {
+      run = g_new(trace_run, 1);
+      g_hash_table_insert(db->traceRuns, stmt, run);
+    }
+    run->rows = 0;
+    run->start = g_get_monotonic_time();
+    break;
+
+  case SQLITE_TRACE_ROW:
+    if(run)
+      run->rows++;
+    break;
+
+  case SQLITE_TRACE_PROFILE:
+    if(!run)
+      break;
+    us = g_get_monotonic_time() - run->start;
+
+    g_mutex_lock(&trace->lock);
+    s = trace_entry(trace, stmt);
+    s->calls++;
+    s->rows += run->rows;
+    s->totalMicros += us;
+    if(us > s->maxMicros)
+      s->maxMicros = us;
+
+    /* keep the slow ones with their values, over the oldest */
+    if(trace->slowMicros >= 0 && us >= trace->slowMicros) {
+      q = trace->slow + trace->slowNext;
+      g_free(q->sql);
+      sql = sqlite3_expanded_sql(stmt);
+      q->sql = g_strdup(sql ? sql : s->sql);
+      sqlite3_free(sql);
+      q->micros = us;
+      q->when = g_get_real_time();
+      trace->slowNext = (trace->slowNext + 1) % GRA_DB_SLOW_LOG_SIZE;
+      if(trace->slowCount < GRA_DB_SLOW_LOG_SIZE)
+        trace->slowCount++;
+    }
+    g_mutex_unlock(&trace->lock);
+
+    /* the statement may be finalized after this */
+    g_hash_table_remove(db->traceRuns, stmt);
+    break;
+  }
+
+  return 0;
+}
+
+
+/* The timings of a statement, by its SQL */
+static gra_stmt_stats_t *
+trace_entry(gra_db_trace_t *trace, sqlite3_stmt *stmt) {
+  gra_stmt_stats_t *s;
+  const char *sql;
+
+  sql = sqlite3_sql(stmt);
+  if(!sql)
+    sql = "";
+  s = g_hash_table_lookup(trace->stmts, sql);
+  if(!s) {
+    s = g_new0(gra_stmt_stats_t, 1);
+    s->sql = g_strdup(sql);
+    g_hash_table_insert(trace->stmts, s->sql, s);
+  }
+
+  return s;
+}
+
+
+static void
+stmt_stats_free(gpointer data) {
+  gra_stmt_stats_t *s = (gra_stmt_stats_t *) data;
+
+  g_free(s->sql);
+  g_free(s);
+}
+
+
+static void
+slow_query_free(gpointer data) {
+  gra_slow_query_t *q = (gra_slow_query_t *) data;
+
+  g_free(q->sql);
+  g_free(q);
+}
+
+
+/* Most total time first */
+static gint
+stmt_stats_compare(gconstpointer a, gconstpointer b) {
+  const gra_stmt_stats_t *x = *(gra_stmt_stats_t * const *) a;
+  const gra_stmt_stats_t *y = *(gra_stmt_stats_t * const *) b;
+
+  return x->totalMicros < y->totalMicros ? 1 : x->totalMicros > y->totalMicros ? -1 : 0;
+}
+
+
+/* Read a citation as the database has it.  The paper IDs are -1 if
+   there is no such row. */
+static gboolean
+cite_lookup(gra_db_t *db, int rowid, gra_citation_change_t *c, GError **error) {
+  sqlite3_stmt *stmt;
+  int rc;
+
+  stmt = db_stmt(db, GRA_STMT_REF_GET, error);
+  if(!stmt) return FALSE;
+
+  sqlite3_bind_int(stmt, 1, rowid);
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    c->paperId = sqlite3_column_int(stmt, 0);
+    c->refPaperId = sqlite3_column_int(stmt, 1);
+  } else if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+
+  return rc == SQLITE_ROW || rc == SQLITE_DONE;
+}
+
+
+/* Pass a citation change on to the graph once it is committed */
+static void
+cite_note(gra_db_t *db, int paperId, int refPaperId, gboolean added) {
+  gra_citation_change_t c;
+
+  if(!db->citations) return;
+
+  c.paperId = paperId;
+  c.refPaperId = refPaperId;
+  c.added = added;
+  if(db->batchDepth)
+    g_array_append_val(db->citeLog, c);
+  else
+    gra_citegraph_apply(db->citations, &c, 1);
+}
+
+
+/* Delete a set of papers, and everything hanging off them, in one
+   batch.  Each table is cleared with one statement over the set.  The
+   papers go first, so the field text trigger finds no index row left
+   to rewrite as their fields follow.  Returns the papers deleted. */
+static int
+delete_set(gra_db_t *db, const int *ids, int n, GError **error) {
+  sqlite3_stmt *stmt;
+  GArray *docs;
+  GError *err = NULL;
+  int i, rc, doc[2], deleted = 0;
+
+  gra_db_batch_begin(db, &err);
+  if(err) {
+    g_propagate_error(error, err);
+    return 0;
+  }
+
+  /* the ID set */
+  db_step_once(db, GRA_STMT_DELSET_CLEAR, &err);
+  for(i=0; i<n && !err; i++) {
+    stmt = db_stmt(db, GRA_STMT_DELSET_ADD, &err);
+    if(!stmt) break;
+    sqlite3_bind_int(stmt, 1, ids[i]);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
+
+  /* each document loses a reference per paper, counted before the
+     papers go and released after the scan is done */
+  docs = g_array_new(FALSE, FALSE, sizeof(int));
+  stmt = err ? NULL : db_stmt(db, GRA_STMT_DELSET_DOCS, &err);
+  if(stmt) {
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      doc[0] = sqlite3_column_int(stmt, 0);
+      doc[1] = sqlite3_column_int(stmt, 1);
+      g_array_append_vals(docs, doc, 2);
+    }
+    if(rc != SQLITE_DONE)
+      DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
+
+  /* citations either way go from the citation graph */
+  stmt = err || !db->citations ? NULL : db_stmt(db, GRA_STMT_DELSET_CITES, &err);
+  if(stmt) {
+    while((rc = sqlite3_step(stmt)) == SQLITE_ROW)
+      cite_note(db, sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), FALSE);
+    if(rc != SQLITE_DONE)
+      DB_ERROR(&err);
+    sqlite3_reset(stmt);
+  }
+
+  db_step_once(db, GRA_STMT_DELSET_PAPERS, &err);
+  if(!err)
+    deleted = sqlite3_changes(db->db);
+  db_step_once(db, GRA_STMT_DELSET_FIELDS, &err);
+  db_step_once(db, GRA_STMT_DELSET_REFS, &err);
+  db_step_once(db, GRA_STMT_DELSET_NOTES, &err);
+  db_step_once(db, GRA_STMT_DELSET_AUTHORS, &err);
+  db_step_once(db, GRA_STMT_AUTHOR_PRUNE, &err);
+  for(i=0; i+1 < docs->len && !err; i += 2)
+    document_unref(db, g_array_index(docs, int, i), g_array_index(docs, int, i + 1), &err);
+  g_array_free(docs, TRUE);
+
+  if(!err)
+    gra_db_batch_commit(db, &err);
+  if(err) {
+    gra_db_batch_rollback(db, NULL);
+    g_propagate_error(error, err);
+    return 0;
+  }
+
+  /* cached copies are gone with them */
+  for(i=0; i<n && db->cache; i++)
+    cache_remove(db, ids[i]);
+
+  return deleted;
+}
+
+
+/* Mark a deleted paper, and all of it which was loaded, as new, so
+   saving it again writes it all back */
+static void
+paper_forget(gra_paper_t *p) {
+  GHashTableIter iter;
+  gra_note_t *n;
+  GList *cur;
+  int i;
+
+  p->indb = FALSE;
+  p->changed = TRUE;
+  for(i=0; i<p->fieldCount; i++) {
+    p->fields[i].indb = FALSE;
+    p->fields[i].changed = TRUE;
+  }
+  for(cur=p->refs; cur; cur=g_list_next(cur)) {
+    ((gra_reference_t *) cur->data)->indb = FALSE;
+    ((gra_reference_t *) cur->data)->changed = TRUE;
+  }
+
+  if(!p->notes)
+    return;
+  g_hash_table_iter_init(&iter, p->notes);
+  while(g_hash_table_iter_next(&iter, NULL, (gpointer *) &n)) {
+    n->indb = FALSE;
+    if(n->changed)
+      continue;
+    n->changed = TRUE;
+    if(!p->notesDirty)
+      p->notesDirty = g_ptr_array_new();
+    g_ptr_array_add(p->notesDirty, n);
+  }
+}
+
+
+/* Remember the rows a save of p may give IDs to or mark current */
+static void
+save_undo_mark(gra_paper_t *p, paper_save_undo *u) {
+  GList *cur;
+  guint i;
+
+  u->id = p->id;
+  u->indb = p->indb;
+  u->fields = g_new(gra_field_t, p->fieldCount);
+  if(p->fieldCount)
+    memcpy(u->fields, p->fields, p->fieldCount * sizeof(gra_field_t));
+
+  u->refs = g_new(gra_reference_t, g_list_length(p->refs));
+  for(cur=p->refs, i=0; cur; cur = g_list_next(cur), i++)
+    u->refs[i] = *(gra_reference_t *) cur->data;
+
+  /* notes leave notesDirty once written */
+  u->noteCount = p->notesDirty ? p->notesDirty->len : 0;
+  u->notes = g_new(gra_note_t *, u->noteCount);
+  u->noteState = g_new(gra_note_t, u->noteCount);
+  for(i=0; i < u->noteCount; i++) {
+    u->notes[i] = g_ptr_array_index(p->notesDirty, i);
+    u->noteState[i] = *u->notes[i];
+  }
+}
+
+
+/* Put p back as save_undo_mark found it, after a rollback */
+static void
+save_undo_restore(gra_paper_t *p, paper_save_undo *u) {
+  GList *cur;
+  gra_note_t *n;
+  guint i;
+
+  p->id = u->id;
+  p->indb = u->indb;
+  if(p->fieldCount)
+    memcpy(p->fields, u->fields, p->fieldCount * sizeof(gra_field_t));
+
+  for(cur=p->refs, i=0; cur; cur = g_list_next(cur), i++)
+    *(gra_reference_t *) cur->data = u->refs[i];
+
+  if(!u->noteCount) return;
+  g_ptr_array_set_size(p->notesDirty, 0);
+  for(i=0; i < u->noteCount; i++) {
+    n = u->notes[i];
+    n->id = u->noteState[i].id;
+    n->paperId = u->noteState[i].paperId;
+    n->indb = u->noteState[i].indb;
+    n->changed = TRUE;
+    g_ptr_array_add(p->notesDirty, n);
+  }
+}
+
+
+static void
+save_undo_free(paper_save_undo *u) {
+  g_free(u->fields);
+  g_free(u->refs);
+  g_free(u->notes);
+  g_free(u->noteState);
+}
+
+
+/* Size of the database, counting its free pages */
+static gint64
+db_bytes(gra_db_t *db, GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  gint64 bytes = 0;
+
+  /* abort on previous error */
+  if(error && *error) return 0;
+
+  if(sqlite3_prepare_v2(db->db, "SELECT \"page_count\" * \"page_size\""
+                        " FROM pragma_page_count(), pragma_page_size()",
+                        -1, &stmt, NULL) != SQLITE_OK ||
+     sqlite3_step(stmt) != SQLITE_ROW) {
+    DB_ERROR(error);
+  } else {
+    bytes = sqlite3_column_int64(stmt, 0);
+  }
+  sqlite3_finalize(stmt);
+
+  return bytes;
+}
+
+
+/* Split a BibTeX author list at each "and" outside of braces.  Empty
+   names and the "others" of a cut short list are left out. */
+static gchar **
+author_split(const gchar *authors) {
+  GPtrArray *names;
+  const gchar *p, *start;
+  gchar *name;
+  int depth = 0;
+
+  names = g_ptr_array_new();
+  for(p = start = authors ? authors : ""; ; p++) {
+    if(*p == '{') {
+      depth++;
+    } else if(*p == '}' && depth) {
+      depth--;
+    } else if(!*p || (!depth && g_ascii_isspace(*p) &&
+                      !g_ascii_strncasecmp(p + 1, "and", 3) && g_ascii_isspace(p[4]))) {
+      name = g_strstrip(g_strndup(start, p - start));
+      if(*name && g_ascii_strcasecmp(name, "others"))
+        g_ptr_array_add(names, name);
+      else
+        g_free(name);
+      if(!*p) break;
+      p += 4;
+      start = p + 1;
+    }
+  }
+  g_ptr_array_add(names, NULL);
+
+  return (gchar **) g_ptr_array_free(names, FALSE);
+}
+
+
+/* Fold a name for comparison: no case, accents, TeX accent commands
+   or braces, dots taken as spaces, and single spaces between words.
+   A comma stays, with a space after it and none before. */
+static gchar *
+author_fold(const gchar *text) {
+  GString *s;
+  gchar *nfd, *result;
+  const gchar *p;
+  gunichar c;
+  gboolean space = FALSE;
+
+  nfd = g_utf8_normalize(text ? text : "", -1, G_NORMALIZE_NFD);
+  if(!nfd) return NULL;
+
+  s = g_string_new(NULL);
+  for(p=nfd; *p; p=g_utf8_next_char(p)) {
+    c = g_utf8_get_char(p);
+    if(c == '\\') {
+      /* \"o and the like: the letter stays, the accent goes */
+      if(p[1] && !g_ascii_isalnum(p[1])) p++;
+      continue;
+    }
+    if(c == '{' || c == '}' || g_unichar_type(c) == G_UNICODE_NON_SPACING_MARK)
+      continue;
+    if(c == '.' || c == '~' || g_unichar_isspace(c)) {
+      space = TRUE;
+      continue;
+    }
+    if(c == ',') {
+      g_string_append_c(s, ',');
+      space = TRUE;
+      continue;
+    }
+    if(space && s->len)
+      g_string_append_c(s, ' ');
+    space = FALSE;
+    g_string_append_unichar(s, c);
+  }
+  g_free(nfd);
+
+  result = g_utf8_casefold(s->str, -1);
+  g_string_free(s, TRUE);
+  return result;
+}
+
+
+/* The key of a name: the folded surname, a comma, then any given
+   names.  The surname is what comes before a comma, or else the last
+   word, so "R. J. Lowe" and "Lowe, R.J." both become "lowe, r j".
+   NULL if there is no name. */
+static gchar *
+author_key(const gchar *name) {
+  gchar *folded, *split, *surname, *given, *key;
+
+  folded = author_fold(name);
+  if(!folded) return NULL;
+
+  if((split = strchr(folded, ','))) {
+    *split = '\0';
+    surname = g_strstrip(folded);
+    given = g_strstrip(split + 1);
+  } else if((split = strrchr(folded, ' '))) {
+    *split = '\0';
+    surname = split + 1;
+    given = folded;
+  } else {
+    surname = folded;
+    given = "";
+  }
+
+  key = NULL;
+  if(*surname)
+    key = *given ? g_strdup_printf("%s, %s", surname, given) : g_strdup_printf("%s,", surname);
+
+  g_free(folded);
+  return key;
+}
+
+
+/* List the authors of a paper in Authorship, adding those not yet
+   known.  Replacing drops the paper's old list first, and any author
+   left without papers.  An author named twice is listed once. */
+static void
+author_link(gra_db_t *db, int paperId, const gchar *authors,
+            gboolean replace, GError **error) {
+  sqlite3_stmt *stmt;
+  GPtrArray *keys;
+  gchar **names;
+  gchar *key;
+  int i, j, authorId, rc, position = 0;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  if(replace) {
+    stmt = db_stmt(db, GRA_STMT_AUTHOR_UNLINK, error);
+    if(!stmt) return;
+    sqlite3_bind_int(stmt, 1, paperId);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(error);
+    sqlite3_reset(stmt);
+  }
+
+  names = author_split(authors);
+  keys = g_ptr_array_new_with_free_func(g_free);
+  for(i=0; names[i] && !(error && *error); i++) {
+    key = author_key(names[i]);
+    for(j=0; key && j<keys->len; j++) {
+      if(!strcmp(key, g_ptr_array_index(keys, j))) {
+        g_free(key);
+        key = NULL;
+      }
+    }
+    if(!key) continue;
+    g_ptr_array_add(keys, key);
+
+    /* find the author, or add them */
+    authorId = 0;
+    stmt = db_stmt(db, GRA_STMT_AUTHOR_FIND, error);
+    if(!stmt) break;
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW)
+      authorId = sqlite3_column_int(stmt, 0);
+    else if(rc != SQLITE_DONE)
+      DB_ERROR(error);
+    sqlite3_reset(stmt);
+
+    if(!authorId && !(error && *error)) {
+      stmt = db_stmt(db, GRA_STMT_AUTHOR_INSERT, error);
+      if(!stmt) break;
+      bind_text(stmt, 1, names[i]);
+      sqlite3_bind_text(stmt, 2, key, -1, SQLITE_STATIC);
+      if(sqlite3_step(stmt) == SQLITE_DONE)
+        authorId = sqlite3_last_insert_rowid(db->db);
+      else
+        DB_ERROR(error);
+      sqlite3_reset(stmt);
+    }
+
+    stmt = (error && *error) ? NULL : db_stmt(db, GRA_STMT_AUTHOR_LINK, error);
+    if(!stmt) break;
+    sqlite3_bind_int(stmt, 1, paperId);
+    sqlite3_bind_int(stmt, 2, position++);
+    sqlite3_bind_int(stmt, 3, authorId);
+    if(sqlite3_step(stmt) != SQLITE_DONE)
+      DB_ERROR(error);
+    sqlite3_reset(stmt);
+  }
+  g_ptr_array_free(keys, TRUE);
+  g_strfreev(names);
+
+  if(replace)
+    db_step_once(db, GRA_STMT_AUTHOR_PRUNE, error);
+}
+
+
+/* Bind ?1 and ?2 to the range of keys starting with a prefix.  Keys
+   compare byte by byte, and no UTF-8 text continues past U+10FFFF. */
+static void
+bind_prefix(sqlite3_stmt *stmt, const gchar *prefix) {
+  sqlite3_bind_text(stmt, 1, prefix, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt, 2, g_strconcat(prefix, "\xf4\x8f\xbf\xbf", NULL), -1, g_free);
+}
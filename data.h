@@ -24,11 +24,39 @@
 #include <glib.h>
 #include "datatypes.h"
 
-#define GRA_DB_VERSION 1.0
+#define GRA_DB_VERSION 2.6
 #define GRA_DATA_ERROR gra_data_error_quark()
 
 GQuark gra_data_error_quark(void);
 
+/** Flags for gra_db_open_full */
+typedef enum {
+  GRA_DB_OPEN_DEFAULT = 0,
+  /** Use write-ahead logging with synchronous=NORMAL.  Commits no
+      longer wait for an fsync; a power loss may lose the most recent
+      transactions, but never corrupts the database. */
+  GRA_DB_OPEN_WAL = 1 << 0,
+  /** Do not upgrade an older file.  The caller is expected to call
+      gra_db_upgrade before anything else. */
+  GRA_DB_OPEN_NO_UPGRADE = 1 << 1,
+  /** Open the file read-only.  It must already exist and be up to
+      date. */
+  GRA_DB_OPEN_READ_ONLY = 1 << 2
+} gra_db_open_flags;
+
+
+/** Reports the progress of gra_db_upgrade.  It is called when each
+ *  step starts, and then every so often while the step runs.
+ *  @param description What the step does.
+ *  @param step The running step, counting from 1.
+ *  @param steps Number of steps in this upgrade.
+ *  @param data The user data given to gra_db_upgrade.
+ *  @return FALSE to cancel the upgrade.  The running step is rolled
+ *  back; the steps before it are kept.
+ */
+typedef gboolean (*gra_db_progress_func)(const gchar *description, int step,
+                                         int steps, gpointer data);
+
 
 /** Opens a database.  If the database does not exist, it is created.
  *  @param filename The name of the file we are opening.
@@ -41,7 +69,66 @@ GQuark gra_data_error_quark(void);
 gra_db_t *gra_db_open(const gchar *filename, GError **error);
 
 
-/** Closes a database and destroys the connection.
+/** Opens a database with extra options.  Older files are upgraded to
+ *  GRA_DB_VERSION unless GRA_DB_OPEN_NO_UPGRADE is given; files from a
+ *  newer version are refused.
+ *  @param filename The name of the file we are opening.
+ *  @param flags A combination of gra_db_open_flags.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return As gra_db_open.
+ *  @see gra_db_open
+ */
+gra_db_t *gra_db_open_full(const gchar *filename, unsigned int flags, GError **error);
+
+
+/** Upgrades the schema of an open database to GRA_DB_VERSION.  Each
+ *  step runs in its own transaction and records its version in
+ *  MetaInfo, so an interrupted upgrade resumes where it stopped.
+ *  @param db the database connection, usually opened with
+ *  GRA_DB_OPEN_NO_UPGRADE
+ *  @param progress Progress callback.  May be NULL.
+ *  @param data User data for progress.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_upgrade(gra_db_t *db, gra_db_progress_func progress, gpointer data,
+                    GError **error);
+
+
+/** @struct gra_db_compact_stats_t
+ *  @brief What gra_db_compact did.
+ *  @var gra_db_compact_stats_t::orphans Rows dropped because their
+ *  paper was gone.
+ *  @var gra_db_compact_stats_t::bytesBefore Size of the database
+ *  before.
+ *  @var gra_db_compact_stats_t::bytesAfter Size of the database after.
+ */
+typedef struct gra_db_compact_stats_t {
+  unsigned long orphans;
+  gint64 bytesBefore;
+  gint64 bytesAfter;
+} gra_db_compact_stats_t;
+
+
+/** Compacts a database.  Fields, references, notes, author links and
+ *  staged contents left behind by papers deleted before deletes
+ *  cascaded are dropped, with authors left with no papers.  Then the
+ *  file is rebuilt without its free pages.  This rewrites the whole
+ *  file, so run it offline: no batch may be open, the worker and
+ *  readers should be stopped, and other processes should not have the
+ *  file open.  Reference IDs may change, so the
+ *  paper cache is cleared and papers loaded before must be loaded
+ *  again.
+ *  @param db the database connection
+ *  @param stats filled in
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_compact(gra_db_t *db, gra_db_compact_stats_t *stats, GError **error);
+
+
+/** Closes a database and destroys the connection.  The request
+ *  running on the worker thread, if any, is finished first; requests
+ *  which have not started are cancelled.  The reader pool is closed
+ *  too, so every reader must have been released.
  *  @param db the database to close
  *  @param error GError Pointer.  Set to NULL for no error reporting.
  *  @see gra_db_open
@@ -49,13 +136,427 @@ gra_db_t *gra_db_open(const gchar *filename, GError **error);
 void gra_db_close(gra_db_t *db, GError **error);
 
 
+/** Reports how well the prepared statement cache is doing.
+ *  @param db the database connection
+ *  @param hits Set to the number of times a cached statement was reused.
+ *  @param prepares Set to the number of statements which had to be
+ *  prepared.  Either pointer may be NULL.
+ */
+void gra_db_stmt_stats(gra_db_t *db, unsigned long *hits, unsigned long *prepares);
+
+
+/** Starts a batch.  All writes made until the matching
+ *  gra_db_batch_commit are grouped into one transaction, and so cost a
+ *  single disk flush.  Batches nest; inner batches become savepoints.
+ *  @param db the database connection
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_batch_begin(gra_db_t *db, GError **error);
+
+
+/** Commits the innermost batch.  Nothing reaches the disk until the
+ *  outermost batch is committed.
+ *  @param db the database connection
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_batch_commit(gra_db_t *db, GError **error);
+
+
+/** Discards every write made in the innermost batch.  This runs even
+ *  if error is already set, so it can be used on failure paths.  The
+ *  in-memory objects saved during the batch are not restored.
+ *  @param db the database connection
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_batch_rollback(gra_db_t *db, GError **error);
+
+
+/** Takes the writer lock of a connection.  A connection may be shared
+ *  between threads as long as each one holds the lock while using it.
+ *  The lock is recursive, and every batch holds it from
+ *  gra_db_batch_begin until its commit or rollback, so a batch is
+ *  never interleaved with another thread's writes.
+ *  @param db the database connection
+ */
+void gra_db_lock(gra_db_t *db);
+
+/** Releases the lock taken by gra_db_lock. */
+void gra_db_unlock(gra_db_t *db);
+
+
+/** Slow queries kept by gra_db_trace, the oldest dropped first. */
+#define GRA_DB_SLOW_LOG_SIZE 64
+
+/** @struct gra_stmt_stats_t
+ *  @brief Timings of one SQL statement.
+ *  @var gra_stmt_stats_t::sql The statement, as prepared.
+ *  @var gra_stmt_stats_t::calls Times it ran to completion or was
+ *  reset.
+ *  @var gra_stmt_stats_t::rows Rows it returned.
+ *  @var gra_stmt_stats_t::totalMicros Time spent running it, in
+ *  microseconds.
+ *  @var gra_stmt_stats_t::maxMicros Longest single run.
+ */
+typedef struct gra_stmt_stats_t {
+  gchar *sql;
+  unsigned long calls;
+  guint64 rows;
+  guint64 totalMicros;
+  guint64 maxMicros;
+} gra_stmt_stats_t;
+
+/** @struct gra_slow_query_t
+ *  @brief One run of a statement which took too long.
+ *  @var gra_slow_query_t::sql The statement with its bound values.
+ *  @var gra_slow_query_t::micros How long it ran.
+ *  @var gra_slow_query_t::when When it finished, as g_get_real_time.
+ */
+typedef struct gra_slow_query_t {
+  gchar *sql;
+  guint64 micros;
+  gint64 when;
+} gra_slow_query_t;
+
+/** @struct gra_db_stats_t
+ *  @brief A snapshot of the timings collected by gra_db_trace.
+ *  @var gra_db_stats_t::statements gra_stmt_stats_t of each
+ *  statement, most total time first.
+ *  @var gra_db_stats_t::slow gra_slow_query_t of the slow queries,
+ *  oldest first.
+ *  @var gra_db_stats_t::calls Runs of all statements.
+ *  @var gra_db_stats_t::rows Rows returned by all statements.
+ *  @var gra_db_stats_t::totalMicros Time spent in all statements.
+ *  Statements SQLite runs inside others, such as those of the
+ *  full-text index, count as part of them.
+ *  @var gra_db_stats_t::since When the timings were last reset, as
+ *  g_get_real_time.
+ */
+typedef struct gra_db_stats_t {
+  GPtrArray *statements;
+  GPtrArray *slow;
+  unsigned long calls;
+  guint64 rows;
+  guint64 totalMicros;
+  gint64 since;
+} gra_db_stats_t;
+
+
+/** Starts or stops timing every statement run on a connection, with
+ *  SQLite's trace hooks.  Calls, rows and time are counted for each
+ *  distinct statement, and runs slower than a threshold are kept in
+ *  a log of the last GRA_DB_SLOW_LOG_SIZE.  Pool readers share the
+ *  writer's timings, from the next time they are acquired.  Nothing
+ *  is collected, and nothing costs, until this is called.
+ *  @param db the database connection
+ *  @param enable TRUE to collect timings.  Calling again while
+ *  enabled only changes the threshold; disabling drops the timings.
+ *  @param slowMicros Runs at least this long, in microseconds, are
+ *  logged.  Negative for no log.
+ */
+void gra_db_trace(gra_db_t *db, gboolean enable, gint64 slowMicros);
+
+/** Takes a snapshot of the timings collected by gra_db_trace.
+ *  @param db the database connection
+ *  @param reset TRUE to start the timings and the slow log over.
+ *  @return The snapshot, or NULL if timings are not collected.  Free
+ *  with gra_db_stats_free.
+ */
+gra_db_stats_t *gra_db_stats(gra_db_t *db, gboolean reset);
+
+/** Frees a snapshot from gra_db_stats.  May be NULL. */
+void gra_db_stats_free(gra_db_stats_t *stats);
+
+
+/** Sets up a pool of read-only connections to the same file, which
+ *  threads can search and export from without taking the writer
+ *  lock.  The file is switched to write-ahead logging, so readers
+ *  never wait on the writer, nor the writer on them.  Readers are
+ *  opened as they are first needed.
+ *  @param db the database connection, which stays the writer
+ *  @param readers Most readers open at once.  Zero closes the idle
+ *  readers and disables the pool.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_pool_set_readers(gra_db_t *db, int readers, GError **error);
+
+/** Hands out a reader from the pool, waiting for one to be released
+ *  if they are all in use.  A reader is an ordinary read-only
+ *  connection, to be used by one thread at a time.  Wrap a series of
+ *  queries in a batch to have them all see the same snapshot.
+ *  @param db the writer connection
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The reader, or NULL on error or if there is no pool.  A
+ *  caller waiting when the pool is resized to zero gets NULL too.
+ */
+gra_db_t *gra_db_reader_acquire(gra_db_t *db, GError **error);
+
+/** Returns a reader to the pool.
+ *  @param db the writer connection
+ *  @param reader a reader from gra_db_reader_acquire
+ */
+void gra_db_reader_release(gra_db_t *db, gra_db_t *reader);
+
+
+/** @struct gra_cache_stats_t
+ *  @brief Paper cache statistics.
+ *  @var gra_cache_stats_t::hits Loads answered from the cache.
+ *  @var gra_cache_stats_t::misses Loads which went to the database.
+ *  @var gra_cache_stats_t::evictions Papers dropped to stay within
+ *  the budget.
+ *  @var gra_cache_stats_t::papers Papers currently cached.
+ *  @var gra_cache_stats_t::bytes Estimated memory held by the cache.
+ *  @var gra_cache_stats_t::budget The memory budget.
+ */
+typedef struct gra_cache_stats_t {
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned int papers;
+  gsize bytes;
+  gsize budget;
+} gra_cache_stats_t;
+
+
+/** Sets the memory budget of the paper cache.  While the budget is
+ *  non-zero, gra_db_paper_load hands out the same paper for the same
+ *  ID for as long as it stays in the cache, and papers which are not
+ *  used elsewhere are evicted least recently used first.  The cache
+ *  is off by default.
+ *  @param db the database connection
+ *  @param bytes The budget, or 0 to empty and disable the cache.
+ */
+void gra_db_cache_set_budget(gra_db_t *db, gsize bytes);
+
+
+/** Drops every paper from the cache.  Papers held elsewhere stay
+ *  valid.
+ *  @param db the database connection
+ */
+void gra_db_cache_clear(gra_db_t *db);
+
+
+/** Reports how well the paper cache is doing.
+ *  @param db the database connection
+ *  @param stats Filled in with the statistics.
+ */
+void gra_db_cache_stats(gra_db_t *db, gra_cache_stats_t *stats);
+
+
 /* paper functions */
+
+/** Loads a paper, without its fields or references.  With the cache
+ *  enabled, a paper which is already loaded is returned as is,
+ *  including any fields, references and unsaved changes it has.
+ *  @param db the database connection
+ *  @param id the paper ID
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The paper.  Release it with gra_paper_free.
+ */
 gra_paper_t *gra_db_paper_load(gra_db_t *db, int id, GError **error);
 void gra_db_paper_save(gra_db_t *db, gra_paper_t *p, GError **error);
+
+/** Deletes a paper, along with its fields, notes and the references
+ *  from it and to it, in one batch.  Its document loses a reference,
+ *  and is deleted along with it if no other paper has the same
+ *  contents.
+ *  @param db the database connection
+ *  @param p the paper, which is marked as no longer in the database.
+ *  So are its loaded fields, references and notes, so saving it
+ *  again puts it all back under a new ID.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
 void gra_db_paper_delete(gra_db_t *db, gra_paper_t *p, GError **error);
+
+/** Deletes many papers as gra_db_paper_delete does, with one
+ *  statement per table rather than one per paper.  Papers loaded
+ *  elsewhere are not marked.
+ *  @param db the database connection
+ *  @param ids IDs of the papers.  Repeated and unknown IDs are
+ *  skipped.
+ *  @param n number of IDs
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The number of papers deleted.  Nothing is deleted on
+ *  error.
+ */
+int gra_db_paper_delete_many(gra_db_t *db, const int *ids, int n, GError **error);
 void gra_db_paper_load_fields(gra_db_t *db, gra_paper_t *p, GError **error);
 void gra_db_paper_load_refs(gra_db_t *db, gra_paper_t *p, GError **error);
 
+/** Flags for gra_db_paper_load_many */
+typedef enum {
+  GRA_LOAD_PAPER = 0,
+  /** Also load the fields of each paper */
+  GRA_LOAD_FIELDS = 1 << 0,
+  /** Also load the references of each paper */
+  GRA_LOAD_REFS = 1 << 1,
+  /** Carve the papers, their strings, fields and references from one
+      shared arena instead of allocating each piece.  The arena goes
+      away with the last of the papers. */
+  GRA_LOAD_ARENA = 1 << 2
+} gra_db_load_flags;
+
+/** Loads a set of papers at once.  This runs one query for the
+ *  papers, and one each for their fields and references if asked
+ *  for, however many IDs there are.
+ *  @param db the database connection
+ *  @param ids the paper IDs to load
+ *  @param n number of IDs
+ *  @param flags A combination of gra_db_load_flags.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return An array of n papers in the order of ids.  IDs which are
+ *  not in the database give NULL entries, and repeated IDs give
+ *  separate copies.  Free with gra_paper_free_many.  Returns NULL on
+ *  failure.
+ */
+gra_paper_t **gra_db_paper_load_many(gra_db_t *db, const int *ids, int n,
+                                     unsigned int flags, GError **error);
+
+/** Orders gra_db_paper_browse can page through the library in.
+ *  Titles and authors sort without regard to case; papers without a
+ *  year sort as year 0.  Ties are broken by ID. */
+typedef enum {
+  GRA_SORT_ID,
+  GRA_SORT_TITLE,
+  GRA_SORT_AUTHOR,
+  GRA_SORT_YEAR
+} gra_db_sort_column;
+
+/** Counts the papers in the library.
+ *  @param db the database connection
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The number of papers, or -1 on error.
+ */
+int gra_db_paper_count(gra_db_t *db, GError **error);
+
+/** Loads a page of papers in sort order, without their fields or
+ *  references.  Given the last paper of the page before, the next
+ *  page is found by seeking the sort index, however deep into the
+ *  library it is.  Skipping papers costs time in proportion to the
+ *  number skipped, so keep it small.
+ *  @param db the database connection
+ *  @param column the sort key
+ *  @param descending TRUE to page from the last paper backwards
+ *  @param after the page starts after this paper in sort order.  Only
+ *  its sort key and ID are used.  NULL to start at the beginning.
+ *  @param skip number of papers to skip after that
+ *  @param limit most papers to return
+ *  @param n set to the number of papers returned
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return An array of papers carved from one arena.  Free with
+ *  gra_paper_free_many.  Returns NULL on failure.
+ */
+gra_paper_t **gra_db_paper_browse(gra_db_t *db, gra_db_sort_column column,
+                                  gboolean descending, const gra_paper_t *after,
+                                  int skip, int limit, int *n, GError **error);
+
+/** Allocates a new, empty paper which is not yet in the database.
+ *  @return The paper.  Free it with gra_paper_free.
+ */
+gra_paper_t *gra_paper_new(void);
+
+/** Allocates a new, empty paper from an arena.  Fields set on it
+ *  later are allocated from the same arena.
+ *  @param arena the arena, which the paper holds a reference to.  NULL
+ *  gives an ordinary paper.
+ *  @return The paper.  Free it with gra_paper_free.
+ */
+gra_paper_t *gra_paper_new_in(gra_arena_t *arena);
+
+/** Sets the file name of a paper.  The setters below mark only the
+ *  column they change, so saving the paper writes that column alone.
+ *  Setting a value the paper already has changes nothing.
+ *  @param p the paper
+ *  @param fileName the new file name, which is copied
+ */
+void gra_paper_set_file_name(gra_paper_t *p, const gchar *fileName);
+
+/** Sets the page count of a paper.
+ *  @param p the paper
+ *  @param pageCount the new page count
+ */
+void gra_paper_set_page_count(gra_paper_t *p, int pageCount);
+
+/** Marks a paper read or unread.
+ *  @param p the paper
+ *  @param read TRUE if the paper has been read
+ */
+void gra_paper_set_read(gra_paper_t *p, gboolean read);
+
+/** Sets the BibTeX entry type of a paper.
+ *  @param p the paper
+ *  @param type the new type, which is copied
+ */
+void gra_paper_set_type(gra_paper_t *p, const gchar *type);
+
+/** Sets the author of a paper.
+ *  @param p the paper
+ *  @param author the new author, which is copied
+ */
+void gra_paper_set_author(gra_paper_t *p, const gchar *author);
+
+/** Sets the title of a paper.
+ *  @param p the paper
+ *  @param title the new title, which is copied
+ */
+void gra_paper_set_title(gra_paper_t *p, const gchar *title);
+
+/** Sets the year of a paper.
+ *  @param p the paper
+ *  @param year the new year
+ */
+void gra_paper_set_year(gra_paper_t *p, unsigned int year);
+
+/** Sets the value of a field, adding the field if the paper does not
+ *  have it yet.  The field is saved along with the paper.
+ *  @param p the paper
+ *  @param name the field name
+ *  @param value the new value, which is copied
+ *  @return The field, owned by the paper.  Fields are kept in an
+ *  array, so the pointer is only good until a field is added.
+ */
+gra_field_t *gra_paper_set_field(gra_paper_t *p, const gchar *name, const gchar *value);
+
+/** Looks up a field by name.
+ *  @param p the paper
+ *  @param name the field name
+ *  @return The field, or NULL if the paper does not have it.  As with
+ *  gra_paper_set_field, the pointer is only good until a field is
+ *  added.
+ */
+gra_field_t *gra_paper_get_field(gra_paper_t *p, const gchar *name);
+
+/** Called for each field by gra_paper_foreach_field.
+ *  @return TRUE to stop the traversal.
+ */
+typedef gboolean (*gra_field_func)(gra_field_t *f, gpointer data);
+
+/** Visits the fields of a paper in name order.  Fields must not be
+ *  added during the traversal.
+ *  @param p the paper
+ *  @param func called for each field
+ *  @param data user data for func
+ */
+void gra_paper_foreach_field(gra_paper_t *p, gra_field_func func, gpointer data);
+
+/** Adds a holder to a paper.
+ *  @param p the paper
+ *  @return p
+ */
+gra_paper_t *gra_paper_ref(gra_paper_t *p);
+
+/** Drops a holder of a paper.  The last one releases the paper, its
+ *  fields and its references.  This does not touch the database.
+ *  @param p the paper to free.  May be NULL.
+ */
+void gra_paper_free(gra_paper_t *p);
+
+/** Releases an array of papers returned by gra_db_paper_load_many
+ *  or gra_db_paper_browse.
+ *  @param papers the array.  May be NULL.
+ *  @param n number of entries
+ */
+void gra_paper_free_many(gra_paper_t **papers, int n);
+
 /* field functions */
 void gra_db_field_save(gra_db_t *db, gra_field_t *f, GError **error);
 void gra_db_field_delete(gra_db_t *db, gra_field_t *f, GError **error);
@@ -65,11 +566,317 @@ void gra_db_reference_save(gra_db_t *db, gra_reference_t *r, GError **error);
 void gra_db_reference_delete(gra_db_t *db, gra_reference_t *r, GError ** error);
 
 /* note functions */
-void gra_db_note_save(gra_db_t *db, gra_note_t *f, GError **error);
-void gra_db_note_delete(gra_db_t *db, gra_note_t *f, GError **error);
+
+/* Notes are loaded a page range at a time, as the pages are shown,
+   and kept on the paper.  Editing a note only marks it, so an
+   autosave writes the notes which changed and nothing else. */
+
+/** Pages whose notes are loaded together.  A range is widened to
+ *  whole blocks, and blocks already loaded are skipped. */
+#define GRA_NOTE_BLOCK_PAGES 32
+
+/** Loads the notes of a range of pages onto a paper.  Pages which
+ *  already had their notes loaded keep them, with any changes.
+ *  @param db the database connection
+ *  @param p the paper
+ *  @param firstPage first page of the range
+ *  @param lastPage last page of the range
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_load_notes(gra_db_t *db, gra_paper_t *p, int firstPage,
+                             int lastPage, GError **error);
+
+/** Looks up the note of a page.
+ *  @param p the paper
+ *  @param page the page
+ *  @return The note, owned by the paper, or NULL if the page has none
+ *  or its notes are not loaded.
+ */
+gra_note_t *gra_paper_get_note(gra_paper_t *p, int page);
+
+/** Sets the margin notes of a page, adding a note if the page has
+ *  none.  The note is only marked changed if its text differs.  The
+ *  notes of the page must have been loaded, unless the paper is not
+ *  in the database.
+ *  @param p the paper
+ *  @param page the page
+ *  @param leftNote the left margin, or NULL to leave it as it is
+ *  @param rightNote the right margin, or NULL to leave it as it is
+ *  @return The note, owned by the paper.
+ */
+gra_note_t *gra_paper_set_note(gra_paper_t *p, int page, const gchar *leftNote,
+                               const gchar *rightNote);
+
+/** Writes the changed notes of a paper in one batch.  Notes left
+ *  with both margins empty are deleted.  This costs nothing when no
+ *  note changed, so it can be called from an autosave timer.  The
+ *  notes of a paper which is not in the database yet are saved by
+ *  gra_db_paper_save.
+ *  @param db the database connection
+ *  @param p the paper
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_save_notes(gra_db_t *db, gra_paper_t *p, GError **error);
+
+/** Inserts or updates a single note.
+ *  @param db the database connection
+ *  @param n the note
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_note_save(gra_db_t *db, gra_note_t *n, GError **error);
+
+/** Deletes a single note.
+ *  @param db the database connection
+ *  @param n the note, which is marked as no longer in the database
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_note_delete(gra_db_t *db, gra_note_t *n, GError **error);
+
+/* contents functions */
+
+/* Contents are stored as documents, once per distinct SHA-256 hash of
+   their bytes.  Papers with the same contents share one document,
+   which goes away with the last paper referencing it.  Documents
+   above the external threshold are kept as files under
+   <database>-documents/, named by their hash and sharded by its first
+   two digits, and are memory-mapped when opened. */
+
+/** Size of the chunks contents are copied and hashed in. */
+#define GRA_CONTENTS_CHUNK_SIZE (64 * 1024)
+
+/** Lets SQLite map up to the given number of bytes of the file into
+ *  memory.  Reads of mapped pages, including contents reads, are then
+ *  copied straight from the mapping instead of going through read(2)
+ *  and the page cache.
+ *  @param db the database connection
+ *  @param bytes How much to map, or 0 to stop mapping.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_set_mmap_size(gra_db_t *db, gint64 bytes, GError **error);
+
+/** Sets the size from which new documents are stored as external
+ *  files rather than in the database.  Documents already stored stay
+ *  where they are.  External files need a database on disk.
+ *  @param db the database connection
+ *  @param bytes the threshold, or 0 to keep every document inside
+ */
+void gra_db_set_external_threshold(gra_db_t *db, gsize bytes);
+
+/** Opens the contents of a paper for incremental reading without
+ *  loading them into memory.
+ *
+ *  A handle opened for writing works on the bytes staged by
+ *  gra_db_paper_contents_create instead, and holds gra_db_lock until
+ *  it is closed.  The staged bytes replace the contents of the paper
+ *  when the handle is committed, and are dropped if it is closed
+ *  without committing.
+ *  @param db the database connection
+ *  @param paperId ID of the paper
+ *  @param writable TRUE to open the staged contents for writing
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The handle, or NULL on error.  A paper with no contents
+ *  opens with a size of 0.
+ */
+gra_contents_t *gra_db_paper_contents_open(gra_db_t *db, int paperId,
+                                           gboolean writable, GError **error);
+
+/** Opens a document by its ID for reading, as gra_db_paper_contents_open
+ *  does for the document of a paper.
+ *  @param db the database connection
+ *  @param documentId ID of the document
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The handle, or NULL on error.
+ */
+gra_contents_t *gra_db_document_open(gra_db_t *db, int documentId, GError **error);
+
+/** Size of the contents behind a handle.
+ *  @param c the handle
+ *  @return The size in bytes.
+ */
+gsize gra_db_paper_contents_size(gra_contents_t *c);
+
+/** Reads part of the contents.
+ *  @param c the handle
+ *  @param buf where to put the bytes
+ *  @param len how many bytes to read
+ *  @param offset where to start
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return Number of bytes read, which is less than len at the end of
+ *  the contents, or -1 on error.
+ */
+gssize gra_db_paper_contents_read(gra_contents_t *c, gpointer buf, gsize len,
+                                  gsize offset, GError **error);
+
+/** The contents of an external document, mapped into memory.
+ *  @param c a handle opened for reading
+ *  @return The gra_db_paper_contents_size bytes of the contents, valid
+ *  until the handle is closed, or NULL if the document is not
+ *  external.  Use gra_db_paper_contents_read then.
+ */
+gconstpointer gra_db_paper_contents_map(gra_contents_t *c);
+
+/** Overwrites part of the staged contents.  Writes cannot change the
+ *  size; use gra_db_paper_contents_create for that.
+ *  @param c a handle opened for writing
+ *  @param buf the bytes to write
+ *  @param len how many bytes to write
+ *  @param offset where to start
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_contents_write(gra_contents_t *c, gconstpointer buf, gsize len,
+                                 gsize offset, GError **error);
+
+/** Makes the staged contents the contents of the paper.  They are
+ *  hashed, and stored unless a document with the same bytes exists.
+ *  The handle stays open, with nothing left to write.
+ *  @param c a handle opened for writing
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_contents_commit(gra_contents_t *c, GError **error);
+
+/** Closes a contents handle.  Staged contents which were not
+ *  committed are kept for the next writable handle.
+ *  @param c the handle, which is freed
+ */
+void gra_db_paper_contents_close(gra_contents_t *c);
+
+/** Stages size zero bytes as the new contents of a paper, to be
+ *  filled in through a writable handle and committed.  No memory is
+ *  allocated for them.  A size of 0 removes the contents of the paper
+ *  right away.
+ *  @param db the database connection
+ *  @param paperId ID of the paper
+ *  @param size the new size, or 0 to remove the contents
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_contents_create(gra_db_t *db, int paperId, gsize size,
+                                  GError **error);
+
+/** Stores a file as the contents of a paper.  The file is hashed
+ *  first, so one already in the database is only linked to the paper;
+ *  otherwise it is copied in chunks of GRA_CONTENTS_CHUNK_SIZE bytes.
+ *  @param db the database connection
+ *  @param paperId ID of the paper
+ *  @param filename the file to read
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_paper_contents_import(gra_db_t *db, int paperId, const gchar *filename,
+                                  GError **error);
+
 
 /* search functions */
-GList *gra_db_search_keyword(gra_db_t *db, const gchar *keyword, GError **error);
-GList *gra_db_search_title(gra_db_t *db, const gchar *title, GError **error);
-GList *gra_db_search_author(gra_db_t *db, const gchar *author, GError **error);
+
+/** Full-text search over titles, authors and field values.  Results
+ *  are ranked by BM25, with title matches weighted above author
+ *  matches and author matches above field matches.  Every word must
+ *  match; the last word also matches as a prefix.
+ *  @param db the database connection
+ *  @param keyword the words to look for
+ *  @param limit maximum number of papers to return, or -1 for no limit
+ *  @param offset number of ranked papers to skip
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return A list of gra_paper_t, best match first.  The fields and
+ *  references are not loaded.  Free with
+ *  g_list_free_full(list, (GDestroyNotify) gra_paper_free).
+ */
+GList *gra_db_search_keyword(gra_db_t *db, const gchar *keyword,
+                             int limit, int offset, GError **error);
+
+/** As gra_db_search_keyword, matching titles only. */
+GList *gra_db_search_title(gra_db_t *db, const gchar *title,
+                           int limit, int offset, GError **error);
+
+/** Finds the papers of an author.  Names are compared without case,
+ *  accents or the dots of initials, so "R. J. Lowe" and "Lowe, R J"
+ *  are the same, and an accented surname is found without its
+ *  accents.  A single word matches surnames, and only whole ones:
+ *  "Lowe" does not find "Lowell".  Given names narrow that down to
+ *  authors whose given names start the same way, so "Lowe, R" finds
+ *  both "Robert Lowe" and "R. J. Lowe".  The lookup seeks the author
+ *  index, so it does not slow down as the library grows.
+ *  @param db the database connection
+ *  @param author the name to look for
+ *  @param limit maximum number of papers to return, or -1 for no limit
+ *  @param offset number of papers to skip
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return A list of gra_paper_t, those with the author first in their
+ *  author list first, then by ID.  The fields and references are not
+ *  loaded.  Free with g_list_free_full(list, (GDestroyNotify)
+ *  gra_paper_free).
+ */
+GList *gra_db_search_author(gra_db_t *db, const gchar *author,
+                            int limit, int offset, GError **error);
+
+/** @struct gra_author_t
+ *  @brief An author, as found by gra_db_author_complete.
+ *  @var gra_author_t::id ID of the author.
+ *  @var gra_author_t::name The name, as it was first written.
+ *  @var gra_author_t::paperCount Papers listing the author.
+ */
+typedef struct gra_author_t {
+  int id;
+  gchar *name;
+  int paperCount;
+} gra_author_t;
+
+/** @struct gra_author_stats_t
+ *  @brief What the library holds of an author.
+ *  @var gra_author_stats_t::papers Papers listing the author.
+ *  @var gra_author_stats_t::firstYear Year of the earliest of them, or
+ *  0 if none has a year.
+ *  @var gra_author_stats_t::lastYear Year of the latest of them, or 0.
+ *  @var gra_author_stats_t::citations References to them from papers
+ *  in the library.
+ *  @var gra_author_stats_t::coauthors Other authors sharing a paper
+ *  with the author.
+ */
+typedef struct gra_author_stats_t {
+  int papers;
+  int firstYear;
+  int lastYear;
+  int citations;
+  int coauthors;
+} gra_author_stats_t;
+
+/** Completes an author's name as it is typed.  The text is compared
+ *  as gra_db_search_author compares names, with the surname first:
+ *  "low" finds "Lowe, Robert" and "Lowell, Amy"; "lowe, r" finds only
+ *  the first.
+ *  @param db the database connection
+ *  @param text the start of the name
+ *  @param limit maximum number of authors to return, or -1 for no limit
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return A list of gra_author_t in order of their names.  Free with
+ *  g_list_free_full(list, (GDestroyNotify) gra_author_free).
+ */
+GList *gra_db_author_complete(gra_db_t *db, const gchar *text, int limit,
+                              GError **error);
+
+/** Gathers the statistics of an author.
+ *  @param db the database connection
+ *  @param authorId ID of the author
+ *  @param stats filled in, or zeroed if there is no such author
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_db_author_stats(gra_db_t *db, int authorId, gra_author_stats_t *stats,
+                         GError **error);
+
+/** Frees an author.
+ *  @param a the author
+ */
+void gra_author_free(gra_author_t *a);
+
+/** Full-text search over the text of the papers' documents, as far as
+ *  the indexer has got with them.  Papers are ranked by their best
+ *  matching page.  Words are matched as by gra_db_search_keyword.
+ *  @param db the database connection
+ *  @param text the words to look for
+ *  @param limit maximum number of papers to return, or -1 for no limit
+ *  @param offset number of ranked papers to skip
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return A list of gra_paper_t, best match first, as from
+ *  gra_db_search_keyword.
+ */
+GList *gra_db_search_body(gra_db_t *db, const gchar *text,
+                          int limit, int offset, GError **error);
 #endif
@@ -1,9 +1,95 @@
 #include "data.h"
+#include "citegraph.h"
+#include "query.h"
+#include "indexer.h"
+#include "worker.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* papers in the database each feature test starts from */
+#define FIXTURE_PAPERS 2000
+
+typedef int (*test_func)(const char *filename);
+
+static int upgrade_test(const char *filename, int rows);
+static int browse_test(const char *filename);
+static int save_test(const char *filename);
+static int authors_test(const char *filename);
+static int trace_test(const char *filename);
+static int query_test(const char *filename);
+static int citations_test(const char *filename);
+static int delete_test(const char *filename);
+static int pool_test(const char *filename);
+static int contents_test(const char *filename);
+static int indexer_test(const char *filename);
+static int worker_test(const char *filename);
+static gpointer acquire_thread(gpointer data);
+static void async_done(GObject *source, GAsyncResult *result, gpointer data);
+static gboolean async_timeout(gpointer data);
+static void store_text(gra_db_t *db, int paperId, const gchar *text, GError **error);
+static gra_db_t *fixture(const char *filename, GError **error);
+static void make_v1(const char *filename, int papers);
+static gboolean print_progress(const gchar *description, int step, int steps, gpointer data);
+static gboolean cancel_progress(const gchar *description, int step, int steps, gpointer data);
+static int count(gra_db_t *db, const char *sql);
+static void count_writes(void *data, int op, const char *dbName, const char *table,
+                         sqlite3_int64 rowid);
+
+/* rows written to each table, as counted by count_writes */
+typedef struct table_writes {
+  int paper;
+  int authorship;
+  int field;
+} table_writes;
+
+/* one asynchronous request of worker_test, and its result once done */
+typedef struct async_call {
+  GMainLoop *loop;
+  int *pending;
+  GAsyncResult *result;
+} async_call;
+
+/* the feature tests, by the name given to --test */
+static const struct {
+  const char *name;
+  test_func func;
+} tests[] = {
+  { "browse", browse_test },
+  { "save", save_test },
+  { "authors", authors_test },
+  { "trace", trace_test },
+  { "query", query_test },
+  { "citations", citations_test },
+  { "delete", delete_test },
+  { "pool", pool_test },
+  { "contents", contents_test },
+  { "indexer", indexer_test },
+  { "worker", worker_test }
+};
+
+#define CHECK(cond, ...) \
+  if(!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); return 1; }
 
 int main(int argc, char **argv) {
   gra_db_t *db;
   GError *err=NULL;
+  int i;
+
+  /* dataTest --upgrade file [rows] */
+  if(argc > 2 && !strcmp(argv[1], "--upgrade")) {
+    return upgrade_test(argv[2], argc > 3 ? atoi(argv[3]) : FIXTURE_PAPERS * 10);
+  }
+
+  /* dataTest --test name file */
+  if(argc > 3 && !strcmp(argv[1], "--test")) {
+    for(i=0; i < G_N_ELEMENTS(tests); i++) {
+      if(!strcmp(argv[2], tests[i].name))
+        return tests[i].func(argv[3]);
+    }
+    printf("no test named %s\n", argv[2]);
+    return 1;
+  }
 
   db = gra_db_open(argv[1], &err);
   gra_db_close(db, &err);
@@ -14,3 +100,866 @@ int main(int argc, char **argv) {
 
   return 0;
 }
+
+
+/* Build a version 1.0 file with about the given number of rows, then
+   upgrade it: once cancelled, once for real, and check the result. */
+static int
+upgrade_test(const char *filename, int rows) {
+  gra_db_t *db;
+  GError *err=NULL;
+  int papers = rows / 10;
+  int calls = 0;
+
+  remove(filename);
+  make_v1(filename, papers);
+
+  /* an old file opens as is when asked */
+  db = gra_db_open_full(filename, GRA_DB_OPEN_NO_UPGRADE, &err);
+  CHECK(db && !err, "open without upgrade: %s", err ? err->message : "");
+  CHECK(db->version == 1.0, "expected version 1.0, got %.1f", db->version);
+
+  /* a cancelled upgrade leaves the file as it was */
+  gra_db_upgrade(db, cancel_progress, &calls, &err);
+  CHECK(err && err->code == 6, "expected the upgrade to be cancelled");
+  g_clear_error(&err);
+  CHECK(db->version == 1.0, "cancelled upgrade moved to %.1f", db->version);
+  CHECK(!count(db, "SELECT count(*) FROM sqlite_master WHERE name='FieldPaper'"),
+        "cancelled upgrade left an index behind");
+
+  /* the real thing */
+  gra_db_upgrade(db, print_progress, NULL, &err);
+  CHECK(!err, "upgrade: %s", err->message);
+  CHECK(db->version == GRA_DB_VERSION, "upgrade stopped at %.1f", db->version);
+  gra_db_close(db, &err);
+
+  /* reopening is a no-op */
+  db = gra_db_open(filename, &err);
+  CHECK(db && !err, "reopen: %s", err ? err->message : "");
+  CHECK(count(db, "SELECT Version FROM MetaInfo") == (int) GRA_DB_VERSION,
+        "MetaInfo not updated");
+
+  /* nothing lost, everything indexed */
+  CHECK(count(db, "SELECT count(*) FROM Paper") == papers, "papers lost");
+  CHECK(count(db, "SELECT count(*) FROM Field") == papers * 8, "fields lost");
+  CHECK(count(db, "SELECT count(*) FROM Reference") == papers, "references lost");
+  CHECK(count(db, "SELECT count(*) FROM PaperText") == papers, "text index incomplete");
+  CHECK(count(db, "SELECT count(*) FROM sqlite_master WHERE type='index' AND name IN"
+              " ('FieldPaper', 'NotePage', 'ReferenceRefPaper',"
+              "  'PaperTitle', 'PaperAuthor', 'PaperYear', 'AuthorKey', 'AuthorPaper')") == 8,
+        "indexes missing");
+  CHECK(count(db, "SELECT count(*) FROM sqlite_master WHERE name='PaperContents'") == 0,
+        "contents table left behind");
+  CHECK(count(db, "SELECT count(*) FROM Document") == 3, "documents not shared");
+  CHECK(count(db, "SELECT sum(RefCount) FROM Document") ==
+        count(db, "SELECT count(*) FROM Paper WHERE DocumentID IS NOT NULL") &&
+        count(db, "SELECT count(*) FROM Paper WHERE DocumentID IS NOT NULL") == papers / 100,
+        "document references wrong");
+  CHECK(count(db, "SELECT count(*) FROM sqlite_master WHERE name IN"
+              " ('DocumentText', 'DocumentIndex', 'PaperDocument')") == 3,
+        "document text index missing");
+  CHECK(count(db, "SELECT count(*) FROM Note") == papers / 1000 &&
+        count(db, "SELECT count(*) FROM Note WHERE LeftNote='first' || char(10) || 'second'"
+              " AND RightNote='margin'") == papers / 1000,
+        "notes not merged");
+  CHECK(count(db, "SELECT count(*) FROM Author") == 1000 &&
+        count(db, "SELECT count(*) FROM Authorship") == papers &&
+        count(db, "SELECT sum(PaperCount) FROM Author") == papers,
+        "authors not listed");
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+
+  printf("upgraded %d papers, %d rows\n", papers, papers * 10);
+  return 0;
+}
+
+
+/* Browsing by key agrees with browsing by offset */
+static int
+browse_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_paper_t **page, **next, **skipped;
+  int n;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* the second page, found by key, is the one found by offset */
+  page = gra_db_paper_browse(db, GRA_SORT_TITLE, TRUE, NULL, 0, 10, &n, &err);
+  CHECK(!err && n == 10, "browse found %d papers", n);
+  next = gra_db_paper_browse(db, GRA_SORT_TITLE, TRUE, page[9], 0, 10, &n, &err);
+  CHECK(!err && n == 10, "browse after found %d papers", n);
+  skipped = gra_db_paper_browse(db, GRA_SORT_TITLE, TRUE, NULL, 10, 10, &n, &err);
+  CHECK(!err && n == 10 && next[0]->id == skipped[0]->id && next[9]->id == skipped[9]->id,
+        "browse pages disagree");
+  gra_paper_free_many(page, 10);
+  gra_paper_free_many(next, 10);
+  gra_paper_free_many(skipped, 10);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Saving writes only what changed */
+static int
+save_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_paper_t *p;
+  int changes;
+  table_writes writes = { 0, 0, 0 };
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* marking a paper read writes that column alone, so the text index
+     is left alone */
+  p = gra_db_paper_load(db, 5, &err);
+  CHECK(p && !err, "load: %s", err ? err->message : "");
+  gra_paper_set_read(p, !p->read);
+  changes = sqlite3_total_changes(db->db);
+  gra_db_paper_save(db, p, &err);
+  CHECK(!err && sqlite3_total_changes(db->db) - changes == 1,
+        "marking read changed %d rows", sqlite3_total_changes(db->db) - changes);
+  CHECK(count(db, "SELECT Read FROM Paper WHERE ID=5") == p->read, "read not saved");
+  gra_paper_free(p);
+
+  /* a paper marked changed with no columns marked is written whole */
+  p = gra_db_paper_load(db, 6, &err);
+  CHECK(p && !err, "load: %s", err ? err->message : "");
+  g_free(p->title);
+  p->title = g_strdup("Assigned");
+  p->changed = TRUE;
+  gra_db_paper_save(db, p, &err);
+  CHECK(!err && count(db, "SELECT count(*) FROM Paper WHERE ID=6 AND Title='Assigned'") == 1,
+        "assigned title not saved");
+  CHECK(count(db, "SELECT count(*) FROM Authorship WHERE PaperID=6") == 1,
+        "authors lost on a full save");
+  gra_paper_free(p);
+
+  /* editing a field writes the field alone, not its paper or the
+     paper's authors; the text index follows by trigger */
+  p = gra_db_paper_load(db, 7, &err);
+  CHECK(p && !err, "load: %s", err ? err->message : "");
+  gra_db_paper_load_fields(db, p, &err);
+  CHECK(!err, "load fields: %s", err->message);
+  gra_paper_set_field(p, "field3", "edited");
+  sqlite3_update_hook(db->db, count_writes, &writes);
+  gra_db_paper_save(db, p, &err);
+  sqlite3_update_hook(db->db, NULL, NULL);
+  CHECK(!err && writes.field == 1 && !writes.paper && !writes.authorship,
+        "a field edit wrote %d fields, %d papers, %d authorships",
+        writes.field, writes.paper, writes.authorship);
+  CHECK(count(db, "SELECT count(*) FROM Field WHERE PaperID=7 AND Name='field3'"
+              " AND Value='edited'") == 1, "field not saved");
+  gra_paper_free(p);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Authors are split out of papers and found by name */
+static int
+authors_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  GList *hits;
+  gra_paper_t *p;
+  gra_author_stats_t author;
+  int papers = FIXTURE_PAPERS;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* an author list is split up, and each author found however they
+     are written, but not by a longer surname */
+  p = gra_paper_new();
+  gra_paper_set_author(p, "Lowell, Amy and R. J. L{\\\"o}we and Author 42 and others");
+  gra_paper_set_title(p, "Authors");
+  gra_paper_set_year(p, 1990);
+  gra_db_paper_save(db, p, &err);
+  CHECK(!err, "save: %s", err->message);
+  hits = gra_db_search_author(db, "Lowe, R.", -1, 0, &err);
+  CHECK(!err && g_list_length(hits) == 1 && ((gra_paper_t *) hits->data)->id == p->id,
+        "author not found");
+  g_list_free_full(hits, (GDestroyNotify) gra_paper_free);
+  hits = gra_db_search_author(db, "Author 42", -1, 0, &err);
+  CHECK(!err && g_list_length(hits) == papers / 1000 + 1 &&
+        ((gra_paper_t *) g_list_last(hits)->data)->id == p->id, "co-author not found");
+  g_list_free_full(hits, (GDestroyNotify) gra_paper_free);
+  hits = gra_db_author_complete(db, "LOW", 10, &err);
+  CHECK(!err && g_list_length(hits) == 2 &&
+        !strcmp(((gra_author_t *) hits->data)->name, "R. J. L{\\\"o}we"),
+        "completion wrong");
+  g_list_free_full(hits, (GDestroyNotify) gra_author_free);
+  hits = gra_db_author_complete(db, "42", 1, &err);
+  CHECK(!err && hits, "completion found nothing");
+  gra_db_author_stats(db, ((gra_author_t *) hits->data)->id, &author, &err);
+  g_list_free_full(hits, (GDestroyNotify) gra_author_free);
+  CHECK(!err && author.papers == papers / 1000 + 1 && author.firstYear == 1990 &&
+        author.lastYear == 2000 && author.citations == papers / 1000 &&
+        author.coauthors == 2, "author stats wrong");
+  gra_db_paper_delete(db, p, &err);
+  gra_paper_free(p);
+  CHECK(!err && count(db, "SELECT count(*) FROM Author") == 1000,
+        "authors kept after their paper");
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Statements are timed while tracing */
+static int
+trace_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  GList *hits;
+  gra_db_stats_t *stats;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* the search is timed, and logged as slow with no threshold */
+  gra_db_trace(db, TRUE, 0);
+  hits = gra_db_search_keyword(db, "paper42", 10, 0, &err);
+  CHECK(!err && hits, "search after upgrade found nothing");
+  g_list_free_full(hits, (GDestroyNotify) gra_paper_free);
+  stats = gra_db_stats(db, TRUE);
+  CHECK(stats && stats->statements->len && stats->calls && stats->rows &&
+        stats->slow->len == MIN(stats->calls, GRA_DB_SLOW_LOG_SIZE),
+        "search not timed");
+  gra_db_stats_free(stats);
+  gra_db_trace(db, FALSE, -1);
+  CHECK(!gra_db_stats(db, FALSE), "timings kept after tracing stopped");
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Queries combine conditions and page in order */
+static int
+query_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_query_t *query;
+  gra_paper_t **page, *p;
+  int paged = 0;
+  int n;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* conditions of every kind combine into one query */
+  query = gra_query_new();
+  gra_query_read(query, FALSE);
+  gra_query_type(query, "article");
+  gra_query_author(query, "Author 42");
+  gra_query_year(query, 1990, 2010);
+  gra_query_field(query, "field3", "of 1042");
+  gra_query_cited_by(query, 1041);
+  page = gra_query_run(db, query, NULL, 10, &n, &err);
+  CHECK(!err && n == 1 && page[0]->id == 1042, "query found %d papers", n);
+  gra_paper_free_many(page, n);
+  gra_query_free(query);
+
+  /* and page through their results in order */
+  query = gra_query_new();
+  gra_query_author(query, "Author 42");
+  gra_query_order(query, GRA_SORT_TITLE, TRUE);
+  p = NULL;
+  do {
+    page = gra_query_run(db, query, p, 5, &n, &err);
+    CHECK(!err, "query: %s", err->message);
+    CHECK(!p || !n || g_ascii_strcasecmp(page[0]->title, p->title) < 0, "query pages out of order");
+    paged += n;
+    if(p)
+      gra_paper_free(p);
+    p = n ? gra_paper_ref(page[n - 1]) : NULL;
+    gra_paper_free_many(page, n);
+  } while(p);
+  gra_query_free(query);
+  CHECK(paged == count(db, "SELECT count(*) FROM Paper WHERE Author LIKE '%Author 42%'"),
+        "query paged through %d papers", paged);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* The citation graph follows saved and deleted citations */
+static int
+citations_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_citegraph_t *graph;
+  gra_reference_t ref = { 0, 1, 3, FALSE, TRUE }, undone = { 0, 1, 4, FALSE, TRUE };
+  GArray *found;
+  gra_paper_t *p;
+  int papers = FIXTURE_PAPERS;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* each paper cites the next, round the ring */
+  graph = gra_citegraph_new(db, 0, &err);
+  CHECK(graph && !err, "citation graph: %s", err ? err->message : "");
+  CHECK(gra_citegraph_count(graph, 1, GRA_CITES) == 1 &&
+        gra_citegraph_count(graph, 1, GRA_CITED_BY) == 1, "citations lost");
+  found = gra_citegraph_closure(graph, 1, GRA_CITES, 3);
+  CHECK(found->len == 3 && g_array_index(found, gra_citation_hit_t, 2).paperId == 4 &&
+        g_array_index(found, gra_citation_hit_t, 2).score == 3, "closure wrong");
+  g_array_unref(found);
+
+  /* a saved citation shows at once, one rolled back never does */
+  gra_db_reference_save(db, &ref, &err);
+  gra_db_batch_begin(db, &err);
+  gra_db_reference_save(db, &undone, &err);
+  gra_db_batch_rollback(db, &err);
+  CHECK(!err, "save reference: %s", err->message);
+  CHECK(gra_citegraph_count(graph, 1, GRA_CITES) == 2, "graph not updated");
+  found = gra_citegraph_cocited(graph, 2, -1);
+  CHECK(found->len == 1 && g_array_index(found, gra_citation_hit_t, 0).paperId == 3,
+        "co-citation wrong");
+  g_array_unref(found);
+  found = gra_citegraph_coupled(graph, 1, -1);
+  CHECK(found->len == 1 && g_array_index(found, gra_citation_hit_t, 0).paperId == 2,
+        "coupling wrong");
+  g_array_unref(found);
+  found = gra_citegraph_most_cited(graph, 1);
+  CHECK(found->len == 1 && g_array_index(found, gra_citation_hit_t, 0).paperId == 3 &&
+        g_array_index(found, gra_citation_hit_t, 0).score == 2, "most cited wrong");
+  g_array_unref(found);
+  found = gra_citegraph_pagerank(graph, -1);
+  CHECK(found->len == papers &&
+        g_array_index(found, gra_citation_hit_t, 0).paperId == 3, "ranks wrong");
+  g_array_unref(found);
+  gra_db_reference_delete(db, &ref, &err);
+  CHECK(!err && gra_citegraph_count(graph, 3, GRA_CITED_BY) == 1, "graph kept a deleted citation");
+
+  /* deleting a paper takes its fields and citations with it */
+  p = gra_db_paper_load(db, 2, &err);
+  gra_db_paper_delete(db, p, &err);
+  CHECK(!err && !p->indb, "delete: %s", err ? err->message : "");
+  gra_paper_free(p);
+  CHECK(!count(db, "SELECT count(*) FROM Field WHERE PaperID=2") &&
+        !count(db, "SELECT count(*) FROM Reference WHERE 2 IN (PaperID, RefPaperID)"),
+        "delete did not cascade");
+  CHECK(gra_citegraph_count(graph, 1, GRA_CITES) == 0 &&
+        gra_citegraph_count(graph, 3, GRA_CITED_BY) == 0, "graph kept a deleted paper");
+  gra_citegraph_free(graph);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Deletes cascade, and compaction gives the space back */
+static int
+delete_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_db_compact_stats_t compacted;
+  int gone[] = { 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 1000, 1000 };
+  int n;
+  int papers = FIXTURE_PAPERS;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* many at once, with their notes and documents */
+  n = gra_db_paper_delete_many(db, gone, G_N_ELEMENTS(gone), &err);
+  CHECK(!err && n == 11, "deleted %d papers", n);
+  CHECK(count(db, "SELECT count(*) FROM Field") == (papers - 11) * 8 &&
+        count(db, "SELECT count(*) FROM Note") == papers / 1000 - 1 &&
+        count(db, "SELECT sum(RefCount) FROM Document") == papers / 100 - 1,
+        "delete many did not cascade");
+
+  /* compaction finds rows left behind, and gives space back */
+  sqlite3_exec(db->db, "INSERT INTO Field (PaperID, Name, Value) VALUES(-1, 'lost', '')",
+               NULL, NULL, NULL);
+  gra_db_compact(db, &compacted, &err);
+  CHECK(!err, "compact: %s", err->message);
+  CHECK(compacted.orphans == 1 && compacted.bytesAfter < compacted.bytesBefore,
+        "compact removed %lu rows, %" G_GINT64_FORMAT " to %" G_GINT64_FORMAT " bytes",
+        compacted.orphans, compacted.bytesBefore, compacted.bytesAfter);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Readers are shared out up to the limit, and the pool shrinks
+   under its waiters */
+static int
+pool_test(const char *filename) {
+  gra_db_t *db, *a, *b;
+  GError *err=NULL;
+  GThread *waiter;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  gra_db_pool_set_readers(db, 2, &err);
+  a = gra_db_reader_acquire(db, &err);
+  b = gra_db_reader_acquire(db, &err);
+  CHECK(a && b && a != b && !err && db->readerCount == 2,
+        "acquire: %s", err ? err->message : "");
+
+  /* a thread waiting for a reader is let go when the pool goes */
+  waiter = g_thread_new("waiter", acquire_thread, db);
+  g_usleep(G_USEC_PER_SEC / 10);
+  gra_db_pool_set_readers(db, 0, &err);
+  CHECK(!g_thread_join(waiter), "a reader was handed out of an empty pool");
+  gra_db_reader_release(db, a);
+  gra_db_reader_release(db, b);
+  CHECK(!err && db->readerCount == 0, "%d readers kept", db->readerCount);
+
+  /* idle readers over a new limit are closed */
+  gra_db_pool_set_readers(db, 2, &err);
+  a = gra_db_reader_acquire(db, &err);
+  b = gra_db_reader_acquire(db, &err);
+  gra_db_reader_release(db, a);
+  gra_db_reader_release(db, b);
+  CHECK(!err && db->readerCount == 2, "%d readers open", db->readerCount);
+  gra_db_pool_set_readers(db, 1, &err);
+  CHECK(!err && db->readerCount == 1, "%d readers kept", db->readerCount);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Wait for a reader, giving back what came */
+static gpointer
+acquire_thread(gpointer data) {
+  gra_db_t *db = data;
+  GError *err = NULL;
+  gra_db_t *reader;
+
+  reader = gra_db_reader_acquire(db, &err);
+  g_clear_error(&err);
+
+  return reader;
+}
+
+
+/* Contents go in and come back out in pieces, whether they are
+   stored inside the database or as an external file */
+static int
+contents_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_contents_t *c;
+  gsize sizes[] = { 3000, 300000 };
+  gsize threshold = 100000;
+  gsize size, at;
+  gchar *data, buf[1000];
+  int i;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+  gra_db_set_external_threshold(db, threshold);
+
+  for(i=0; i < G_N_ELEMENTS(sizes); i++) {
+    size = sizes[i];
+    data = g_malloc(size);
+    for(at=0; at < size; at++)
+      data[at] = (at * 7 + i) % 251;
+
+    /* written a chunk at a time, but never past the end */
+    gra_db_paper_contents_create(db, i + 1, size, &err);
+    c = gra_db_paper_contents_open(db, i + 1, TRUE, &err);
+    CHECK(c && !err, "open for writing: %s", err ? err->message : "");
+    for(at=0; at < size && !err; at += sizeof(buf))
+      gra_db_paper_contents_write(c, data + at, MIN(sizeof(buf), size - at), at, &err);
+    CHECK(!err, "write: %s", err->message);
+    gra_db_paper_contents_write(c, data, 2, size - 1, &err);
+    CHECK(err && err->code == 4, "wrote past the end of %" G_GSIZE_FORMAT " bytes", size);
+    g_clear_error(&err);
+    gra_db_paper_contents_commit(c, &err);
+    gra_db_paper_contents_close(c);
+    CHECK(!err, "commit: %s", err->message);
+
+    /* read back from anywhere, with nothing past the end */
+    c = gra_db_paper_contents_open(db, i + 1, FALSE, &err);
+    CHECK(c && !err && gra_db_paper_contents_size(c) == size,
+          "open for reading: %s", err ? err->message : "wrong size");
+    CHECK((gra_db_paper_contents_map(c) != NULL) == (size >= threshold),
+          "%" G_GSIZE_FORMAT " bytes stored in the wrong place", size);
+    CHECK(gra_db_paper_contents_read(c, buf, sizeof(buf), 0, &err) == sizeof(buf) &&
+          !memcmp(buf, data, sizeof(buf)), "start read back wrong");
+    CHECK(gra_db_paper_contents_read(c, buf, sizeof(buf), size / 2 + 1, &err) == sizeof(buf) &&
+          !memcmp(buf, data + size / 2 + 1, sizeof(buf)), "middle read back wrong");
+    CHECK(gra_db_paper_contents_read(c, buf, sizeof(buf), size - 10, &err) == 10 &&
+          !memcmp(buf, data + size - 10, 10), "end read back wrong");
+    CHECK(gra_db_paper_contents_read(c, buf, sizeof(buf), size, &err) == 0 &&
+          gra_db_paper_contents_read(c, buf, sizeof(buf), size + 10, &err) == 0,
+          "read past the end");
+    CHECK(!err, "read: %s", err->message);
+    gra_db_paper_contents_close(c);
+    g_free(data);
+  }
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* A document whose external file has gone is marked failed, and the
+   walk carries on to the documents after it */
+static int
+indexer_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  gra_indexer_t *ix;
+  gra_indexer_stats_t stats;
+  sqlite3_stmt *stmt;
+  gchar *text, *path;
+  int i;
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+
+  /* papers 1 to 3 have no contents yet, so theirs come last in the walk */
+  gra_db_set_external_threshold(db, 64);
+  for(i=1; i <= 3; i++) {
+    text = g_strdup_printf("The first page of the contents of paper %d.\f"
+                           "The second page of the contents of paper %d.", i, i);
+    store_text(db, i, text, &err);
+    g_free(text);
+    CHECK(!err, "store contents of paper %d: %s", i, err->message);
+  }
+
+  CHECK(sqlite3_prepare_v2(db->db, "SELECT Hash FROM Document WHERE ID="
+                           "(SELECT DocumentID FROM Paper WHERE ID=1)",
+                           -1, &stmt, NULL) == SQLITE_OK &&
+        sqlite3_step(stmt) == SQLITE_ROW, "no document on paper 1");
+  path = g_strdup_printf("%s-documents" G_DIR_SEPARATOR_S "%.2s" G_DIR_SEPARATOR_S "%s",
+                         sqlite3_db_filename(db->db, "main"),
+                         sqlite3_column_text(stmt, 0), sqlite3_column_text(stmt, 0));
+  sqlite3_finalize(stmt);
+  CHECK(!remove(path), "remove %s", path);
+  g_free(path);
+
+  ix = gra_indexer_start(db, 1, &err);
+  CHECK(ix && !err, "start: %s", err ? err->message : "");
+  gra_indexer_kick(ix);
+  for(i=0; i < 1000; i++) {
+    gra_indexer_get_stats(ix, &stats);
+    if(stats.idle) break;
+    g_usleep(10000);
+  }
+  gra_indexer_stop(ix);
+  CHECK(stats.idle, "indexer still busy after ten seconds");
+
+  CHECK(gra_db_paper_text_state(db, 1, &err) == GRA_TEXT_FAILED,
+        "missing document not marked failed");
+  CHECK(gra_db_paper_text_state(db, 2, &err) == GRA_TEXT_INDEXED &&
+        gra_db_paper_text_state(db, 3, &err) == GRA_TEXT_INDEXED,
+        "walk stopped at the missing document");
+  CHECK(!err, "text state: %s", err->message);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* Requests queued behind a busy worker merge only where they may:
+   saves of one paper share a write, a load stays behind a save of the
+   same paper, a newer search drops the waiting one, and a cancelled
+   request is never run */
+static int
+worker_test(const char *filename) {
+  gra_db_t *db;
+  GError *err=NULL;
+  GMainLoop *loop;
+  GCancellable *cancel;
+  async_call calls[9];
+  table_writes writes = {0};
+  gra_paper_t *edited, *saved, *p;
+  GList *papers;
+  guint timeout;
+  int i, pending = G_N_ELEMENTS(calls);
+
+  db = fixture(filename, &err);
+  CHECK(db && !err, "fixture: %s", err ? err->message : "");
+  edited = gra_db_paper_load(db, 20, &err);
+  saved = gra_db_paper_load(db, 10, &err);
+  CHECK(edited && saved && !err, "load: %s", err ? err->message : "");
+
+  loop = g_main_loop_new(NULL, FALSE);
+  cancel = g_cancellable_new();
+  for(i=0; i < G_N_ELEMENTS(calls); i++) {
+    calls[i].loop = loop;
+    calls[i].pending = &pending;
+    calls[i].result = NULL;
+  }
+
+  /* the worker waits on the lock with its first request, so the
+     rest stay queued until the loop runs */
+  gra_db_lock(db);
+  sqlite3_update_hook(db->db, count_writes, &writes);
+  gra_db_paper_load_async(db, 500, NULL, async_done, &calls[0]);
+
+  gra_paper_set_title(edited, "First edit");
+  gra_db_paper_save_async(db, edited, NULL, async_done, &calls[1]);
+  gra_paper_set_title(edited, "Second edit");
+  gra_db_paper_save_async(db, edited, NULL, async_done, &calls[2]);
+
+  gra_db_paper_load_async(db, 10, NULL, async_done, &calls[3]);
+  gra_paper_set_title(saved, "Saved title");
+  gra_db_paper_save_async(db, saved, NULL, async_done, &calls[4]);
+  gra_db_paper_load_async(db, 10, NULL, async_done, &calls[5]);
+
+  gra_db_search_title_async(db, "paper1", 10, 0, NULL, async_done, &calls[6]);
+  gra_db_search_title_async(db, "paper2", 10, 0, NULL, async_done, &calls[7]);
+
+  gra_db_paper_load_async(db, 30, cancel, async_done, &calls[8]);
+  g_cancellable_cancel(cancel);
+  gra_db_unlock(db);
+
+  timeout = g_timeout_add_seconds(10, async_timeout, loop);
+  g_main_loop_run(loop);
+  g_source_remove(timeout);
+  sqlite3_update_hook(db->db, NULL, NULL);
+  CHECK(!pending, "%d requests still waiting after ten seconds", pending);
+
+  p = gra_db_paper_load_finish(db, calls[0].result, &err);
+  CHECK(p && !err, "first load: %s", err ? err->message : "");
+  gra_paper_free(p);
+
+  /* two saves of one paper, one write of its last state */
+  CHECK(gra_db_paper_save_finish(db, calls[1].result, &err) &&
+        gra_db_paper_save_finish(db, calls[2].result, &err),
+        "save: %s", err ? err->message : "");
+  CHECK(writes.paper == 2, "%d paper rows written for two papers", writes.paper);
+  CHECK(count(db, "SELECT count(*) FROM Paper WHERE ID=20 AND Title='Second edit'") == 1,
+        "last edit not saved");
+
+  /* the load after the save sees it, the one before does not */
+  CHECK(gra_db_paper_save_finish(db, calls[4].result, &err),
+        "save: %s", err ? err->message : "");
+  p = gra_db_paper_load_finish(db, calls[3].result, &err);
+  CHECK(p && !err && !strcmp(p->title, "Title of paper10"),
+        "load before the save: %s", err ? err->message : "saw the save");
+  gra_paper_free(p);
+  p = gra_db_paper_load_finish(db, calls[5].result, &err);
+  CHECK(p && !err && !strcmp(p->title, "Saved title"),
+        "load after the save: %s", err ? err->message : "merged ahead of the save");
+  gra_paper_free(p);
+
+  /* the older search gives way to the newer */
+  papers = gra_db_search_finish(db, calls[6].result, &err);
+  CHECK(!papers && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED),
+        "superseded search not cancelled");
+  g_clear_error(&err);
+  papers = gra_db_search_finish(db, calls[7].result, &err);
+  CHECK(papers && !err, "newer search: %s", err ? err->message : "nothing found");
+  g_list_free_full(papers, (GDestroyNotify) gra_paper_free);
+
+  p = gra_db_paper_load_finish(db, calls[8].result, &err);
+  CHECK(!p && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED),
+        "cancelled load was run");
+  g_clear_error(&err);
+
+  for(i=0; i < G_N_ELEMENTS(calls); i++)
+    g_object_unref(calls[i].result);
+  g_object_unref(cancel);
+  g_main_loop_unref(loop);
+  gra_paper_free(edited);
+  gra_paper_free(saved);
+
+  gra_db_close(db, &err);
+  CHECK(!err, "close: %s", err->message);
+  return 0;
+}
+
+
+/* A fresh database of FIXTURE_PAPERS papers, upgraded from 1.0 */
+static gra_db_t *
+fixture(const char *filename, GError **error) {
+  remove(filename);
+  make_v1(filename, FIXTURE_PAPERS);
+
+  return gra_db_open(filename, error);
+}
+
+
+/* The 1.0 schema, filled with synthetic papers.  Each paper has
+   eight fields and one reference, and every thousandth has two notes
+   on the same page. */
+static void
+make_v1(const char *filename, int papers) {
+  sqlite3 *db;
+  sqlite3_stmt *paper, *field, *ref, *note;
+  int i, j;
+  char buf[64];
+
+  sqlite3_open(filename, &db);
+  sqlite3_exec(db,
+    "CREATE TABLE MetaInfo (Version REAL NOT NULL, Created INTEGER NOT NULL, LastUpdate INTEGER);"
+    "CREATE TABLE Paper (ID INTEGER PRIMARY KEY AUTOINCREMENT, FileName TEXT NOT NULL, Contents BLOB,"
+    " PageCount INTEGER, Read INTEGER NOT NULL, Type TEXT NOT NULL, Author TEXT NOT NULL,"
+    " Title TEXT NOT NULL, Year INTEGER);"
+    "CREATE TABLE Field (ID INTEGER PRIMARY KEY AUTOINCREMENT, PaperID INTEGER NOT NULL,"
+    " Name TEXT NOT NULL, Value TEXT NOT NULL, FOREIGN KEY (PaperID) REFERENCES Paper(ID));"
+    "CREATE TABLE Reference (PaperID INTEGER NOT NULL, RefPaperID INTEGER NOT NULL,"
+    " FOREIGN KEY (PaperID) REFERENCES Paper(ID), FOREIGN KEY (RefPaperID) REFERENCES Paper(ID),"
+    " PRIMARY KEY (PaperID, RefPaperID));"
+    "CREATE TABLE Note (ID INTEGER PRIMARY KEY AUTOINCREMENT, PaperID INTEGER NOT NULL,"
+    " Page INTEGER NOT NULL, LeftNote TEXT NOT NULL, RightNote TEXT NOT NULL,"
+    " FOREIGN KEY (PaperID) REFERENCES Paper(ID));"
+    "INSERT INTO MetaInfo VALUES(1.0, 0, 0);"
+    "BEGIN;",
+    NULL, NULL, NULL);
+
+  /* every hundredth paper has one of three documents */
+  sqlite3_prepare_v2(db, "INSERT INTO Paper (FileName, Contents, Read, Type, Author, Title, Year)"
+                     " VALUES('', CASE WHEN ?3 % 100 THEN NULL ELSE CAST('document ' || (?3 % 3) AS BLOB) END,"
+                     " 0, 'Article', ?1, ?2, 2000)", -1, &paper, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO Field (PaperID, Name, Value) VALUES(?, ?, ?)",
+                     -1, &field, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO Reference VALUES(?, ?)", -1, &ref, NULL);
+  sqlite3_prepare_v2(db, "INSERT INTO Note (PaperID, Page, LeftNote, RightNote)"
+                     " VALUES(?1, 7, 'first', 'margin'), (?1, 7, 'second', '')", -1, &note, NULL);
+
+  for(i=1; i<=papers; i++) {
+    sprintf(buf, "Author %d", i % 1000);
+    sqlite3_bind_text(paper, 1, buf, -1, SQLITE_TRANSIENT);
+    sprintf(buf, "Title of paper%d", i);
+    sqlite3_bind_text(paper, 2, buf, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(paper, 3, i);
+    sqlite3_step(paper);
+    sqlite3_reset(paper);
+
+    for(j=0; j<8; j++) {
+      sqlite3_bind_int(field, 1, i);
+      sprintf(buf, "field%d", j);
+      sqlite3_bind_text(field, 2, buf, -1, SQLITE_TRANSIENT);
+      sprintf(buf, "value %d of %d", j, i);
+      sqlite3_bind_text(field, 3, buf, -1, SQLITE_TRANSIENT);
+      sqlite3_step(field);
+      sqlite3_reset(field);
+    }
+
+    sqlite3_bind_int(ref, 1, i);
+    sqlite3_bind_int(ref, 2, i % papers + 1);
+    sqlite3_step(ref);
+    sqlite3_reset(ref);
+
+    if(i % 1000 == 0) {
+      sqlite3_bind_int(note, 1, i);
+      sqlite3_step(note);
+      sqlite3_reset(note);
+    }
+  }
+
+  sqlite3_finalize(paper);
+  sqlite3_finalize(field);
+  sqlite3_finalize(ref);
+  sqlite3_finalize(note);
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  sqlite3_close(db);
+}
+
+
+static gboolean
+print_progress(const gchar *description, int step, int steps, gpointer data) {
+  static int last = 0;
+
+  if(step != last) {
+    printf("step %d/%d: %s\n", step, steps, description);
+    last = step;
+  }
+  return TRUE;
+}
+
+
+/* let the first step start, then cancel it */
+static gboolean
+cancel_progress(const gchar *description, int step, int steps, gpointer data) {
+  int *calls = data;
+
+  return ++*calls < 2;
+}
+
+
+/* run a query which returns a single number */
+static int
+count(gra_db_t *db, const char *sql) {
+  sqlite3_stmt *stmt;
+  int result = -1;
+
+  if(sqlite3_prepare_v2(db->db, sql, -1, &stmt, NULL) != SQLITE_OK)
+    return -1;
+  if(sqlite3_step(stmt) == SQLITE_ROW)
+    result = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  return result;
+}
+
+
+/* tally the rows written to the tables save_test watches */
+static void
+count_writes(void *data, int op, const char *dbName, const char *table,
+             sqlite3_int64 rowid) {
+  table_writes *writes = data;
+
+  if(!strcmp(table, "Paper"))
+    writes->paper++;
+  else if(!strcmp(table, "Authorship"))
+    writes->authorship++;
+  else if(!strcmp(table, "Field"))
+    writes->field++;
+}
+
+
+/* keep the result of a worker_test request, and stop once all are in */
+static void
+async_done(GObject *source, GAsyncResult *result, gpointer data) {
+  async_call *call = data;
+
+  call->result = g_object_ref(result);
+  if(!--*call->pending)
+    g_main_loop_quit(call->loop);
+}
+
+
+/* give up on requests which never complete */
+static gboolean
+async_timeout(gpointer data) {
+  g_main_loop_quit(data);
+  return FALSE;
+}
+
+
+/* give a paper contents of the given text */
+static void
+store_text(gra_db_t *db, int paperId, const gchar *text, GError **error) {
+  gra_contents_t *c;
+  gsize size = strlen(text);
+
+  gra_db_paper_contents_create(db, paperId, size, error);
+  c = gra_db_paper_contents_open(db, paperId, TRUE, error);
+  if(!c) return;
+  gra_db_paper_contents_write(c, text, size, 0, error);
+  gra_db_paper_contents_commit(c, error);
+  gra_db_paper_contents_close(c);
+}
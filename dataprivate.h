@@ -0,0 +1,47 @@
+/*
+    Internals of the paper database shared with the modules which
+    build their own SQL.  Not part of the public interface.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DATAPRIVATE_H
+#define DATAPRIVATE_H
+
+#include <sqlite3.h>
+#include <glib.h>
+#include "datatypes.h"
+
+/** Builds a paper from the current row of a statement selecting
+ *  ID, FileName, PageCount, Read, Type, Author, Title, Year.
+ *  @param stmt the statement, on a row
+ *  @param arena The arena to carve the paper from, or NULL.
+ *  @return The paper, marked as in the database and unchanged.
+ */
+gra_paper_t *gra_db_paper_from_row(sqlite3_stmt *stmt, gra_arena_t *arena);
+
+/** Fetches the compiled statement for a piece of SQL, preparing it on
+ *  first use.  Statements are kept per connection, keyed by their
+ *  SQL, and counted in the connection's statement cache stats.  The
+ *  connection finalizes them when it closes.
+ *  @param db the connection
+ *  @param sql the SQL
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The statement, or NULL on error.  Callers reset it when
+ *  they are done with it.
+ */
+sqlite3_stmt *gra_db_stmt_prepare(gra_db_t *db, const gchar *sql, GError **error);
+
+#endif
@@ -21,6 +21,126 @@
 
 #include <sqlite3.h>
 
+/** Region allocator, see arena.h */
+typedef struct gra_arena_t gra_arena_t;
+
+/** Database worker thread, see worker.h */
+typedef struct gra_db_worker_t gra_db_worker_t;
+
+/** Statement timings, see gra_db_trace */
+typedef struct gra_db_trace_t gra_db_trace_t;
+
+/** Citation graph, see citegraph.h */
+typedef struct gra_citegraph_t gra_citegraph_t;
+
+
+/** @enum gra_db_stmt_id
+ *  @brief Slots in the prepared statement cache of a gra_db_t.  Each
+ *         data.c operation owns exactly one slot.
+ */
+typedef enum gra_db_stmt_id {
+  GRA_STMT_PAPER_LOAD,
+  GRA_STMT_PAPER_INSERT,
+  GRA_STMT_PAPER_FIELDS,
+  GRA_STMT_PAPER_REFS,
+  GRA_STMT_FIELD_INSERT,
+  GRA_STMT_FIELD_DELETE,
+  GRA_STMT_REF_INSERT,
+  GRA_STMT_REF_DELETE,
+  GRA_STMT_REF_GET,
+  GRA_STMT_BEGIN,
+  GRA_STMT_BEGIN_READ,
+  GRA_STMT_COMMIT,
+  GRA_STMT_ROLLBACK,
+  GRA_STMT_SAVEPOINT,
+  GRA_STMT_RELEASE,
+  GRA_STMT_ROLLBACK_TO,
+  GRA_STMT_SEARCH,
+  GRA_STMT_SEARCH_BODY,
+  GRA_STMT_TEXT_FLUSH,
+  GRA_STMT_TEXT_APPEND,
+  GRA_STMT_LOAD_BEGIN,
+  GRA_STMT_LOAD_END,
+  GRA_STMT_LOADSET_CLEAR,
+  GRA_STMT_LOADSET_ADD,
+  GRA_STMT_LOAD_PAPERS,
+  GRA_STMT_LOAD_FIELDS,
+  GRA_STMT_LOAD_REFS,
+  GRA_STMT_DELSET_CLEAR,
+  GRA_STMT_DELSET_ADD,
+  GRA_STMT_DELSET_DOCS,
+  GRA_STMT_DELSET_CITES,
+  GRA_STMT_DELSET_PAPERS,
+  GRA_STMT_DELSET_FIELDS,
+  GRA_STMT_DELSET_REFS,
+  GRA_STMT_DELSET_NOTES,
+  GRA_STMT_DELSET_AUTHORS,
+  GRA_STMT_CONTENTS_DOC,
+  GRA_STMT_STAGE_SIZE,
+  GRA_STMT_STAGE_CREATE,
+  GRA_STMT_STAGE_DELETE,
+  GRA_STMT_DOC_FIND,
+  GRA_STMT_DOC_INSERT,
+  GRA_STMT_DOC_CONTENTS,
+  GRA_STMT_DOC_REF,
+  GRA_STMT_DOC_INFO,
+  GRA_STMT_DOC_DELETE,
+  GRA_STMT_PAPER_SET_DOC,
+  GRA_STMT_NOTE_LOAD,
+  GRA_STMT_NOTE_INSERT,
+  GRA_STMT_NOTE_UPDATE,
+  GRA_STMT_NOTE_DELETE,
+  GRA_STMT_PAPER_COUNT,
+  GRA_STMT_AUTHOR_FIND,
+  GRA_STMT_AUTHOR_INSERT,
+  GRA_STMT_AUTHOR_LINK,
+  GRA_STMT_AUTHOR_UNLINK,
+  GRA_STMT_AUTHOR_PRUNE,
+  GRA_STMT_AUTHOR_SEARCH,
+  GRA_STMT_AUTHOR_COMPLETE,
+  GRA_STMT_AUTHOR_STATS,
+  /* one slot per sort column, direction, and first page or not */
+  GRA_STMT_BROWSE,
+  GRA_STMT_BROWSE_LAST = GRA_STMT_BROWSE + 15,
+  GRA_STMT_COUNT
+} gra_db_stmt_id;
+
+
+/** @enum gra_paper_column
+ *  @brief Columns of the Paper table, as bits of gra_paper_t::dirty.
+ */
+typedef enum gra_paper_column {
+  GRA_PAPER_FILE_NAME  = 1 << 0,
+  GRA_PAPER_PAGE_COUNT = 1 << 1,
+  GRA_PAPER_READ       = 1 << 2,
+  GRA_PAPER_TYPE       = 1 << 3,
+  GRA_PAPER_AUTHOR     = 1 << 4,
+  GRA_PAPER_TITLE      = 1 << 5,
+  GRA_PAPER_YEAR       = 1 << 6,
+  GRA_PAPER_ALL        = (1 << 7) - 1
+} gra_paper_column;
+
+/** @enum gra_field_column
+ *  @brief Columns of the Field table, as bits of gra_field_t::dirty.
+ */
+typedef enum gra_field_column {
+  GRA_FIELD_PAPER_ID = 1 << 0,
+  GRA_FIELD_NAME     = 1 << 1,
+  GRA_FIELD_VALUE    = 1 << 2,
+  GRA_FIELD_ALL      = (1 << 3) - 1
+} gra_field_column;
+
+/** @enum gra_reference_column
+ *  @brief Columns of the Reference table, as bits of
+ *         gra_reference_t::dirty.
+ */
+typedef enum gra_reference_column {
+  GRA_REFERENCE_PAPER_ID     = 1 << 0,
+  GRA_REFERENCE_REF_PAPER_ID = 1 << 1,
+  GRA_REFERENCE_ALL          = (1 << 2) - 1
+} gra_reference_column;
+
+
 /** @struct gra_db_t
  *  @brief The database type for all data interactions.
  *  @var gra_database_t::db
@@ -33,6 +153,79 @@
  *  @var gra_database_t::version Version of te schema
  *  @var gra_database_t::created Timestamp of the creation time of db.
  *  @var gra_database_t::lastUpdate Timestamp of last update of db.
+ *
+ *  @var gra_database_t::stmts Prepared statement cache, indexed by
+ *  gra_db_stmt_id.  Statements are prepared on first use and
+ *  finalized by gra_db_close.
+ *  @var gra_database_t::stmtHits Number of times a cached statement
+ *  was reused.
+ *  @var gra_database_t::stmtPrepares Number of times a statement had
+ *  to be prepared.
+ *  @var gra_database_t::paperUpdates UPDATEs of the Paper table which
+ *  set only some columns, by gra_paper_column mask.  Prepared on
+ *  first use, like stmts.
+ *  @var gra_database_t::fieldUpdates The same for the Field table.
+ *  @var gra_database_t::refUpdates The same for the Reference table.
+ *  @var gra_database_t::queries Statements compiled by
+ *  gra_db_stmt_prepare, such as those of gra_query_run, keyed by
+ *  their SQL.  NULL until the first one.
+ *  @var gra_database_t::batchDepth Nesting depth of open batches.  Zero
+ *  when the connection is in autocommit mode.
+ *  @var gra_database_t::textFirstPaper First paper inserted in the
+ *  current batch, or zero.  New papers are added to the text index
+ *  when the batch commits.
+ *  @var gra_database_t::textLastPaper Last paper inserted in the
+ *  current batch.
+ *  @var gra_database_t::textFirstField First field inserted in the
+ *  current batch, or zero.
+ *
+ *  @var gra_database_t::cache Identity cache of loaded papers, keyed
+ *  by paper ID.  NULL while the cache is disabled.
+ *  @var gra_database_t::cacheLru Cache entries, most recently used
+ *  first.
+ *  @var gra_database_t::cacheBudget Memory budget of the cache in
+ *  bytes.  Zero disables it.
+ *  @var gra_database_t::cacheBytes Estimated memory held by the cache.
+ *  @var gra_database_t::cacheHits Loads answered from the cache.
+ *  @var gra_database_t::cacheMisses Loads which went to the database.
+ *  @var gra_database_t::cacheEvictions Papers dropped to stay within
+ *  the budget.
+ *
+ *  @var gra_database_t::worker Thread running the asynchronous
+ *  requests, started by the first of them.  NULL until then.
+ *
+ *  @var gra_database_t::readOnly True for read-only connections, such
+ *  as pool readers.
+ *  @var gra_database_t::writeLock Serializes threads sharing the
+ *  connection, see gra_db_lock.
+ *  @var gra_database_t::readers Idle pool readers.  NULL without a
+ *  pool.
+ *  @var gra_database_t::readerLock Guards readers, readerCount and
+ *  readerMax.
+ *  @var gra_database_t::readerFree Signalled when a reader is
+ *  released, a slot frees up or the pool is resized.
+ *  @var gra_database_t::readerCount Number of readers open, idle or
+ *  not.
+ *  @var gra_database_t::readerMax Most readers the pool may open.
+ *  @var gra_database_t::mmapSize Bytes of the file SQLite may map into
+ *  memory, see gra_db_set_mmap_size.  Pool readers get the same.
+ *
+ *  @var gra_database_t::externalThreshold Size from which documents
+ *  are stored as external files, or zero.
+ *  @var gra_database_t::docSweep Hashes of external documents dropped
+ *  in the current batch.  Their files are removed once it commits.
+ *
+ *  @var gra_database_t::trace Statement timings, shared with the pool
+ *  readers, or NULL while they are not collected.
+ *  @var gra_database_t::traceRuns Statements of this connection which
+ *  have started and not finished, while timings are collected.
+ *
+ *  @var gra_database_t::citations The citation graph kept current with
+ *  the Reference table, or NULL.
+ *  @var gra_database_t::citeLog Citations added and removed in the
+ *  current batch, for the graph once it commits.
+ *  @var gra_database_t::citeMarks Length of citeLog as each open
+ *  savepoint began.
  */
 typedef struct gra_db_t {
   sqlite3 *db;
@@ -41,6 +234,47 @@ typedef struct gra_db_t {
   double version;
   int created;
   int lastUpdate;
+  /* prepared statement cache */
+  sqlite3_stmt *stmts[GRA_STMT_COUNT];
+  unsigned long stmtHits;
+  unsigned long stmtPrepares;
+  sqlite3_stmt *paperUpdates[GRA_PAPER_ALL + 1];
+  sqlite3_stmt *fieldUpdates[GRA_FIELD_ALL + 1];
+  sqlite3_stmt *refUpdates[GRA_REFERENCE_ALL + 1];
+  GHashTable *queries;
+  int batchDepth;
+  int textFirstPaper;
+  int textLastPaper;
+  int textFirstField;
+  /* paper identity cache */
+  GHashTable *cache;
+  GQueue cacheLru;
+  gsize cacheBudget;
+  gsize cacheBytes;
+  unsigned long cacheHits;
+  unsigned long cacheMisses;
+  unsigned long cacheEvictions;
+  /* asynchronous requests */
+  gra_db_worker_t *worker;
+  /* connection pool */
+  gboolean readOnly;
+  GRecMutex writeLock;
+  GQueue *readers;
+  GMutex readerLock;
+  GCond readerFree;
+  int readerCount;
+  int readerMax;
+  gint64 mmapSize;
+  /* document store */
+  gsize externalThreshold;
+  GPtrArray *docSweep;
+  /* instrumentation */
+  gra_db_trace_t *trace;
+  GHashTable *traceRuns;
+  /* citation graph */
+  gra_citegraph_t *citations;
+  GArray *citeLog;
+  GArray *citeMarks;
 } gra_db_t;
 
 
@@ -54,12 +288,40 @@ typedef struct gra_db_t {
  *  @var gra_paper_t::author Author of the paper.
  *  @var gra_paper_t::title Title of the paper.
  *  @var gra_paper_t::year The year of the paper's publication
- *  @var gra_paper_t::fields This paper's additional fields
- *  This uses GTree as an associative table.  The key is the field
- *  name and the value is the field struct itself.
+ *  @var gra_paper_t::fields This paper's additional fields, sorted by
+ *  name.  Use gra_paper_get_field and gra_paper_foreach_field rather
+ *  than walking the array.
+ *  @var gra_paper_t::fieldCount Number of fields.
+ *  @var gra_paper_t::fieldSpace Number of slots allocated in fields.
  *  @var gra_paper_t::refs The papers referenced by this paper.
  *  @var gra_paper_t::indb True if paper is in DB, False otherwise
- *  @var gra_paper_t::changed True if changed, false if not.
+ *  @var gra_paper_t::changed True if the paper, its fields or its
+ *  references need saving.
+ *  @var gra_paper_t::childrenChanged True if changed was set by
+ *  gra_paper_set_field rather than by a change to the paper's own
+ *  columns.
+ *  @var gra_paper_t::dirty The gra_paper_column bits of the columns
+ *  changed since the paper was loaded or saved.  Saving a paper
+ *  already in the database writes these columns and no others.  With
+ *  none set, it writes all of them, unless only its fields changed.
+ *  The gra_paper_set functions keep it; code assigning the members of
+ *  a saved paper directly may set the bits itself, or just set
+ *  changed.
+ *  @var gra_paper_t::refCount Number of holders.  The paper is freed
+ *  when the last one calls gra_paper_free.  Updated atomically, so
+ *  papers may be shared with the database worker thread.
+ *  @var gra_paper_t::arena The arena the paper, its strings, fields
+ *  and references were carved from, or NULL if they are individually
+ *  allocated.  Strings of an arena paper must not be freed or
+ *  replaced with g_free'able ones.
+ *  @var gra_paper_t::notes The notes loaded so far, keyed by page, or
+ *  NULL.  Notes are never carved from the arena.  Use
+ *  gra_paper_get_note and gra_paper_set_note.
+ *  @var gra_paper_t::noteBlocks One byte per block of
+ *  GRA_NOTE_BLOCK_PAGES pages, set once the notes of the block are
+ *  loaded.
+ *  @var gra_paper_t::notesDirty The notes changed since they were
+ *  last saved.
  */
 typedef struct gra_paper_t {
   int id;
@@ -70,10 +332,19 @@ typedef struct gra_paper_t {
   gchar *author;
   gchar *title;
   unsigned int year;
-  GTree *fields;
+  struct gra_field_t *fields;
+  int fieldCount;
+  int fieldSpace;
   GList *refs;
   gboolean indb;
   gboolean changed;
+  gboolean childrenChanged;
+  guint dirty;
+  int refCount;
+  gra_arena_t *arena;
+  GHashTable *notes;
+  GArray *noteBlocks;
+  GPtrArray *notesDirty;
 } gra_paper_t;
 
 
@@ -81,18 +352,22 @@ typedef struct gra_paper_t {
  *  @brief Used to store extra fields for the paper.
  *  @var gra_field_t::id ID of the field row
  *  @var gra_field_t::paperId ID of the paper this belongs to.
- *  @var gra_field_t::name The name of the field
+ *  @var gra_field_t::name The name of the field.  Names are interned
+ *  with g_intern_string, so equal names share one string.
  *  @var gra_field_t::value The value of the field
  *  @var gra_field_t::indb True if the field is in DB, False otherwise.
  *  @var gra_field_t_t::changed True if changed, false if not.
+ *  @var gra_field_t::dirty The gra_field_column bits of the columns
+ *  changed.  A changed field with none set has all of them written.
  */
 typedef struct gra_field_t {
   int id;
   int paperId;
-  gchar *name;
+  const gchar *name;
   gchar *value;
   gboolean indb;
   gboolean changed;
+  guint dirty;
 } gra_field_t;
 
 
@@ -104,6 +379,9 @@ typedef struct gra_field_t {
  *  @var gra_reference_t::refPaperId ID of the cited paper
  *  @var gra_reference_t::indb True if the field is in DB, False Otherwise.
  *  @var gra_reference_t::changed True if changed, false otherwise.
+ *  @var gra_reference_t::dirty The gra_reference_column bits of the
+ *  columns changed.  A changed reference with none set has all of
+ *  them written.
  */
 typedef struct gra_reference_t {
   int id;
@@ -111,11 +389,35 @@ typedef struct gra_reference_t {
   int refPaperId;
   gboolean indb;
   gboolean changed;
+  guint dirty;
 } gra_reference_t;
 
 
+/** @struct gra_contents_t
+ *  @brief An open handle on the Contents of a paper, see
+ *         gra_db_paper_contents_open.
+ *  @var gra_contents_t::db The connection the handle belongs to.
+ *  @var gra_contents_t::paperId ID of the paper.
+ *  @var gra_contents_t::blob The SQLite blob handle, or NULL when the
+ *  paper has no contents or they are external.
+ *  @var gra_contents_t::map The mapped file of an external document,
+ *  or NULL.
+ *  @var gra_contents_t::size Size of the contents in bytes.
+ *  @var gra_contents_t::writable True if opened for writing.
+ */
+typedef struct gra_contents_t {
+  gra_db_t *db;
+  int paperId;
+  sqlite3_blob *blob;
+  GMappedFile *map;
+  gsize size;
+  gboolean writable;
+} gra_contents_t;
+
+
 /** @struct gra_note_t
- *  @brief Stores the notes for a given paper.  
+ *  @brief Stores the notes for a given paper.  A paper has at most one
+ *         note per page.
  *  @var gra_note_t::id ID of the note row.
  *  @var gra_note_t::paperId ID of the paper this note belongs to.
  *  @var gra_note_t::page The page this note block belongs to.
@@ -0,0 +1,653 @@
+/*
+    BibTeX and CSL-JSON export for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include "export.h"
+#include "data.h"
+#include "arena.h"
+
+#define DB_ERROR(error)  g_set_error(error, GRA_DATA_ERROR, 1, "SQLite Error: %s", sqlite3_errmsg(db->db))
+
+#define EXPORT_OUT_BUFFER (256 * 1024)
+
+/* the three table walks, all in paper ID order */
+static const gchar *papersSql =
+  "SELECT \"ID\", \"FileName\", \"PageCount\", \"Read\", \"Type\", \"Author\", \"Title\", \"Year\""
+  " FROM \"Paper\" ORDER BY \"ID\"";
+static const gchar *fieldsSql =
+  "SELECT \"PaperID\", \"Name\", \"Value\" FROM \"Field\" ORDER BY \"PaperID\", \"ID\"";
+static const gchar *refsSql =
+  "SELECT r.\"PaperID\", COALESCE(k.\"Value\", 'gra' || r.\"RefPaperID\")"
+  " FROM \"Reference\" r LEFT JOIN \"Field\" k"
+  " ON k.\"PaperID\"=r.\"RefPaperID\" AND k.\"Name\"='citekey'"
+  " ORDER BY r.\"PaperID\", r.\"rowid\"";
+
+/* bibtex types and their CSL equivalents */
+static const gchar *cslTypes[][2] = {
+  {"article", "article-journal"}, {"book", "book"},
+  {"booklet", "pamphlet"}, {"conference", "paper-conference"},
+  {"inbook", "chapter"}, {"incollection", "chapter"},
+  {"inproceedings", "paper-conference"}, {"manual", "book"},
+  {"mastersthesis", "thesis"}, {"phdthesis", "thesis"},
+  {"proceedings", "book"}, {"techreport", "report"},
+  {"unpublished", "manuscript"}
+};
+
+/* bibtex fields and their CSL variables.  The first field present
+   wins when several map onto the same variable. */
+static const gchar *cslFields[][2] = {
+  {"journal", "container-title"}, {"booktitle", "container-title"},
+  {"volume", "volume"}, {"number", "issue"}, {"pages", "page"},
+  {"chapter", "chapter-number"}, {"edition", "edition"},
+  {"series", "collection-title"}, {"publisher", "publisher"},
+  {"school", "publisher"}, {"institution", "publisher"},
+  {"organization", "publisher"}, {"address", "publisher-place"},
+  {"doi", "DOI"}, {"url", "URL"}, {"isbn", "ISBN"}, {"issn", "ISSN"},
+  {"abstract", "abstract"}, {"keywords", "keyword"}, {"note", "note"}
+};
+
+/* a run of papers read and formatted together */
+typedef struct export_batch {
+  gra_arena_t *arena;
+  GPtrArray *papers;
+  GPtrArray *cites;
+  gboolean first;
+  GString *text;
+  gboolean done;
+} export_batch;
+
+/* state shared by the reader and the formatting threads */
+typedef struct exporter {
+  gra_db_t *db;
+  gra_export_format format;
+  sqlite3_stmt *papers;
+  sqlite3_stmt *fields;
+  sqlite3_stmt *refs;
+  gboolean papersDone;
+  int fieldsRc;
+  int refsRc;
+  GMutex lock;
+  GCond cond;
+} exporter;
+
+/* static method prototypes */
+static export_batch *read_batch(exporter *ex, GError **error);
+static void format_batch(gpointer data, gpointer user_data);
+static void write_batch(exporter *ex, export_batch *batch, FILE *out,
+                        gra_export_stats_t *stats, GError **error);
+static void write_text(FILE *out, const gchar *text, gsize len,
+                       gra_export_stats_t *stats, GError **error);
+static void free_batch(export_batch *batch);
+static void format_bibtex(GString *s, gra_paper_t *p, GString *cites);
+static void format_csl(GString *s, gra_paper_t *p);
+static const gchar *paper_key(gra_paper_t *p, gchar *buf, gsize len);
+static const gchar *field_value(gra_paper_t *p, const gchar *name);
+static void bib_value(GString *s, const gchar *value);
+static void json_string(GString *s, const gchar *value);
+static void json_names(GString *s, const gchar *names);
+static gboolean fieldBibVisit(gra_field_t *f, gpointer data);
+
+
+void
+gra_export(gra_db_t *db, const gchar *filename, gra_export_format format,
+           int threads, gra_export_stats_t *stats, GError **error) {
+  FILE *out;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  out = fopen(filename, "w");
+  if(!out) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s",
+                filename, g_strerror(errno));
+    return;
+  }
+  setvbuf(out, NULL, _IOFBF, EXPORT_OUT_BUFFER);
+
+  gra_export_stream(db, out, format, threads, stats, error);
+
+  if(fclose(out) && error && !*error) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "%s: %s",
+                filename, g_strerror(errno));
+  }
+}
+
+
+void
+gra_export_stream(gra_db_t *db, FILE *out, gra_export_format format,
+                  int threads, gra_export_stats_t *stats, GError **error) {
+  exporter ex = {0};
+  gra_export_stats_t result = {0};
+  gra_db_t *owner = db, *reader = NULL;
+  GThreadPool *pool = NULL;
+  GQueue *pending;
+  export_batch *batch;
+  gboolean first = TRUE;
+  gint64 start;
+  GError *err = NULL;
+
+  /* abort on previous error */
+  if(error && *error) return;
+
+  start = g_get_monotonic_time();
+
+  /* read from the pool, if there is one, so writers carry on */
+  if(db->readerMax) {
+    reader = gra_db_reader_acquire(db, &err);
+    if(!reader) {
+      g_propagate_error(error, err);
+      return;
+    }
+  }
+
+  ex.db = reader ? reader : db;
+  ex.format = format;
+  g_mutex_init(&ex.lock);
+  g_cond_init(&ex.cond);
+  pending = g_queue_new();
+
+  /* While the paper walk is unfinished the connection stays in one
+     read transaction, so all three walks see the same snapshot. */
+  db = ex.db;
+  if(sqlite3_prepare_v2(db->db, papersSql, -1, &ex.papers, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, fieldsSql, -1, &ex.fields, NULL) != SQLITE_OK) {
+    DB_ERROR(&err);
+    goto cleanup;
+  }
+  if(format == GRA_EXPORT_BIBTEX &&
+     sqlite3_prepare_v2(db->db, refsSql, -1, &ex.refs, NULL) != SQLITE_OK) {
+    DB_ERROR(&err);
+    goto cleanup;
+  }
+
+  if(threads <= 0)
+    threads = g_get_num_processors();
+  if(threads > 1)
+    pool = g_thread_pool_new(format_batch, &ex, threads, FALSE, NULL);
+
+  if(format == GRA_EXPORT_CSL_JSON)
+    write_text(out, "[\n", 2, &result, &err);
+
+  /* read batches, keeping at most two per thread in flight */
+  while(!err && (batch = read_batch(&ex, &err))) {
+    batch->first = first;
+    first = FALSE;
+    g_queue_push_tail(pending, batch);
+
+    if(pool)
+      g_thread_pool_push(pool, batch, NULL);
+    else
+      format_batch(batch, &ex);
+
+    while(g_queue_get_length(pending) > 2 * threads) {
+      write_batch(&ex, g_queue_pop_head(pending), out, &result, &err);
+    }
+  }
+
+  /* wait for the rest, writing them unless something failed */
+  while(!g_queue_is_empty(pending)) {
+    write_batch(&ex, g_queue_pop_head(pending), out, &result, &err);
+  }
+
+  if(format == GRA_EXPORT_CSL_JSON)
+    write_text(out, "\n]\n", 3, &result, &err);
+
+  if(!err && fflush(out)) {
+    g_set_error(&err, GRA_DATA_ERROR, 4, "Write error: %s", g_strerror(errno));
+  }
+
+  /* report */
+  result.seconds = (g_get_monotonic_time() - start) / (double) G_USEC_PER_SEC;
+  if(result.seconds > 0)
+    result.papersPerSecond = result.papers / result.seconds;
+  if(stats)
+    *stats = result;
+
+  cleanup:
+  if(pool) g_thread_pool_free(pool, FALSE, TRUE);
+  g_queue_free(pending);
+  sqlite3_finalize(ex.papers);
+  sqlite3_finalize(ex.fields);
+  sqlite3_finalize(ex.refs);
+  g_mutex_clear(&ex.lock);
+  g_cond_clear(&ex.cond);
+  if(reader) gra_db_reader_release(owner, reader);
+  if(err) g_propagate_error(error, err);
+}
+
+
+
+/*
+ * Static Methods
+ */
+
+/* Read the next run of papers, merging in their fields and
+   references.  Returns NULL once every paper has been read. */
+static export_batch *
+read_batch(exporter *ex, GError **error) {
+  gra_db_t *db = ex->db;
+  export_batch *batch;
+  gra_paper_t *p;
+  GString *cites;
+  int rc, id, i;
+
+  /* the papers of a batch are freed together, so share one arena */
+  batch = g_malloc0(sizeof(export_batch));
+  batch->arena = gra_arena_new(0);
+  batch->papers = g_ptr_array_new_with_free_func((GDestroyNotify) gra_paper_free);
+  batch->cites = g_ptr_array_new();
+
+  /* the papers; a finished statement would start over if stepped */
+  if(ex->papersDone)
+    goto fail;
+  while(batch->papers->len < GRA_EXPORT_BATCH_SIZE &&
+        (rc = sqlite3_step(ex->papers)) == SQLITE_ROW) {
+    p = gra_paper_new_in(batch->arena);
+    p->id = sqlite3_column_int(ex->papers, 0);
+    p->fileName = gra_arena_strdup(batch->arena, (gchar*)sqlite3_column_text(ex->papers, 1));
+    p->pageCount = sqlite3_column_int(ex->papers, 2);
+    p->read = sqlite3_column_int(ex->papers, 3);
+    p->type = gra_arena_strdup(batch->arena, (gchar*)sqlite3_column_text(ex->papers, 4));
+    p->author = gra_arena_strdup(batch->arena, (gchar*)sqlite3_column_text(ex->papers, 5));
+    p->title = gra_arena_strdup(batch->arena, (gchar*)sqlite3_column_text(ex->papers, 6));
+    p->year = sqlite3_column_int(ex->papers, 7);
+    p->indb = TRUE;
+    g_ptr_array_add(batch->papers, p);
+    g_ptr_array_add(batch->cites, NULL);
+  }
+  if(batch->papers->len < GRA_EXPORT_BATCH_SIZE) {
+    ex->papersDone = TRUE;
+    if(rc != SQLITE_DONE) {
+      DB_ERROR(error);
+      goto fail;
+    }
+  }
+  if(!batch->papers->len)
+    goto fail;
+
+  /* first call: position the other walks on their first rows */
+  if(!ex->fieldsRc) {
+    ex->fieldsRc = sqlite3_step(ex->fields);
+    ex->refsRc = ex->refs ? sqlite3_step(ex->refs) : SQLITE_DONE;
+  }
+
+  /* The field walk stops on the first row past this batch, which is
+     picked up by the next one.  Rows of missing papers are skipped. */
+  for(i=0; ex->fieldsRc == SQLITE_ROW; ex->fieldsRc = sqlite3_step(ex->fields)) {
+    id = sqlite3_column_int(ex->fields, 0);
+    while(i < batch->papers->len &&
+          ((gra_paper_t*)g_ptr_array_index(batch->papers, i))->id < id)
+      i++;
+    if(i == batch->papers->len) break;
+
+    p = g_ptr_array_index(batch->papers, i);
+    if(p->id == id) {
+      gra_paper_set_field(p, (gchar*)sqlite3_column_text(ex->fields, 1),
+                          (gchar*)sqlite3_column_text(ex->fields, 2));
+    }
+  }
+  if(ex->fieldsRc != SQLITE_ROW && ex->fieldsRc != SQLITE_DONE) {
+    DB_ERROR(error);
+    goto fail;
+  }
+
+  /* the same for references */
+  for(i=0; ex->refsRc == SQLITE_ROW; ex->refsRc = sqlite3_step(ex->refs)) {
+    id = sqlite3_column_int(ex->refs, 0);
+    while(i < batch->papers->len &&
+          ((gra_paper_t*)g_ptr_array_index(batch->papers, i))->id < id)
+      i++;
+    if(i == batch->papers->len) break;
+
+    p = g_ptr_array_index(batch->papers, i);
+    if(p->id == id) {
+      cites = g_ptr_array_index(batch->cites, i);
+      if(!cites) {
+        cites = g_string_new(NULL);
+        g_ptr_array_index(batch->cites, i) = cites;
+      } else {
+        g_string_append(cites, ", ");
+      }
+      g_string_append(cites, (gchar*)sqlite3_column_text(ex->refs, 1));
+    }
+  }
+  if(ex->refsRc != SQLITE_ROW && ex->refsRc != SQLITE_DONE) {
+    DB_ERROR(error);
+    goto fail;
+  }
+
+  /* these papers are copies, not edits */
+  for(i=0; i < batch->papers->len; i++) {
+    ((gra_paper_t*)g_ptr_array_index(batch->papers, i))->changed = FALSE;
+  }
+
+  return batch;
+
+  fail:
+  free_batch(batch);
+  return NULL;
+}
+
+
+/* Format a batch.  This runs on the worker threads, and touches
+   nothing but the batch itself. */
+static void
+format_batch(gpointer data, gpointer user_data) {
+  export_batch *batch = data;
+  exporter *ex = user_data;
+  gra_paper_t *p;
+  int i;
+
+  batch->text = g_string_sized_new(batch->papers->len * 512);
+
+  for(i=0; i < batch->papers->len; i++) {
+    p = g_ptr_array_index(batch->papers, i);
+    if(ex->format == GRA_EXPORT_BIBTEX) {
+      format_bibtex(batch->text, p, g_ptr_array_index(batch->cites, i));
+    } else {
+      if(i || !batch->first)
+        g_string_append(batch->text, ",\n");
+      format_csl(batch->text, p);
+    }
+  }
+
+  g_mutex_lock(&ex->lock);
+  batch->done = TRUE;
+  g_cond_broadcast(&ex->cond);
+  g_mutex_unlock(&ex->lock);
+}
+
+
+/* Wait for a batch to be formatted, then write and free it.  After
+   an error the batch is only waited for and freed. */
+static void
+write_batch(exporter *ex, export_batch *batch, FILE *out,
+            gra_export_stats_t *stats, GError **error) {
+  g_mutex_lock(&ex->lock);
+  while(!batch->done)
+    g_cond_wait(&ex->cond, &ex->lock);
+  g_mutex_unlock(&ex->lock);
+
+  if(!(error && *error)) {
+    write_text(out, batch->text->str, batch->text->len, stats, error);
+    if(!(error && *error))
+      stats->papers += batch->papers->len;
+  }
+
+  free_batch(batch);
+}
+
+
+static void
+write_text(FILE *out, const gchar *text, gsize len,
+           gra_export_stats_t *stats, GError **error) {
+  /* abort on previous error */
+  if(error && *error) return;
+
+  if(fwrite(text, 1, len, out) != len) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Write error: %s", g_strerror(errno));
+    return;
+  }
+  stats->bytes += len;
+}
+
+
+static void
+free_batch(export_batch *batch) {
+  int i;
+
+  for(i=0; i < batch->cites->len; i++) {
+    if(g_ptr_array_index(batch->cites, i))
+      g_string_free(g_ptr_array_index(batch->cites, i), TRUE);
+  }
+  g_ptr_array_free(batch->cites, TRUE);
+  g_ptr_array_free(batch->papers, TRUE);
+  gra_arena_unref(batch->arena);
+  if(batch->text) g_string_free(batch->text, TRUE);
+  g_free(batch);
+}
+
+
+/* one @type{key, ...} entry */
+static void
+format_bibtex(GString *s, gra_paper_t *p, GString *cites) {
+  gchar key[32];
+  gchar *type;
+
+  type = g_ascii_strdown(p->type && *p->type ? p->type : "misc", -1);
+  g_string_append_printf(s, "@%s{%s", type, paper_key(p, key, sizeof(key)));
+  g_free(type);
+
+  if(p->title && *p->title) {
+    g_string_append(s, ",\n  title = ");
+    bib_value(s, p->title);
+  }
+  if(p->author && *p->author) {
+    g_string_append(s, ",\n  author = ");
+    bib_value(s, p->author);
+  }
+  if(p->year)
+    g_string_append_printf(s, ",\n  year = {%u}", p->year);
+  gra_paper_foreach_field(p, fieldBibVisit, s);
+  if(cites) {
+    g_string_append(s, ",\n  cites = ");
+    bib_value(s, cites->str);
+  }
+
+  g_string_append(s, "\n}\n\n");
+}
+
+
+/* one CSL-JSON item */
+static void
+format_csl(GString *s, gra_paper_t *p) {
+  gchar key[32];
+  const gchar *type = "document";
+  const gchar *value;
+  const gchar *written[G_N_ELEMENTS(cslFields)];
+  int nwritten = 0;
+  int i, j;
+
+  for(i=0; p->type && i < G_N_ELEMENTS(cslTypes); i++) {
+    if(!g_ascii_strcasecmp(p->type, cslTypes[i][0])) {
+      type = cslTypes[i][1];
+      break;
+    }
+  }
+
+  g_string_append(s, "  {\"id\": ");
+  json_string(s, paper_key(p, key, sizeof(key)));
+  g_string_append_printf(s, ", \"type\": \"%s\"", type);
+
+  if(p->title && *p->title) {
+    g_string_append(s, ", \"title\": ");
+    json_string(s, p->title);
+  }
+  if(p->author && *p->author) {
+    g_string_append(s, ", \"author\": ");
+    json_names(s, p->author);
+  }
+  if((value = field_value(p, "editor"))) {
+    g_string_append(s, ", \"editor\": ");
+    json_names(s, value);
+  }
+  if(p->year)
+    g_string_append_printf(s, ", \"issued\": {\"date-parts\": [[%u]]}", p->year);
+
+  for(i=0; i < G_N_ELEMENTS(cslFields); i++) {
+    if(!(value = field_value(p, cslFields[i][0])))
+      continue;
+
+    /* each variable only once */
+    for(j=0; j < nwritten && strcmp(written[j], cslFields[i][1]); j++);
+    if(j < nwritten)
+      continue;
+    written[nwritten++] = cslFields[i][1];
+
+    g_string_append_printf(s, ", \"%s\": ", cslFields[i][1]);
+    json_string(s, value);
+  }
+
+  g_string_append(s, "}");
+}
+
+
+/* the citekey field, or one made up from the paper ID */
+static const gchar *
+paper_key(gra_paper_t *p, gchar *buf, gsize len) {
+  const gchar *key = field_value(p, "citekey");
+
+  if(key)
+    return key;
+
+  g_snprintf(buf, len, "gra%d", p->id);
+  return buf;
+}
+
+
+/* the value of a field, or NULL if it is missing or empty */
+static const gchar *
+field_value(gra_paper_t *p, const gchar *name) {
+  gra_field_t *f;
+
+  f = gra_paper_get_field(p, name);
+  if(!f || !f->value || !*f->value)
+    return NULL;
+
+  return f->value;
+}
+
+
+/* A braced bibtex value.  Braces in the value are kept so the case
+   protection survives, unless they do not balance, in which case
+   they are all dropped. */
+static void
+bib_value(GString *s, const gchar *value) {
+  const gchar *c;
+  int depth = 0;
+
+  for(c=value; *c && depth >= 0; c++) {
+    if(*c == '{') depth++;
+    else if(*c == '}') depth--;
+  }
+
+  g_string_append_c(s, '{');
+  if(!depth) {
+    g_string_append(s, value);
+  } else {
+    for(c=value; *c; c++) {
+      if(*c != '{' && *c != '}')
+        g_string_append_c(s, *c);
+    }
+  }
+  g_string_append_c(s, '}');
+}
+
+
+/* A JSON string.  Bibtex case protection braces are dropped. */
+static void
+json_string(GString *s, const gchar *value) {
+  const guchar *c;
+
+  g_string_append_c(s, '"');
+  for(c=(const guchar*)value; *c; c++) {
+    switch(*c) {
+    case '{':
+    case '}':
+      break;
+    case '"':
+      g_string_append(s, "\\\"");
+      break;
+    case '\\':
+      g_string_append(s, "\\\\");
+      break;
+    case '\n':
+      g_string_append(s, "\\n");
+      break;
+    case '\t':
+      g_string_append(s, "\\t");
+      break;
+    default:
+      if(*c < 0x20)
+        g_string_append_printf(s, "\\u%04x", *c);
+      else
+        g_string_append_c(s, *c);
+    }
+  }
+  g_string_append_c(s, '"');
+}
+
+
+/* A bibtex name list ("Last, First and First Last") as CSL names.  A
+   fully braced name is taken literally. */
+static void
+json_names(GString *s, const gchar *names) {
+  gchar **list, *name, *split;
+  int i, n = 0;
+
+  list = g_strsplit(names, " and ", -1);
+  g_string_append_c(s, '[');
+
+  for(i=0; list[i]; i++) {
+    name = g_strstrip(list[i]);
+    if(!*name) continue;
+    if(n++) g_string_append(s, ", ");
+
+    if(*name == '{' && name[strlen(name)-1] == '}') {
+      g_string_append(s, "{\"literal\": ");
+      json_string(s, name);
+    } else if((split = strchr(name, ','))) {
+      *split++ = '\0';
+      g_string_append(s, "{\"family\": ");
+      json_string(s, g_strstrip(name));
+      g_string_append(s, ", \"given\": ");
+      json_string(s, g_strstrip(split));
+    } else if((split = strrchr(name, ' '))) {
+      *split++ = '\0';
+      g_string_append(s, "{\"family\": ");
+      json_string(s, split);
+      g_string_append(s, ", \"given\": ");
+      json_string(s, g_strstrip(name));
+    } else {
+      g_string_append(s, "{\"family\": ");
+      json_string(s, name);
+    }
+    g_string_append_c(s, '}');
+  }
+
+  g_string_append_c(s, ']');
+  g_strfreev(list);
+}
+
+
+/* one field = {value} line; the citation key is not a field */
+static gboolean
+fieldBibVisit(gra_field_t *f, gpointer data) {
+  GString *s = data;
+
+  if(!f->value || !*f->value || !strcmp(f->name, "citekey"))
+    return FALSE;
+
+  g_string_append_printf(s, ",\n  %s = ", f->name);
+  bib_value(s, f->value);
+
+  return FALSE;
+}
@@ -0,0 +1,77 @@
+/*
+    BibTeX and CSL-JSON export for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <stdio.h>
+#include <glib.h>
+#include "datatypes.h"
+
+/** Number of papers read from the database and formatted together. */
+#define GRA_EXPORT_BATCH_SIZE 1000
+
+/** Output formats understood by gra_export */
+typedef enum {
+  GRA_EXPORT_BIBTEX,
+  GRA_EXPORT_CSL_JSON
+} gra_export_format;
+
+
+/** @struct gra_export_stats_t
+ *  @brief Summary of a finished export.
+ *  @var gra_export_stats_t::papers Number of papers written.
+ *  @var gra_export_stats_t::bytes Number of bytes written.
+ *  @var gra_export_stats_t::seconds Wall clock time of the export.
+ *  @var gra_export_stats_t::papersPerSecond Export throughput.
+ */
+typedef struct gra_export_stats_t {
+  unsigned long papers;
+  unsigned long long bytes;
+  double seconds;
+  double papersPerSecond;
+} gra_export_stats_t;
+
+
+/** Writes every paper in the database to a file.  The Paper, Field
+ *  and Reference tables are each read once, in paper ID order, and
+ *  GRA_EXPORT_BATCH_SIZE papers at a time are formatted by a pool of
+ *  worker threads.  Batches are written in order, and only a few of
+ *  them are in memory at once, so memory use does not depend on the
+ *  size of the library.
+ *
+ *  Papers are keyed by their "citekey" field, or by "gra" followed by
+ *  the paper ID if they have none.  BibTeX output lists the keys of
+ *  cited papers in a "cites" field.  CSL-JSON has no place for
+ *  citations, so they are left out.
+ *  @param db the database connection
+ *  @param filename The file to write.
+ *  @param format The output format.
+ *  @param threads Number of formatting threads.  Zero uses one per
+ *  processor.
+ *  @param stats Filled in with the export summary.  May be NULL.
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ */
+void gra_export(gra_db_t *db, const gchar *filename, gra_export_format format,
+                int threads, gra_export_stats_t *stats, GError **error);
+
+
+/** As gra_export, writing to an open stream. */
+void gra_export_stream(gra_db_t *db, FILE *out, gra_export_format format,
+                       int threads, gra_export_stats_t *stats, GError **error);
+#endif
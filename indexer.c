@@ -0,0 +1,817 @@
+/*
+    Background text extraction and indexing for stored documents.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+#include <string.h>
+#include <sqlite3.h>
+#ifdef HAVE_POPPLER
+#include <poppler.h>
+#endif
+#include "data.h"
+#include "indexer.h"
+
+#define DB_ERROR(error)  g_set_error(error, GRA_DATA_ERROR, 1, "SQLite Error: %s", sqlite3_errmsg(db->db))
+
+/* documents handed to the extraction threads at once, per thread */
+#define INDEXER_DOCS_PER_THREAD 2
+
+/* page chunks waiting to be written, per thread, before extraction
+   waits for the writer */
+#define INDEXER_CHUNKS_PER_THREAD 4
+
+/* how often an idle indexer looks for new documents by itself */
+#define INDEXER_RESCAN_USEC (30 * G_USEC_PER_SEC)
+
+/* the documents which need (more) extracting, in ID order */
+static const gchar *staleSql =
+  "SELECT d.\"ID\", i.\"Version\", i.\"Done\", i.\"Error\","
+  " (SELECT max(\"PageCount\") FROM \"Paper\" WHERE \"DocumentID\"=d.\"ID\")"
+  " FROM \"Document\" d LEFT JOIN \"DocumentIndex\" i ON i.\"DocumentID\"=d.\"ID\""
+  " WHERE d.\"ID\" > ?1 AND (i.\"DocumentID\" IS NULL OR i.\"Version\" <> ?2"
+  "  OR (i.\"Error\" IS NULL AND i.\"Done\" < i.\"Pages\"))"
+  " ORDER BY d.\"ID\" LIMIT ?3";
+static const gchar *startSql =
+  "INSERT OR REPLACE INTO \"DocumentIndex\" (\"DocumentID\", \"Version\", \"Pages\", \"Done\", \"Error\")"
+  " SELECT \"ID\", ?2, ?3, ?4, ?5 FROM \"Document\" WHERE \"ID\"=?1";
+static const gchar *clearSql =
+  "DELETE FROM \"DocumentText\" WHERE \"rowid\" BETWEEN ?1 * 65536 AND ?1 * 65536 + 65535";
+static const gchar *doneSql =
+  "UPDATE \"DocumentIndex\" SET \"Done\"=?3 WHERE \"DocumentID\"=?1 AND \"Version\"=?2";
+static const gchar *pageSql =
+  "INSERT INTO \"DocumentText\" (\"rowid\", \"Body\") VALUES(?, ?)";
+static const gchar *stateSql =
+  "SELECT p.\"DocumentID\", i.\"Version\", i.\"Pages\", i.\"Done\", i.\"Error\""
+  " FROM \"Paper\" p LEFT JOIN \"DocumentIndex\" i ON i.\"DocumentID\"=p.\"DocumentID\""
+  " WHERE p.\"ID\"=?";
+
+/* what the extraction threads tell the writer */
+typedef enum {
+  RESULT_START,
+  RESULT_PAGES,
+  RESULT_FAILED,
+  RESULT_END,
+  RESULT_WAKE
+} result_kind;
+
+typedef struct result {
+  result_kind kind;
+  int docId;
+  int first;
+  int pages;
+  GPtrArray *text;
+  gchar *message;
+  gboolean complete;
+} result;
+
+/* one document to extract, from page first on */
+typedef struct job {
+  int docId;
+  int first;
+  int pageHint;
+  gra_contents_t *contents;
+  gchar *copy;
+  const gchar *data;
+  gsize size;
+} job;
+
+/* an open document, ready to give up its pages */
+typedef struct extraction {
+#ifdef HAVE_POPPLER
+  PopplerDocument *pdf;
+#endif
+  const gchar *text;
+  GArray *starts;
+  int pages;
+} extraction;
+
+struct gra_indexer_t {
+  gra_db_t *db;
+  GThread *thread;
+  GThreadPool *pool;
+  GAsyncQueue *results;
+  int threads;
+  /* prepared on db, used under its lock */
+  sqlite3_stmt *start;
+  sqlite3_stmt *clear;
+  sqlite3_stmt *done;
+  sqlite3_stmt *page;
+  /* shared with the extraction threads and callers, under lock */
+  GMutex lock;
+  GCond cond;
+  gboolean quit;
+  gboolean paused;
+  int rate;
+  int inflight;
+  int chunks;
+  gra_indexer_stats_t stats;
+  gint64 started;
+  gint64 pausedAt;
+  gint64 pausedFor;
+  /* the writer's own */
+  int scanFrom;
+  gboolean scanned;
+  gint64 nextWrite;
+};
+
+/* static method prototypes */
+static gpointer indexer_main(gpointer data);
+static gboolean feed(gra_indexer_t *ix, GError **error);
+static job *job_load(gra_db_t *conn, sqlite3_stmt *stale, GError **error);
+static void job_free(job *j);
+static void extract_job(gpointer data, gpointer user_data);
+static void result_push(gra_indexer_t *ix, result *r);
+static void result_fail(gra_indexer_t *ix, int docId, const gchar *message);
+static void result_free(result *r);
+static void write_result(gra_indexer_t *ix, result *r);
+static void throttle(gra_indexer_t *ix, int pages);
+static void bind_run(gra_indexer_t *ix, sqlite3_stmt *stmt, GError **error);
+static extraction *extract_open(const gchar *data, gsize size, int pageHint,
+                                GError **error);
+static gchar *extract_page(extraction *x, int page);
+static void extract_close(extraction *x);
+
+
+gra_indexer_t *
+gra_indexer_start(gra_db_t *db, int threads, GError **error) {
+  gra_indexer_t *ix;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  if(threads <= 0)
+    threads = g_get_num_processors();
+
+  ix = g_malloc0(sizeof(gra_indexer_t));
+  ix->db = db;
+  ix->threads = threads;
+  g_mutex_init(&ix->lock);
+  g_cond_init(&ix->cond);
+
+  gra_db_lock(db);
+  if(sqlite3_prepare_v2(db->db, startSql, -1, &ix->start, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, clearSql, -1, &ix->clear, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, doneSql, -1, &ix->done, NULL) != SQLITE_OK ||
+     sqlite3_prepare_v2(db->db, pageSql, -1, &ix->page, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    sqlite3_finalize(ix->start);
+    sqlite3_finalize(ix->clear);
+    sqlite3_finalize(ix->done);
+    gra_db_unlock(db);
+    g_mutex_clear(&ix->lock);
+    g_cond_clear(&ix->cond);
+    g_free(ix);
+    return NULL;
+  }
+  gra_db_unlock(db);
+
+  ix->results = g_async_queue_new_full((GDestroyNotify) result_free);
+  ix->pool = g_thread_pool_new(extract_job, ix, threads, FALSE, NULL);
+  ix->started = g_get_monotonic_time();
+  ix->thread = g_thread_new("gra-indexer", indexer_main, ix);
+
+  return ix;
+}
+
+
+void
+gra_indexer_stop(gra_indexer_t *ix) {
+  g_mutex_lock(&ix->lock);
+  ix->quit = TRUE;
+  g_cond_broadcast(&ix->cond);
+  g_mutex_unlock(&ix->lock);
+  gra_indexer_kick(ix);
+
+  /* the writer drains the extraction threads before it exits */
+  g_thread_join(ix->thread);
+  g_thread_pool_free(ix->pool, FALSE, TRUE);
+  g_async_queue_unref(ix->results);
+
+  gra_db_lock(ix->db);
+  sqlite3_finalize(ix->start);
+  sqlite3_finalize(ix->clear);
+  sqlite3_finalize(ix->done);
+  sqlite3_finalize(ix->page);
+  gra_db_unlock(ix->db);
+
+  g_mutex_clear(&ix->lock);
+  g_cond_clear(&ix->cond);
+  g_free(ix);
+}
+
+
+void
+gra_indexer_kick(gra_indexer_t *ix) {
+  result *r = g_malloc0(sizeof(result));
+
+  r->kind = RESULT_WAKE;
+  g_async_queue_push(ix->results, r);
+}
+
+
+void
+gra_indexer_pause(gra_indexer_t *ix, gboolean paused) {
+  g_mutex_lock(&ix->lock);
+  if(paused && !ix->paused) {
+    ix->pausedAt = g_get_monotonic_time();
+  } else if(!paused && ix->paused) {
+    ix->pausedFor += g_get_monotonic_time() - ix->pausedAt;
+    ix->nextWrite = 0;
+  }
+  ix->paused = paused;
+  g_cond_broadcast(&ix->cond);
+  g_mutex_unlock(&ix->lock);
+  gra_indexer_kick(ix);
+}
+
+
+void
+gra_indexer_set_rate(gra_indexer_t *ix, int pagesPerSecond) {
+  g_mutex_lock(&ix->lock);
+  ix->rate = MAX(pagesPerSecond, 0);
+  ix->nextWrite = 0;
+  g_cond_broadcast(&ix->cond);
+  g_mutex_unlock(&ix->lock);
+}
+
+
+void
+gra_indexer_get_stats(gra_indexer_t *ix, gra_indexer_stats_t *stats) {
+  gint64 now = g_get_monotonic_time();
+
+  g_mutex_lock(&ix->lock);
+  *stats = ix->stats;
+  stats->seconds = (now - ix->started - ix->pausedFor -
+                    (ix->paused ? now - ix->pausedAt : 0)) / (double) G_USEC_PER_SEC;
+  g_mutex_unlock(&ix->lock);
+
+  if(stats->seconds > 0)
+    stats->pagesPerSecond = stats->pages / stats->seconds;
+}
+
+
+gra_text_state
+gra_db_paper_text_state(gra_db_t *db, int paperId, GError **error) {
+  sqlite3_stmt *stmt = NULL;
+  gra_text_state state = GRA_TEXT_NONE;
+  int rc;
+
+  /* abort on previous error */
+  if(error && *error) return GRA_TEXT_NONE;
+
+  if(sqlite3_prepare_v2(db->db, stateSql, -1, &stmt, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    return GRA_TEXT_NONE;
+  }
+  sqlite3_bind_int(stmt, 1, paperId);
+
+  rc = sqlite3_step(stmt);
+  if(rc == SQLITE_ROW) {
+    if(sqlite3_column_type(stmt, 0) == SQLITE_NULL)
+      state = GRA_TEXT_NONE;
+    else if(sqlite3_column_type(stmt, 1) == SQLITE_NULL ||
+            sqlite3_column_int(stmt, 1) != GRA_TEXT_VERSION)
+      state = GRA_TEXT_STALE;
+    else if(sqlite3_column_type(stmt, 4) != SQLITE_NULL)
+      state = GRA_TEXT_FAILED;
+    else if(sqlite3_column_int(stmt, 3) < sqlite3_column_int(stmt, 2))
+      state = GRA_TEXT_STALE;
+    else
+      state = GRA_TEXT_INDEXED;
+  } else if(rc == SQLITE_DONE) {
+    g_set_error(error, GRA_DATA_ERROR, 1, "No paper with ID %d.", paperId);
+  } else {
+    DB_ERROR(error);
+  }
+
+  sqlite3_finalize(stmt);
+  return state;
+}
+
+
+
+/*
+ * Static Methods
+ */
+
+/* The indexer thread: hands documents to the extraction threads and
+   writes what comes back. */
+static gpointer
+indexer_main(gpointer data) {
+  gra_indexer_t *ix = data;
+  result *r;
+  gboolean quit, want, idle;
+  GError *err = NULL;
+
+  for(;;) {
+    g_mutex_lock(&ix->lock);
+    while(ix->paused && !ix->quit)
+      g_cond_wait(&ix->cond, &ix->lock);
+    quit = ix->quit;
+    idle = !ix->inflight;
+    want = !quit && !ix->scanned &&
+      ix->inflight < ix->threads * INDEXER_DOCS_PER_THREAD;
+    ix->stats.idle = idle && ix->scanned;
+    g_mutex_unlock(&ix->lock);
+
+    /* done once the extraction threads have nothing more to say */
+    if(quit && idle)
+      break;
+
+    if(want) {
+      if(!feed(ix, &err)) {
+        g_warning("Indexer: %s", err->message);
+        g_clear_error(&err);
+        ix->scanned = TRUE;
+      }
+      continue;
+    }
+
+    /* An idle indexer looks again now and then, or when kicked.  A
+       busy one carries on from where its walk got to, so it never
+       hands out a document which is still in flight. */
+    if(idle) {
+      r = g_async_queue_timeout_pop(ix->results, INDEXER_RESCAN_USEC);
+    } else {
+      r = g_async_queue_pop(ix->results);
+    }
+    if(!r || r->kind == RESULT_WAKE) {
+      ix->scanned = FALSE;
+      if(idle)
+        ix->scanFrom = 0;
+    }
+
+    if(r) {
+      write_result(ix, r);
+      result_free(r);
+    }
+  }
+
+  return NULL;
+}
+
+
+/* Hand the next stale documents to the extraction threads.  Returns
+   FALSE on error. */
+static gboolean
+feed(gra_indexer_t *ix, GError **error) {
+  gra_db_t *db = ix->db, *conn = NULL;
+  sqlite3_stmt *stale = NULL;
+  job *j;
+  int want, rc, n = 0;
+  GError *err = NULL;
+
+  g_mutex_lock(&ix->lock);
+  want = ix->threads * INDEXER_DOCS_PER_THREAD - ix->inflight;
+  g_mutex_unlock(&ix->lock);
+
+  /* read from the pool, if there is one */
+  if(db->readerMax) {
+    conn = gra_db_reader_acquire(db, error);
+    if(!conn) return FALSE;
+  } else {
+    gra_db_lock(db);
+  }
+
+  db = conn ? conn : ix->db;
+  if(sqlite3_prepare_v2(db->db, staleSql, -1, &stale, NULL) != SQLITE_OK) {
+    DB_ERROR(error);
+    goto cleanup;
+  }
+  sqlite3_bind_int(stale, 1, ix->scanFrom);
+  sqlite3_bind_int(stale, 2, GRA_TEXT_VERSION);
+  sqlite3_bind_int(stale, 3, want);
+
+  while((rc = sqlite3_step(stale)) == SQLITE_ROW) {
+    ix->scanFrom = sqlite3_column_int(stale, 0);
+    n++;
+
+    /* A document which cannot be read is marked failed, like one
+       which cannot be extracted, and the walk moves on.  Only a
+       database error ends it. */
+    j = job_load(db, stale, &err);
+    if(!j) {
+      if(err->domain == GRA_DATA_ERROR) {
+        g_propagate_error(error, err);
+        goto cleanup;
+      }
+      result_fail(ix, ix->scanFrom, err->message);
+      g_clear_error(&err);
+      continue;
+    }
+
+    g_mutex_lock(&ix->lock);
+    ix->inflight++;
+    g_mutex_unlock(&ix->lock);
+    g_thread_pool_push(ix->pool, j, NULL);
+  }
+  if(rc != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+
+  /* a short page means the walk is over */
+  if(n < want)
+    ix->scanned = TRUE;
+
+  cleanup:
+  sqlite3_finalize(stale);
+  if(conn)
+    gra_db_reader_release(ix->db, conn);
+  else
+    gra_db_unlock(ix->db);
+  return !(error && *error);
+}
+
+
+/* Pick up the bytes of the document on the current row of the stale
+   walk.  External documents stay mapped; the rest are copied, so the
+   connection is free again once the walk is done. */
+static job *
+job_load(gra_db_t *db, sqlite3_stmt *stale, GError **error) {
+  job *j;
+  gssize n;
+
+  j = g_malloc0(sizeof(job));
+  j->docId = sqlite3_column_int(stale, 0);
+  j->pageHint = sqlite3_column_int(stale, 4);
+
+  /* pick up where the same version left off, else start over */
+  if(sqlite3_column_int(stale, 1) == GRA_TEXT_VERSION &&
+     sqlite3_column_type(stale, 3) == SQLITE_NULL)
+    j->first = sqlite3_column_int(stale, 2);
+
+  j->contents = gra_db_document_open(db, j->docId, error);
+  if(!j->contents) {
+    g_free(j);
+    return NULL;
+  }
+
+  j->size = gra_db_paper_contents_size(j->contents);
+  j->data = gra_db_paper_contents_map(j->contents);
+  if(!j->data) {
+    j->copy = g_malloc(j->size + 1);
+    n = gra_db_paper_contents_read(j->contents, j->copy, j->size, 0, error);
+    gra_db_paper_contents_close(j->contents);
+    j->contents = NULL;
+    if(n >= 0 && n != (gssize) j->size)
+      g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_IO,
+                  "Document %d is shorter than its recorded size.", j->docId);
+    if(n != (gssize) j->size) {
+      g_free(j->copy);
+      g_free(j);
+      return NULL;
+    }
+    j->copy[j->size] = '\0';
+    j->data = j->copy;
+  }
+
+  return j;
+}
+
+
+static void
+job_free(job *j) {
+  gra_db_paper_contents_close(j->contents);
+  g_free(j->copy);
+  g_free(j);
+}
+
+
+/* Extract one document.  This runs on the extraction threads, and
+   waits whenever the writer falls behind. */
+static void
+extract_job(gpointer data, gpointer user_data) {
+  job *j = data;
+  gra_indexer_t *ix = user_data;
+  extraction *x;
+  result *r, *chunk = NULL;
+  int page, pages;
+  gboolean quit = FALSE, complete = FALSE;
+  GError *err = NULL;
+
+  /* a stopping indexer only wants its documents back */
+  g_mutex_lock(&ix->lock);
+  quit = ix->quit;
+  g_mutex_unlock(&ix->lock);
+  if(quit) goto end;
+
+  x = extract_open(j->data, j->size, j->pageHint, &err);
+  if(!x) {
+    result_fail(ix, j->docId, err->message);
+    g_error_free(err);
+    goto end;
+  }
+
+  pages = MIN(x->pages, GRA_INDEXER_MAX_PAGES);
+  r = g_malloc0(sizeof(result));
+  r->kind = RESULT_START;
+  r->docId = j->docId;
+  r->first = j->first;
+  r->pages = pages;
+  result_push(ix, r);
+
+  for(page = j->first; page < pages && !quit; page++) {
+    if(!chunk) {
+      chunk = g_malloc0(sizeof(result));
+      chunk->kind = RESULT_PAGES;
+      chunk->docId = j->docId;
+      chunk->first = page;
+      chunk->text = g_ptr_array_new_with_free_func(g_free);
+    }
+    g_ptr_array_add(chunk->text, extract_page(x, page));
+
+    if(chunk->text->len == GRA_INDEXER_CHUNK_PAGES || page == pages - 1) {
+      /* wait for room, unless stopping */
+      g_mutex_lock(&ix->lock);
+      while(!ix->quit && ix->chunks >= ix->threads * INDEXER_CHUNKS_PER_THREAD)
+        g_cond_wait(&ix->cond, &ix->lock);
+      quit = ix->quit;
+      ix->chunks++;
+      g_mutex_unlock(&ix->lock);
+
+      result_push(ix, chunk);
+      chunk = NULL;
+    }
+  }
+  extract_close(x);
+  complete = !quit;
+
+  end:
+  r = g_malloc0(sizeof(result));
+  r->kind = RESULT_END;
+  r->docId = j->docId;
+  r->complete = complete;
+  result_push(ix, r);
+  job_free(j);
+}
+
+
+static void
+result_push(gra_indexer_t *ix, result *r) {
+  g_async_queue_push(ix->results, r);
+}
+
+
+/* Have the writer record why a document could not be indexed */
+static void
+result_fail(gra_indexer_t *ix, int docId, const gchar *message) {
+  result *r = g_malloc0(sizeof(result));
+
+  r->kind = RESULT_FAILED;
+  r->docId = docId;
+  r->message = g_strdup(message);
+  result_push(ix, r);
+}
+
+
+static void
+result_free(result *r) {
+  if(r->text)
+    g_ptr_array_free(r->text, TRUE);
+  g_free(r->message);
+  g_free(r);
+}
+
+
+/* Write what an extraction thread sent.  Each result is one
+   transaction, and the document's progress moves with its pages. */
+static void
+write_result(gra_indexer_t *ix, result *r) {
+  gra_db_t *db = ix->db;
+  gsize bytes = 0;
+  int i;
+  GError *err = NULL;
+
+  if(r->kind == RESULT_WAKE)
+    return;
+
+  if(r->kind == RESULT_END) {
+    g_mutex_lock(&ix->lock);
+    ix->inflight--;
+    if(r->complete)
+      ix->stats.documents++;
+    g_mutex_unlock(&ix->lock);
+    return;
+  }
+
+  gra_db_batch_begin(db, &err);
+  if(err) goto cleanup;
+
+  switch(r->kind) {
+  case RESULT_START:
+    /* a fresh start drops what an older version wrote */
+    if(!r->first) {
+      sqlite3_bind_int(ix->clear, 1, r->docId);
+      bind_run(ix, ix->clear, &err);
+    }
+    sqlite3_bind_int(ix->start, 1, r->docId);
+    sqlite3_bind_int(ix->start, 2, GRA_TEXT_VERSION);
+    sqlite3_bind_int(ix->start, 3, r->pages);
+    sqlite3_bind_int(ix->start, 4, r->first);
+    sqlite3_bind_null(ix->start, 5);
+    bind_run(ix, ix->start, &err);
+    break;
+
+  case RESULT_FAILED:
+    sqlite3_bind_int(ix->clear, 1, r->docId);
+    bind_run(ix, ix->clear, &err);
+    sqlite3_bind_int(ix->start, 1, r->docId);
+    sqlite3_bind_int(ix->start, 2, GRA_TEXT_VERSION);
+    sqlite3_bind_int(ix->start, 3, 0);
+    sqlite3_bind_int(ix->start, 4, 0);
+    sqlite3_bind_text(ix->start, 5, r->message, -1, SQLITE_STATIC);
+    bind_run(ix, ix->start, &err);
+
+    g_mutex_lock(&ix->lock);
+    ix->stats.failed++;
+    g_mutex_unlock(&ix->lock);
+    break;
+
+  case RESULT_PAGES:
+    /* the document may have gone while it was being extracted */
+    sqlite3_bind_int(ix->done, 1, r->docId);
+    sqlite3_bind_int(ix->done, 2, GRA_TEXT_VERSION);
+    sqlite3_bind_int(ix->done, 3, r->first + r->text->len);
+    bind_run(ix, ix->done, &err);
+    if(err || !sqlite3_changes(db->db))
+      break;
+
+    for(i=0; !err && i < r->text->len; i++) {
+      if(!*(gchar*) g_ptr_array_index(r->text, i))
+        continue;
+      sqlite3_bind_int64(ix->page, 1, (sqlite3_int64) r->docId * GRA_INDEXER_MAX_PAGES + r->first + i);
+      sqlite3_bind_text(ix->page, 2, g_ptr_array_index(r->text, i), -1, SQLITE_STATIC);
+      bind_run(ix, ix->page, &err);
+      bytes += strlen(g_ptr_array_index(r->text, i));
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  gra_db_batch_commit(db, &err);
+  if(err)
+    gra_db_batch_rollback(db, NULL);
+
+  cleanup:
+  if(err) {
+    g_warning("Indexer: document %d: %s", r->docId, err->message);
+    g_error_free(err);
+  }
+
+  if(r->kind == RESULT_PAGES) {
+    g_mutex_lock(&ix->lock);
+    ix->chunks--;
+    if(!err) {
+      ix->stats.pages += r->text->len;
+      ix->stats.bytes += bytes;
+    }
+    g_cond_broadcast(&ix->cond);
+    g_mutex_unlock(&ix->lock);
+
+    throttle(ix, r->text->len);
+  }
+}
+
+
+/* Hold the writer back to the rate limit.  Stopping, pausing and a
+   new rate all cut the wait short. */
+static void
+throttle(gra_indexer_t *ix, int pages) {
+  gint64 now = g_get_monotonic_time();
+
+  g_mutex_lock(&ix->lock);
+  if(ix->rate) {
+    if(ix->nextWrite < now)
+      ix->nextWrite = now;
+    ix->nextWrite += pages * G_USEC_PER_SEC / ix->rate;
+
+    while(ix->rate && !ix->quit && !ix->paused &&
+          g_cond_wait_until(&ix->cond, &ix->lock, ix->nextWrite));
+  }
+  g_mutex_unlock(&ix->lock);
+}
+
+
+/* Step one of the indexer's statements, which returns no rows */
+static void
+bind_run(gra_indexer_t *ix, sqlite3_stmt *stmt, GError **error) {
+  gra_db_t *db = ix->db;
+
+  if(!(error && *error) && sqlite3_step(stmt) != SQLITE_DONE) {
+    DB_ERROR(error);
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+
+/* Open a document for extraction.  PDFs go to poppler, when there is
+   one.  UTF-8 text is split into pages at form feeds or, lacking
+   those, into pageHint pieces at line ends. */
+static extraction *
+extract_open(const gchar *data, gsize size, int pageHint, GError **error) {
+  extraction *x;
+  const gchar *c, *end = data + size;
+  gsize at;
+  int i;
+
+  if(size >= 5 && !memcmp(data, "%PDF-", 5)) {
+#ifdef HAVE_POPPLER
+    PopplerDocument *pdf;
+
+    pdf = poppler_document_new_from_data((char*) data, size, NULL, error);
+    if(!pdf) return NULL;
+
+    x = g_malloc0(sizeof(extraction));
+    x->pdf = pdf;
+    x->pages = poppler_document_get_n_pages(pdf);
+    return x;
+#else
+    g_set_error(error, GRA_DATA_ERROR, 4, "PDF support was not built in.");
+    return NULL;
+#endif
+  }
+
+  if(!g_utf8_validate(data, size, NULL)) {
+    g_set_error(error, GRA_DATA_ERROR, 4, "Unknown document format.");
+    return NULL;
+  }
+
+  x = g_malloc0(sizeof(extraction));
+  x->text = data;
+  x->starts = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+  at = 0;
+  g_array_append_val(x->starts, at);
+  for(c = memchr(data, '\f', size); c; c = memchr(c, '\f', end - c)) {
+    at = ++c - data;
+    g_array_append_val(x->starts, at);
+  }
+
+  /* no page breaks: cut it into even pieces at line ends */
+  if(x->starts->len == 1 && pageHint > 1) {
+    for(i=1; i < pageHint; i++) {
+      at = MAX(size * i / pageHint, g_array_index(x->starts, gsize, x->starts->len - 1));
+      c = memchr(data + at, '\n', size - at);
+      if(!c) break;
+      at = c + 1 - data;
+      g_array_append_val(x->starts, at);
+    }
+  }
+
+  x->pages = x->starts->len;
+  at = size + 1;
+  g_array_append_val(x->starts, at);
+
+  return x;
+}
+
+
+/* The text of one page, empty if it has none */
+static gchar *
+extract_page(extraction *x, int page) {
+  gsize from, to;
+
+#ifdef HAVE_POPPLER
+  if(x->pdf) {
+    PopplerPage *p = poppler_document_get_page(x->pdf, page);
+    gchar *text = p ? poppler_page_get_text(p) : NULL;
+
+    if(p) g_object_unref(p);
+    return text ? text : g_strdup("");
+  }
+#endif
+
+  /* up to the form feed, if any */
+  from = g_array_index(x->starts, gsize, page);
+  to = g_array_index(x->starts, gsize, page + 1) - 1;
+  return g_strndup(x->text + from, to - from);
+}
+
+
+static void
+extract_close(extraction *x) {
+#ifdef HAVE_POPPLER
+  if(x->pdf)
+    g_object_unref(x->pdf);
+#endif
+  if(x->starts)
+    g_array_free(x->starts, TRUE);
+  g_free(x);
+}
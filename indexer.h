@@ -0,0 +1,134 @@
+/*
+    Background text extraction and indexing for stored documents.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* The indexer walks the documents whose text is missing or was
+   extracted by an older version of the extractor.  A pool of threads
+   pulls the text out of them a page at a time, and one thread writes
+   the pages into the DocumentText index in small transactions, noting
+   in DocumentIndex how far each document got.  Stopping at any point,
+   even by crashing, loses at most the pages in flight: the next
+   indexer starts each document where the last one left off.
+
+   PDFs need poppler-glib at build time (HAVE_POPPLER).  Plain UTF-8
+   documents are always understood, with form feeds between pages. */
+
+#ifndef INDEXER_H
+#define INDEXER_H
+
+#include <glib.h>
+#include "datatypes.h"
+
+/** Version of the text extraction.  Documents indexed by an older
+ *  version, or which failed with one, are done again. */
+#ifdef HAVE_POPPLER
+#define GRA_TEXT_VERSION 2
+#else
+#define GRA_TEXT_VERSION 1
+#endif
+
+/** Pages written to the index in one transaction. */
+#define GRA_INDEXER_CHUNK_PAGES 16
+
+/** Most pages indexed per document; the rest are left out. */
+#define GRA_INDEXER_MAX_PAGES 65536
+
+typedef struct gra_indexer_t gra_indexer_t;
+
+/** Where the text of a paper stands. */
+typedef enum {
+  GRA_TEXT_NONE,     /**< the paper has no contents */
+  GRA_TEXT_STALE,    /**< waiting for, or part way through, indexing */
+  GRA_TEXT_INDEXED,  /**< every page is searchable */
+  GRA_TEXT_FAILED    /**< the text could not be extracted */
+} gra_text_state;
+
+
+/** @struct gra_indexer_stats_t
+ *  @brief What an indexer has done since it started.
+ *  @var gra_indexer_stats_t::documents Documents finished.
+ *  @var gra_indexer_stats_t::failed Documents whose text could not be
+ *  extracted.
+ *  @var gra_indexer_stats_t::pages Pages written to the index.
+ *  @var gra_indexer_stats_t::bytes Bytes of text written.
+ *  @var gra_indexer_stats_t::seconds Time spent running, not paused.
+ *  @var gra_indexer_stats_t::pagesPerSecond Indexing throughput.
+ *  @var gra_indexer_stats_t::idle True when nothing is left to do.
+ */
+typedef struct gra_indexer_stats_t {
+  unsigned long documents;
+  unsigned long failed;
+  unsigned long pages;
+  unsigned long long bytes;
+  double seconds;
+  double pagesPerSecond;
+  gboolean idle;
+} gra_indexer_stats_t;
+
+
+/** Starts indexing the documents of a database in the background.
+ *  Documents are read through a pool reader when the connection has
+ *  a pool, and pages are written under gra_db_lock, so the connection
+ *  stays usable.  Stop the indexer before closing the connection.
+ *  @param db the database connection
+ *  @param threads extraction threads, or 0 for one per processor
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The running indexer, or NULL on error.
+ */
+gra_indexer_t *gra_indexer_start(gra_db_t *db, int threads, GError **error);
+
+/** Stops an indexer and frees it.  Pages already extracted are
+ *  written first; the rest wait for the next indexer.
+ *  @param ix the indexer
+ */
+void gra_indexer_stop(gra_indexer_t *ix);
+
+/** Tells the indexer that documents were added, so it looks for work
+ *  now rather than at its next periodic scan.
+ *  @param ix the indexer
+ */
+void gra_indexer_kick(gra_indexer_t *ix);
+
+/** Pauses or resumes an indexer.  A paused indexer finishes the page
+ *  chunk it is writing and holds no locks.
+ *  @param ix the indexer
+ *  @param paused TRUE to pause
+ */
+void gra_indexer_pause(gra_indexer_t *ix, gboolean paused);
+
+/** Limits how fast an indexer writes pages.  Extraction slows down
+ *  along with it.
+ *  @param ix the indexer
+ *  @param pagesPerSecond the limit, or 0 for none
+ */
+void gra_indexer_set_rate(gra_indexer_t *ix, int pagesPerSecond);
+
+/** Reports on an indexer.
+ *  @param ix the indexer
+ *  @param stats filled in
+ */
+void gra_indexer_get_stats(gra_indexer_t *ix, gra_indexer_stats_t *stats);
+
+/** Where the text of a paper stands in the index.
+ *  @param db the database connection
+ *  @param paperId ID of the paper
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return The state.  GRA_TEXT_NONE on error.
+ */
+gra_text_state gra_db_paper_text_state(gra_db_t *db, int paperId, GError **error);
+#endif
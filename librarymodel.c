@@ -0,0 +1,783 @@
+/*
+    Tree model which pages the library in from the database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include "librarymodel.h"
+#include "data.h"
+
+/* The sort key and ID of a paper at the edge of a page.  Given the
+   last key of a page, the page after it is one index seek away; the
+   first key does the same for the page before. */
+typedef struct library_key {
+  gboolean known;
+  int id;
+  unsigned int year;
+  gchar *text;
+} library_key;
+
+typedef struct library_bounds {
+  library_key first;
+  library_key last;
+} library_bounds;
+
+/* A loaded page of rows.  The link sits in the LRU queue. */
+typedef struct library_page {
+  int number;
+  gra_paper_t **papers;
+  int n;
+  GList link;
+} library_page;
+
+struct _GraLibraryModel {
+  GObject parent;
+  gra_db_t *db;
+  gint stamp;
+  int rows;
+
+  /* the order rows are in */
+  gint sortColumn;
+  GtkSortType order;
+
+  /* resident pages, most recently used first */
+  GHashTable *pages;
+  GQueue lru;
+
+  /* edges of the pages loaded so far, indexed by page number */
+  GArray *bounds;
+
+  /* page whose neighbours are to be loaded while idle */
+  guint prefetch;
+  int prefetchPage;
+
+  /* next page whose end the idle walk is to find */
+  guint walk;
+  int walkPage;
+};
+
+static void gra_library_model_tree_model_init(GtkTreeModelIface *iface);
+static void gra_library_model_sortable_init(GtkTreeSortableIface *iface);
+static void gra_library_model_finalize(GObject *object);
+
+static GtkTreeModelFlags model_get_flags(GtkTreeModel *tree);
+static gint model_get_n_columns(GtkTreeModel *tree);
+static GType model_get_column_type(GtkTreeModel *tree, gint column);
+static gboolean model_get_iter(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreePath *path);
+static GtkTreePath *model_get_path(GtkTreeModel *tree, GtkTreeIter *iter);
+static void model_get_value(GtkTreeModel *tree, GtkTreeIter *iter, gint column, GValue *value);
+static gboolean model_iter_next(GtkTreeModel *tree, GtkTreeIter *iter);
+static gboolean model_iter_previous(GtkTreeModel *tree, GtkTreeIter *iter);
+static gboolean model_iter_children(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreeIter *parent);
+static gboolean model_iter_has_child(GtkTreeModel *tree, GtkTreeIter *iter);
+static gint model_iter_n_children(GtkTreeModel *tree, GtkTreeIter *iter);
+static gboolean model_iter_nth_child(GtkTreeModel *tree, GtkTreeIter *iter,
+                                     GtkTreeIter *parent, gint n);
+static gboolean model_iter_parent(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreeIter *child);
+
+static gboolean sortable_get_sort_column_id(GtkTreeSortable *sortable, gint *column,
+                                            GtkSortType *order);
+static void sortable_set_sort_column_id(GtkTreeSortable *sortable, gint column,
+                                        GtkSortType order);
+static void sortable_set_sort_func(GtkTreeSortable *sortable, gint column,
+                                   GtkTreeIterCompareFunc func, gpointer data,
+                                   GDestroyNotify destroy);
+static void sortable_set_default_sort_func(GtkTreeSortable *sortable,
+                                           GtkTreeIterCompareFunc func, gpointer data,
+                                           GDestroyNotify destroy);
+static gboolean sortable_has_default_sort_func(GtkTreeSortable *sortable);
+
+static int count_rows(GraLibraryModel *model);
+static gra_paper_t *row_paper(GraLibraryModel *model, int row);
+static library_page *page_get(GraLibraryModel *model, int number);
+static library_page *page_load(GraLibraryModel *model, int number);
+static void page_free(gpointer data);
+static void pages_clear(GraLibraryModel *model);
+static library_bounds *bounds_at(GraLibraryModel *model, int number);
+static void key_set(library_key *key, gra_paper_t *p, gra_db_sort_column column);
+static void key_paper(library_key *key, gra_paper_t *p);
+static void key_clear(library_key *key);
+static gra_db_sort_column sort_key(gint column);
+static gboolean prefetch_idle(gpointer data);
+static void walk_start(GraLibraryModel *model);
+static gboolean walk_idle(gpointer data);
+
+G_DEFINE_TYPE_WITH_CODE(GraLibraryModel, gra_library_model, G_TYPE_OBJECT,
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_MODEL,
+                                              gra_library_model_tree_model_init)
+                        G_IMPLEMENT_INTERFACE(GTK_TYPE_TREE_SORTABLE,
+                                              gra_library_model_sortable_init))
+
+
+GraLibraryModel *
+gra_library_model_new(gra_db_t *db) {
+  GraLibraryModel *model;
+
+  model = g_object_new(GRA_TYPE_LIBRARY_MODEL, NULL);
+  model->db = db;
+
+  /* no view to tell yet */
+  model->rows = count_rows(model);
+  walk_start(model);
+
+  return model;
+}
+
+
+gra_paper_t *
+gra_library_model_get_paper(GraLibraryModel *model, GtkTreeIter *iter) {
+  gra_paper_t *p;
+
+  g_return_val_if_fail(iter->stamp == model->stamp, NULL);
+
+  p = row_paper(model, GPOINTER_TO_INT(iter->user_data));
+  return p ? gra_paper_ref(p) : NULL;
+}
+
+
+void
+gra_library_model_reload(GraLibraryModel *model) {
+  GtkTreeModel *tree = GTK_TREE_MODEL(model);
+  GtkTreePath *path;
+  GtkTreeIter iter;
+  int rows;
+
+  rows = count_rows(model);
+  pages_clear(model);
+  model->stamp++;
+
+  /* the rows past the new end go, from the last */
+  while(model->rows > rows) {
+    model->rows--;
+    path = gtk_tree_path_new_from_indices(model->rows, -1);
+    gtk_tree_model_row_deleted(tree, path);
+    gtk_tree_path_free(path);
+  }
+
+  /* new rows are added at the end */
+  while(model->rows < rows) {
+    iter.stamp = model->stamp;
+    iter.user_data = GINT_TO_POINTER(model->rows);
+    model->rows++;
+    path = gtk_tree_path_new_from_indices(model->rows - 1, -1);
+    gtk_tree_model_row_inserted(tree, path, &iter);
+    gtk_tree_path_free(path);
+  }
+
+  walk_start(model);
+}
+
+
+
+/*
+ * Static Methods
+ */
+static void
+gra_library_model_class_init(GraLibraryModelClass *klass) {
+  G_OBJECT_CLASS(klass)->finalize = gra_library_model_finalize;
+}
+
+
+static void
+gra_library_model_init(GraLibraryModel *model) {
+  model->stamp = g_random_int();
+  model->sortColumn = GRA_LIBRARY_COLUMN_ID;
+  model->order = GTK_SORT_ASCENDING;
+  model->pages = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, page_free);
+  g_queue_init(&model->lru);
+  model->bounds = g_array_new(FALSE, TRUE, sizeof(library_bounds));
+}
+
+
+static void
+gra_library_model_tree_model_init(GtkTreeModelIface *iface) {
+  iface->get_flags = model_get_flags;
+  iface->get_n_columns = model_get_n_columns;
+  iface->get_column_type = model_get_column_type;
+  iface->get_iter = model_get_iter;
+  iface->get_path = model_get_path;
+  iface->get_value = model_get_value;
+  iface->iter_next = model_iter_next;
+  iface->iter_previous = model_iter_previous;
+  iface->iter_children = model_iter_children;
+  iface->iter_has_child = model_iter_has_child;
+  iface->iter_n_children = model_iter_n_children;
+  iface->iter_nth_child = model_iter_nth_child;
+  iface->iter_parent = model_iter_parent;
+}
+
+
+static void
+gra_library_model_sortable_init(GtkTreeSortableIface *iface) {
+  iface->get_sort_column_id = sortable_get_sort_column_id;
+  iface->set_sort_column_id = sortable_set_sort_column_id;
+  iface->set_sort_func = sortable_set_sort_func;
+  iface->set_default_sort_func = sortable_set_default_sort_func;
+  iface->has_default_sort_func = sortable_has_default_sort_func;
+}
+
+
+static void
+gra_library_model_finalize(GObject *object) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(object);
+
+  pages_clear(model);
+  g_hash_table_destroy(model->pages);
+  g_array_free(model->bounds, TRUE);
+
+  G_OBJECT_CLASS(gra_library_model_parent_class)->finalize(object);
+}
+
+
+static GtkTreeModelFlags
+model_get_flags(GtkTreeModel *tree) {
+  return GTK_TREE_MODEL_LIST_ONLY;
+}
+
+
+static gint
+model_get_n_columns(GtkTreeModel *tree) {
+  return GRA_LIBRARY_N_COLUMNS;
+}
+
+
+static GType
+model_get_column_type(GtkTreeModel *tree, gint column) {
+  switch(column) {
+  case GRA_LIBRARY_COLUMN_ID:
+    return G_TYPE_INT;
+  case GRA_LIBRARY_COLUMN_TITLE:
+  case GRA_LIBRARY_COLUMN_AUTHOR:
+    return G_TYPE_STRING;
+  case GRA_LIBRARY_COLUMN_YEAR:
+    return G_TYPE_UINT;
+  case GRA_LIBRARY_COLUMN_READ:
+    return G_TYPE_BOOLEAN;
+  }
+  return G_TYPE_INVALID;
+}
+
+
+/* Iterators are just row numbers, so walking the whole list, as the
+   view does when the model is set, never touches the database. */
+static gboolean
+model_get_iter(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreePath *path) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(tree);
+  gint row;
+
+  if(gtk_tree_path_get_depth(path) != 1)
+    return FALSE;
+
+  row = gtk_tree_path_get_indices(path)[0];
+  if(row < 0 || row >= model->rows)
+    return FALSE;
+
+  iter->stamp = model->stamp;
+  iter->user_data = GINT_TO_POINTER(row);
+  return TRUE;
+}
+
+
+static GtkTreePath *
+model_get_path(GtkTreeModel *tree, GtkTreeIter *iter) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(tree);
+
+  g_return_val_if_fail(iter->stamp == model->stamp, NULL);
+
+  return gtk_tree_path_new_from_indices(GPOINTER_TO_INT(iter->user_data), -1);
+}
+
+
+/* The one place rows are loaded */
+static void
+model_get_value(GtkTreeModel *tree, GtkTreeIter *iter, gint column, GValue *value) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(tree);
+  gra_paper_t *p;
+
+  g_return_if_fail(iter->stamp == model->stamp);
+
+  g_value_init(value, model_get_column_type(tree, column));
+  p = row_paper(model, GPOINTER_TO_INT(iter->user_data));
+  if(!p) return;
+
+  switch(column) {
+  case GRA_LIBRARY_COLUMN_ID:
+    g_value_set_int(value, p->id);
+    break;
+  case GRA_LIBRARY_COLUMN_TITLE:
+    g_value_set_string(value, p->title);
+    break;
+  case GRA_LIBRARY_COLUMN_AUTHOR:
+    g_value_set_string(value, p->author);
+    break;
+  case GRA_LIBRARY_COLUMN_YEAR:
+    g_value_set_uint(value, p->year);
+    break;
+  case GRA_LIBRARY_COLUMN_READ:
+    g_value_set_boolean(value, p->read);
+    break;
+  }
+}
+
+
+static gboolean
+model_iter_next(GtkTreeModel *tree, GtkTreeIter *iter) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(tree);
+  gint row = GPOINTER_TO_INT(iter->user_data) + 1;
+
+  if(row >= model->rows)
+    return FALSE;
+
+  iter->user_data = GINT_TO_POINTER(row);
+  return TRUE;
+}
+
+
+static gboolean
+model_iter_previous(GtkTreeModel *tree, GtkTreeIter *iter) {
+  gint row = GPOINTER_TO_INT(iter->user_data) - 1;
+
+  if(row < 0)
+    return FALSE;
+
+  iter->user_data = GINT_TO_POINTER(row);
+  return TRUE;
+}
+
+
+static gboolean
+model_iter_children(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreeIter *parent) {
+  return model_iter_nth_child(tree, iter, parent, 0);
+}
+
+
+static gboolean
+model_iter_has_child(GtkTreeModel *tree, GtkTreeIter *iter) {
+  return FALSE;
+}
+
+
+static gint
+model_iter_n_children(GtkTreeModel *tree, GtkTreeIter *iter) {
+  return iter ? 0 : GRA_LIBRARY_MODEL(tree)->rows;
+}
+
+
+static gboolean
+model_iter_nth_child(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreeIter *parent, gint n) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(tree);
+
+  /* a list: only the root has children */
+  if(parent || n < 0 || n >= model->rows)
+    return FALSE;
+
+  iter->stamp = model->stamp;
+  iter->user_data = GINT_TO_POINTER(n);
+  return TRUE;
+}
+
+
+static gboolean
+model_iter_parent(GtkTreeModel *tree, GtkTreeIter *iter, GtkTreeIter *child) {
+  return FALSE;
+}
+
+
+static gboolean
+sortable_get_sort_column_id(GtkTreeSortable *sortable, gint *column, GtkSortType *order) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(sortable);
+
+  if(column) *column = model->sortColumn;
+  if(order) *order = model->order;
+  return TRUE;
+}
+
+
+/* Re-sorting drops every loaded row.  The view is told the rows were
+   reordered so it asks for them again; where each row went is not
+   known, so the order given is the old one. */
+static void
+sortable_set_sort_column_id(GtkTreeSortable *sortable, gint column, GtkSortType order) {
+  GraLibraryModel *model = GRA_LIBRARY_MODEL(sortable);
+  GtkTreePath *path;
+  gint *newOrder;
+  int i;
+
+  /* the default order is by ID */
+  if(column == GTK_TREE_SORTABLE_DEFAULT_SORT_COLUMN_ID ||
+     column == GTK_TREE_SORTABLE_UNSORTED_SORT_COLUMN_ID) {
+    column = GRA_LIBRARY_COLUMN_ID;
+  }
+  g_return_if_fail(column >= 0 && column < GRA_LIBRARY_COLUMN_READ);
+
+  if(column == model->sortColumn && order == model->order)
+    return;
+
+  model->sortColumn = column;
+  model->order = order;
+  pages_clear(model);
+  walk_start(model);
+  gtk_tree_sortable_sort_column_changed(sortable);
+
+  if(!model->rows) return;
+
+  newOrder = g_new(gint, model->rows);
+  for(i=0; i < model->rows; i++) {
+    newOrder[i] = i;
+  }
+  path = gtk_tree_path_new();
+  gtk_tree_model_rows_reordered(GTK_TREE_MODEL(model), path, NULL, newOrder);
+  gtk_tree_path_free(path);
+  g_free(newOrder);
+}
+
+
+static void
+sortable_set_sort_func(GtkTreeSortable *sortable, gint column,
+                       GtkTreeIterCompareFunc func, gpointer data,
+                       GDestroyNotify destroy) {
+  g_warning("The library is sorted by the database; sort functions are not supported.");
+}
+
+
+static void
+sortable_set_default_sort_func(GtkTreeSortable *sortable,
+                               GtkTreeIterCompareFunc func, gpointer data,
+                               GDestroyNotify destroy) {
+  g_warning("The library is sorted by the database; sort functions are not supported.");
+}
+
+
+static gboolean
+sortable_has_default_sort_func(GtkTreeSortable *sortable) {
+  return FALSE;
+}
+
+
+static int
+count_rows(GraLibraryModel *model) {
+  GError *err = NULL;
+  int rows;
+
+  rows = gra_db_paper_count(model->db, &err);
+  if(err) {
+    g_warning("Could not count the papers: %s", err->message);
+    g_error_free(err);
+    rows = 0;
+  }
+
+  return rows;
+}
+
+
+/* The paper of a row, loading its page if need be */
+static gra_paper_t *
+row_paper(GraLibraryModel *model, int row) {
+  library_page *page;
+  int number = row / GRA_LIBRARY_PAGE_ROWS;
+
+  if(row < 0 || row >= model->rows)
+    return NULL;
+
+  page = page_get(model, number);
+  if(!page) {
+    page = page_load(model, number);
+    if(!page) return NULL;
+
+    /* load the neighbours before they are scrolled to */
+    model->prefetchPage = number;
+    if(!model->prefetch)
+      model->prefetch = g_idle_add_full(G_PRIORITY_LOW, prefetch_idle, model, NULL);
+  }
+
+  row %= GRA_LIBRARY_PAGE_ROWS;
+  return row < page->n ? page->papers[row] : NULL;
+}
+
+
+/* A resident page, marked as just used */
+static library_page *
+page_get(GraLibraryModel *model, int number) {
+  library_page *page;
+
+  page = g_hash_table_lookup(model->pages, GINT_TO_POINTER(number));
+  if(page) {
+    g_queue_unlink(&model->lru, &page->link);
+    g_queue_push_head_link(&model->lru, &page->link);
+  }
+
+  return page;
+}
+
+
+/* Load a page from whichever known page edge is nearest: forwards
+   from the end of a page before it, or backwards from the start of
+   one after it.  Failing those it is counted from the first or last
+   row. */
+static library_page *
+page_load(GraLibraryModel *model, int number) {
+  library_page *page;
+  library_bounds *b;
+  library_key *from = NULL;
+  gra_paper_t after = {0}, **papers, *p;
+  gboolean descending = model->order == GTK_SORT_DESCENDING;
+  gboolean backwards;
+  GError *err = NULL;
+  int rows, skip, n, i, a;
+
+  rows = MIN(GRA_LIBRARY_PAGE_ROWS, model->rows - number * GRA_LIBRARY_PAGE_ROWS);
+  if(rows <= 0) return NULL;
+
+  /* the nearest page edges either side */
+  for(a = number - 1; a >= 0; a--) {
+    b = bounds_at(model, a);
+    if(b->last.known) {
+      from = &b->last;
+      break;
+    }
+  }
+  skip = (number - a - 1) * GRA_LIBRARY_PAGE_ROWS;
+  backwards = FALSE;
+
+  for(a = number + 1; a < (int) model->bounds->len; a++) {
+    b = bounds_at(model, a);
+    if(b->first.known)
+      break;
+  }
+  if(a < (int) model->bounds->len) {
+    if((a - number - 1) * GRA_LIBRARY_PAGE_ROWS < skip) {
+      from = &b->first;
+      skip = (a - number - 1) * GRA_LIBRARY_PAGE_ROWS;
+      backwards = TRUE;
+    }
+  } else if(model->rows - number * GRA_LIBRARY_PAGE_ROWS - rows < skip) {
+    from = NULL;
+    skip = model->rows - number * GRA_LIBRARY_PAGE_ROWS - rows;
+    backwards = TRUE;
+  }
+
+  if(from)
+    key_paper(from, &after);
+  papers = gra_db_paper_browse(model->db, sort_key(model->sortColumn),
+                               backwards ? !descending : descending,
+                               from ? &after : NULL, skip, rows, &n, &err);
+  if(err) {
+    g_warning("Could not load papers: %s", err->message);
+    g_error_free(err);
+    return NULL;
+  }
+
+  /* backwards, the page came out back to front */
+  if(backwards) {
+    for(i=0; i < n / 2; i++) {
+      p = papers[i];
+      papers[i] = papers[n - 1 - i];
+      papers[n - 1 - i] = p;
+    }
+  }
+
+  page = g_new0(library_page, 1);
+  page->number = number;
+  page->papers = papers;
+  page->n = n;
+  page->link.data = page;
+
+  /* remember its edges */
+  if(n) {
+    b = bounds_at(model, number);
+    key_set(&b->first, papers[0], sort_key(model->sortColumn));
+    key_set(&b->last, papers[n - 1], sort_key(model->sortColumn));
+  }
+
+  /* make room */
+  g_hash_table_insert(model->pages, GINT_TO_POINTER(number), page);
+  g_queue_push_head_link(&model->lru, &page->link);
+  while(model->lru.length > GRA_LIBRARY_RESIDENT_PAGES) {
+    page = g_queue_peek_tail(&model->lru);
+    g_queue_unlink(&model->lru, &page->link);
+    g_hash_table_remove(model->pages, GINT_TO_POINTER(page->number));
+  }
+
+  return g_hash_table_lookup(model->pages, GINT_TO_POINTER(number));
+}
+
+
+static void
+page_free(gpointer data) {
+  library_page *page = data;
+
+  gra_paper_free_many(page->papers, page->n);
+  g_free(page);
+}
+
+
+/* Drop every page and page edge, as when the order changes */
+static void
+pages_clear(GraLibraryModel *model) {
+  guint i;
+
+  if(model->prefetch) {
+    g_source_remove(model->prefetch);
+    model->prefetch = 0;
+  }
+  if(model->walk) {
+    g_source_remove(model->walk);
+    model->walk = 0;
+  }
+
+  g_queue_init(&model->lru);
+  g_hash_table_remove_all(model->pages);
+
+  for(i=0; i < model->bounds->len; i++) {
+    key_clear(&g_array_index(model->bounds, library_bounds, i).first);
+    key_clear(&g_array_index(model->bounds, library_bounds, i).last);
+  }
+  g_array_set_size(model->bounds, 0);
+}
+
+
+static library_bounds *
+bounds_at(GraLibraryModel *model, int number) {
+  if(number >= (int) model->bounds->len)
+    g_array_set_size(model->bounds, number + 1);
+  return &g_array_index(model->bounds, library_bounds, number);
+}
+
+
+/* Remember the sort key of a paper */
+static void
+key_set(library_key *key, gra_paper_t *p, gra_db_sort_column column) {
+  key_clear(key);
+  key->known = TRUE;
+  key->id = p->id;
+  key->year = p->year;
+  if(column == GRA_SORT_TITLE)
+    key->text = g_strdup(p->title);
+  else if(column == GRA_SORT_AUTHOR)
+    key->text = g_strdup(p->author);
+}
+
+
+/* Dress a key up as a paper for gra_db_paper_browse */
+static void
+key_paper(library_key *key, gra_paper_t *p) {
+  p->id = key->id;
+  p->year = key->year;
+  p->title = key->text;
+  p->author = key->text;
+}
+
+
+static void
+key_clear(library_key *key) {
+  g_free(key->text);
+  memset(key, 0, sizeof(library_key));
+}
+
+
+static gra_db_sort_column
+sort_key(gint column) {
+  switch(column) {
+  case GRA_LIBRARY_COLUMN_TITLE:
+    return GRA_SORT_TITLE;
+  case GRA_LIBRARY_COLUMN_AUTHOR:
+    return GRA_SORT_AUTHOR;
+  case GRA_LIBRARY_COLUMN_YEAR:
+    return GRA_SORT_YEAR;
+  }
+  return GRA_SORT_ID;
+}
+
+
+/* Load the pages either side of the last one the view asked for,
+   one per call so the main loop stays responsive */
+static gboolean
+prefetch_idle(gpointer data) {
+  GraLibraryModel *model = data;
+  int number = model->prefetchPage;
+
+  if(number + 1 < (model->rows + GRA_LIBRARY_PAGE_ROWS - 1) / GRA_LIBRARY_PAGE_ROWS &&
+     !g_hash_table_lookup(model->pages, GINT_TO_POINTER(number + 1)) &&
+     page_load(model, number + 1)) {
+    return TRUE;
+  }
+
+  if(number > 0 && !g_hash_table_lookup(model->pages, GINT_TO_POINTER(number - 1)))
+    page_load(model, number - 1);
+
+  model->prefetch = 0;
+  return FALSE;
+}
+
+
+/* Start finding the end of every page in the background.  Once it
+   is done, any page is one index seek away, however far the view
+   jumps. */
+static void
+walk_start(GraLibraryModel *model) {
+  model->walkPage = 0;
+  if(!model->walk && model->rows)
+    model->walk = g_idle_add_full(G_PRIORITY_LOW, walk_idle, model, NULL);
+}
+
+
+/* Find the ends of the next few pages, each from the end of the one
+   before.  Loaded pages already know theirs. */
+static gboolean
+walk_idle(gpointer data) {
+  GraLibraryModel *model = data;
+  gra_paper_t after = {0}, **papers;
+  library_bounds *b;
+  GError *err = NULL;
+  int pages = (model->rows + GRA_LIBRARY_PAGE_ROWS - 1) / GRA_LIBRARY_PAGE_ROWS;
+  int steps, n, rows;
+
+  for(steps = 0; steps < GRA_LIBRARY_WALK_PAGES && model->walkPage < pages; model->walkPage++) {
+    b = bounds_at(model, model->walkPage);
+    if(b->last.known) continue;
+
+    if(model->walkPage)
+      key_paper(&bounds_at(model, model->walkPage - 1)->last, &after);
+
+    /* the last row of the page is all it needs */
+    rows = MIN(GRA_LIBRARY_PAGE_ROWS, model->rows - model->walkPage * GRA_LIBRARY_PAGE_ROWS);
+    papers = gra_db_paper_browse(model->db, sort_key(model->sortColumn),
+                                 model->order == GTK_SORT_DESCENDING,
+                                 model->walkPage ? &after : NULL, rows - 1, 1, &n, &err);
+    if(err) {
+      g_warning("Could not load papers: %s", err->message);
+      g_error_free(err);
+      break;
+    }
+
+    /* the library shrank under us; a reload will start again */
+    if(!n) {
+      gra_paper_free_many(papers, n);
+      break;
+    }
+
+    key_set(&bounds_at(model, model->walkPage)->last, papers[0], sort_key(model->sortColumn));
+    gra_paper_free_many(papers, n);
+    steps++;
+  }
+
+  if(steps == GRA_LIBRARY_WALK_PAGES && model->walkPage < pages)
+    return TRUE;
+
+  model->walk = 0;
+  return FALSE;
+}
@@ -0,0 +1,96 @@
+/*
+    Tree model which pages the library in from the database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A flat GtkTreeModel over every paper in a database.  Rows are
+   loaded a page at a time as the view asks for them, with
+   gra_db_paper_browse, and only the most recently used pages are
+   kept.  The pages next to the one being shown are loaded while the
+   main loop is idle, so scrolling rarely waits on the database.
+   While idle, the model also finds where every page of the library
+   starts, so that jumping anywhere in it costs one index seek.
+
+   The model is also a GtkTreeSortable.  Sorting by title, author or
+   year asks the database for pages in that order; nothing is sorted
+   in memory.  Use it with a tree view in fixed height mode, which
+   only asks for the rows on screen. */
+
+#ifndef LIBRARYMODEL_H
+#define LIBRARYMODEL_H
+
+#include <gtk/gtk.h>
+#include <glib.h>
+#include "datatypes.h"
+
+#define GRA_TYPE_LIBRARY_MODEL (gra_library_model_get_type())
+#define GRA_LIBRARY_MODEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_CAST((obj), GRA_TYPE_LIBRARY_MODEL, GraLibraryModel))
+#define GRA_IS_LIBRARY_MODEL(obj) \
+  (G_TYPE_CHECK_INSTANCE_TYPE((obj), GRA_TYPE_LIBRARY_MODEL))
+
+/** Rows loaded together. */
+#define GRA_LIBRARY_PAGE_ROWS 128
+
+/** Most pages kept loaded at once. */
+#define GRA_LIBRARY_RESIDENT_PAGES 32
+
+/** Page ends found per idle call while the model maps out the
+ *  library in the background. */
+#define GRA_LIBRARY_WALK_PAGES 64
+
+/** Columns of the model.  All but GRA_LIBRARY_COLUMN_READ can be
+ *  sorted on. */
+enum {
+  GRA_LIBRARY_COLUMN_ID,      /**< G_TYPE_INT */
+  GRA_LIBRARY_COLUMN_TITLE,   /**< G_TYPE_STRING */
+  GRA_LIBRARY_COLUMN_AUTHOR,  /**< G_TYPE_STRING */
+  GRA_LIBRARY_COLUMN_YEAR,    /**< G_TYPE_UINT */
+  GRA_LIBRARY_COLUMN_READ,    /**< G_TYPE_BOOLEAN */
+  GRA_LIBRARY_N_COLUMNS
+};
+
+typedef struct _GraLibraryModel GraLibraryModel;
+typedef struct _GraLibraryModelClass GraLibraryModelClass;
+
+struct _GraLibraryModelClass {
+  GObjectClass parent_class;
+};
+
+GType gra_library_model_get_type(void);
+
+/** Creates a model of the papers in a database, sorted by ID.
+ *  @param db the database connection, which must outlive the model
+ *  @return The model.  Release it with g_object_unref.
+ */
+GraLibraryModel *gra_library_model_new(gra_db_t *db);
+
+/** Looks up the paper behind a row.
+ *  @param model the model
+ *  @param iter the row
+ *  @return The paper, with its own reference.  Release it with
+ *  gra_paper_free.  NULL if the row could not be loaded.
+ */
+gra_paper_t *gra_library_model_get_paper(GraLibraryModel *model, GtkTreeIter *iter);
+
+/** Forgets every loaded row and counts the papers again.  Call this
+ *  after papers were added or deleted.  Rows are added or removed at
+ *  the end to match the new count; redraw the view to show the rest.
+ *  @param model the model
+ */
+void gra_library_model_reload(GraLibraryModel *model);
+#endif
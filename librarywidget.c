@@ -0,0 +1,82 @@
+/*
+    Library widget listing every paper in a database.
+   
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "librarywidget.h"
+
+static void addTextColumn(gra_library_widget *lw, const gchar *title,
+                          gint column, gint width);
+
+
+gra_library_widget *
+gra_library_widget_new(gra_db_t *db) {
+  gra_library_widget *lw;
+  GtkCellRenderer *renderer;
+  GtkTreeViewColumn *column;
+
+  /* create the widgets */
+  lw = g_malloc(sizeof(gra_library_widget));
+  lw->model = gra_library_model_new(db);
+  lw->widget = gtk_scrolled_window_new(NULL, NULL);
+  lw->view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(lw->model));
+  gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(lw->widget),
+                                 GTK_POLICY_AUTOMATIC, GTK_POLICY_AUTOMATIC);
+
+  /* the view holds the only reference to the model */
+  g_object_unref(lw->model);
+
+  /* every column has a fixed size, so no row is measured */
+  renderer = gtk_cell_renderer_toggle_new();
+  column = gtk_tree_view_column_new_with_attributes("Read", renderer,
+                                                    "active", GRA_LIBRARY_COLUMN_READ,
+                                                    NULL);
+  gtk_tree_view_column_set_sizing(column, GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_set_fixed_width(column, 40);
+  gtk_tree_view_append_column(GTK_TREE_VIEW(lw->view), column);
+  addTextColumn(lw, "Title", GRA_LIBRARY_COLUMN_TITLE, 400);
+  addTextColumn(lw, "Author", GRA_LIBRARY_COLUMN_AUTHOR, 200);
+  addTextColumn(lw, "Year", GRA_LIBRARY_COLUMN_YEAR, 60);
+  gtk_tree_view_set_fixed_height_mode(GTK_TREE_VIEW(lw->view), TRUE);
+
+  /* typing to search would read every row */
+  gtk_tree_view_set_enable_search(GTK_TREE_VIEW(lw->view), FALSE);
+
+  gtk_container_add(GTK_CONTAINER(lw->widget), lw->view);
+  gtk_widget_show(lw->view);
+
+  return lw;
+}
+
+
+/* Add a fixed width text column, sorted by the model */
+static void
+addTextColumn(gra_library_widget *lw, const gchar *title, gint column, gint width) {
+  GtkCellRenderer *renderer;
+  GtkTreeViewColumn *col;
+
+  renderer = gtk_cell_renderer_text_new();
+  g_object_set(renderer, "ellipsize", PANGO_ELLIPSIZE_END, NULL);
+  col = gtk_tree_view_column_new_with_attributes(title, renderer,
+                                                 "text", column,
+                                                 NULL);
+  gtk_tree_view_column_set_sizing(col, GTK_TREE_VIEW_COLUMN_FIXED);
+  gtk_tree_view_column_set_fixed_width(col, width);
+  gtk_tree_view_column_set_resizable(col, TRUE);
+  gtk_tree_view_column_set_sort_column_id(col, column);
+  gtk_tree_view_append_column(GTK_TREE_VIEW(lw->view), col);
+}
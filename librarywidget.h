@@ -0,0 +1,44 @@
+/*
+    Library widget listing every paper in a database.
+   
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LIBRARYWIDGET_H
+#define LIBRARYWIDGET_H
+
+#include <gtk/gtk.h>
+#include <glib.h>
+#include "datatypes.h"
+#include "librarymodel.h"
+
+
+/** A scrolling list of the papers in a database.  The view is in
+ *  fixed height mode over a GraLibraryModel, so it only asks for the
+ *  rows on screen however large the library is.  Clicking a column
+ *  header sorts by that column in the database.
+ */
+typedef struct gra_library_widget {
+  GraLibraryModel *model;
+  GtkWidget       *widget;
+  GtkWidget       *view;
+} gra_library_widget;
+
+/** Create a new library widget.
+ *  @param db the database to list, which must outlive the widget
+ *  @return The widget.  Its model goes away with the view.
+ */
+gra_library_widget *gra_library_widget_new(gra_db_t *db);
+#endif
@@ -1,24 +1,124 @@
 #include <gtk/gtk.h>
+#include "data.h"
 #include "paperwidget.h"
+#include "librarywidget.h"
+
+/* what the library selection is shown in */
+typedef struct {
+  gra_db_t *db;
+  gra_paper_widget *paper;
+} selection_target;
+
+static void selectionChanged(GtkTreeSelection *selection, gpointer data);
+static int compact(const gchar *filename);
 
 int
 main(int argc, char **argv) {
-  GtkWidget *window;
+  GtkWidget *window, *paned;
   gra_paper_widget *paper;
+  gra_library_widget *library;
+  gra_db_t *db = NULL;
+  GError *error = NULL;
+  selection_target target;
+
+  /* gra --compact FILE tidies up a library without opening a window */
+  if(argc == 3 && !g_strcmp0(argv[1], "--compact"))
+    return compact(argv[2]);
 
   gtk_init(&argc, &argv);
 
   window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
   g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
-  gtk_window_set_title(GTK_WINDOW(window), "Paper");
-
   paper = gra_paper_widget_new(NULL);
-  
-  gtk_container_add(GTK_CONTAINER(window), paper->widget);
+
+  /* browse the library named on the command line */
+  if(argc > 1) {
+    db = gra_db_open(argv[1], &error);
+    if(!db) {
+      g_printerr("%s: %s\n", argv[1], error->message);
+      g_error_free(error);
+      return 1;
+    }
+
+    /* the selected paper is shown in the one paper widget */
+    gtk_window_set_title(GTK_WINDOW(window), "Library");
+    gtk_window_set_default_size(GTK_WINDOW(window), 1000, 600);
+    library = gra_library_widget_new(db);
+    target.db = db;
+    target.paper = paper;
+    g_signal_connect(gtk_tree_view_get_selection(GTK_TREE_VIEW(library->view)),
+                     "changed", G_CALLBACK(selectionChanged), &target);
+    paned = gtk_hpaned_new();
+    gtk_paned_pack1(GTK_PANED(paned), library->widget, TRUE, FALSE);
+    gtk_paned_pack2(GTK_PANED(paned), paper->widget, FALSE, FALSE);
+    gtk_container_add(GTK_CONTAINER(window), paned);
+    gtk_widget_show(library->widget);
+    gtk_widget_show(paned);
+  } else {
+    gtk_window_set_title(GTK_WINDOW(window), "Paper");
+    gtk_container_add(GTK_CONTAINER(window), paper->widget);
+  }
   gtk_widget_show(paper->widget);
   gtk_widget_show(window);
 
   gtk_main();
 
+  /* the window, and the model with it, is gone by now */
+  if(db)
+    gra_db_close(db, NULL);
+
+  return 0;
+}
+
+
+/* Show the selected paper, with its fields, in the paper widget */
+static void
+selectionChanged(GtkTreeSelection *selection, gpointer data) {
+  selection_target *target = (selection_target *) data;
+  GtkTreeModel *model;
+  GtkTreeIter iter;
+  gra_paper_t *row, *p;
+
+  if(!gtk_tree_selection_get_selected(selection, &model, &iter))
+    return;
+
+  /* rows are paged in without fields */
+  row = gra_library_model_get_paper(GRA_LIBRARY_MODEL(model), &iter);
+  if(!row)
+    return;
+  p = gra_db_paper_load(target->db, row->id, NULL);
+  gra_paper_free(row);
+  if(!p)
+    return;
+
+  if(!p->fieldCount)
+    gra_db_paper_load_fields(target->db, p, NULL);
+  gra_paper_widget_bind(target->paper, p);
+  gra_paper_free(p);
+}
+
+
+/* Compact a library and report what it freed */
+static int
+compact(const gchar *filename) {
+  gra_db_compact_stats_t stats;
+  gra_db_t *db;
+  GError *error = NULL;
+  gchar *freed;
+
+  db = gra_db_open(filename, &error);
+  if(db) {
+    gra_db_compact(db, &stats, &error);
+    gra_db_close(db, error ? NULL : &error);
+  }
+  if(error) {
+    g_printerr("%s: %s\n", filename, error->message);
+    g_error_free(error);
+    return 1;
+  }
+
+  freed = g_format_size(MAX(stats.bytesBefore - stats.bytesAfter, 0));
+  g_print("%s: removed %lu orphaned rows, freed %s\n", filename, stats.orphans, freed);
+  g_free(freed);
   return 0;
 }
@@ -18,52 +18,42 @@
 */
 
 #include "paperwidget.h"
+#include "bibtex.h"
+#include "data.h"
 
 static void addLabelRow(gra_paper_widget *pw, const gchar* text, GtkWidget *widget);
 static void addFieldRow(gra_paper_widget *pw);
 static void addRow(gra_paper_widget *pw, GtkWidget *row, GtkWidget *w1, GtkWidget *w2);
 static void addFieldButtonClicked(GtkWidget *widget, gpointer data);
+static void widgetDestroyed(GtkWidget *widget, gpointer data);
+static GtkTreeModel *sharedList(GtkListStore **store, const gchar * const *items, int n);
+static GtkWidget *comboNew(GtkTreeModel *model);
+static void setText(GtkWidget *widget, const gchar *text);
+static gboolean bindField(gra_field_t *f, gpointer data);
+static void showFieldRow(gra_paper_widget *pw, const gchar *name, const gchar *value);
 
-/**
- * These are the standard bibtex fields.  Minus the ones which are
- * always defined.
- */
-static gchar* standardFields[] = {
-  "address", "editor", "eprint", "institution", "journal", "key",
-    "month", "note", "organization", "pages", "publisher", "school",
-    "series", "ur", "volume"
-};
-
-
-/**
- * These are the standard document types used in bibtex.
- */
-static gchar* standardTypes[] = {
-  "Article", "Book", "Booklet", "Conference", "Inbook", "Incollection",
-    "Inproceedings", "Manual", "Mastersthesis", "misc", "Phdthesis",
-    "Techreport", "Unpublished"
-};
+/* field names and types, shared by every paper widget */
+static GtkListStore *fieldStore = NULL;
+static GtkListStore *typeStore = NULL;
 
 
 gra_paper_widget *
 gra_paper_widget_new(gra_paper_t *paper) {
   gra_paper_widget *pw;
   GtkWidget *button;
-  int i, n;
-  
-  
-  /* TODO: Magic to glue to the paper struct */
 
   /* create the widgets */
   pw = g_malloc(sizeof(gra_paper_widget));
+  pw->paper = NULL;
   pw->widget = gtk_vbox_new(FALSE, 1);
   pw->fieldBox = gtk_vbox_new(TRUE, 2);
-  pw->type = gtk_combo_box_text_new_with_entry();
+  pw->type = comboNew(sharedList(&typeStore, gra_bibtex_types, gra_bibtex_type_count));
   pw->title = gtk_entry_new();
   pw->author = gtk_entry_new();
   pw->year = gtk_entry_new();
-  pw->fieldNames = NULL;
-  pw->fieldValues = NULL;
+  pw->fieldNames = g_ptr_array_new();
+  pw->fieldValues = g_ptr_array_new();
+  pw->fieldRows = 0;
 
   /* pack widgets and label */
   gtk_box_pack_start(GTK_BOX(pw->widget), pw->fieldBox, FALSE, FALSE, 0);
@@ -76,14 +66,6 @@ gra_paper_widget_new(gra_paper_t *paper) {
          gtk_hbox_new(TRUE, 2),
          gtk_label_new("Field"),
          gtk_label_new("Value"));
-  addFieldRow(pw);
-
-  /* populate type dropdown */
-  n = sizeof(standardTypes) / sizeof(standardTypes[0]);
-  for(i=0; i<n; i++) {
-    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(pw->type),
-                                   standardTypes[i]);
-  }
 
   /*add the add button */
   button = gtk_button_new_with_label("Add Field");
@@ -93,6 +75,19 @@ gra_paper_widget_new(gra_paper_t *paper) {
                    "clicked",
                    G_CALLBACK(addFieldButtonClicked),
                    pw);
+  g_signal_connect(G_OBJECT(pw->widget),
+                   "destroy",
+                   G_CALLBACK(widgetDestroyed),
+                   pw);
+
+  /* TODO: Magic to glue edits back to the paper struct */
+  if(paper) {
+    gra_paper_widget_bind(pw, paper);
+  } else {
+    paper = gra_paper_new();
+    gra_paper_widget_bind(pw, paper);
+    gra_paper_free(paper);
+  }
 
   /* show the last widet in the container.
      Caller is responsible for the container */
@@ -101,6 +96,44 @@ gra_paper_widget_new(gra_paper_t *paper) {
 }
 
 
+/* Show a paper in the rows already there, adding only missing ones */
+void
+gra_paper_widget_bind(gra_paper_widget *pw, gra_paper_t *paper) {
+  GtkWidget *field;
+  gchar year[16];
+  int shown, i;
+
+  /* hold the new paper before letting go of the old, which may be it */
+  gra_paper_ref(paper);
+  if(pw->paper)
+    gra_paper_free(pw->paper);
+  pw->paper = paper;
+
+  setText(gtk_bin_get_child(GTK_BIN(pw->type)), paper->type);
+  setText(pw->title, paper->title);
+  setText(pw->author, paper->author);
+  if(paper->year)
+    g_snprintf(year, sizeof(year), "%u", paper->year);
+  else
+    year[0] = '\0';
+  setText(pw->year, year);
+
+  /* fill rows from the top, then one blank row for a new field */
+  shown = pw->fieldRows;
+  pw->fieldRows = 0;
+  gra_paper_foreach_field(paper, bindField, pw);
+  showFieldRow(pw, NULL, NULL);
+
+  /* hide the rows left over from a paper with more fields */
+  for(i=pw->fieldRows; i<shown; i++) {
+    field = g_ptr_array_index(pw->fieldNames, i);
+    setText(gtk_bin_get_child(GTK_BIN(field)), NULL);
+    setText(g_ptr_array_index(pw->fieldValues, i), NULL);
+    gtk_widget_hide(gtk_widget_get_parent(field));
+  }
+}
+
+
 
 /*
  * Static Methods
@@ -120,16 +153,12 @@ addLabelRow(gra_paper_widget *pw, const gchar* text, GtkWidget *widget) {
 static void
 addFieldRow(gra_paper_widget *pw) {
   GtkWidget *field, *value;
-  int i;
-  int n = sizeof(standardFields) / sizeof(standardFields[0]);
   
   /* create the combo box and entry */
-  field = gtk_combo_box_text_new_with_entry();
+  field = comboNew(sharedList(&fieldStore, gra_bibtex_fields, gra_bibtex_field_count));
   value = gtk_entry_new();
-
-  for(i=0; i<n; i++) {
-    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(field), standardFields[i]);
-  }
+  g_ptr_array_add(pw->fieldNames, field);
+  g_ptr_array_add(pw->fieldValues, value);
 
   addRow(pw, gtk_hbox_new(TRUE, 2), field, value);
 }
@@ -153,5 +182,81 @@ addFieldButtonClicked(GtkWidget *widget, gpointer data) {
 
   pw = (gra_paper_widget *) data;
 
-  addFieldRow(pw);
+  showFieldRow(pw, NULL, NULL);
+}
+
+
+/* The widgets are gone with their container; free the rest */
+static void
+widgetDestroyed(GtkWidget *widget, gpointer data) {
+  gra_paper_widget *pw;
+
+  pw = (gra_paper_widget *) data;
+
+  g_ptr_array_free(pw->fieldNames, TRUE);
+  g_ptr_array_free(pw->fieldValues, TRUE);
+  gra_paper_free(pw->paper);
+  g_free(pw);
+}
+
+
+/* Fill a list store the first time it is asked for */
+static GtkTreeModel *
+sharedList(GtkListStore **store, const gchar * const *items, int n) {
+  GtkTreeIter iter;
+  int i;
+
+  if(!*store) {
+    *store = gtk_list_store_new(1, G_TYPE_STRING);
+    for(i=0; i<n; i++) {
+      gtk_list_store_insert_with_values(*store, &iter, -1, 0, items[i], -1);
+    }
+  }
+
+  return GTK_TREE_MODEL(*store);
+}
+
+
+/* A combo box with an entry, drawing its choices from a shared list */
+static GtkWidget *
+comboNew(GtkTreeModel *model) {
+  GtkWidget *combo;
+
+  combo = gtk_combo_box_new_with_model_and_entry(model);
+  gtk_combo_box_set_entry_text_column(GTK_COMBO_BOX(combo), 0);
+
+  return combo;
+}
+
+
+/* Set an entry's text, leaving it alone when it would not change */
+static void
+setText(GtkWidget *widget, const gchar *text) {
+  if(!text)
+    text = "";
+  if(g_strcmp0(gtk_entry_get_text(GTK_ENTRY(widget)), text))
+    gtk_entry_set_text(GTK_ENTRY(widget), text);
+}
+
+
+static gboolean
+bindField(gra_field_t *f, gpointer data) {
+  showFieldRow((gra_paper_widget *) data, f->name, f->value);
+  return FALSE;
+}
+
+
+/* Show the next hidden field row, creating one when none is left */
+static void
+showFieldRow(gra_paper_widget *pw, const gchar *name, const gchar *value) {
+  GtkWidget *field;
+
+  if(pw->fieldRows == pw->fieldNames->len)
+    addFieldRow(pw);
+  field = g_ptr_array_index(pw->fieldNames, pw->fieldRows);
+
+  setText(gtk_bin_get_child(GTK_BIN(field)), name);
+  setText(g_ptr_array_index(pw->fieldValues, pw->fieldRows), value);
+  gtk_widget_show(gtk_widget_get_parent(field));
+  pw->fieldRows++;
 }
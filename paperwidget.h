@@ -24,8 +24,18 @@
 #include "datatypes.h"
 
 
-/**  TODO: Write documentation block. 
- * 
+/** Editor for the fields of one paper.  The rows of extra fields are
+ *  kept when a different paper is shown, hidden if it has fewer
+ *  fields, so flipping between papers creates no widgets once enough
+ *  rows exist.  The field name and type lists are shared by every
+ *  paper widget.
+ *  @var gra_paper_widget::paper The paper shown, with a reference
+ *  held by the widget.
+ *  @var gra_paper_widget::fieldNames The name combo of each field
+ *  row, shown or not, in order.
+ *  @var gra_paper_widget::fieldValues The value entry of each field
+ *  row, in the same order.
+ *  @var gra_paper_widget::fieldRows Number of field rows shown.
  */
 typedef struct gra_paper_widget {
   gra_paper_t *paper;
@@ -35,12 +45,20 @@ typedef struct gra_paper_widget {
   GtkWidget   *title;
   GtkWidget   *author;
   GtkWidget   *year;
-  GList       *fieldNames;
-  GList       *fieldValues;
+  GPtrArray   *fieldNames;
+  GPtrArray   *fieldValues;
+  int          fieldRows;
 } gra_paper_widget;
 
 /** Create a new paper widget.  If paper is NULL, a new paper
- *  is allocated.
+ *  is allocated.  The widget is freed when pw->widget is destroyed.
  */
 gra_paper_widget *gra_paper_widget_new(gra_paper_t *paper);
+
+/** Shows another paper in an existing widget, reusing its rows.
+ *  @param pw the widget
+ *  @param paper the paper to show.  The widget takes its own
+ *  reference and releases the one on the paper it showed before.
+ */
+void gra_paper_widget_bind(gra_paper_widget *pw, gra_paper_t *paper);
 #endif
@@ -0,0 +1,283 @@
+/*
+    Queries combining conditions on papers, their fields and citations.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <glib.h>
+#include <string.h>
+#include "query.h"
+#include "dataprivate.h"
+#include "arena.h"
+
+#define DB_ERROR(error)  g_set_error(error, GRA_DATA_ERROR, 1, "SQLite Error: %s", sqlite3_errmsg(db->db))
+
+/* A value to bind, in the order of the conditions */
+typedef struct query_value {
+  gchar *text;            /* NULL for a number */
+  int number;
+} query_value;
+
+struct gra_query_t {
+  GString *where;         /* each condition starts with " AND " */
+  GArray *values;         /* query_value */
+  gra_db_sort_column column;
+  gboolean descending;
+};
+
+/* sort keys, as the browse indexes have them, by gra_db_sort_column */
+static const gchar *sortKeys[] = {
+  "P.\"ID\"",
+  "P.\"Title\" COLLATE NOCASE",
+  "P.\"Author\" COLLATE NOCASE",
+  "IFNULL(P.\"Year\", 0)"
+};
+
+static void add_text(gra_query_t *q, const gchar *text);
+static void add_number(gra_query_t *q, int number);
+static void add_pattern(gra_query_t *q, const gchar *text);
+
+
+gra_query_t *
+gra_query_new(void) {
+  gra_query_t *q;
+
+  q = g_new0(gra_query_t, 1);
+  q->where = g_string_new(NULL);
+  q->values = g_array_new(FALSE, FALSE, sizeof(query_value));
+  q->column = GRA_SORT_ID;
+
+  return q;
+}
+
+
+void
+gra_query_free(gra_query_t *q) {
+  int i;
+
+  if(!q) return;
+
+  for(i=0; i<q->values->len; i++)
+    g_free(g_array_index(q->values, query_value, i).text);
+  g_array_free(q->values, TRUE);
+  g_string_free(q->where, TRUE);
+  g_free(q);
+}
+
+
+void
+gra_query_read(gra_query_t *q, gboolean read) {
+  g_string_append(q->where, " AND P.\"Read\"=?");
+  add_number(q, read ? 1 : 0);
+}
+
+
+void
+gra_query_type(gra_query_t *q, const gchar *type) {
+  g_string_append(q->where, " AND P.\"Type\"=? COLLATE NOCASE");
+  add_text(q, type);
+}
+
+
+void
+gra_query_author(gra_query_t *q, const gchar *text) {
+  g_string_append(q->where, " AND P.\"Author\" LIKE ? ESCAPE '\\'");
+  add_pattern(q, text);
+}
+
+
+void
+gra_query_title(gra_query_t *q, const gchar *text) {
+  g_string_append(q->where, " AND P.\"Title\" LIKE ? ESCAPE '\\'");
+  add_pattern(q, text);
+}
+
+
+void
+gra_query_year(gra_query_t *q, unsigned int from, unsigned int to) {
+  g_string_append(q->where, " AND P.\"Year\" BETWEEN ? AND ?");
+  add_number(q, from);
+  add_number(q, to);
+}
+
+
+/* The field index finds a paper's fields, so this is checked paper by
+   paper once the other conditions have narrowed them down */
+void
+gra_query_field(gra_query_t *q, const gchar *name, const gchar *text) {
+  g_string_append(q->where, " AND EXISTS (SELECT 1 FROM \"Field\" f"
+                  " WHERE f.\"PaperID\"=P.\"ID\" AND f.\"Name\"=?");
+  add_text(q, name);
+  if(text) {
+    g_string_append(q->where, " AND f.\"Value\" LIKE ? ESCAPE '\\'");
+    add_pattern(q, text);
+  }
+  g_string_append_c(q->where, ')');
+}
+
+
+void
+gra_query_cites(gra_query_t *q, int paperId) {
+  g_string_append(q->where, " AND P.\"ID\" IN (SELECT \"PaperID\" FROM \"Reference\""
+                  " WHERE \"RefPaperID\"=?)");
+  add_number(q, paperId);
+}
+
+
+void
+gra_query_cited_by(gra_query_t *q, int paperId) {
+  g_string_append(q->where, " AND P.\"ID\" IN (SELECT \"RefPaperID\" FROM \"Reference\""
+                  " WHERE \"PaperID\"=?)");
+  add_number(q, paperId);
+}
+
+
+void
+gra_query_order(gra_query_t *q, gra_db_sort_column column, gboolean descending) {
+  q->column = column;
+  q->descending = descending;
+}
+
+
+gra_paper_t **
+gra_query_run(gra_db_t *db, gra_query_t *q, const gra_paper_t *after,
+              int limit, int *n, GError **error) {
+  gra_paper_t **result;
+  gra_arena_t *arena;
+  sqlite3_stmt *stmt;
+  query_value *v;
+  GString *sql;
+  const gchar *key = sortKeys[q->column];
+  const gchar *dir = q->descending ? "DESC" : "ASC";
+  const gchar *cmp = q->descending ? "<" : ">";
+  int i, rc = SQLITE_DONE;
+
+  *n = 0;
+
+  /* abort on previous error */
+  if(error && *error) return NULL;
+
+  /* The shape of the query is its SQL.  A page after the first starts
+     past the last paper by sort key, then ID.  The key is bounded on
+     its own as well, or SQLite would not seek the sort index to it. */
+  sql = g_string_new("SELECT P.\"ID\", P.\"FileName\", P.\"PageCount\", P.\"Read\","
+                     " P.\"Type\", P.\"Author\", P.\"Title\", P.\"Year\""
+                     " FROM \"Paper\" AS P WHERE 1");
+  g_string_append(sql, q->where->str);
+  i = q->values->len;
+  if(after && q->column == GRA_SORT_ID)
+    g_string_append_printf(sql, " AND P.\"ID\" %s ?%d", cmp, ++i);
+  else if(after) {
+    g_string_append_printf(sql, " AND %s %s= ?%d AND (%s %s ?%d OR P.\"ID\" %s ?%d)",
+                           key, cmp, i + 1, key, cmp, i + 1, cmp, i + 2);
+    i += 2;
+  }
+  if(q->column == GRA_SORT_ID)
+    g_string_append_printf(sql, " ORDER BY P.\"ID\" %s LIMIT ?%d", dir, i + 1);
+  else
+    g_string_append_printf(sql, " ORDER BY %s %s, P.\"ID\" %s LIMIT ?%d", key, dir, dir, i + 1);
+
+  stmt = gra_db_stmt_prepare(db, sql->str, error);
+  g_string_free(sql, TRUE);
+  if(!stmt) return NULL;
+
+  /* the values, in the order of their conditions */
+  for(i=0; i<q->values->len; i++) {
+    v = &g_array_index(q->values, query_value, i);
+    if(v->text)
+      sqlite3_bind_text(stmt, i + 1, v->text, -1, SQLITE_STATIC);
+    else
+      sqlite3_bind_int(stmt, i + 1, v->number);
+  }
+  if(after) {
+    switch(q->column) {
+    case GRA_SORT_TITLE:
+      sqlite3_bind_text(stmt, ++i, after->title ? after->title : "", -1, SQLITE_STATIC);
+      break;
+    case GRA_SORT_AUTHOR:
+      sqlite3_bind_text(stmt, ++i, after->author ? after->author : "", -1, SQLITE_STATIC);
+      break;
+    case GRA_SORT_YEAR:
+      sqlite3_bind_int(stmt, ++i, after->year);
+      break;
+    default:
+      break;
+    }
+    sqlite3_bind_int(stmt, ++i, after->id);
+  }
+  sqlite3_bind_int(stmt, i + 1, limit);
+
+  /* the page shares one arena, which goes with its last paper */
+  result = g_new0(gra_paper_t *, limit > 0 ? limit : 1);
+  arena = gra_arena_new(0);
+  while(*n < limit && (rc=sqlite3_step(stmt)) == SQLITE_ROW) {
+    result[(*n)++] = gra_db_paper_from_row(stmt, arena);
+  }
+  gra_arena_unref(arena);
+
+  if(*n < limit && rc != SQLITE_DONE) {
+    DB_ERROR(error);
+    gra_paper_free_many(result, *n);
+    result = NULL;
+    *n = 0;
+  }
+
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return result;
+}
+
+
+/*-------------------------------
+ * static methods
+ *-------------------------------*/
+
+/* Bind a string with the next condition.  The query keeps a copy. */
+static void
+add_text(gra_query_t *q, const gchar *text) {
+  query_value v = { g_strdup(text ? text : ""), 0 };
+
+  g_array_append_val(q->values, v);
+}
+
+
+/* Bind a number with the next condition */
+static void
+add_number(gra_query_t *q, int number) {
+  query_value v = { NULL, number };
+
+  g_array_append_val(q->values, v);
+}
+
+
+/* Bind a LIKE pattern matching text anywhere, with its own
+   wildcards escaped */
+static void
+add_pattern(gra_query_t *q, const gchar *text) {
+  query_value v = { NULL, 0 };
+  GString *s;
+
+  s = g_string_new("%");
+  for(; text && *text; text++) {
+    if(*text == '%' || *text == '_' || *text == '\\')
+      g_string_append_c(s, '\\');
+    g_string_append_c(s, *text);
+  }
+  g_string_append_c(s, '%');
+
+  v.text = g_string_free(s, FALSE);
+  g_array_append_val(q->values, v);
+}
+
@@ -0,0 +1,135 @@
+/*
+    Queries combining conditions on papers, their fields and citations.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* A gra_query_t collects conditions, all of which a paper must meet,
+   and an order.  Running it compiles the whole query into one SQL
+   statement, so SQLite does the filtering in one pass over the best
+   index it has.  Values are bound, never written into the SQL, so
+   every query with the same conditions in the same order shares one
+   prepared statement, kept on the connection.
+
+   Results come a page at a time.  Each page after the first starts
+   right after the last paper of the one before, as with
+   gra_db_paper_browse, so paging stays as quick deep into the
+   results as at the start.
+
+     q = gra_query_new();
+     gra_query_read(q, FALSE);
+     gra_query_type(q, "Inproceedings");
+     gra_query_author(q, "Lowe");
+     gra_query_year(q, 2005, 2012);
+     gra_query_field(q, "journal", "Systems");
+     page = gra_query_run(db, q, NULL, 50, &n, &error); */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <glib.h>
+#include "datatypes.h"
+#include "data.h"
+
+/** Most compiled queries a connection keeps.  They are all dropped
+ *  when one more is needed. */
+#define GRA_QUERY_CACHE_SIZE 64
+
+typedef struct gra_query_t gra_query_t;
+
+/** Creates a query which matches every paper, in ID order.
+ *  @return The query.  Free it with gra_query_free.
+ */
+gra_query_t *gra_query_new(void);
+
+/** Frees a query.
+ *  @param q the query
+ */
+void gra_query_free(gra_query_t *q);
+
+/** Only papers which have, or have not, been read.
+ *  @param q the query
+ *  @param read TRUE for read papers, FALSE for unread ones
+ */
+void gra_query_read(gra_query_t *q, gboolean read);
+
+/** Only papers of a BibTeX entry type, ignoring case.
+ *  @param q the query
+ *  @param type the type
+ */
+void gra_query_type(gra_query_t *q, const gchar *type);
+
+/** Only papers whose author contains some text, ignoring case.
+ *  @param q the query
+ *  @param text the text
+ */
+void gra_query_author(gra_query_t *q, const gchar *text);
+
+/** Only papers whose title contains some text, ignoring case.
+ *  @param q the query
+ *  @param text the text
+ */
+void gra_query_title(gra_query_t *q, const gchar *text);
+
+/** Only papers published in a range of years.
+ *  @param q the query
+ *  @param from the first year
+ *  @param to the last year
+ */
+void gra_query_year(gra_query_t *q, unsigned int from, unsigned int to);
+
+/** Only papers with a field.
+ *  @param q the query
+ *  @param name the field name
+ *  @param text text the value contains, ignoring case, or NULL for any
+ *  value
+ */
+void gra_query_field(gra_query_t *q, const gchar *name, const gchar *text);
+
+/** Only papers citing a paper.
+ *  @param q the query
+ *  @param paperId ID of the cited paper
+ */
+void gra_query_cites(gra_query_t *q, int paperId);
+
+/** Only papers cited by a paper.
+ *  @param q the query
+ *  @param paperId ID of the citing paper
+ */
+void gra_query_cited_by(gra_query_t *q, int paperId);
+
+/** Sets the order of the results.  Ties are broken by ID.
+ *  @param q the query
+ *  @param column what to sort by
+ *  @param descending TRUE for the highest first
+ */
+void gra_query_order(gra_query_t *q, gra_db_sort_column column, gboolean descending);
+
+/** Finds a page of the papers matching a query.  Papers come without
+ *  their fields or references.
+ *  @param db the database connection
+ *  @param q the query
+ *  @param after the last paper of the page before, or NULL for the
+ *  first page.  Only its ID and sort key are used.
+ *  @param limit most papers to return
+ *  @param n set to the number of papers returned
+ *  @param error GError Pointer.  Set to NULL for no error reporting.
+ *  @return An array of n papers, or NULL on error.  Free it with
+ *  gra_paper_free_many.
+ */
+gra_paper_t **gra_query_run(gra_db_t *db, gra_query_t *q, const gra_paper_t *after,
+                            int limit, int *n, GError **error);
+#endif
@@ -0,0 +1,547 @@
+/*
+    Asynchronous database requests for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <glib.h>
+#include <gio/gio.h>
+#include <sqlite3.h>
+#include "data.h"
+#include "worker.h"
+
+/* kinds of request, searches last */
+typedef enum {
+  REQ_LOAD,
+  REQ_SAVE,
+  REQ_SEARCH_KEYWORD,
+  REQ_SEARCH_TITLE,
+  REQ_SEARCH_AUTHOR,
+  REQ_SEARCH_BODY
+} request_kind;
+
+#define IS_SEARCH(kind) ((kind) >= REQ_SEARCH_KEYWORD)
+
+/* One unit of work for the worker.  Merged requests share it, so
+   it completes every task in the list. */
+typedef struct request {
+  request_kind kind;
+  gra_db_worker_t *worker;
+  int id;
+  gra_paper_t *paper;
+  gchar *text;
+  int limit;
+  int offset;
+  GList *tasks;
+  gboolean superseded;
+} request;
+
+struct gra_db_worker_t {
+  gra_db_t *db;
+  GThread *thread;
+  GMutex lock;
+  GCond wake;
+  GQueue queue;
+  request *current;
+  gra_db_t *conn;
+  gboolean quit;
+};
+
+/* the synchronous search behind each search kind */
+typedef GList *(*search_func)(gra_db_t *db, const gchar *text,
+                              int limit, int offset, GError **error);
+static const search_func searches[] = {
+  gra_db_search_keyword,
+  gra_db_search_title,
+  gra_db_search_author,
+  gra_db_search_body
+};
+
+static gra_db_worker_t *worker_get(gra_db_t *db);
+static gpointer worker_main(gpointer data);
+static request *request_new(gra_db_t *db, request_kind kind, GTask *task);
+static void request_free(request *req);
+static void request_submit(request *req);
+static gboolean request_touches(request *a, request *b);
+static gboolean request_merge(request *req, request *waiting);
+static void request_run(request *req);
+static gboolean request_cancelled(request *req);
+static void request_cancel(request *req, const gchar *message);
+static void search_submit(gra_db_t *db, request_kind kind, const gchar *text,
+                          int limit, int offset, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer data);
+static void search_interrupt(GCancellable *cancellable, gpointer data);
+static void paper_list_free(gpointer data);
+
+
+void
+gra_db_paper_load_async(gra_db_t *db, int id, GCancellable *cancellable,
+                        GAsyncReadyCallback callback, gpointer data) {
+  GTask *task;
+  request *req;
+
+  task = g_task_new(NULL, cancellable, callback, data);
+  g_task_set_source_tag(task, gra_db_paper_load_async);
+
+  req = request_new(db, REQ_LOAD, task);
+  req->id = id;
+  request_submit(req);
+}
+
+
+gra_paper_t *
+gra_db_paper_load_finish(gra_db_t *db, GAsyncResult *result, GError **error) {
+  g_return_val_if_fail(g_task_is_valid(result, NULL), NULL);
+
+  return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+
+void
+gra_db_paper_save_async(gra_db_t *db, gra_paper_t *p, GCancellable *cancellable,
+                        GAsyncReadyCallback callback, gpointer data) {
+  GTask *task;
+  request *req;
+
+  task = g_task_new(NULL, cancellable, callback, data);
+  g_task_set_source_tag(task, gra_db_paper_save_async);
+
+  req = request_new(db, REQ_SAVE, task);
+  req->paper = gra_paper_ref(p);
+  request_submit(req);
+}
+
+
+gboolean
+gra_db_paper_save_finish(gra_db_t *db, GAsyncResult *result, GError **error) {
+  g_return_val_if_fail(g_task_is_valid(result, NULL), FALSE);
+
+  return g_task_propagate_boolean(G_TASK(result), error);
+}
+
+
+void
+gra_db_search_keyword_async(gra_db_t *db, const gchar *keyword,
+                            int limit, int offset, GCancellable *cancellable,
+                            GAsyncReadyCallback callback, gpointer data) {
+  search_submit(db, REQ_SEARCH_KEYWORD, keyword, limit, offset,
+                cancellable, callback, data);
+}
+
+
+void
+gra_db_search_title_async(gra_db_t *db, const gchar *title,
+                          int limit, int offset, GCancellable *cancellable,
+                          GAsyncReadyCallback callback, gpointer data) {
+  search_submit(db, REQ_SEARCH_TITLE, title, limit, offset,
+                cancellable, callback, data);
+}
+
+
+void
+gra_db_search_author_async(gra_db_t *db, const gchar *author,
+                           int limit, int offset, GCancellable *cancellable,
+                           GAsyncReadyCallback callback, gpointer data) {
+  search_submit(db, REQ_SEARCH_AUTHOR, author, limit, offset,
+                cancellable, callback, data);
+}
+
+
+void
+gra_db_search_body_async(gra_db_t *db, const gchar *text,
+                         int limit, int offset, GCancellable *cancellable,
+                         GAsyncReadyCallback callback, gpointer data) {
+  search_submit(db, REQ_SEARCH_BODY, text, limit, offset,
+                cancellable, callback, data);
+}
+
+
+GList *
+gra_db_search_finish(gra_db_t *db, GAsyncResult *result, GError **error) {
+  g_return_val_if_fail(g_task_is_valid(result, NULL), NULL);
+
+  return g_task_propagate_pointer(G_TASK(result), error);
+}
+
+
+void
+gra_db_worker_stop(gra_db_t *db) {
+  gra_db_worker_t *w = db->worker;
+  request *req;
+
+  if(!w) return;
+
+  /* let the running request finish, and take the rest */
+  g_mutex_lock(&w->lock);
+  w->quit = TRUE;
+  g_cond_signal(&w->wake);
+  g_mutex_unlock(&w->lock);
+  g_thread_join(w->thread);
+
+  while((req = g_queue_pop_head(&w->queue))) {
+    request_cancel(req, "The database was closed");
+    request_free(req);
+  }
+
+  g_mutex_clear(&w->lock);
+  g_cond_clear(&w->wake);
+  g_free(w);
+  db->worker = NULL;
+}
+
+
+
+/*******************************************
+ * Static Methods
+ *******************************************/
+
+/* The worker of a connection, started on first use */
+static gra_db_worker_t *
+worker_get(gra_db_t *db) {
+  gra_db_worker_t *w;
+
+  if(db->worker)
+    return db->worker;
+
+  w = g_malloc0(sizeof(gra_db_worker_t));
+  w->db = db;
+  g_mutex_init(&w->lock);
+  g_cond_init(&w->wake);
+  g_queue_init(&w->queue);
+  w->thread = g_thread_new("gra-db", worker_main, w);
+
+  db->worker = w;
+  return w;
+}
+
+
+/* Run requests until told to quit */
+static gpointer
+worker_main(gpointer data) {
+  gra_db_worker_t *w = data;
+  request *req;
+
+  g_mutex_lock(&w->lock);
+  for(;;) {
+    while(!w->quit && g_queue_is_empty(&w->queue))
+      g_cond_wait(&w->wake, &w->lock);
+    if(w->quit) break;
+
+    req = g_queue_pop_head(&w->queue);
+    w->current = req;
+    g_mutex_unlock(&w->lock);
+
+    request_run(req);
+    request_free(req);
+
+    g_mutex_lock(&w->lock);
+  }
+  g_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+
+static request *
+request_new(gra_db_t *db, request_kind kind, GTask *task) {
+  request *req;
+
+  req = g_malloc0(sizeof(request));
+  req->kind = kind;
+  req->worker = worker_get(db);
+  req->tasks = g_list_append(NULL, task);
+
+  return req;
+}
+
+
+static void
+request_free(request *req) {
+  gra_paper_free(req->paper);
+  g_free(req->text);
+  g_list_free_full(req->tasks, g_object_unref);
+  g_free(req);
+}
+
+
+/* Queue a request, merging it into a waiting one where possible.  A
+   search drops the waiting searches of its kind and interrupts the
+   running one. */
+static void
+request_submit(request *req) {
+  gra_db_worker_t *w = req->worker;
+  GList *cur, *next, *dropped = NULL;
+  request *waiting;
+  gboolean merged = FALSE;
+
+  g_mutex_lock(&w->lock);
+
+  if(IS_SEARCH(req->kind)) {
+    for(cur = w->queue.head; cur; cur = next) {
+      next = cur->next;
+      waiting = cur->data;
+
+      if(waiting->kind == req->kind) {
+        g_queue_delete_link(&w->queue, cur);
+        dropped = g_list_prepend(dropped, waiting);
+      }
+    }
+  } else {
+    /* only the newest request on the same paper may take req, an
+       older one would run before, not after, that one */
+    for(cur = w->queue.tail; cur; cur = cur->prev) {
+      waiting = cur->data;
+
+      if(request_touches(req, waiting)) {
+        merged = request_merge(req, waiting);
+        break;
+      }
+    }
+  }
+
+  if(IS_SEARCH(req->kind) && w->current && w->current->kind == req->kind) {
+    w->current->superseded = TRUE;
+    if(w->conn)
+      sqlite3_interrupt(w->conn->db);
+  }
+
+  if(!merged) {
+    g_queue_push_tail(&w->queue, req);
+    g_cond_signal(&w->wake);
+  }
+
+  g_mutex_unlock(&w->lock);
+
+  /* complete outside the lock, callbacks may queue more work */
+  if(merged)
+    request_free(req);
+
+  for(cur = dropped; cur; cur = cur->next) {
+    request_cancel(cur->data, "Superseded by a newer search");
+    request_free(cur->data);
+  }
+  g_list_free(dropped);
+}
+
+
+/* True if a and b load or save the same paper */
+static gboolean
+request_touches(request *a, request *b) {
+  int id;
+
+  if(IS_SEARCH(a->kind) || IS_SEARCH(b->kind))
+    return FALSE;
+  if(a->paper && a->paper == b->paper)
+    return TRUE;
+
+  /* a paper yet to be saved has no ID to share */
+  id = a->kind == REQ_SAVE ? a->paper->id : a->id;
+  return id && id == (b->kind == REQ_SAVE ? b->paper->id : b->id);
+}
+
+
+/* Fold req into a waiting request if they do the same work.  Its
+   tasks move over, leaving req empty. */
+static gboolean
+request_merge(request *req, request *waiting) {
+  if(waiting->kind != req->kind)
+    return FALSE;
+
+  switch(req->kind) {
+  case REQ_LOAD:
+    if(waiting->id != req->id)
+      return FALSE;
+    break;
+
+  case REQ_SAVE:
+    /* another copy has edits of its own to write */
+    if(waiting->paper != req->paper)
+      return FALSE;
+    break;
+
+  default:
+    return FALSE;
+  }
+
+  waiting->tasks = g_list_concat(waiting->tasks, req->tasks);
+  req->tasks = NULL;
+  return TRUE;
+}
+
+
+/* Do the work of a request and complete its tasks */
+static void
+request_run(request *req) {
+  gra_db_worker_t *w = req->worker;
+  GError *err = NULL;
+  GList *cur, *papers = NULL;
+  gra_paper_t *p = NULL;
+  gulong *handlers = NULL;
+  gra_db_t *conn;
+  gboolean superseded;
+  int i;
+
+  if(request_cancelled(req)) {
+    request_cancel(req, "Operation was cancelled");
+    g_mutex_lock(&w->lock);
+    w->current = NULL;
+    g_mutex_unlock(&w->lock);
+    return;
+  }
+
+  /* searches go to a pool reader when there is one */
+  conn = w->db;
+  if(IS_SEARCH(req->kind) && w->db->readerMax)
+    conn = gra_db_reader_acquire(w->db, &err);
+  if(conn == w->db)
+    gra_db_lock(conn);
+
+  g_mutex_lock(&w->lock);
+  w->conn = conn;
+  g_mutex_unlock(&w->lock);
+
+  switch(err ? -1 : (int) req->kind) {
+  case -1:
+    break;
+
+  case REQ_LOAD:
+    p = gra_db_paper_load(conn, req->id, &err);
+    break;
+
+  case REQ_SAVE:
+    gra_db_paper_save(conn, req->paper, &err);
+    break;
+
+  default:
+    /* a search is interrupted if it is cancelled while it runs */
+    handlers = g_new0(gulong, g_list_length(req->tasks));
+    for(cur = req->tasks, i = 0; cur; cur = cur->next, i++) {
+      if(g_task_get_cancellable(cur->data))
+        handlers[i] = g_cancellable_connect(g_task_get_cancellable(cur->data),
+                                            G_CALLBACK(search_interrupt), req, NULL);
+    }
+
+    papers = searches[req->kind - REQ_SEARCH_KEYWORD](conn, req->text,
+                                                      req->limit, req->offset, &err);
+
+    for(cur = req->tasks, i = 0; cur; cur = cur->next, i++) {
+      if(handlers[i])
+        g_cancellable_disconnect(g_task_get_cancellable(cur->data), handlers[i]);
+    }
+    g_free(handlers);
+    break;
+  }
+  g_mutex_lock(&w->lock);
+  w->current = NULL;
+  w->conn = NULL;
+  superseded = req->superseded;
+  g_mutex_unlock(&w->lock);
+
+  if(conn == w->db)
+    gra_db_unlock(conn);
+  else
+    gra_db_reader_release(w->db, conn);
+
+  /* an interrupted search is not an error of its own */
+  if(superseded || (err && request_cancelled(req))) {
+    g_clear_error(&err);
+    paper_list_free(papers);
+    request_cancel(req, superseded ? "Superseded by a newer search"
+                                   : "Operation was cancelled");
+    return;
+  }
+
+  for(cur = req->tasks; cur; cur = cur->next) {
+    if(err) {
+      g_task_return_error(cur->data, g_error_copy(err));
+    } else if(req->kind == REQ_LOAD) {
+      g_task_return_pointer(cur->data, gra_paper_ref(p), (GDestroyNotify) gra_paper_free);
+    } else if(req->kind == REQ_SAVE) {
+      g_task_return_boolean(cur->data, TRUE);
+    } else {
+      g_task_return_pointer(cur->data, papers, paper_list_free);
+    }
+  }
+
+  gra_paper_free(p);
+  g_clear_error(&err);
+}
+
+
+/* TRUE if every task waiting on the request was cancelled */
+static gboolean
+request_cancelled(request *req) {
+  GList *cur;
+
+  for(cur = req->tasks; cur; cur = cur->next) {
+    if(!g_cancellable_is_cancelled(g_task_get_cancellable(cur->data)))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+/* Complete every task of a request with G_IO_ERROR_CANCELLED.  The
+   message is used for tasks whose own cancellable was not cancelled. */
+static void
+request_cancel(request *req, const gchar *message) {
+  GList *cur;
+
+  for(cur = req->tasks; cur; cur = cur->next) {
+    if(!g_task_return_error_if_cancelled(cur->data)) {
+      g_task_return_new_error(cur->data, G_IO_ERROR, G_IO_ERROR_CANCELLED,
+                              "%s", message);
+    }
+  }
+}
+
+
+static void
+search_submit(gra_db_t *db, request_kind kind, const gchar *text,
+              int limit, int offset, GCancellable *cancellable,
+              GAsyncReadyCallback callback, gpointer data) {
+  GTask *task;
+  request *req;
+
+  task = g_task_new(NULL, cancellable, callback, data);
+  g_task_set_source_tag(task, search_submit);
+
+  req = request_new(db, kind, task);
+  req->text = g_strdup(text);
+  req->limit = limit;
+  req->offset = offset;
+  request_submit(req);
+}
+
+
+/* Cancellation handler for a running search */
+static void
+search_interrupt(GCancellable *cancellable, gpointer data) {
+  request *req = data;
+  gra_db_worker_t *w = req->worker;
+
+  g_mutex_lock(&w->lock);
+  if(w->current == req && w->conn && request_cancelled(req))
+    sqlite3_interrupt(w->conn->db);
+  g_mutex_unlock(&w->lock);
+}
+
+
+static void
+paper_list_free(gpointer data) {
+  g_list_free_full(data, (GDestroyNotify) gra_paper_free);
+}
@@ -0,0 +1,126 @@
+/*
+    Asynchronous database requests for the paper database.
+
+       Copyright (C) 2013 Robert Lowe <pngwen@acm.org>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Each connection gets one worker thread, started by its first
+   asynchronous request.  Requests run on the worker in the order they
+   were made, and complete through GTask in the main context which was
+   the thread default when they were made, so callbacks run on the GTK
+   main loop.
+
+   Requests are merged while they wait:
+     - loads of the same paper share one load,
+     - saves of the same struct save once, with its latest state,
+     - a search supersedes the waiting and running searches of the
+       same kind, which finish with G_IO_ERROR_CANCELLED.  A running
+       search is interrupted, so typing into a search box only ever
+       waits on the query for the latest text.
+   A load or save only merges into the last waiting request on its
+   paper, so a load still sees every save queued before it.
+
+   The worker holds gra_db_lock while it runs a request, so other
+   threads may keep using the connection under the same lock. */
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <glib.h>
+#include <gio/gio.h>
+#include "datatypes.h"
+
+
+/** Loads a paper on the worker thread.  As with gra_db_paper_load,
+ *  the paper may come from the identity cache.
+ *  @param db the database connection
+ *  @param id ID of the paper
+ *  @param cancellable optional GCancellable
+ *  @param callback called on completion
+ *  @param data user data for callback
+ */
+void gra_db_paper_load_async(gra_db_t *db, int id, GCancellable *cancellable,
+                             GAsyncReadyCallback callback, gpointer data);
+
+/** Finishes gra_db_paper_load_async.
+ *  @return The paper, or NULL on error.  Free with gra_paper_free.
+ */
+gra_paper_t *gra_db_paper_load_finish(gra_db_t *db, GAsyncResult *result,
+                                      GError **error);
+
+
+/** Saves a paper on the worker thread.  The worker holds a reference
+ *  to the paper until the save completes.  Do not change the paper
+ *  while its save may be running; asking for another save is fine.
+ *  @param db the database connection
+ *  @param p the paper to save
+ *  @param cancellable optional GCancellable
+ *  @param callback called on completion
+ *  @param data user data for callback
+ */
+void gra_db_paper_save_async(gra_db_t *db, gra_paper_t *p, GCancellable *cancellable,
+                             GAsyncReadyCallback callback, gpointer data);
+
+/** Finishes gra_db_paper_save_async.
+ *  @return TRUE if the paper was saved.
+ */
+gboolean gra_db_paper_save_finish(gra_db_t *db, GAsyncResult *result,
+                                  GError **error);
+
+
+/** Runs gra_db_search_keyword on the worker thread.
+ *  @param db the database connection
+ *  @param keyword the words to look for
+ *  @param limit maximum number of papers to return, or -1 for no limit
+ *  @param offset number of ranked papers to skip
+ *  @param cancellable optional GCancellable
+ *  @param callback called on completion
+ *  @param data user data for callback
+ */
+void gra_db_search_keyword_async(gra_db_t *db, const gchar *keyword,
+                                 int limit, int offset, GCancellable *cancellable,
+                                 GAsyncReadyCallback callback, gpointer data);
+
+/** As gra_db_search_keyword_async, matching titles only. */
+void gra_db_search_title_async(gra_db_t *db, const gchar *title,
+                               int limit, int offset, GCancellable *cancellable,
+                               GAsyncReadyCallback callback, gpointer data);
+
+/** As gra_db_search_keyword_async, matching authors only. */
+void gra_db_search_author_async(gra_db_t *db, const gchar *author,
+                                int limit, int offset, GCancellable *cancellable,
+                                GAsyncReadyCallback callback, gpointer data);
+
+/** As gra_db_search_keyword_async, searching document text with
+ *  gra_db_search_body. */
+void gra_db_search_body_async(gra_db_t *db, const gchar *text,
+                              int limit, int offset, GCancellable *cancellable,
+                              GAsyncReadyCallback callback, gpointer data);
+
+/** Finishes any of the asynchronous searches.
+ *  @return A list of gra_paper_t, as from gra_db_search_keyword.
+ *  NULL on error, and when nothing matched.
+ */
+GList *gra_db_search_finish(gra_db_t *db, GAsyncResult *result, GError **error);
+
+
+/** Stops the worker thread of a connection.  The running request is
+ *  finished and the waiting ones are cancelled.  Called by
+ *  gra_db_close.
+ *  @param db the database connection
+ */
+void gra_db_worker_stop(gra_db_t *db);
+#endif